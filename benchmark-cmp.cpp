@@ -0,0 +1,272 @@
+#include "benchmark-cmp.h"
+#include "benchmark-corpus.h"
+#include "benchmark-perf.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include <cmp.h>
+
+#include "packmsg.h"
+
+namespace {
+
+// cmp does all its I/O through callbacks, these work on a memory buffer.
+struct buffer {
+	const char *ptr;
+	const char *end;
+	char *out;
+	char *outend;
+};
+
+bool buffer_read(cmp_ctx_t *ctx, void *data, size_t limit) {
+	buffer *buf = (buffer *)ctx->buf;
+
+	if (limit > (size_t)(buf->end - buf->ptr))
+		return false;
+
+	memcpy(data, buf->ptr, limit);
+	buf->ptr += limit;
+	return true;
+}
+
+bool buffer_skip(cmp_ctx_t *ctx, size_t count) {
+	buffer *buf = (buffer *)ctx->buf;
+
+	if (count > (size_t)(buf->end - buf->ptr))
+		return false;
+
+	buf->ptr += count;
+	return true;
+}
+
+size_t buffer_write(cmp_ctx_t *ctx, const void *data, size_t count) {
+	buffer *buf = (buffer *)ctx->buf;
+
+	if (count > (size_t)(buf->outend - buf->out))
+		return 0;
+
+	memcpy(buf->out, data, count);
+	buf->out += count;
+	return count;
+}
+
+// Returns a pointer to the payload of a string or binary object that was just read, and skips it.
+const char *buffer_payload(cmp_ctx_t *ctx, uint32_t size) {
+	buffer *buf = (buffer *)ctx->buf;
+	const char *ptr = buf->ptr;
+	return buffer_skip(ctx, size) ? ptr : NULL;
+}
+
+bool encode(cmp_ctx_t *ctx, const corpus &c) {
+	const char *pool = c.pool.data();
+	bool ok = true;
+
+	for (auto &token: c.tokens) {
+		switch (token.type) {
+		case PACKMSG_NIL: ok = cmp_write_nil(ctx); break;
+		case PACKMSG_BOOL: ok = cmp_write_bool(ctx, token.b); break;
+		case PACKMSG_INT64: ok = cmp_write_integer(ctx, token.i); break;
+		case PACKMSG_UINT64: ok = cmp_write_uinteger(ctx, token.u); break;
+		case PACKMSG_DOUBLE: ok = cmp_write_double(ctx, token.d); break;
+		case PACKMSG_STR: ok = cmp_write_str(ctx, pool + token.offset, token.len); break;
+		case PACKMSG_BIN: ok = cmp_write_bin(ctx, pool + token.offset, token.len); break;
+		case PACKMSG_MAP: ok = cmp_write_map(ctx, token.len); break;
+		case PACKMSG_ARRAY: ok = cmp_write_array(ctx, token.len); break;
+		default: abort();
+		}
+
+		if (!ok)
+			break;
+	}
+
+	return ok;
+}
+
+struct encoded {
+	std::vector<char> data;
+	std::vector<size_t> offsets;
+
+	explicit encoded(const corpus &c): data(c.data.size() * 2 + 64) {
+		buffer buf = {NULL, NULL, data.data(), data.data() + data.size()};
+		cmp_ctx_t ctx;
+		cmp_init(&ctx, &buf, buffer_read, buffer_skip, buffer_write);
+
+		bool ok = encode(&ctx, c);
+		assert(ok);
+		(void)ok;
+		data.resize(buf.out - data.data());
+
+		buf.ptr = data.data();
+		buf.end = data.data() + data.size();
+
+		while (buf.ptr != buf.end) {
+			offsets.push_back(buf.ptr - data.data());
+
+			if (!cmp_skip_object_no_limit(&ctx))
+				abort();
+		}
+
+		offsets.push_back(data.size());
+	}
+};
+
+}
+
+void cmp_encode_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+	std::vector<char> out(e.data.size());
+
+	perf_start();
+
+	for (auto _: state) {
+		buffer buf = {NULL, NULL, out.data(), out.data() + out.size()};
+		cmp_ctx_t ctx;
+		cmp_init(&ctx, &buf, buffer_read, buffer_skip, buffer_write);
+
+		bool ok = encode(&ctx, c);
+
+		assert(ok && buf.out == buf.outend);
+		benchmark::DoNotOptimize(ok);
+		benchmark::ClobberMemory();
+	}
+
+	corpus_counters(state, c, e.data.size());
+}
+
+void cmp_decode_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+
+	perf_start();
+
+	for (auto _: state) {
+		buffer buf = {e.data.data(), e.data.data() + e.data.size(), NULL, NULL};
+		cmp_ctx_t ctx;
+		cmp_init(&ctx, &buf, buffer_read, buffer_skip, buffer_write);
+		uint64_t sum = 0;
+		bool ok = true;
+
+		while (ok && buf.ptr != buf.end) {
+			cmp_object_t obj;
+
+			if (!cmp_read_object(&ctx, &obj)) {
+				ok = false;
+				break;
+			}
+
+			switch (obj.type) {
+			case CMP_TYPE_NIL: break;
+			case CMP_TYPE_BOOLEAN: sum += obj.as.boolean; break;
+			case CMP_TYPE_POSITIVE_FIXNUM:
+			case CMP_TYPE_UINT8: sum += obj.as.u8; break;
+			case CMP_TYPE_UINT16: sum += obj.as.u16; break;
+			case CMP_TYPE_UINT32: sum += obj.as.u32; break;
+			case CMP_TYPE_UINT64: sum += obj.as.u64; break;
+			case CMP_TYPE_NEGATIVE_FIXNUM:
+			case CMP_TYPE_SINT8: sum += obj.as.s8; break;
+			case CMP_TYPE_SINT16: sum += obj.as.s16; break;
+			case CMP_TYPE_SINT32: sum += obj.as.s32; break;
+			case CMP_TYPE_SINT64: sum += obj.as.s64; break;
+			case CMP_TYPE_DOUBLE: sum += obj.as.dbl; break;
+			case CMP_TYPE_FIXSTR:
+			case CMP_TYPE_STR8:
+			case CMP_TYPE_STR16:
+			case CMP_TYPE_STR32:
+				ok = buffer_payload(&ctx, obj.as.str_size) != NULL;
+				sum += obj.as.str_size;
+				break;
+			case CMP_TYPE_BIN8:
+			case CMP_TYPE_BIN16:
+			case CMP_TYPE_BIN32:
+				ok = buffer_payload(&ctx, obj.as.bin_size) != NULL;
+				sum += obj.as.bin_size;
+				break;
+			case CMP_TYPE_FIXMAP:
+			case CMP_TYPE_MAP16:
+			case CMP_TYPE_MAP32: sum += obj.as.map_size; break;
+			case CMP_TYPE_FIXARRAY:
+			case CMP_TYPE_ARRAY16:
+			case CMP_TYPE_ARRAY32: sum += obj.as.array_size; break;
+			default: ok = false; break;
+			}
+		}
+
+		assert(ok);
+		benchmark::DoNotOptimize(sum);
+	}
+
+	corpus_counters(state, c, e.data.size());
+}
+
+void cmp_skip_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+
+	perf_start();
+
+	for (auto _: state) {
+		buffer buf = {e.data.data(), e.data.data() + e.data.size(), NULL, NULL};
+		cmp_ctx_t ctx;
+		cmp_init(&ctx, &buf, buffer_read, buffer_skip, buffer_write);
+		size_t records = 0;
+
+		while (buf.ptr != buf.end && cmp_skip_object_no_limit(&ctx))
+			records++;
+
+		assert(records == c.records);
+		benchmark::DoNotOptimize(records);
+	}
+
+	corpus_counters(state, c, e.data.size());
+}
+
+void cmp_lookup_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+	uint32_t keylen = strlen(c.key);
+
+	perf_start();
+
+	for (auto _: state) {
+		size_t found = 0;
+
+		for (size_t i = 0; i < c.records; i++) {
+			buffer buf = {e.data.data() + e.offsets[i], e.data.data() + e.offsets[i + 1], NULL, NULL};
+			cmp_ctx_t ctx;
+			cmp_init(&ctx, &buf, buffer_read, buffer_skip, buffer_write);
+			uint32_t count;
+
+			if (!cmp_read_map(&ctx, &count))
+				continue;
+
+			while (count--) {
+				cmp_object_t obj;
+
+				if (!cmp_read_object(&ctx, &obj))
+					break;
+
+				// All keys in the corpus are strings.
+				if (!cmp_object_is_str(&obj))
+					break;
+
+				const char *key = buffer_payload(&ctx, obj.as.str_size);
+
+				if (key && obj.as.str_size == keylen && !memcmp(key, c.key, keylen)) {
+					found += cmp_skip_object_no_limit(&ctx);
+					break;
+				}
+
+				if (!cmp_skip_object_no_limit(&ctx))
+					break;
+			}
+		}
+
+		assert(found == c.records);
+		benchmark::DoNotOptimize(found);
+	}
+
+	corpus_counters(state, c, e.data.size());
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <benchmark/benchmark.h>
+
+void cmp_encode_corpus(benchmark::State &state);
+void cmp_decode_corpus(benchmark::State &state);
+void cmp_skip_corpus(benchmark::State &state);
+void cmp_lookup_corpus(benchmark::State &state);
@@ -0,0 +1,345 @@
+#include "benchmark-corpus.h"
+#include "benchmark-packmsg.h"
+#include "benchmark-perf.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "packmsg.h"
+
+namespace {
+
+// A small deterministic PRNG, so every run benchmarks the same corpus.
+struct xorshift {
+	uint64_t state = 0x9e3779b97f4a7c15;
+
+	uint64_t next() {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+	uint32_t below(uint32_t n) {
+		return next() % n;
+	}
+};
+
+struct generator {
+	corpus &c;
+	xorshift rng;
+
+	void add(uint8_t type, uint32_t len = 0) {
+		corpus_token t;
+		t.type = type;
+		t.len = len;
+		t.u = 0;
+		c.tokens.push_back(t);
+	}
+
+	void add_map(uint32_t count) { add(PACKMSG_MAP, count); }
+	void add_array(uint32_t count) { add(PACKMSG_ARRAY, count); }
+	void add_nil() { add(PACKMSG_NIL); }
+	void add_bool(bool val) { add(PACKMSG_BOOL); c.tokens.back().b = val; }
+	void add_int(int64_t val) { add(PACKMSG_INT64); c.tokens.back().i = val; }
+	void add_uint(uint64_t val) { add(PACKMSG_UINT64); c.tokens.back().u = val; }
+	void add_double(double val) { add(PACKMSG_DOUBLE); c.tokens.back().d = val; }
+
+	void add_str(const char *str, size_t len) {
+		add(PACKMSG_STR, len);
+		c.tokens.back().offset = c.pool.size();
+		c.pool.insert(c.pool.end(), str, str + len);
+		c.pool.push_back(0);
+	}
+
+	void add_str(const char *str) {
+		add_str(str, strlen(str));
+	}
+
+	void add_bin(uint32_t len) {
+		add(PACKMSG_BIN, len);
+		c.tokens.back().offset = c.pool.size();
+		for (uint32_t i = 0; i < len; i++)
+			c.pool.push_back(rng.next() >> 56);
+	}
+
+	void flat_map() {
+		char value[32];
+		add_map(32);
+
+		for (int i = 0; i < 32; i++) {
+			static const char *const keys[32] = {
+				"id", "name", "email", "created", "updated", "active", "score", "ratio",
+				"country", "city", "zip", "age", "balance", "currency", "verified", "visits",
+				"referrer", "plan", "seats", "latitude", "longitude", "locale", "timezone", "admin",
+				"tags", "theme", "quota", "used", "limit", "owner", "group", "deleted",
+			};
+			add_str(keys[i]);
+
+			switch (i % 5) {
+			case 0: add_uint(rng.below(100000)); break;
+			case 1: add_int((int64_t)rng.below(2000000) - 1000000); break;
+			case 2: add_double(rng.below(1000000) / 1000.0); break;
+			case 3: add_bool(rng.below(2)); break;
+			case 4:
+				snprintf(value, sizeof value, "value-%u", rng.below(100000));
+				add_str(value);
+				break;
+			}
+		}
+	}
+
+	void nested(int depth) {
+		char tag[16];
+		add_map(3);
+		add_str("id");
+		add_uint(rng.below(1u << 20));
+		add_str("tags");
+		add_array(2);
+		for (int i = 0; i < 2; i++) {
+			snprintf(tag, sizeof tag, "tag%u", rng.below(1000));
+			add_str(tag);
+		}
+		add_str("child");
+		if (depth < 8)
+			nested(depth + 1);
+		else
+			add_nil();
+	}
+
+	void numeric(size_t size) {
+		uint32_t count = size / 16 < 8 ? 8 : size / 16 > 4096 ? 4096 : size / 16;
+		bool integers = c.records & 1;
+
+		add_map(2);
+		add_str("series");
+		add_array(count);
+
+		if (integers) {
+			int64_t value = 0;
+			for (uint32_t i = 0; i < count; i++) {
+				value += (int64_t)rng.below(2001) - 1000;
+				add_int(value);
+			}
+		} else {
+			for (uint32_t i = 0; i < count; i++)
+				add_double(rng.next() / 18446744073709551616.0);
+		}
+
+		add_str("name");
+		add_str(integers ? "delta" : "sample");
+	}
+
+	void log() {
+		static const char *const levels[] = {"debug", "info", "info", "info", "warning", "error"};
+		static const char *const words[] = {
+			"connection", "from", "client", "accepted", "closed", "request", "GET", "POST",
+			"/api/v1/users", "/index.html", "timeout", "after", "ms", "retrying", "upstream", "returned",
+			"status", "200", "404", "503", "bytes", "sent", "cache", "miss",
+		};
+		char host[16];
+		std::string msg;
+
+		add_map(4);
+		add_str("ts");
+		add_uint(1700000000000 + c.records * 17 + rng.below(17));
+		add_str("level");
+		add_str(levels[rng.below(6)]);
+		add_str("host");
+		snprintf(host, sizeof host, "web-%02u", rng.below(32));
+		add_str(host);
+		add_str("msg");
+
+		uint32_t count = 6 + rng.below(25);
+		for (uint32_t i = 0; i < count; i++) {
+			if (i)
+				msg += ' ';
+			msg += words[rng.below(24)];
+		}
+
+		add_str(msg.data(), msg.size());
+	}
+
+	void blob(size_t size) {
+		uint32_t len = size / 4 < 16 ? 16 : size / 4 > 65536 ? 65536 : size / 4;
+		add_map(3);
+		add_str("id");
+		add_uint(c.records);
+		add_str("type");
+		add_str("application/octet-stream");
+		add_str("data");
+		add_bin(len / 2 + rng.below(len / 2));
+	}
+
+	void value(int depth) {
+		char key[8];
+
+		switch (rng.below(depth < 2 ? 9 : 7)) {
+		case 0: add_uint(rng.next() >> rng.below(64)); break;
+		case 1: add_int(-(int64_t)(rng.next() >> (1 + rng.below(63))) - 1); break;
+		case 2: add_double(rng.next() / 4294967296.0); break;
+		case 3: add_bool(rng.below(2)); break;
+		case 4: add_nil(); break;
+		case 5: {
+			char str[48];
+			uint32_t len = rng.below(sizeof str);
+			for (uint32_t i = 0; i < len; i++)
+				str[i] = 'a' + rng.below(26);
+			add_str(str, len);
+			break;
+		}
+		case 6: add_bin(rng.below(32)); break;
+		case 7: {
+			uint32_t count = 1 + rng.below(6);
+			add_array(count);
+			for (uint32_t i = 0; i < count; i++)
+				value(depth + 1);
+			break;
+		}
+		case 8: {
+			uint32_t count = 1 + rng.below(3);
+			add_map(count);
+			for (uint32_t i = 0; i < count; i++) {
+				snprintf(key, sizeof key, "k%u", i);
+				add_str(key);
+				value(depth + 1);
+			}
+			break;
+		}
+		}
+	}
+
+	void message() {
+		static const char *const keys[15] = {
+			"method", "params", "user", "session", "ts", "flags", "retry", "timeout",
+			"trace", "path", "status", "error", "result", "token", "version",
+		};
+		uint32_t count = 3 + rng.below(8);
+		uint32_t start = rng.below(15);
+		uint32_t id = rng.below(count);
+
+		add_map(count);
+
+		for (uint32_t i = 0; i < count; i++) {
+			if (i == id) {
+				add_str("id");
+				add_uint(rng.below(1u << 31));
+			} else {
+				add_str(keys[(start + i) % 15]);
+				value(0);
+			}
+		}
+	}
+
+	void record() {
+		switch (c.shape) {
+		case CORPUS_FLAT_MAP: flat_map(); break;
+		case CORPUS_NESTED: nested(1); break;
+		case CORPUS_NUMERIC: numeric(c.size); break;
+		case CORPUS_LOGS: log(); break;
+		case CORPUS_BLOBS: blob(c.size); break;
+		case CORPUS_MESSAGES: message(); break;
+		default: abort();
+		}
+
+		c.records++;
+	}
+};
+
+std::unique_ptr<corpus> current;
+
+}
+
+const char *corpus_name(enum corpus_shape shape) {
+	static const char *const names[CORPUS_SHAPES] = {"flat_map", "nested", "numeric", "logs", "blobs", "messages"};
+	return names[shape];
+}
+
+// Lookups use the last key of each record, so they have to skip over all other values.
+static const char *corpus_key(enum corpus_shape shape) {
+	static const char *const keys[CORPUS_SHAPES] = {"deleted", "child", "name", "msg", "data", "id"};
+	return keys[shape];
+}
+
+const corpus &corpus_get(enum corpus_shape shape, size_t size) {
+	if (current && current->shape == shape && current->size == size)
+		return *current;
+
+	current.reset();
+	current.reset(new corpus);
+	corpus &c = *current;
+	c.shape = shape;
+	c.size = size;
+	c.records = 0;
+	c.key = corpus_key(shape);
+
+	// Add records until the encoded corpus is large enough.
+	generator gen{c, {}};
+	packmsg_output_t scratch;
+	packmsg_output_init_growable(&scratch, NULL, NULL, 4096);
+	size_t total = 0;
+
+	while (total < size) {
+		size_t first = c.tokens.size();
+		size_t pool = c.pool.size();
+		gen.record();
+		packmsg_output_reset(&scratch);
+		packmsg_encode_tokens(&scratch, c, first, c.tokens.size() - first);
+		assert(packmsg_output_ok(&scratch));
+		size_t record = packmsg_output_size(&scratch, packmsg_output_data(&scratch));
+
+		// Keep messages close to 200 bytes.
+		if (shape == CORPUS_MESSAGES && (record < 150 || record > 250)) {
+			c.tokens.resize(first);
+			c.pool.resize(pool);
+			c.records--;
+			continue;
+		}
+
+		c.first_tokens.push_back(first);
+		total += record;
+	}
+
+	c.first_tokens.push_back(c.tokens.size());
+
+	packmsg_output_free(&scratch);
+
+	c.data.resize(total);
+	packmsg_output_t out;
+	packmsg_output_init(&out, c.data.data(), c.data.size());
+	packmsg_encode_tokens(&out, c, 0, c.tokens.size());
+	assert(packmsg_output_size(&out, c.data.data()) == total);
+
+	c.offsets.resize(c.records + 1);
+	size_t used;
+	size_t found = packmsg_find_boundaries(c.data.data(), total, c.offsets.data(), c.records, &used);
+	assert(found == c.records && used == total);
+	(void)found;
+	(void)used;
+	c.offsets[c.records] = total;
+
+	return c;
+}
+
+void corpus_register(const corpus_benchmark *benchmarks, size_t count) {
+	for (int shape = 0; shape < CORPUS_SHAPES; shape++)
+		for (int64_t size = 100; size <= 100000000; size *= 100)
+			for (size_t i = 0; i < count; i++)
+				benchmark::RegisterBenchmark(benchmarks[i].name, benchmarks[i].function)
+					->ArgNames({"shape", "size"})
+					->Args({shape, size});
+}
+
+void corpus_counters(benchmark::State &state, const corpus &c, size_t bytes) {
+	if (!bytes)
+		bytes = c.data.size();
+
+	perf_stop(state, bytes, c.tokens.size());
+	state.SetLabel(corpus_name(c.shape));
+	state.SetBytesProcessed(state.iterations() * bytes);
+	state.SetItemsProcessed(state.iterations() * c.tokens.size());
+	state.counters["records"] = c.records;
+}
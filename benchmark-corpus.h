@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+// The shapes of the generated corpora.
+enum corpus_shape {
+	CORPUS_FLAT_MAP,  // Wide maps with mixed scalar values.
+	CORPUS_NESTED,    // Documents with maps nested eight levels deep.
+	CORPUS_NUMERIC,   // Large arrays of doubles and integers.
+	CORPUS_LOGS,      // Log records dominated by strings.
+	CORPUS_BLOBS,     // Records carrying binary data.
+	CORPUS_MESSAGES,  // RPC messages of about 200 bytes, each with a different shape.
+	CORPUS_SHAPES,
+};
+
+// A single value of a corpus, in the form an application would pass it to the encoder.
+struct corpus_token {
+	uint8_t type;     // The enum packmsg_type of the value.
+	uint32_t len;     // The element count of a map or array, or the length of a string or binary data.
+	union {
+		bool b;
+		int64_t i;
+		uint64_t u;
+		double d;
+		size_t offset;  // The offset of a string or binary data in the pool.
+	};
+};
+
+// A corpus of concatenated records, both as native values and encoded.
+struct corpus {
+	enum corpus_shape shape;
+	size_t size;                      // The requested size of the encoded corpus.
+	std::vector<corpus_token> tokens;
+	std::vector<size_t> first_tokens; // The index of the first token of each record, followed by the number of tokens.
+	std::vector<char> pool;           // Strings (NUL-terminated) and binary data referred to by tokens.
+	std::vector<uint8_t> data;        // The encoded records, at least size bytes long.
+	std::vector<size_t> offsets;      // The offset of each record in data, followed by the size of data.
+	size_t records;
+	const char *key;                  // A key present in every record, used for lookups.
+};
+
+// A benchmark run for every corpus.
+struct corpus_benchmark {
+	const char *name;
+	void (*function)(benchmark::State &state);
+};
+
+const char *corpus_name(enum corpus_shape shape);
+
+// Returns the corpus with the given shape and size, generating it if necessary.
+// Only the most recently requested corpus is kept in memory.
+const corpus &corpus_get(enum corpus_shape shape, size_t size);
+
+// Registers the given benchmarks for all combinations of shapes and sizes from 100 B to 100 MB.
+// All benchmarks for the same corpus are registered together, so each corpus only has to be generated once,
+// and the results of different libraries for the same corpus are shown next to each other.
+void corpus_register(const corpus_benchmark *benchmarks, size_t count);
+
+// Sets the label and the byte and item counters of a benchmark that processed a corpus once per iteration,
+// and stops the performance counters started with perf_start().
+// Libraries using the standard big-endian format pass the size of their own encoding of the corpus.
+void corpus_counters(benchmark::State &state, const corpus &c, size_t bytes = 0);
@@ -0,0 +1,129 @@
+#include "benchmark-latency.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#endif
+
+bool latency_histograms = false;
+
+namespace {
+
+// Larger than the L1 and L2 caches of current processors.
+const size_t pollute_size = 4 << 20;
+std::vector<uint8_t> pollution(pollute_size);
+
+// The time it takes to read the clock twice, which is subtracted from every sample.
+double clock_overhead() {
+	static double overhead = -1;
+
+	if (overhead < 0) {
+		overhead = INFINITY;
+
+		for (int i = 0; i < 1000; i++) {
+			auto start = std::chrono::steady_clock::now();
+			auto end = std::chrono::steady_clock::now();
+			overhead = std::min(overhead, std::chrono::duration<double, std::nano>(end - start).count());
+		}
+	}
+
+	return overhead;
+}
+
+}
+
+void latency_args(benchmark::internal::Benchmark *b) {
+	b->ArgName("cold")->Arg(0)->Arg(1)->Iterations(20000)->UseManualTime();
+}
+
+std::vector<uint32_t> latency_order(const corpus &c, size_t count) {
+	std::vector<uint32_t> order(count);
+	uint64_t state = 0x2545f4914f6cdd1d;
+
+	for (auto &record: order) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		record = state % c.records;
+	}
+
+	return order;
+}
+
+void latency_evict(const void *data, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+	const char *ptr = (const char *)data;
+
+	for (size_t i = 0; i < len; i += 64)
+		_mm_clflush(ptr + i);
+
+	if (len)
+		_mm_clflush(ptr + len - 1);
+
+	_mm_mfence();
+#else
+	(void)data;
+	(void)len;
+#endif
+}
+
+void latency_pollute() {
+	for (size_t i = 0; i < pollution.size(); i += 64)
+		pollution[i]++;
+
+	benchmark::ClobberMemory();
+}
+
+void latency_report(benchmark::State &state, const char *name, std::vector<double> &samples) {
+	if (samples.empty())
+		return;
+
+	double overhead = clock_overhead();
+
+	for (auto &sample: samples)
+		sample = std::max(0.0, sample - overhead);
+
+	std::sort(samples.begin(), samples.end());
+
+	auto percentile = [&](double p) {
+		return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+	};
+
+	state.counters["p50_ns"] = percentile(0.5);
+	state.counters["p90_ns"] = percentile(0.9);
+	state.counters["p99_ns"] = percentile(0.99);
+	state.counters["p999_ns"] = percentile(0.999);
+	state.counters["max_ns"] = samples.back();
+
+	if (!latency_histograms)
+		return;
+
+	// Buckets grow by a factor of the fourth root of two, starting at 1 ns.
+	std::vector<size_t> buckets;
+
+	for (auto sample: samples) {
+		size_t bucket = sample < 1 ? 0 : (size_t)(4 * std::log2(sample)) + 1;
+
+		if (bucket >= buckets.size())
+			buckets.resize(bucket + 1);
+
+		buckets[bucket]++;
+	}
+
+	size_t largest = *std::max_element(buckets.begin(), buckets.end());
+	fprintf(stderr, "\n%s/cold:%d latency histogram:\n", name, (int)state.range(0));
+
+	for (size_t bucket = 0; bucket < buckets.size(); bucket++) {
+		if (!buckets[bucket])
+			continue;
+
+		double low = bucket ? std::exp2((bucket - 1) / 4.0) : 0;
+		double high = std::exp2(bucket / 4.0);
+		int width = (int)(60 * buckets[bucket] / largest);
+		fprintf(stderr, "%10.1f - %10.1f ns %8zu %.*s\n", low, high, buckets[bucket], width,
+		        "############################################################");
+	}
+}
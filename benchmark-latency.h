@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "benchmark-corpus.h"
+
+// Whether latency benchmarks print a histogram of their samples, set by --latency_histograms.
+extern bool latency_histograms;
+
+// Registers the warm and cold variants of a latency benchmark.
+void latency_args(benchmark::internal::Benchmark *b);
+
+// Returns a random order in which to visit the records of a corpus, so successive samples have different shapes.
+std::vector<uint32_t> latency_order(const corpus &c, size_t count);
+
+// Evicts a buffer from all cache levels, where the processor supports this.
+void latency_evict(const void *data, size_t len);
+
+// Fills the first cache levels with unrelated data, so the tables and code of the library are likely cold as well.
+void latency_pollute();
+
+// Reports percentiles of the samples as counters, and prints a histogram if requested.
+void latency_report(benchmark::State &state, const char *name, std::vector<double> &samples);
+
+// Times op for one randomly chosen record of the corpus per iteration.
+// If the first argument of the benchmark is non-zero, the caches are made cold between samples:
+// evict is called with the record number, and should evict the buffers op is going to use.
+template<typename Evict, typename Op>
+void latency_run(benchmark::State &state, const char *name, const corpus &c, Evict evict, Op op) {
+	bool cold = state.range(0);
+	std::vector<uint32_t> order = latency_order(c, state.max_iterations);
+	std::vector<double> samples;
+	samples.reserve(state.max_iterations);
+	size_t i = 0;
+
+	for (auto _: state) {
+		uint32_t record = order[i++];
+
+		if (cold) {
+			evict(record);
+			latency_pollute();
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		op(record);
+		auto end = std::chrono::steady_clock::now();
+
+		double ns = std::chrono::duration<double, std::nano>(end - start).count();
+		samples.push_back(ns);
+		state.SetIterationTime(ns * 1e-9);
+	}
+
+	latency_report(state, name, samples);
+}
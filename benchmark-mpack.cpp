@@ -0,0 +1,229 @@
+#include "benchmark-mpack.h"
+#include "benchmark-corpus.h"
+#include "benchmark-perf.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include <mpack.h>
+
+#include "packmsg.h"
+
+namespace {
+
+// mpack wants every map and array to be finished explicitly, so elements are written recursively.
+const corpus_token *encode(mpack_writer_t *writer, const corpus_token *token, const char *pool) {
+	switch (token->type) {
+	case PACKMSG_NIL: mpack_write_nil(writer); break;
+	case PACKMSG_BOOL: mpack_write_bool(writer, token->b); break;
+	case PACKMSG_INT64: mpack_write_i64(writer, token->i); break;
+	case PACKMSG_UINT64: mpack_write_u64(writer, token->u); break;
+	case PACKMSG_DOUBLE: mpack_write_double(writer, token->d); break;
+	case PACKMSG_STR: mpack_write_str(writer, pool + token->offset, token->len); break;
+	case PACKMSG_BIN: mpack_write_bin(writer, pool + token->offset, token->len); break;
+	case PACKMSG_MAP: {
+		const corpus_token *next = token + 1;
+		mpack_start_map(writer, token->len);
+		for (uint32_t i = 0; i < token->len * 2; i++)
+			next = encode(writer, next, pool);
+		mpack_finish_map(writer);
+		return next;
+	}
+	case PACKMSG_ARRAY: {
+		const corpus_token *next = token + 1;
+		mpack_start_array(writer, token->len);
+		for (uint32_t i = 0; i < token->len; i++)
+			next = encode(writer, next, pool);
+		mpack_finish_array(writer);
+		return next;
+	}
+	default: abort();
+	}
+
+	return token + 1;
+}
+
+size_t encode(char *buf, size_t size, const corpus &c) {
+	mpack_writer_t writer;
+	mpack_writer_init(&writer, buf, size);
+	const corpus_token *token = c.tokens.data();
+	const corpus_token *end = token + c.tokens.size();
+
+	while (token != end)
+		token = encode(&writer, token, c.pool.data());
+
+	size_t used = mpack_writer_buffer_used(&writer);
+	return mpack_writer_destroy(&writer) == mpack_ok ? used : 0;
+}
+
+uint64_t decode(mpack_reader_t *reader) {
+	mpack_tag_t tag = mpack_read_tag(reader);
+	uint64_t sum = 0;
+
+	switch (mpack_tag_type(&tag)) {
+	case mpack_type_nil: break;
+	case mpack_type_bool: sum += mpack_tag_bool_value(&tag); break;
+	case mpack_type_int: sum += mpack_tag_int_value(&tag); break;
+	case mpack_type_uint: sum += mpack_tag_uint_value(&tag); break;
+	case mpack_type_double: sum += mpack_tag_double_value(&tag); break;
+	case mpack_type_str:
+		mpack_read_bytes_inplace(reader, mpack_tag_bytes(&tag));
+		mpack_done_str(reader);
+		sum += mpack_tag_bytes(&tag);
+		break;
+	case mpack_type_bin:
+		mpack_read_bytes_inplace(reader, mpack_tag_bytes(&tag));
+		mpack_done_bin(reader);
+		sum += mpack_tag_bytes(&tag);
+		break;
+	case mpack_type_map:
+		for (uint32_t i = 0; i < mpack_tag_map_count(&tag) * 2 && mpack_reader_error(reader) == mpack_ok; i++)
+			sum += decode(reader);
+		mpack_done_map(reader);
+		break;
+	case mpack_type_array:
+		for (uint32_t i = 0; i < mpack_tag_array_count(&tag) && mpack_reader_error(reader) == mpack_ok; i++)
+			sum += decode(reader);
+		mpack_done_array(reader);
+		break;
+	default:
+		mpack_reader_flag_error(reader, mpack_error_type);
+		break;
+	}
+
+	return sum;
+}
+
+struct encoded {
+	std::vector<char> data;
+	std::vector<size_t> offsets;
+
+	explicit encoded(const corpus &c): data(c.data.size() * 2 + 64) {
+		data.resize(encode(data.data(), data.size(), c));
+		assert(!data.empty());
+
+		mpack_reader_t reader;
+		mpack_reader_init_data(&reader, data.data(), data.size());
+		size_t remaining;
+
+		while ((remaining = mpack_reader_remaining(&reader, NULL))) {
+			offsets.push_back(data.size() - remaining);
+			mpack_discard(&reader);
+		}
+
+		if (mpack_reader_destroy(&reader) != mpack_ok)
+			abort();
+
+		offsets.push_back(data.size());
+	}
+};
+
+}
+
+void mpack_encode_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+	std::vector<char> out(e.data.size());
+
+	perf_start();
+
+	for (auto _: state) {
+		size_t used = encode(out.data(), out.size(), c);
+
+		assert(used == out.size());
+		benchmark::DoNotOptimize(used);
+		benchmark::ClobberMemory();
+	}
+
+	corpus_counters(state, c, e.data.size());
+}
+
+void mpack_decode_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+
+	perf_start();
+
+	for (auto _: state) {
+		mpack_reader_t reader;
+		mpack_reader_init_data(&reader, e.data.data(), e.data.size());
+		uint64_t sum = 0;
+
+		while (mpack_reader_remaining(&reader, NULL) && mpack_reader_error(&reader) == mpack_ok)
+			sum += decode(&reader);
+
+		mpack_error_t error = mpack_reader_destroy(&reader);
+
+		assert(error == mpack_ok);
+		benchmark::DoNotOptimize(error);
+		benchmark::DoNotOptimize(sum);
+	}
+
+	corpus_counters(state, c, e.data.size());
+}
+
+void mpack_skip_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+
+	perf_start();
+
+	for (auto _: state) {
+		mpack_reader_t reader;
+		mpack_reader_init_data(&reader, e.data.data(), e.data.size());
+		size_t records = 0;
+
+		while (mpack_reader_remaining(&reader, NULL) && mpack_reader_error(&reader) == mpack_ok) {
+			mpack_discard(&reader);
+			records++;
+		}
+
+		mpack_error_t error = mpack_reader_destroy(&reader);
+
+		assert(error == mpack_ok && records == c.records);
+		benchmark::DoNotOptimize(error);
+		benchmark::DoNotOptimize(records);
+	}
+
+	corpus_counters(state, c, e.data.size());
+}
+
+void mpack_lookup_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+	uint32_t keylen = strlen(c.key);
+
+	perf_start();
+
+	for (auto _: state) {
+		size_t found = 0;
+
+		for (size_t i = 0; i < c.records; i++) {
+			mpack_reader_t reader;
+			mpack_reader_init_data(&reader, e.data.data() + e.offsets[i], e.offsets[i + 1] - e.offsets[i]);
+
+			for (uint32_t count = mpack_expect_map(&reader); count-- && mpack_reader_error(&reader) == mpack_ok;) {
+				uint32_t len = mpack_expect_str(&reader);
+				const char *key = mpack_read_bytes_inplace(&reader, len);
+				mpack_done_str(&reader);
+
+				if (mpack_reader_error(&reader) == mpack_ok && len == keylen && !memcmp(key, c.key, keylen)) {
+					mpack_discard(&reader);
+					found += mpack_reader_error(&reader) == mpack_ok;
+					break;
+				}
+
+				mpack_discard(&reader);
+			}
+
+			// The rest of the map is not read, so the reader may complain about it in debug builds.
+			mpack_reader_destroy(&reader);
+		}
+
+		assert(found == c.records);
+		benchmark::DoNotOptimize(found);
+	}
+
+	corpus_counters(state, c, e.data.size());
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <benchmark/benchmark.h>
+
+void mpack_encode_corpus(benchmark::State &state);
+void mpack_decode_corpus(benchmark::State &state);
+void mpack_skip_corpus(benchmark::State &state);
+void mpack_lookup_corpus(benchmark::State &state);
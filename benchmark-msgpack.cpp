@@ -1,13 +1,23 @@
 #include "benchmark-msgpack.h"
+#include "benchmark-corpus.h"
+#include "benchmark-perf.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
 
 #include <msgpack.h>
 
+#include "packmsg.h"
+
 void msgpack_encode_nil(benchmark::State &state) {
 	msgpack_sbuffer sbuf;
 	msgpack_sbuffer_init(&sbuf);
 	msgpack_packer pk;
 	msgpack_packer_init(&pk, &sbuf, msgpack_sbuffer_write);
 
+	perf_start();
+
 	for (auto _: state) {
 		msgpack_sbuffer_clear(&sbuf);
 
@@ -17,6 +27,8 @@ void msgpack_encode_nil(benchmark::State &state) {
 		benchmark::ClobberMemory();
 	}
 
+	perf_stop(state, 1, 1);
+
 	msgpack_sbuffer_destroy(&sbuf);
 }
 
@@ -31,6 +43,8 @@ void msgpack_decode_nil(benchmark::State &state) {
 	msgpack_unpacked und;
 	msgpack_unpacked_init(&und);
 
+	perf_start();
+
 	for (auto _: state) {
 		msgpack_unpacker_reset(&unp);
 
@@ -40,6 +54,8 @@ void msgpack_decode_nil(benchmark::State &state) {
 		benchmark::ClobberMemory();
 	}
 
+	perf_stop(state, 1, 1);
+
 	msgpack_unpacked_destroy(&und);
 	msgpack_unpacker_destroy(&unp);
 }
@@ -53,6 +69,8 @@ void msgpack_encode_hello(benchmark::State &state) {
 	const char *str1 = "compact";
 	const char *str2 = "schema";
 
+	perf_start();
+
 	for (auto _: state) {
 		msgpack_sbuffer_clear(&sbuf);
 
@@ -68,6 +86,8 @@ void msgpack_encode_hello(benchmark::State &state) {
 		benchmark::ClobberMemory();
 	}
 
+	perf_stop(state, 18, 1);
+
 	msgpack_sbuffer_destroy(&sbuf);
 }
 
@@ -77,20 +97,226 @@ void msgpack_decode_hello(benchmark::State &state) {
 	msgpack_unpacked und;
 	msgpack_unpacked_init(&und);
 
+	perf_start();
+
 	for (auto _: state) {
-		// TODO: can we move the unpacker out of the loop?
-		msgpack_unpacker unp;
-		msgpack_unpacker_init(&unp, 1024);
-		memcpy(msgpack_unpacker_buffer(&unp), buf, sizeof buf);
-		msgpack_unpacker_buffer_consumed(&unp, sizeof buf);
+		size_t off = 0;
+		msgpack_unpack_return ret = msgpack_unpack_next(&und, (const char *)buf, sizeof buf, &off);
+
+		assert(ret == MSGPACK_UNPACK_SUCCESS && off == sizeof buf);
+		assert(und.data.type == MSGPACK_OBJECT_MAP && und.data.via.map.size == 2);
+
+		const msgpack_object_kv *kv = und.data.via.map.ptr;
+		const char *key1 = kv[0].key.via.str.ptr;
+		bool val1 = kv[0].val.via.boolean;
+		const char *key2 = kv[1].key.via.str.ptr;
+		uint64_t val2 = kv[1].val.via.u64;
+
+		benchmark::DoNotOptimize(ret);
+		benchmark::DoNotOptimize(key1);
+		benchmark::DoNotOptimize(val1);
+		benchmark::DoNotOptimize(key2);
+		benchmark::DoNotOptimize(val2);
+	}
+
+	perf_stop(state, 18, 1);
+
+	msgpack_unpacked_destroy(&und);
+}
+
+namespace {
+
+void encode(msgpack_packer *pk, const corpus &c) {
+	const char *pool = c.pool.data();
+
+	for (auto &token: c.tokens) {
+		switch (token.type) {
+		case PACKMSG_NIL: msgpack_pack_nil(pk); break;
+		case PACKMSG_BOOL: token.b ? msgpack_pack_true(pk) : msgpack_pack_false(pk); break;
+		case PACKMSG_INT64: msgpack_pack_int64(pk, token.i); break;
+		case PACKMSG_UINT64: msgpack_pack_uint64(pk, token.u); break;
+		case PACKMSG_DOUBLE: msgpack_pack_double(pk, token.d); break;
+		case PACKMSG_STR:
+			msgpack_pack_str(pk, token.len);
+			msgpack_pack_str_body(pk, pool + token.offset, token.len);
+			break;
+		case PACKMSG_BIN:
+			msgpack_pack_bin(pk, token.len);
+			msgpack_pack_bin_body(pk, pool + token.offset, token.len);
+			break;
+		case PACKMSG_MAP: msgpack_pack_map(pk, token.len); break;
+		case PACKMSG_ARRAY: msgpack_pack_array(pk, token.len); break;
+		default: abort();
+		}
+	}
+}
+
+uint64_t walk(const msgpack_object *obj) {
+	uint64_t sum = 0;
+
+	switch (obj->type) {
+	case MSGPACK_OBJECT_NIL: break;
+	case MSGPACK_OBJECT_BOOLEAN: sum += obj->via.boolean; break;
+	case MSGPACK_OBJECT_POSITIVE_INTEGER: sum += obj->via.u64; break;
+	case MSGPACK_OBJECT_NEGATIVE_INTEGER: sum += obj->via.i64; break;
+	case MSGPACK_OBJECT_FLOAT32:
+	case MSGPACK_OBJECT_FLOAT64: sum += obj->via.f64; break;
+	case MSGPACK_OBJECT_STR: sum += obj->via.str.size; break;
+	case MSGPACK_OBJECT_BIN: sum += obj->via.bin.size; break;
+	case MSGPACK_OBJECT_MAP:
+		for (uint32_t i = 0; i < obj->via.map.size; i++) {
+			sum += walk(&obj->via.map.ptr[i].key);
+			sum += walk(&obj->via.map.ptr[i].val);
+		}
+		break;
+	case MSGPACK_OBJECT_ARRAY:
+		for (uint32_t i = 0; i < obj->via.array.size; i++)
+			sum += walk(&obj->via.array.ptr[i]);
+		break;
+	default: break;
+	}
+
+	return sum;
+}
+
+struct encoded {
+	msgpack_sbuffer sbuf;
+	std::vector<size_t> offsets;
+
+	explicit encoded(const corpus &c) {
+		msgpack_sbuffer_init(&sbuf);
+		msgpack_packer pk;
+		msgpack_packer_init(&pk, &sbuf, msgpack_sbuffer_write);
+		encode(&pk, c);
+
+		msgpack_unpacked und;
+		msgpack_unpacked_init(&und);
+		size_t off = 0;
+
+		while (off != sbuf.size) {
+			offsets.push_back(off);
+
+			if (msgpack_unpack_next(&und, sbuf.data, sbuf.size, &off) != MSGPACK_UNPACK_SUCCESS)
+				abort();
+		}
+
+		msgpack_unpacked_destroy(&und);
+		offsets.push_back(sbuf.size);
+	}
+
+	~encoded() {
+		msgpack_sbuffer_destroy(&sbuf);
+	}
+};
+
+}
+
+void msgpack_encode_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	msgpack_sbuffer sbuf;
+	msgpack_sbuffer_init(&sbuf);
+	msgpack_packer pk;
+	msgpack_packer_init(&pk, &sbuf, msgpack_sbuffer_write);
+
+	perf_start();
+
+	for (auto _: state) {
+		msgpack_sbuffer_clear(&sbuf);
+
+		encode(&pk, c);
 
-		// TODO: how to unpack the contents of the array?
-		msgpack_unpacker_next(&unp, &und);
-		assert(und.data.type == MSGPACK_OBJECT_MAP);
-		
-		msgpack_unpacker_destroy(&unp);
 		benchmark::ClobberMemory();
 	}
 
+	corpus_counters(state, c, sbuf.size);
+	msgpack_sbuffer_destroy(&sbuf);
+}
+
+void msgpack_decode_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+	msgpack_unpacked und;
+	msgpack_unpacked_init(&und);
+
+	perf_start();
+
+	for (auto _: state) {
+		size_t off = 0;
+		uint64_t sum = 0;
+
+		while (off != e.sbuf.size && msgpack_unpack_next(&und, e.sbuf.data, e.sbuf.size, &off) == MSGPACK_UNPACK_SUCCESS)
+			sum += walk(&und.data);
+
+		assert(off == e.sbuf.size);
+		benchmark::DoNotOptimize(sum);
+	}
+
+	msgpack_unpacked_destroy(&und);
+	corpus_counters(state, c, e.sbuf.size);
+}
+
+// msgpack-c cannot skip objects without unpacking them.
+void msgpack_skip_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+	msgpack_unpacked und;
+	msgpack_unpacked_init(&und);
+
+	perf_start();
+
+	for (auto _: state) {
+		size_t off = 0;
+		size_t records = 0;
+
+		while (off != e.sbuf.size && msgpack_unpack_next(&und, e.sbuf.data, e.sbuf.size, &off) == MSGPACK_UNPACK_SUCCESS)
+			records++;
+
+		assert(records == c.records);
+		benchmark::DoNotOptimize(records);
+	}
+
+	msgpack_unpacked_destroy(&und);
+	corpus_counters(state, c, e.sbuf.size);
+}
+
+void msgpack_lookup_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+	uint32_t keylen = strlen(c.key);
+	msgpack_unpacked und;
+	msgpack_unpacked_init(&und);
+
+	perf_start();
+
+	for (auto _: state) {
+		size_t found = 0;
+
+		for (size_t i = 0; i < c.records; i++) {
+			size_t off = 0;
+
+			if (msgpack_unpack_next(&und, e.sbuf.data + e.offsets[i], e.offsets[i + 1] - e.offsets[i], &off) != MSGPACK_UNPACK_SUCCESS)
+				continue;
+
+			if (und.data.type != MSGPACK_OBJECT_MAP)
+				continue;
+
+			const msgpack_object_map &map = und.data.via.map;
+
+			for (uint32_t j = 0; j < map.size; j++) {
+				const msgpack_object &key = map.ptr[j].key;
+
+				if (key.type == MSGPACK_OBJECT_STR && key.via.str.size == keylen && !memcmp(key.via.str.ptr, c.key, keylen)) {
+					benchmark::DoNotOptimize(map.ptr[j].val);
+					found++;
+					break;
+				}
+			}
+		}
+
+		assert(found == c.records);
+		benchmark::DoNotOptimize(found);
+	}
+
 	msgpack_unpacked_destroy(&und);
+	corpus_counters(state, c, e.sbuf.size);
 }
@@ -6,3 +6,8 @@ void msgpack_encode_nil(benchmark::State &state);
 void msgpack_decode_nil(benchmark::State &state);
 void msgpack_encode_hello(benchmark::State &state);
 void msgpack_decode_hello(benchmark::State &state);
+
+void msgpack_encode_corpus(benchmark::State &state);
+void msgpack_decode_corpus(benchmark::State &state);
+void msgpack_skip_corpus(benchmark::State &state);
+void msgpack_lookup_corpus(benchmark::State &state);
@@ -1,65 +1,291 @@
-#include "benchmark-packmsg.h"
+#include "benchmark-msgpuck.h"
+#include "benchmark-corpus.h"
+#include "benchmark-perf.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include <msgpuck.h>
 
 #include "packmsg.h"
 
-void packmsg_encode_nil(benchmark::State &state) {
-	uint8_t buf[1];
+void msgpuck_encode_nil(benchmark::State &state) {
+	char buf[1];
 
-	for (auto _: state) {
-		struct packmsg_output out = {buf, sizeof buf};
+	perf_start();
 
-		packmsg_add_nil(&out);
+	for (auto _: state) {
+		char *ptr = mp_encode_nil(buf);
 
-		assert(packmsg_is_ok(&out));
+		assert(ptr == buf + sizeof buf);
+		benchmark::DoNotOptimize(ptr);
 		benchmark::ClobberMemory();
 	}
+
+	perf_stop(state, 1, 1);
 }
 
-void packmsg_decode_nil(benchmark::State &state) {
-	const uint8_t buf[1] = {0xc0};
+void msgpuck_decode_nil(benchmark::State &state) {
+	const char buf[1] = {'\xc0'};
+
+	perf_start();
 
 	for (auto _: state) {
-		struct packmsg_input in = {buf, sizeof buf};
+		const char *ptr = buf;
 
-		packmsg_get_nil(&in);
+		if (mp_check(&ptr, buf + sizeof buf) == 0) {
+			ptr = buf;
+			mp_decode_nil(&ptr);
+		}
 
-		assert(packmsg_is_done(&in));
-		benchmark::ClobberMemory();
+		assert(ptr == buf + sizeof buf);
+		benchmark::DoNotOptimize(ptr);
 	}
+
+	perf_stop(state, 1, 1);
 }
 
-void packmsg_encode_hello(benchmark::State &state) {
-	uint8_t buf[18];
+void msgpuck_encode_hello(benchmark::State &state) {
+	char buf[18];
+
+	perf_start();
 
 	for (auto _: state) {
-		struct packmsg_output out = {buf, sizeof buf};
+		char *ptr = buf;
 
-		packmsg_add_array(&out, 2);
-		packmsg_add_str(&out, "compact");
-		packmsg_add_bool(&out, true);
-		packmsg_add_str(&out, "schema");
-		packmsg_add_int32(&out, 0);
+		ptr = mp_encode_map(ptr, 2);
+		ptr = mp_encode_str(ptr, "compact", 7);
+		ptr = mp_encode_bool(ptr, true);
+		ptr = mp_encode_str(ptr, "schema", 6);
+		ptr = mp_encode_uint(ptr, 0);
 
-		assert(packmsg_is_ok(&out));
+		assert(ptr == buf + sizeof buf);
+		benchmark::DoNotOptimize(ptr);
 		benchmark::ClobberMemory();
 	}
+
+	perf_stop(state, 18, 1);
 }
 
-void packmsg_decode_hello(benchmark::State &state) {
-	const uint8_t buf[18] = "\x82\xa7" "compact" "\xc3\xa6" "schema";
+void msgpuck_decode_hello(benchmark::State &state) {
+	const char buf[18] = "\x82\xa7" "compact" "\xc3\xa6" "schema";
+
+	perf_start();
 
 	for (auto _: state) {
-		struct packmsg_input in = {buf, sizeof buf};
+		const char *ptr = buf;
+		uint32_t len1;
+		uint32_t len2;
 		const char *key1;
 		const char *key2;
+		bool val1 = false;
+		uint64_t val2 = 0;
+
+		// msgpuck does not check bounds while decoding, the input has to be checked first.
+		if (mp_check(&ptr, buf + sizeof buf) == 0) {
+			ptr = buf;
+			mp_decode_map(&ptr);
+			key1 = mp_decode_str(&ptr, &len1);
+			val1 = mp_decode_bool(&ptr);
+			key2 = mp_decode_str(&ptr, &len2);
+			val2 = mp_decode_uint(&ptr);
+			benchmark::DoNotOptimize(key1);
+			benchmark::DoNotOptimize(key2);
+		}
+
+		assert(ptr == buf + sizeof buf);
+		benchmark::DoNotOptimize(val1);
+		benchmark::DoNotOptimize(val2);
+	}
+
+	perf_stop(state, 18, 1);
+}
+
+namespace {
+
+// msgpuck does not check bounds while encoding, so the size of the output has to be calculated up front.
+size_t encoded_size(const corpus &c) {
+	size_t size = 0;
+
+	for (auto &token: c.tokens) {
+		switch (token.type) {
+		case PACKMSG_NIL: size += mp_sizeof_nil(); break;
+		case PACKMSG_BOOL: size += mp_sizeof_bool(token.b); break;
+		case PACKMSG_INT64: size += token.i < 0 ? mp_sizeof_int(token.i) : mp_sizeof_uint(token.i); break;
+		case PACKMSG_UINT64: size += mp_sizeof_uint(token.u); break;
+		case PACKMSG_DOUBLE: size += mp_sizeof_double(token.d); break;
+		case PACKMSG_STR: size += mp_sizeof_str(token.len); break;
+		case PACKMSG_BIN: size += mp_sizeof_bin(token.len); break;
+		case PACKMSG_MAP: size += mp_sizeof_map(token.len); break;
+		case PACKMSG_ARRAY: size += mp_sizeof_array(token.len); break;
+		default: abort();
+		}
+	}
+
+	return size;
+}
+
+char *encode(char *ptr, const corpus &c) {
+	const char *pool = c.pool.data();
+
+	for (auto &token: c.tokens) {
+		switch (token.type) {
+		case PACKMSG_NIL: ptr = mp_encode_nil(ptr); break;
+		case PACKMSG_BOOL: ptr = mp_encode_bool(ptr, token.b); break;
+		case PACKMSG_INT64: ptr = token.i < 0 ? mp_encode_int(ptr, token.i) : mp_encode_uint(ptr, token.i); break;
+		case PACKMSG_UINT64: ptr = mp_encode_uint(ptr, token.u); break;
+		case PACKMSG_DOUBLE: ptr = mp_encode_double(ptr, token.d); break;
+		case PACKMSG_STR: ptr = mp_encode_str(ptr, pool + token.offset, token.len); break;
+		case PACKMSG_BIN: ptr = mp_encode_bin(ptr, pool + token.offset, token.len); break;
+		case PACKMSG_MAP: ptr = mp_encode_map(ptr, token.len); break;
+		case PACKMSG_ARRAY: ptr = mp_encode_array(ptr, token.len); break;
+		default: abort();
+		}
+	}
+
+	return ptr;
+}
+
+struct encoded {
+	std::vector<char> data;
+	std::vector<size_t> offsets;
+
+	explicit encoded(const corpus &c): data(encoded_size(c)) {
+		char *end = encode(data.data(), c);
+		assert(end == data.data() + data.size());
+		(void)end;
+
+		for (const char *ptr = data.data(); ptr != data.data() + data.size(); mp_next(&ptr))
+			offsets.push_back(ptr - data.data());
+
+		offsets.push_back(data.size());
+	}
+};
+
+}
+
+void msgpuck_encode_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	std::vector<char> buf;
+
+	perf_start();
 
-		packmsg_get_map(&in);
-		packmsg_get_str_raw(&in, &key1);
-		packmsg_get_bool(&in);
-		packmsg_get_str_raw(&in, &key2);
-		packmsg_get_int32(&in);
-		
-		assert(packmsg_is_done(&in));
+	for (auto _: state) {
+		buf.resize(encoded_size(c));
+		char *end = encode(buf.data(), c);
+
+		assert(end == buf.data() + buf.size());
+		benchmark::DoNotOptimize(end);
 		benchmark::ClobberMemory();
 	}
+
+	corpus_counters(state, c, buf.size());
+}
+
+void msgpuck_decode_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+
+	perf_start();
+
+	for (auto _: state) {
+		const char *ptr = e.data.data();
+		const char *end = ptr + e.data.size();
+		uint64_t sum = 0;
+		uint32_t len;
+
+		while (ptr != end) {
+			// msgpuck does not check bounds while decoding, so each record has to be checked first.
+			const char *next = ptr;
+
+			if (mp_check(&next, end))
+				break;
+
+			while (ptr != next) {
+				switch (mp_typeof(*ptr)) {
+				case MP_NIL: mp_decode_nil(&ptr); break;
+				case MP_BOOL: sum += mp_decode_bool(&ptr); break;
+				case MP_INT: sum += mp_decode_int(&ptr); break;
+				case MP_UINT: sum += mp_decode_uint(&ptr); break;
+				case MP_DOUBLE: sum += mp_decode_double(&ptr); break;
+				case MP_STR: mp_decode_str(&ptr, &len); sum += len; break;
+				case MP_BIN: mp_decode_bin(&ptr, &len); sum += len; break;
+				case MP_MAP: sum += mp_decode_map(&ptr); break;
+				case MP_ARRAY: sum += mp_decode_array(&ptr); break;
+				default: mp_next(&ptr); break;
+				}
+			}
+		}
+
+		assert(ptr == end);
+		benchmark::DoNotOptimize(sum);
+	}
+
+	corpus_counters(state, c, e.data.size());
+}
+
+void msgpuck_skip_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+
+	perf_start();
+
+	for (auto _: state) {
+		const char *ptr = e.data.data();
+		const char *end = ptr + e.data.size();
+		size_t records = 0;
+
+		// mp_check() is the bounds-checked equivalent of mp_next().
+		while (ptr != end && !mp_check(&ptr, end))
+			records++;
+
+		assert(records == c.records);
+		benchmark::DoNotOptimize(records);
+	}
+
+	corpus_counters(state, c, e.data.size());
+}
+
+void msgpuck_lookup_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	encoded e(c);
+	uint32_t keylen = strlen(c.key);
+
+	perf_start();
+
+	for (auto _: state) {
+		size_t found = 0;
+
+		for (size_t i = 0; i < c.records; i++) {
+			const char *ptr = e.data.data() + e.offsets[i];
+			const char *end = e.data.data() + e.offsets[i + 1];
+			const char *check = ptr;
+
+			if (mp_check(&check, end) || mp_typeof(*ptr) != MP_MAP)
+				continue;
+
+			for (uint32_t count = mp_decode_map(&ptr); count--;) {
+				if (mp_typeof(*ptr) == MP_STR) {
+					uint32_t len;
+					const char *key = mp_decode_str(&ptr, &len);
+
+					if (len == keylen && !memcmp(key, c.key, keylen)) {
+						mp_next(&ptr);
+						found++;
+						break;
+					}
+				} else {
+					mp_next(&ptr);
+				}
+
+				mp_next(&ptr);
+			}
+		}
+
+		assert(found == c.records);
+		benchmark::DoNotOptimize(found);
+	}
+
+	corpus_counters(state, c, e.data.size());
 }
@@ -2,7 +2,12 @@
 
 #include <benchmark/benchmark.h>
 
-void packmsg_encode_nil(benchmark::State &state);
-void packmsg_decode_nil(benchmark::State &state);
-void packmsg_encode_hello(benchmark::State &state);
-void packmsg_decode_hello(benchmark::State &state);
+void msgpuck_encode_nil(benchmark::State &state);
+void msgpuck_decode_nil(benchmark::State &state);
+void msgpuck_encode_hello(benchmark::State &state);
+void msgpuck_decode_hello(benchmark::State &state);
+
+void msgpuck_encode_corpus(benchmark::State &state);
+void msgpuck_decode_corpus(benchmark::State &state);
+void msgpuck_skip_corpus(benchmark::State &state);
+void msgpuck_lookup_corpus(benchmark::State &state);
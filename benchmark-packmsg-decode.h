@@ -0,0 +1,35 @@
+#pragma once
+
+#include "packmsg.h"
+
+// Reads every value from the input.
+// Every translation unit gets its own copy, so one that defines PACKMSG_TRUSTED uses the getters without bounds checks.
+static inline uint64_t decode_values(packmsg_input_t *in) {
+	uint64_t sum = 0;
+	const char *str;
+	const void *data;
+
+	while (packmsg_input_ok(in) && !packmsg_done(in)) {
+		switch (packmsg_get_type(in)) {
+		case PACKMSG_NIL: packmsg_get_nil(in); break;
+		case PACKMSG_BOOL: sum += packmsg_get_bool(in); break;
+		case PACKMSG_POSITIVE_FIXINT:
+		case PACKMSG_INT8:
+		case PACKMSG_INT16:
+		case PACKMSG_INT32:
+		case PACKMSG_INT64: sum += packmsg_get_int64(in); break;
+		case PACKMSG_UINT8:
+		case PACKMSG_UINT16:
+		case PACKMSG_UINT32:
+		case PACKMSG_UINT64: sum += packmsg_get_uint64(in); break;
+		case PACKMSG_DOUBLE: sum += packmsg_get_double(in); break;
+		case PACKMSG_STR: sum += packmsg_get_str_raw(in, &str); break;
+		case PACKMSG_BIN: sum += packmsg_get_bin_raw(in, &data); break;
+		case PACKMSG_MAP: sum += packmsg_get_map(in); break;
+		case PACKMSG_ARRAY: sum += packmsg_get_array(in); break;
+		default: packmsg_input_invalidate(in); break;
+		}
+	}
+
+	return sum;
+}
@@ -1,38 +1,58 @@
 #include "benchmark-packmsg.h"
+#include "benchmark-corpus.h"
+#include "benchmark-latency.h"
+#include "benchmark-perf.h"
+#include "benchmark-threads.h"
 
-#include "packmsg.h"
+#include <cstdlib>
+#include <cstring>
+
+#include "benchmark-packmsg-decode.h"
 
 void packmsg_encode_nil(benchmark::State &state) {
 	uint8_t buf[1];
 
+	perf_start();
+
 	for (auto _: state) {
-		packmsg_output_t out = {buf, sizeof buf};
+		packmsg_output_t out;
+		packmsg_output_init(&out, buf, sizeof buf);
 
 		packmsg_add_nil(&out);
 
 		assert(packmsg_output_ok(&out));
 		benchmark::ClobberMemory();
 	}
+
+	perf_stop(state, 1, 1);
 }
 
 void packmsg_decode_nil(benchmark::State &state) {
 	const uint8_t buf[1] = {0xc0};
 
+	perf_start();
+
 	for (auto _: state) {
-		packmsg_input_t in = {buf, sizeof buf};
+		packmsg_input_t in;
+		packmsg_input_init(&in, buf, sizeof buf);
 
 		packmsg_get_nil(&in);
 
 		assert(packmsg_done(&in));
 		benchmark::ClobberMemory();
 	}
+
+	perf_stop(state, 1, 1);
 }
 
 void packmsg_encode_hello(benchmark::State &state) {
 	uint8_t buf[18];
 
+	perf_start();
+
 	for (auto _: state) {
-		packmsg_output_t out = {buf, sizeof buf};
+		packmsg_output_t out;
+		packmsg_output_init(&out, buf, sizeof buf);
 
 		packmsg_add_array(&out, 2);
 		packmsg_add_str(&out, "compact");
@@ -43,13 +63,18 @@ void packmsg_encode_hello(benchmark::State &state) {
 		assert(packmsg_output_ok(&out));
 		benchmark::ClobberMemory();
 	}
+
+	perf_stop(state, 18, 1);
 }
 
 void packmsg_decode_hello(benchmark::State &state) {
 	const uint8_t buf[18] = "\x82\xa7" "compact" "\xc3\xa6" "schema";
 
+	perf_start();
+
 	for (auto _: state) {
-		packmsg_input_t in = {buf, sizeof buf};
+		packmsg_input_t in;
+		packmsg_input_init(&in, buf, sizeof buf);
 		const char *key1;
 		const char *key2;
 
@@ -62,4 +87,259 @@ void packmsg_decode_hello(benchmark::State &state) {
 		assert(packmsg_done(&in));
 		benchmark::ClobberMemory();
 	}
+
+	perf_stop(state, 18, 1);
+}
+
+void packmsg_encode_tokens(packmsg_output_t *out, const corpus &c, size_t first, size_t count) {
+	const corpus_token *token = c.tokens.data() + first;
+	const char *pool = c.pool.data();
+
+	for (size_t i = 0; i < count; i++, token++) {
+		switch (token->type) {
+		case PACKMSG_NIL: packmsg_add_nil(out); break;
+		case PACKMSG_BOOL: packmsg_add_bool(out, token->b); break;
+		case PACKMSG_INT64: packmsg_add_int64(out, token->i); break;
+		case PACKMSG_UINT64: packmsg_add_uint64(out, token->u); break;
+		case PACKMSG_DOUBLE: packmsg_add_double(out, token->d); break;
+		case PACKMSG_STR: packmsg_add_str(out, pool + token->offset); break;
+		case PACKMSG_BIN: packmsg_add_bin(out, pool + token->offset, token->len); break;
+		case PACKMSG_MAP: packmsg_add_map(out, token->len); break;
+		case PACKMSG_ARRAY: packmsg_add_array(out, token->len); break;
+		default: abort();
+		}
+	}
+}
+
+void packmsg_encode_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	std::vector<uint8_t> buf(c.data.size());
+
+	perf_start();
+
+	for (auto _: state) {
+		packmsg_output_t out;
+		packmsg_output_init(&out, buf.data(), buf.size());
+
+		packmsg_encode_tokens(&out, c, 0, c.tokens.size());
+
+		assert(packmsg_output_size(&out, buf.data()) == buf.size());
+		benchmark::ClobberMemory();
+	}
+
+	corpus_counters(state, c);
+}
+
+void packmsg_decode_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+
+	perf_start();
+
+	for (auto _: state) {
+		packmsg_input_t in;
+		packmsg_input_init(&in, c.data.data(), c.data.size());
+
+		uint64_t sum = decode_values(&in);
+
+		assert(packmsg_input_ok(&in));
+		benchmark::DoNotOptimize(sum);
+	}
+
+	corpus_counters(state, c);
+}
+
+void packmsg_skip_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+
+	perf_start();
+
+	for (auto _: state) {
+		packmsg_input_t in;
+		packmsg_input_init(&in, c.data.data(), c.data.size());
+		size_t records = 0;
+
+		while (packmsg_input_ok(&in) && !packmsg_done(&in)) {
+			packmsg_skip_object(&in);
+			records++;
+		}
+
+		assert(packmsg_input_ok(&in) && records == c.records);
+		benchmark::DoNotOptimize(records);
+	}
+
+	corpus_counters(state, c);
+}
+
+void packmsg_lookup_corpus(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+	uint32_t keylen = strlen(c.key);
+
+	perf_start();
+
+	for (auto _: state) {
+		size_t found = 0;
+
+		for (size_t i = 0; i < c.records; i++) {
+			packmsg_input_t in;
+			packmsg_input_init(&in, c.data.data() + c.offsets[i], c.offsets[i + 1] - c.offsets[i]);
+
+			if (packmsg_map_find(&in, c.key, keylen)) {
+				packmsg_skip_object(&in);
+				found += packmsg_input_ok(&in);
+			}
+		}
+
+		assert(found == c.records);
+		benchmark::DoNotOptimize(found);
+	}
+
+	corpus_counters(state, c);
+}
+
+void packmsg_encode_latency(benchmark::State &state) {
+	const corpus &c = corpus_get(CORPUS_MESSAGES, 1000000);
+	uint8_t buf[256];
+
+	latency_run(state, "packmsg_encode_latency", c, [&](uint32_t record) {
+		const corpus_token *tokens = c.tokens.data() + c.first_tokens[record];
+		latency_evict(tokens, (c.first_tokens[record + 1] - c.first_tokens[record]) * sizeof *tokens);
+		latency_evict(buf, sizeof buf);
+	}, [&](uint32_t record) {
+		packmsg_output_t out;
+		packmsg_output_init(&out, buf, sizeof buf);
+
+		packmsg_encode_tokens(&out, c, c.first_tokens[record], c.first_tokens[record + 1] - c.first_tokens[record]);
+
+		assert(packmsg_output_size(&out, buf) == c.offsets[record + 1] - c.offsets[record]);
+		benchmark::ClobberMemory();
+	});
+}
+
+void packmsg_decode_latency(benchmark::State &state) {
+	const corpus &c = corpus_get(CORPUS_MESSAGES, 1000000);
+
+	latency_run(state, "packmsg_decode_latency", c, [&](uint32_t record) {
+		latency_evict(c.data.data() + c.offsets[record], c.offsets[record + 1] - c.offsets[record]);
+	}, [&](uint32_t record) {
+		packmsg_input_t in;
+		packmsg_input_init(&in, c.data.data() + c.offsets[record], c.offsets[record + 1] - c.offsets[record]);
+
+		uint64_t sum = decode_values(&in);
+
+		assert(packmsg_input_ok(&in));
+		benchmark::DoNotOptimize(sum);
+	});
+}
+
+// Reads every value from the input, copying strings and binary data into newly allocated memory.
+static uint64_t dup_values(packmsg_input_t *in) {
+	uint64_t sum = 0;
+	uint32_t len;
+
+	while (packmsg_input_ok(in) && !packmsg_done(in)) {
+		switch (packmsg_get_type(in)) {
+		case PACKMSG_STR: {
+			char *str = packmsg_get_str_dup(in);
+			sum += str != NULL;
+			free(str);
+			break;
+		}
+		case PACKMSG_BIN: {
+			void *data = packmsg_get_bin_dup(in, &len);
+			sum += len;
+			free(data);
+			break;
+		}
+		case PACKMSG_MAP: sum += packmsg_get_map(in); break;
+		case PACKMSG_ARRAY: sum += packmsg_get_array(in); break;
+		default: packmsg_skip_object(in); break;
+		}
+	}
+
+	return sum;
+}
+
+// The multi-threaded benchmarks all use the same corpus of messages.
+// The first thread sets up the shared state before the benchmark loop, the other threads wait for it at the start of the loop.
+static const corpus *threads_corpus;
+static std::vector<corpus> threads_corpora;
+static std::vector<std::vector<uint8_t>> threads_data;
+static thread_slots<packmsg_input_t> threads_inputs;
+static thread_slots<packmsg_output_t> threads_outputs;
+
+static void threads_setup(benchmark::State &state, bool encode) {
+	if (state.thread_index())
+		return;
+
+	const corpus &c = corpus_get(CORPUS_MESSAGES, 100000);
+	size_t copies = state.range(0) ? 1 : state.threads();
+	threads_corpus = &c;
+
+	if (encode) {
+		threads_corpora.assign(copies, c);
+		threads_data.assign(state.threads(), std::vector<uint8_t>(c.data.size()));
+		threads_outputs.reset(state.threads(), state.range(1));
+	} else {
+		threads_corpora.clear();
+		threads_data.assign(copies, c.data);
+		threads_inputs.reset(state.threads(), state.range(1));
+	}
+}
+
+// Decodes the input buffer of this thread with the given function, using this thread's iterator.
+template<typename Decode>
+static void threads_decode(benchmark::State &state, const char *name, Decode decode) {
+	threads_setup(state, false);
+
+	double seconds = threads_run(state, [&]() {
+		const std::vector<uint8_t> &data = threads_data[state.range(0) ? 0 : state.thread_index()];
+		packmsg_input_t *in = threads_inputs[state.thread_index()];
+		packmsg_input_init(in, data.data(), data.size());
+
+		uint64_t result = decode(in);
+
+		assert(packmsg_input_ok(in));
+		benchmark::DoNotOptimize(result);
+	});
+
+	threads_report(state, name, seconds, threads_corpus->records, threads_corpus->data.size());
+}
+
+void packmsg_encode_threads(benchmark::State &state) {
+	threads_setup(state, true);
+
+	double seconds = threads_run(state, [&]() {
+		const corpus &c = threads_corpora[state.range(0) ? 0 : state.thread_index()];
+		std::vector<uint8_t> &buf = threads_data[state.thread_index()];
+		packmsg_output_t *out = threads_outputs[state.thread_index()];
+		packmsg_output_init(out, buf.data(), buf.size());
+
+		packmsg_encode_tokens(out, c, 0, c.tokens.size());
+
+		assert(packmsg_output_size(out, buf.data()) == buf.size());
+		benchmark::ClobberMemory();
+	});
+
+	threads_report(state, "packmsg_encode_threads", seconds, threads_corpus->records, threads_corpus->data.size());
+}
+
+void packmsg_decode_threads(benchmark::State &state) {
+	threads_decode(state, "packmsg_decode_threads", decode_values);
+}
+
+void packmsg_skip_threads(benchmark::State &state) {
+	threads_decode(state, "packmsg_skip_threads", [](packmsg_input_t *in) {
+		uint64_t records = 0;
+
+		while (packmsg_input_ok(in) && !packmsg_done(in)) {
+			packmsg_skip_object(in);
+			records++;
+		}
+
+		return records;
+	});
+}
+
+void packmsg_dup_threads(benchmark::State &state) {
+	threads_decode(state, "packmsg_dup_threads", dup_values);
 }
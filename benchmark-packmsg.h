@@ -2,7 +2,25 @@
 
 #include <benchmark/benchmark.h>
 
+struct corpus;
+struct packmsg_output;
+
 void packmsg_encode_nil(benchmark::State &state);
 void packmsg_decode_nil(benchmark::State &state);
 void packmsg_encode_hello(benchmark::State &state);
 void packmsg_decode_hello(benchmark::State &state);
+
+void packmsg_encode_tokens(struct packmsg_output *out, const corpus &c, size_t first, size_t count);
+void packmsg_encode_corpus(benchmark::State &state);
+void packmsg_decode_corpus(benchmark::State &state);
+void packmsg_decode_corpus_trusted(benchmark::State &state);
+void packmsg_skip_corpus(benchmark::State &state);
+void packmsg_lookup_corpus(benchmark::State &state);
+
+void packmsg_encode_latency(benchmark::State &state);
+void packmsg_decode_latency(benchmark::State &state);
+
+void packmsg_encode_threads(benchmark::State &state);
+void packmsg_decode_threads(benchmark::State &state);
+void packmsg_skip_threads(benchmark::State &state);
+void packmsg_dup_threads(benchmark::State &state);
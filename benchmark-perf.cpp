@@ -0,0 +1,147 @@
+#include "benchmark-perf.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+struct perf_event {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+	int fd;
+};
+
+#ifdef __linux__
+#define PERF_CACHE_MISS(cache) ((cache) | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+// The first event is the group leader, all events are counted together.
+perf_event events[] = {
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1},
+	{"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1},
+	{"L1-misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D), -1},
+	{"LLC-misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_LL), -1},
+};
+
+#undef PERF_CACHE_MISS
+
+const size_t nevents = sizeof events / sizeof *events;
+bool enabled = false;
+
+int perf_event_open(perf_event_attr *attr, int group_fd) {
+	return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+#endif
+
+}
+
+bool perf_init() {
+#ifdef __linux__
+	for (size_t i = 0; i < nevents; i++) {
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof attr);
+		attr.size = sizeof attr;
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.disabled = i == 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		events[i].fd = perf_event_open(&attr, i ? events[0].fd : -1);
+
+		if (events[i].fd < 0) {
+			fprintf(stderr, "Could not open the %s performance counter: %s\n", events[i].name, strerror(errno));
+
+			// Without the leader, no events can be counted.
+			if (i == 0)
+				return false;
+		}
+	}
+
+	enabled = true;
+	return true;
+#else
+	fprintf(stderr, "Performance counters are only supported on Linux\n");
+	return false;
+#endif
+}
+
+void perf_start() {
+#ifdef __linux__
+	if (!enabled)
+		return;
+
+	ioctl(events[0].fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(events[0].fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+void perf_stop(benchmark::State &state, double bytes, double items) {
+#ifdef __linux__
+	if (!enabled)
+		return;
+
+	ioctl(events[0].fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	struct {
+		uint64_t nr;
+		uint64_t time_enabled;
+		uint64_t time_running;
+		struct {
+			uint64_t value;
+			uint64_t id;
+		} values[nevents];
+	} data;
+
+	if (read(events[0].fd, &data, sizeof data) < (ssize_t)(3 * sizeof(uint64_t)) || !data.time_running)
+		return;
+
+	// Scale the counts if the events had to share the counters with other events.
+	double scale = (double)data.time_enabled / data.time_running;
+	double counts[nevents] = {};
+
+	for (size_t i = 0; i < nevents; i++) {
+		uint64_t id;
+
+		if (events[i].fd < 0 || ioctl(events[i].fd, PERF_EVENT_IOC_ID, &id))
+			continue;
+
+		for (uint64_t j = 0; j < data.nr && j < nevents; j++)
+			if (data.values[j].id == id)
+				counts[i] = data.values[j].value * scale;
+	}
+
+	double iterations = state.iterations();
+
+	for (size_t i = 0; i < nevents; i++) {
+		if (events[i].fd < 0)
+			continue;
+
+		std::string name = events[i].name;
+
+		if (bytes)
+			state.counters[name + "/B"] = counts[i] / (iterations * bytes);
+
+		if (items)
+			state.counters[name + "/item"] = counts[i] / (iterations * items);
+	}
+
+	if (counts[0] && events[1].fd >= 0)
+		state.counters["IPC"] = counts[1] / counts[0];
+#else
+	(void)state;
+	(void)bytes;
+	(void)items;
+#endif
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <benchmark/benchmark.h>
+
+// Opens the hardware performance counters, returns false if they are not available.
+// Until this is called, perf_start() and perf_stop() do nothing.
+bool perf_init();
+
+// Resets and starts the counters, right before the benchmark loop.
+void perf_start();
+
+// Stops the counters right after the benchmark loop, and adds the cycles, instructions, branch misses,
+// L1 data cache and last level cache misses per byte and per item, and the instructions per cycle,
+// as counters to the benchmark. Bytes and items are the amounts processed per iteration.
+void perf_stop(benchmark::State &state, double bytes, double items);
@@ -1,21 +1,28 @@
 #include "benchmark-printf.h"
+#include "benchmark-perf.h"
 
 #include "packmsg.h"
 
 void printf_encode_hello(benchmark::State &state) {
 	char buf[31];
 
+	perf_start();
+
 	for (auto _: state) {
 		int result = snprintf(buf, sizeof buf, "{\"%s\": %s, \"%s\": %d}", "compact", true ? "true" : "false", "schema", 0);
 
 		assert(result == 30);
 		benchmark::ClobberMemory();
 	}
+
+	perf_stop(state, 30, 1);
 }
 
 void printf_decode_hello(benchmark::State &state) {
 	const char buf[] = "{\"compact\": true, \"schema\": 0}";
 
+	perf_start();
+
 	for (auto _: state) {
 		char key1[32];
 		char val1[32];
@@ -27,4 +34,6 @@ void printf_decode_hello(benchmark::State &state) {
 		assert(result == 4);
 		benchmark::ClobberMemory();
 	}
+
+	perf_stop(state, 30, 1);
 }
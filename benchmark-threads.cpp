@@ -0,0 +1,50 @@
+#include "benchmark-threads.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace {
+
+// The throughput of the single-threaded runs, per benchmark and arguments.
+std::mutex baselines_mutex;
+std::map<std::string, double> baselines;
+
+}
+
+void threads_args(benchmark::internal::Benchmark *b) {
+	int threads = std::max(1u, std::thread::hardware_concurrency());
+
+	b->ArgNames({"shared", "adjacent"});
+
+	for (int shared = 0; shared < 2; shared++)
+		for (int adjacent = 0; adjacent < 2; adjacent++)
+			b->Args({shared, adjacent});
+
+	b->ThreadRange(1, threads)->UseRealTime();
+}
+
+void threads_report(benchmark::State &state, const char *name, double seconds, double items, double bytes) {
+	state.SetItemsProcessed(state.iterations() * items);
+	state.SetBytesProcessed(state.iterations() * bytes);
+
+	if (!seconds)
+		return;
+
+	std::string key = std::string(name) + "/" + std::to_string(state.range(0)) + "/" + std::to_string(state.range(1));
+	double rate = state.iterations() / seconds;
+	std::lock_guard<std::mutex> lock(baselines_mutex);
+
+	if (state.threads() == 1) {
+		baselines[key] = rate;
+		return;
+	}
+
+	auto baseline = baselines.find(key);
+
+	// Every thread reports its own efficiency, the average is shown.
+	if (baseline != baselines.end())
+		state.counters["efficiency"] = benchmark::Counter(rate / baseline->second, benchmark::Counter::kAvgThreads);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+// Registers a multi-threaded benchmark for 1 up to the number of hardware threads, with per-thread or shared buffers,
+// and with the iterators of the threads on separate or adjacent cache lines.
+// The first argument is non-zero if the threads share one input buffer, the second if their iterators are adjacent.
+void threads_args(benchmark::internal::Benchmark *b);
+
+// Objects of one type for every thread, in a single allocation.
+// Unless adjacent is set, every object gets its own cache lines. Otherwise neighbouring threads share cache lines,
+// like iterators that are members of an array of structures would.
+template<typename T>
+class thread_slots {
+	std::vector<uint8_t> storage;
+	uint8_t *base = nullptr;
+	size_t stride = 0;
+
+public:
+	void reset(size_t count, bool adjacent) {
+		stride = adjacent ? sizeof(T) : (sizeof(T) + 63) / 64 * 64;
+		storage.assign(count * stride + 64, 0);
+		base = storage.data() + (64 - (uintptr_t)storage.data() % 64) % 64;
+	}
+
+	T *operator[](size_t index) {
+		return (T *)(base + index * stride);
+	}
+};
+
+// Runs op once per iteration, and returns the time in seconds this thread spent in the benchmark loop,
+// not counting the time spent waiting for the other threads to start and to finish.
+template<typename Op>
+double threads_run(benchmark::State &state, Op op) {
+	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::time_point end;
+	bool started = false;
+
+	for (auto _: state) {
+		if (!started) {
+			start = std::chrono::steady_clock::now();
+			started = true;
+		}
+
+		op();
+		end = std::chrono::steady_clock::now();
+	}
+
+	return started ? std::chrono::duration<double>(end - start).count() : 0;
+}
+
+// Sets the byte and item counters of a multi-threaded benchmark, given the amounts processed per iteration.
+// The single-threaded run is remembered, and runs with more threads report their scaling efficiency:
+// the throughput per thread relative to that of a single thread, where 1 means perfectly linear scaling.
+void threads_report(benchmark::State &state, const char *name, double seconds, double items, double bytes);
@@ -0,0 +1,31 @@
+#define PACKMSG_TRUSTED
+
+#include "benchmark-packmsg.h"
+#include "benchmark-corpus.h"
+#include "benchmark-perf.h"
+
+#include "benchmark-packmsg-decode.h"
+
+void packmsg_decode_corpus_trusted(benchmark::State &state) {
+	const corpus &c = corpus_get((corpus_shape)state.range(0), state.range(1));
+
+	// The corpus is validated once, so it can be decoded any number of times without bounds checks.
+	if (!packmsg_validate(c.data.data(), c.data.size(), c.records, PACKMSG_MAX_DEPTH)) {
+		state.SkipWithError("corpus does not validate");
+		return;
+	}
+
+	perf_start();
+
+	for (auto _: state) {
+		packmsg_input_t in;
+		packmsg_input_init(&in, c.data.data(), c.data.size());
+
+		uint64_t sum = decode_values(&in);
+
+		assert(packmsg_input_ok(&in));
+		benchmark::DoNotOptimize(sum);
+	}
+
+	corpus_counters(state, c);
+}
@@ -1,20 +1,150 @@
+#include <cstring>
+
 #include <benchmark/benchmark.h>
 
+#include "benchmark-corpus.h"
+#include "benchmark-latency.h"
 #include "benchmark-packmsg.h"
-#include "benchmark-msgpack.h"
+#include "benchmark-perf.h"
 #include "benchmark-printf.h"
+#include "benchmark-threads.h"
+
+#ifdef COMPARE_MSGPACK
+#include "benchmark-msgpack.h"
+#endif
+#ifdef COMPARE_MSGPUCK
+#include "benchmark-msgpuck.h"
+#endif
+#ifdef COMPARE_CMP
+#include "benchmark-cmp.h"
+#endif
+#ifdef COMPARE_MPACK
+#include "benchmark-mpack.h"
+#endif
 
 BENCHMARK(packmsg_encode_nil);
 BENCHMARK(packmsg_decode_nil);
 BENCHMARK(packmsg_encode_hello);
 BENCHMARK(packmsg_decode_hello);
 
+#ifdef COMPARE_MSGPACK
 BENCHMARK(msgpack_encode_nil);
 BENCHMARK(msgpack_decode_nil);
 BENCHMARK(msgpack_encode_hello);
 BENCHMARK(msgpack_decode_hello);
+#endif
+
+#ifdef COMPARE_MSGPUCK
+BENCHMARK(msgpuck_encode_nil);
+BENCHMARK(msgpuck_decode_nil);
+BENCHMARK(msgpuck_encode_hello);
+BENCHMARK(msgpuck_decode_hello);
+#endif
 
 BENCHMARK(printf_encode_hello);
 BENCHMARK(printf_decode_hello);
 
-BENCHMARK_MAIN();
+// Latency distributions of single messages of about 200 bytes, with warm and cold caches.
+BENCHMARK(packmsg_encode_latency)->Apply(latency_args);
+BENCHMARK(packmsg_decode_latency)->Apply(latency_args);
+
+// Scaling with the number of threads, each processing its own copy of a corpus of messages, or all sharing one.
+BENCHMARK(packmsg_encode_threads)->Apply(threads_args);
+BENCHMARK(packmsg_decode_threads)->Apply(threads_args);
+BENCHMARK(packmsg_skip_threads)->Apply(threads_args);
+BENCHMARK(packmsg_dup_threads)->Apply(threads_args);
+
+// Every library runs the same workloads on the same corpora.
+// Except for PackMessage, they all use the standard big-endian format.
+#define CORPUS_BENCHMARK(function) {#function, function}
+
+static const corpus_benchmark corpus_benchmarks[] = {
+	CORPUS_BENCHMARK(packmsg_encode_corpus),
+#ifdef COMPARE_MSGPACK
+	CORPUS_BENCHMARK(msgpack_encode_corpus),
+#endif
+#ifdef COMPARE_MSGPUCK
+	CORPUS_BENCHMARK(msgpuck_encode_corpus),
+#endif
+#ifdef COMPARE_CMP
+	CORPUS_BENCHMARK(cmp_encode_corpus),
+#endif
+#ifdef COMPARE_MPACK
+	CORPUS_BENCHMARK(mpack_encode_corpus),
+#endif
+
+	CORPUS_BENCHMARK(packmsg_decode_corpus),
+	CORPUS_BENCHMARK(packmsg_decode_corpus_trusted),
+#ifdef COMPARE_MSGPACK
+	CORPUS_BENCHMARK(msgpack_decode_corpus),
+#endif
+#ifdef COMPARE_MSGPUCK
+	CORPUS_BENCHMARK(msgpuck_decode_corpus),
+#endif
+#ifdef COMPARE_CMP
+	CORPUS_BENCHMARK(cmp_decode_corpus),
+#endif
+#ifdef COMPARE_MPACK
+	CORPUS_BENCHMARK(mpack_decode_corpus),
+#endif
+
+	CORPUS_BENCHMARK(packmsg_skip_corpus),
+#ifdef COMPARE_MSGPACK
+	CORPUS_BENCHMARK(msgpack_skip_corpus),
+#endif
+#ifdef COMPARE_MSGPUCK
+	CORPUS_BENCHMARK(msgpuck_skip_corpus),
+#endif
+#ifdef COMPARE_CMP
+	CORPUS_BENCHMARK(cmp_skip_corpus),
+#endif
+#ifdef COMPARE_MPACK
+	CORPUS_BENCHMARK(mpack_skip_corpus),
+#endif
+
+	CORPUS_BENCHMARK(packmsg_lookup_corpus),
+#ifdef COMPARE_MSGPACK
+	CORPUS_BENCHMARK(msgpack_lookup_corpus),
+#endif
+#ifdef COMPARE_MSGPUCK
+	CORPUS_BENCHMARK(msgpuck_lookup_corpus),
+#endif
+#ifdef COMPARE_CMP
+	CORPUS_BENCHMARK(cmp_lookup_corpus),
+#endif
+#ifdef COMPARE_MPACK
+	CORPUS_BENCHMARK(mpack_lookup_corpus),
+#endif
+};
+
+static const bool corpus_registered = (corpus_register(corpus_benchmarks, sizeof corpus_benchmarks / sizeof *corpus_benchmarks), true);
+
+int main(int argc, char **argv) {
+	// Remove our own options before Google Benchmark parses the rest.
+	bool perf_counters = false;
+	int args = 1;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--latency_histograms"))
+			latency_histograms = true;
+		else if (!strcmp(argv[i], "--perf_counters"))
+			perf_counters = true;
+		else
+			argv[args++] = argv[i];
+	}
+
+	argc = args;
+	argv[argc] = NULL;
+
+	benchmark::Initialize(&argc, argv);
+
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+
+	if (perf_counters && !perf_init())
+		return 1;
+
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
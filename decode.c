@@ -17,10 +17,13 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 
+#define PACKMSG_FILE
 #include "packmsg.h"
 
 static void decode_something(packmsg_input_t *in);
@@ -120,47 +123,25 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	FILE *f = fopen(argv[1], "r");
-	if (!f) {
-		fprintf(stderr, "Could not open %s: %s\n", argv[1], strerror(errno));
-		return 1;
-	}
-
-	long size;
+	packmsg_file_t file;
 
-	if (fseek(f, 0, SEEK_END) || (size = ftell(f)) == -1 || fseek(f, 0, SEEK_SET)) {
-		fprintf(stderr, "Could not seek in %s: %s\n", argv[1], strerror(errno));
+	if (!packmsg_file_open(&file, argv[1])) {
+		fprintf(stderr, "Could not open %s: %s\n", argv[1], strerror(errno));
 		return 1;
 	}
 
-	uint8_t *buf = (uint8_t *)malloc(size);
+	packmsg_input_t in;
 
-	if (!buf) {
-		fprintf(stderr, "Could not allocate memory: %s\n", strerror(errno));
-		fclose(f);
-		return 1;
+	while (packmsg_file_next(&file, &in)) {
+		decode_something(&in);
+		printf("\n");
 	}
 
-	if (fread(buf, size, 1, f) != 1) {
-		fprintf(stderr, "Could not read %s: %s\n", argv[1], strerror(errno));
-		free(buf);
-		fclose(f);
+	if (!packmsg_done(&file.in)) {
+		fprintf(stderr, "Error parsing %s\n", argv[1]);
+		packmsg_file_close(&file);
 		return 1;
 	}
 
-	fclose(f);
-
-	packmsg_input_t in = {buf, size};
-
-	while (!packmsg_done(&in)) {
-		if (!packmsg_input_ok(&in)) {
-			fprintf(stderr, "Error parsing %s\n", argv[1]);
-			return 1;
-		}
-
-		decode_something(&in);
-		printf("\n");
-	}
-
-	free(buf);
+	packmsg_file_close(&file);
 }
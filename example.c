@@ -12,7 +12,8 @@ int main()
 
 	/* Example encoding */
 
-	packmsg_output_t out = {buf, sizeof buf};
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof buf);
 
 	packmsg_add_map(&out, 2);
 	packmsg_add_str(&out, "compact");
@@ -30,7 +31,8 @@ int main()
 
 	/* Example decoding */
 
-	packmsg_input_t in = {buf, len};
+	packmsg_input_t in;
+	packmsg_input_init(&in, buf, len);
 
 	uint32_t count = packmsg_get_map(&in);
 
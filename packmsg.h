@@ -38,6 +38,28 @@
 #include <string.h>
 #include <assert.h>
 
+#ifdef _WIN32
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+#if defined(PACKMSG_FILE) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#ifdef PACKMSG_PARALLEL
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -45,6 +67,11 @@ extern "C" {
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+#ifndef PACKMSG_MAX_DEPTH
+/** \brief The maximum nesting depth of maps and arrays supported when skipping objects, by the incremental decoder and by the structural index. */
+#define PACKMSG_MAX_DEPTH 64
+#endif
+
 /** \mainpage PackMessage, a safe and fast header-only C library for little-endian MessagePack encoding and decoding.
  *
  * This library can encode and decode MessagePack objects, however it differs in one important point
@@ -70,19 +97,36 @@ extern "C" {
  * ## API overview
  *
  * For encoding, a packmsg_output_t variable must be initialized
- * with a pointer to the start of an output buffer, and its size.
+ * with a pointer to the start of an output buffer, and its size, using packmsg_output_init().
  * Elements can then be encoded using packmsg_add_*() functions.
  * When all desired elements have been added, the length of the encoded message
  * can be retrieved using the packmsg_output_size() function.
+ * If the size of the message is not known in advance, packmsg_output_init_growable()
+ * can be used instead to let the library allocate and grow the output buffer.
  *
- * For decoding, a packmsg_input_t variable must be initialized
+ * For decoding, a packmsg_input_t variable must be initialized using packmsg_input_init()
  * with a const pointer to the start of an input buffer, and its size.
+ * Large inputs can instead be read through a fixed size window using packmsg_source_init().
+ * If PACKMSG_FILE is defined before including packmsg.h, input can also be read from a file descriptor
+ * with packmsg_source_init_fd(), and files containing many concatenated messages can be mapped into memory
+ * with packmsg_file_open(), after which packmsg_file_next() returns an input iterator for each message.
+ * This is only supported on POSIX systems. The read-ahead and huge page hints for mapped files also need
+ * the feature test macro _DEFAULT_SOURCE to be defined before including any system header.
+ * If PACKMSG_PARALLEL is defined before including packmsg.h, packmsg_parallel_decode() can be used
+ * to decode such messages using multiple threads. This requires linking with POSIX threads.
  * Elements can then be decoded using packmsg_get_*() functions.
  * If the type of elements in a message is not known up front, then
  * the type of the next element can be queried using packmsg_get_type()
  * or packmsg_is_*() functions. To check that the complete message has been decoded
  * correctly, the function packmsg_done() can be called.
  *
+ * Input that is decoded more than once can be checked up front with packmsg_validate().
+ * Translation units that only decode validated input can define PACKMSG_TRUSTED
+ * before including packmsg.h, which removes the bounds checks from all packmsg_get_*() functions.
+ * Type checks are still performed, so getters still invalidate the input iterator and return NULL or 0
+ * on a type mismatch, and read nothing once it is invalid. packmsg_get_type() and packmsg_is_*() remain safe
+ * to call at the end of the input, but trusted decoding must not be used with input sources.
+ *
  * ## Example code
  *
  * @ref example.c
@@ -97,30 +141,510 @@ extern "C" {
  * ================
  */
 
+/** \brief Allocator callback for growable output buffers.
+ *
+ * This function must behave like realloc(): it returns a pointer to a buffer
+ * of at least size bytes with the contents of ptr preserved, or NULL if
+ * the allocation failed. If size is 0, it must free ptr and return NULL.
+ *
+ * \param ctx   The context pointer passed to packmsg_output_init_growable().
+ * \param ptr   A pointer to the current buffer, or NULL.
+ * \param size  The requested size of the buffer in bytes.
+ */
+typedef void *(*packmsg_alloc_t)(void *ctx, void *ptr, size_t size);
+
 /** \brief Iterator for PackMessage output.
  *
  * This is an iterator that has to be initialized with a pointer to
  * an output buffer that is allocated by the application,
- * and the length of that buffer. A pointer to it is passed to all
- * packmsg_add_*() functions.
+ * and the length of that buffer, using packmsg_output_init().
+ * Alternatively, it can be initialized with packmsg_output_init_growable(),
+ * in which case the buffer is allocated and grown by the library as needed.
+ * A pointer to it is passed to all packmsg_add_*() functions.
  */
 typedef struct packmsg_output {
-	uint8_t *ptr;  /**< A pointer into a buffer. */
-	ptrdiff_t len; /**< The remaining length of the buffer, or -1 in case of errors. */
+	uint8_t *ptr;          /**< A pointer into a buffer. */
+	ptrdiff_t len;         /**< The remaining length of the buffer, or -1 in case of errors. */
+	uint8_t *start;        /**< A pointer to the start of the buffer. */
+	size_t size;           /**< The total size of the buffer. */
+	packmsg_alloc_t alloc; /**< The allocator used to grow the buffer, or NULL for a fixed size buffer. */
+	void *alloc_ctx;       /**< The context pointer passed to the allocator. */
+	struct iovec *iov;     /**< The scatter-gather list, or NULL if not in scatter-gather mode. */
+	size_t iovcnt;         /**< The number of entries used in the scatter-gather list. */
+	size_t iovmax;         /**< The number of entries available in the scatter-gather list. */
+	size_t iovmark;        /**< The offset of the first byte in the buffer not yet covered by the scatter-gather list. */
+	uint32_t threshold;    /**< The minimum size of data that is referenced instead of copied. */
 } packmsg_output_t;
 
 /** \brief Iterator for PackMessage input.
  *
  * This is an iterator that has to be initialized with a pointer to
  * an input buffer that is allocated by the application,
- * and the length of that buffer. A pointer to it is passed to all
- * packmsg_get_*() functions.
+ * and the length of that buffer, using packmsg_input_init().
+ * Alternatively, it can be initialized with packmsg_source_init(),
+ * in which case the buffer is a window that is refilled from a packmsg_source_t as needed.
+ * A pointer to it is passed to all packmsg_get_*() functions.
  */
 typedef struct packmsg_input {
-	const uint8_t *ptr; /**< A pointer into a buffer. */
-	ptrdiff_t len;      /**< The remaining length of the buffer, or -1 in case of errors. */
+	const uint8_t *ptr;         /**< A pointer into a buffer. */
+	ptrdiff_t len;              /**< The remaining length of the buffer, or -1 in case of errors. */
+	struct packmsg_source *src; /**< The source to refill the buffer from, or NULL. */
+	uint64_t end;               /**< The position in the input of the end of the buffer, if reading from a source. */
+	bool utf8;                  /**< Whether strings must be valid UTF-8. */
 } packmsg_input_t;
 
+/** \brief Read callback for input sources.
+ *
+ * This function must behave like read(): it reads up to len bytes into data,
+ * and returns the number of bytes read, 0 at the end of the input, or -1 in case of an error.
+ *
+ * \param ctx   The context pointer passed to packmsg_source_init().
+ * \param data  A pointer to the buffer to read into.
+ * \param len   The maximum number of bytes to read.
+ */
+typedef ptrdiff_t (*packmsg_read_t)(void *ctx, void *data, size_t len);
+
+/** \brief A source that refills the buffer of an input iterator.
+ *
+ * This allows decoding input that does not fit in memory, for example a large file,
+ * using only a fixed amount of memory. The source owns two buffers of equal size,
+ * which are used alternately as the window of the input iterator.
+ * Whenever the iterator needs more bytes than are left in the window,
+ * the remainder is copied to the other buffer, which is then filled using the read callback.
+ * Pointers returned by packmsg_get_*_raw() thus stay valid until the window has been refilled twice.
+ * If the read callback fills the whole window, as read() does for regular files,
+ * this means a raw key stays valid while its value is read.
+ * Elements larger than one buffer can be skipped, but not read.
+ *
+ * Copies of the input iterator can be used, for example to look ahead with packmsg_map_find().
+ * The source remembers which part of the input each buffer holds, so an iterator that falls behind
+ * after a copy has refilled the window continues where it left off, as long as the window
+ * has not been refilled twice since. If the bytes it needs are no longer held by either buffer,
+ * that iterator is invalidated.
+ */
+typedef struct packmsg_source {
+	packmsg_read_t read;    /**< The read callback. */
+	void *ctx;              /**< The context pointer passed to the read callback. */
+	uint8_t *window[2];     /**< The two buffers used as the window of the input iterator. */
+	size_t size;            /**< The size of each buffer. */
+	uint64_t offset[2];     /**< The position in the input of the first byte held by each buffer. */
+	size_t fill[2];         /**< The number of bytes held by each buffer. */
+	unsigned current;       /**< The index of the buffer that was filled last. */
+	bool eof;               /**< Whether the end of the input has been reached. */
+	bool error;             /**< Whether the read callback returned an error. */
+	int fd;                 /**< The file descriptor used by packmsg_source_init_fd(). */
+} packmsg_source_t;
+
+/* Initialization
+ * ==============
+ */
+
+/** \brief Initialize an output iterator with a fixed size buffer.
+ *  \memberof packmsg_output
+ *
+ * This function initializes an output iterator to write to a buffer
+ * allocated by the application. Once the buffer is full, the iterator is invalidated.
+ *
+ * \param buf   A pointer to an output buffer iterator.
+ * \param data  A pointer to the start of the output buffer.
+ * \param len   The size of the output buffer in bytes.
+ */
+static inline void packmsg_output_init(packmsg_output_t *buf, void *data, size_t len)
+{
+	assert(buf);
+	assert(data || !len);
+
+	buf->ptr = (uint8_t *)data;
+	buf->len = len;
+	buf->start = (uint8_t *)data;
+	buf->size = len;
+	buf->alloc = NULL;
+	buf->alloc_ctx = NULL;
+	buf->iov = NULL;
+	buf->iovcnt = 0;
+	buf->iovmax = 0;
+	buf->iovmark = 0;
+	buf->threshold = 0;
+}
+
+/** \brief Internal function, do not use. */
+static inline void *packmsg_realloc_(void *ctx, void *ptr, size_t size)
+{
+	(void)ctx;
+
+	if (!size) {
+		free(ptr);
+		return NULL;
+	}
+
+	return realloc(ptr, size);
+}
+
+/** \brief Initialize an output iterator with a growable buffer.
+ *  \memberof packmsg_output
+ *
+ * This function initializes an output iterator that allocates its own buffer,
+ * and grows it whenever an element does not fit in the remaining space.
+ * The size of the buffer is at least doubled each time it has to grow.
+ * The start of the buffer can be retrieved with packmsg_output_data(),
+ * and it must be released with packmsg_output_free().
+ *
+ * \param buf      A pointer to an output buffer iterator.
+ * \param alloc    The allocator to use, or NULL to use realloc() and free().
+ * \param ctx      A context pointer that is passed to the allocator.
+ * \param initial  The initial size of the buffer in bytes, may be 0.
+ */
+static inline void packmsg_output_init_growable(packmsg_output_t *buf, packmsg_alloc_t alloc, void *ctx, size_t initial)
+{
+	assert(buf);
+
+	buf->ptr = NULL;
+	buf->len = 0;
+	buf->start = NULL;
+	buf->size = 0;
+	buf->alloc = alloc ? alloc : packmsg_realloc_;
+	buf->alloc_ctx = ctx;
+	buf->iov = NULL;
+	buf->iovcnt = 0;
+	buf->iovmax = 0;
+	buf->iovmark = 0;
+	buf->threshold = 0;
+
+	if (initial) {
+		buf->start = (uint8_t *)buf->alloc(ctx, NULL, initial);
+
+		if (buf->start) {
+			buf->size = initial;
+			buf->len = initial;
+		} else {
+			buf->len = -1;
+		}
+	}
+
+	buf->ptr = buf->start;
+}
+
+/** \brief Reset an output iterator to the start of its buffer.
+ *  \memberof packmsg_output
+ *
+ * This function discards everything written so far and clears any error state,
+ * so the buffer can be reused for a new message. A growable buffer keeps its current allocation.
+ * The iterator must have been initialized with packmsg_output_init() or packmsg_output_init_growable().
+ *
+ * \param buf  A pointer to an output buffer iterator.
+ */
+static inline void packmsg_output_reset(packmsg_output_t *buf)
+{
+	assert(buf);
+
+	buf->ptr = buf->start;
+	buf->len = buf->start ? (ptrdiff_t)buf->size : 0;
+	buf->iovcnt = 0;
+	buf->iovmark = 0;
+}
+
+/** \brief Switch an output iterator to scatter-gather mode.
+ *  \memberof packmsg_output
+ *
+ * In scatter-gather mode, string, binary and extension data of at least threshold bytes
+ * is not copied into the output buffer. Instead, the output is described by a list of
+ * struct iovec entries, which alternate between parts of the output buffer
+ * and references to the application's data. This list can be retrieved with
+ * packmsg_output_iov(), and passed to writev() or sendmsg().
+ * The application must keep all referenced data alive until the output has been sent.
+ * If the list runs out of entries, data is copied into the output buffer as usual.
+ *
+ * This function must be called after packmsg_output_init() or packmsg_output_init_growable(),
+ * before any elements have been added.
+ *
+ * \param buf        A pointer to an output buffer iterator.
+ * \param iov        A pointer to an array of struct iovec allocated by the application.
+ * \param iovmax     The number of entries in the array.
+ * \param threshold  The minimum size in bytes of data to reference instead of copy.
+ */
+static inline void packmsg_output_set_iov(packmsg_output_t *buf, struct iovec *iov, size_t iovmax, uint32_t threshold)
+{
+	assert(buf);
+	assert(iov || !iovmax);
+	assert(buf->ptr == buf->start);
+
+	buf->iov = iov;
+	buf->iovcnt = 0;
+	buf->iovmax = iovmax;
+	buf->iovmark = 0;
+	buf->threshold = threshold ? threshold : 1;
+}
+
+/** \brief Release the buffer of a growable output iterator.
+ *  \memberof packmsg_output
+ *
+ * This function frees the buffer allocated by a growable output iterator,
+ * and invalidates the iterator. It does nothing to the buffer of a fixed size output iterator.
+ *
+ * \param buf  A pointer to an output buffer iterator.
+ */
+static inline void packmsg_output_free(packmsg_output_t *buf)
+{
+	assert(buf);
+
+	if (buf->alloc && buf->start)
+		buf->alloc(buf->alloc_ctx, buf->start, 0);
+
+	buf->ptr = NULL;
+	buf->len = -1;
+	buf->start = NULL;
+	buf->size = 0;
+}
+
+/** \brief Initialize an input iterator with a buffer.
+ *  \memberof packmsg_input
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ * \param data  A pointer to the start of the input buffer.
+ * \param len   The size of the input buffer in bytes.
+ */
+static inline void packmsg_input_init(packmsg_input_t *buf, const void *data, size_t len)
+{
+	assert(buf);
+	assert(data || !len);
+
+	buf->ptr = (const uint8_t *)data;
+	buf->len = len;
+	buf->src = NULL;
+	buf->end = 0;
+	buf->utf8 = false;
+}
+
+/** \brief Require strings read from an input iterator to be valid UTF-8.
+ *  \memberof packmsg_input
+ *
+ * When enabled, all functions reading strings, including packmsg_get_str_raw(),
+ * check that the string is valid UTF-8 using packmsg_utf8_valid(),
+ * and invalidate the input iterator if it is not. This is disabled by default.
+ * The setting is inherited by the input iterators returned by hashed map views, structural indexes,
+ * object views and path queries built from this one, and for a packmsg_file_t, by all its records.
+ *
+ * \param buf      A pointer to an input buffer iterator.
+ * \param enabled  Whether to check strings.
+ */
+static inline void packmsg_input_set_utf8(packmsg_input_t *buf, bool enabled)
+{
+	assert(buf);
+
+	buf->utf8 = enabled;
+}
+
+/** \brief Initialize an input iterator that reads from a source.
+ *  \memberof packmsg_source
+ *
+ * This function allocates two buffers of the given size, and initializes
+ * the input iterator with an empty window that will be filled using the read callback.
+ * If the buffers cannot be allocated, the input iterator is invalidated.
+ * The source must be released with packmsg_source_free().
+ *
+ * \param src   A pointer to a source.
+ * \param buf   A pointer to an input buffer iterator.
+ * \param read  The read callback.
+ * \param ctx   A context pointer that is passed to the read callback.
+ * \param size  The size of each buffer in bytes. This limits the size of elements that can be read.
+ */
+static inline void packmsg_source_init(packmsg_source_t *src, packmsg_input_t *buf, packmsg_read_t read, void *ctx, size_t size)
+{
+	assert(src);
+	assert(buf);
+	assert(read);
+
+	src->read = read;
+	src->ctx = ctx;
+	src->window[0] = (uint8_t *)malloc(size ? 2 * size : 1);
+	src->window[1] = src->window[0] + size;
+	src->size = size;
+	src->offset[0] = src->offset[1] = 0;
+	src->fill[0] = src->fill[1] = 0;
+	src->current = 0;
+	src->eof = false;
+	src->error = false;
+	src->fd = -1;
+
+	buf->ptr = src->window[0] ? src->window[0] : (const uint8_t *)"";
+	buf->len = src->window[0] ? 0 : -1;
+	buf->src = src;
+	buf->end = 0;
+	buf->utf8 = false;
+}
+
+#if defined(PACKMSG_FILE) && !defined(_WIN32)
+/** \brief Internal function, do not use. */
+static inline ptrdiff_t packmsg_read_fd_(void *ctx, void *data, size_t len)
+{
+	ptrdiff_t result;
+
+	do {
+		result = read(((packmsg_source_t *)ctx)->fd, data, len);
+	} while (result < 0 && errno == EINTR);
+
+	return result;
+}
+
+/** \brief Initialize an input iterator that reads from a file descriptor.
+ *  \memberof packmsg_source
+ *
+ * This function is like packmsg_source_init(), but uses read() on the given file descriptor.
+ * The file descriptor is not closed by packmsg_source_free().
+ *
+ * \param src   A pointer to a source.
+ * \param buf   A pointer to an input buffer iterator.
+ * \param fd    The file descriptor to read from.
+ * \param size  The size of each buffer in bytes. This limits the size of elements that can be read.
+ */
+static inline void packmsg_source_init_fd(packmsg_source_t *src, packmsg_input_t *buf, int fd, size_t size)
+{
+	packmsg_source_init(src, buf, packmsg_read_fd_, src, size);
+	src->fd = fd;
+}
+#endif
+
+/** \brief Release the buffers of a source.
+ *  \memberof packmsg_source
+ *
+ * \param src  A pointer to a source.
+ */
+static inline void packmsg_source_free(packmsg_source_t *src)
+{
+	assert(src);
+
+	free(src->window[0]);
+	src->window[0] = NULL;
+	src->window[1] = NULL;
+	src->size = 0;
+}
+
+/** \brief Internal function, do not use.
+ *
+ * Makes at least dlen bytes of input available in the source, starting at the position of the input iterator,
+ * without modifying the iterator itself. Returns a pointer to those bytes, or NULL if the iterator is invalid,
+ * if its position is no longer held by the source, for elements larger than the window and at the end of the input.
+ *
+ * The buffer filled last always ends at the current position in the input. If it holds the position of the iterator,
+ * it is filled further using the read callback as long as there is room, otherwise the remainder is moved
+ * to the other buffer, which is then filled instead. An iterator that is still in the other buffer,
+ * because a copy of it has refilled the window, has its remainder moved to the start of that buffer,
+ * followed by the bytes read since, if that all fits.
+ */
+static inline const uint8_t *packmsg_source_fill_(const packmsg_input_t *buf, size_t dlen)
+{
+	packmsg_source_t *src = buf->src;
+	unsigned cur = src->current;
+	unsigned other = cur ^ 1;
+	uint64_t pos = buf->end - buf->len;
+	uint64_t end = src->offset[cur] + src->fill[cur];
+
+	if (buf->len < 0 || src->error || dlen > src->size)
+		return NULL;
+
+	unsigned next = other;
+	uint64_t start = pos;
+	size_t have = end - pos;
+
+	if (pos >= src->offset[cur] && pos <= end) {
+		size_t skip = pos - src->offset[cur];
+
+		if (have >= dlen)
+			return src->window[cur] + skip;
+
+		if (src->eof)
+			return NULL;
+
+		if (skip + dlen <= src->size) {
+			next = cur;
+			start = src->offset[cur];
+			have = src->fill[cur];
+			dlen += skip;
+		} else {
+			memcpy(src->window[other], src->window[cur] + skip, have);
+		}
+	} else if (pos >= src->offset[other] && pos < src->offset[other] + src->fill[other] && have <= src->size) {
+		// The bytes after the end of the other buffer are in the buffer filled last.
+		size_t skip = pos - src->offset[other];
+		size_t keep = src->fill[other] - skip;
+
+		memmove(src->window[other], src->window[other] + skip, keep);
+		memcpy(src->window[other] + keep, src->window[cur] + (size_t)(pos + keep - src->offset[cur]), have - keep);
+	} else {
+		return NULL;
+	}
+
+	uint8_t *data = src->window[next];
+
+	while (have < dlen && !src->eof) {
+		ptrdiff_t result = src->read(src->ctx, data + have, src->size - have);
+
+		if (result > 0) {
+			have += result;
+		} else {
+			src->eof = true;
+			src->error = result < 0;
+		}
+	}
+
+	src->offset[next] = start;
+	src->fill[next] = have;
+	src->current = next;
+	return have >= dlen && !src->error ? data + (size_t)(pos - start) : NULL;
+}
+
+/** \brief Internal function, do not use.
+ *
+ * Refills the window of an input iterator so that at least dlen bytes are available.
+ * Returns false for plain buffers, invalid iterators, elements larger than the window and the end of the input.
+ * Read errors, and iterators whose position is no longer held by the source, invalidate the input iterator.
+ */
+static inline bool packmsg_input_refill_(packmsg_input_t *buf, size_t dlen)
+{
+	packmsg_source_t *src = buf->src;
+
+	if (!src || buf->len < 0)
+		return false;
+
+	bool ok = packmsg_source_fill_(buf, dlen) != NULL;
+	unsigned cur = src->current;
+	uint64_t pos = buf->end - buf->len;
+	uint64_t end = src->offset[cur] + src->fill[cur];
+
+	if (src->error || pos < src->offset[cur] || pos > end) {
+		buf->len = -1;
+		return false;
+	}
+
+	buf->ptr = src->window[cur] + (size_t)(pos - src->offset[cur]);
+	buf->len = end - pos;
+	buf->end = end;
+	return ok;
+}
+
+/** \brief Internal function, do not use.
+ *
+ * Skips dlen bytes of input, refilling the window as often as needed.
+ */
+static inline void packmsg_input_skip_(packmsg_input_t *buf, uint64_t dlen)
+{
+	while (buf->len >= 0 && (uint64_t)buf->len < dlen) {
+		dlen -= buf->len;
+		buf->ptr += buf->len;
+		buf->len = 0;
+
+		if (!packmsg_input_refill_(buf, 1)) {
+			buf->len = -1;
+			return;
+		}
+	}
+
+	if (likely(buf->len >= 0)) {
+		buf->ptr += dlen;
+		buf->len -= dlen;
+	}
+}
+
 /* Checks
  * ======
  */
@@ -163,6 +687,72 @@ static inline size_t packmsg_output_size(const packmsg_output_t *buf, const uint
 		return 0;
 }
 
+/** \brief Get a pointer to the start of the output buffer.
+ *  \memberof packmsg_output
+ *
+ * Since a growable buffer can move whenever it grows, this function should be used
+ * to get the start of its buffer after the last element has been added.
+ *
+ * \param buf  A pointer to an output buffer iterator.
+ *
+ * \return     A pointer to the start of the output buffer,
+ *             or NULL if the iterator was not initialized with an init function.
+ */
+static inline uint8_t *packmsg_output_data(const packmsg_output_t *buf)
+{
+	assert(buf);
+
+	return buf->start;
+}
+
+/** \brief Get the scatter-gather list describing the output.
+ *  \memberof packmsg_output
+ *
+ * This function completes the scatter-gather list of an output iterator in scatter-gather mode,
+ * and returns it. No more elements may be added afterwards, until the iterator is reset
+ * with packmsg_output_reset(). The total size of the message is the sum of the lengths of all entries,
+ * while packmsg_output_size() only returns the amount of bytes written to the output buffer itself.
+ *
+ * \param buf          A pointer to an output buffer iterator.
+ * \param[out] iovcnt  A pointer to a size_t that will be set to the number of entries in the list,
+ *                     or 0 in case of an error.
+ *
+ * \return             A pointer to the scatter-gather list,
+ *                     or NULL if the iterator is not in scatter-gather mode or if any error has occurred.
+ */
+static inline struct iovec *packmsg_output_iov(packmsg_output_t *buf, size_t *iovcnt)
+{
+	assert(buf);
+	assert(iovcnt);
+
+	if (unlikely(!buf->iov || !packmsg_output_ok(buf))) {
+		*iovcnt = 0;
+		return NULL;
+	}
+
+	size_t used = buf->ptr - buf->start;
+
+	if (used > buf->iovmark) {
+		buf->iov[buf->iovcnt].iov_base = NULL;
+		buf->iov[buf->iovcnt].iov_len = used - buf->iovmark;
+		buf->iovcnt++;
+		buf->iovmark = used;
+	}
+
+	// Parts of the output buffer are recorded without a base, since the buffer can move while growing.
+	size_t offset = 0;
+
+	for (size_t i = 0; i < buf->iovcnt; i++) {
+		if (!buf->iov[i].iov_base) {
+			buf->iov[i].iov_base = buf->start + offset;
+			offset += buf->iov[i].iov_len;
+		}
+	}
+
+	*iovcnt = buf->iovcnt;
+	return buf->iov;
+}
+
 /** \brief Check if the PackMessage input buffer is in a valid state.
  *  \memberof packmsg_input
  *
@@ -198,6 +788,12 @@ static inline bool packmsg_done(const packmsg_input_t *buf)
 {
 	assert(buf);
 
+	// With a source, the iterator is done if there are no more bytes after the end of its window.
+	if (buf->len == 0 && buf->src) {
+		const packmsg_source_t *src = buf->src;
+		return !packmsg_source_fill_(buf, 1) && !src->error && buf->end == src->offset[src->current] + src->fill[src->current];
+	}
+
 	return buf->len == 0;
 }
 
@@ -233,13 +829,45 @@ static inline void packmsg_input_invalidate(packmsg_input_t *buf) {
  * ==================
  */
 
+/** \brief Internal function, do not use.
+ *
+ * Grows a growable output buffer so that at least dlen more bytes fit.
+ * Returns false for fixed size buffers, invalid iterators and allocation failures.
+ */
+static inline bool packmsg_output_grow_(packmsg_output_t *buf, size_t dlen)
+{
+	if (!buf->alloc || buf->len < 0)
+		return false;
+
+	size_t used = buf->start ? (size_t)(buf->ptr - buf->start) : 0;
+	size_t size = buf->size ? buf->size : 64;
+
+	while (size - used < dlen) {
+		if (size > PTRDIFF_MAX / 2)
+			return false;
+
+		size *= 2;
+	}
+
+	uint8_t *start = (uint8_t *)buf->alloc(buf->alloc_ctx, buf->start, size);
+
+	if (!start)
+		return false;
+
+	buf->start = start;
+	buf->size = size;
+	buf->ptr = start + used;
+	buf->len = size - used;
+	return true;
+}
+
 /** \brief Internal function, do not use. */
 static inline void packmsg_write_hdr_(packmsg_output_t *buf, uint8_t hdr)
 {
 	assert(buf);
-	assert(buf->ptr);
+	assert(buf->ptr || buf->alloc);
 
-	if (likely(buf->len > 0)) {
+	if (likely(buf->len > 0) || packmsg_output_grow_(buf, 1)) {
 		*buf->ptr = hdr;
 		buf->ptr++;
 		buf->len--;
@@ -252,10 +880,10 @@ static inline void packmsg_write_hdr_(packmsg_output_t *buf, uint8_t hdr)
 static inline void packmsg_write_data_(packmsg_output_t *buf, const void *data, uint32_t dlen)
 {
 	assert(buf);
-	assert(buf->ptr);
+	assert(buf->ptr || buf->alloc);
 	assert(data);
 
-	if (likely(buf->len >= dlen)) {
+	if (likely(buf->len >= dlen) || packmsg_output_grow_(buf, dlen)) {
 		memcpy(buf->ptr, data, dlen);
 		buf->ptr += dlen;
 		buf->len -= dlen;
@@ -268,10 +896,10 @@ static inline void packmsg_write_data_(packmsg_output_t *buf, const void *data,
 static inline void packmsg_write_hdrdata_(packmsg_output_t *buf, uint8_t hdr, const void *data, uint32_t dlen)
 {
 	assert(buf);
-	assert(buf->ptr);
+	assert(buf->ptr || buf->alloc);
 	assert(data);
 
-	if (likely(buf->len > dlen)) {
+	if (likely(buf->len > dlen) || packmsg_output_grow_(buf, (size_t)dlen + 1)) {
 		*buf->ptr = hdr;
 		buf->ptr++;
 		buf->len--;
@@ -284,6 +912,28 @@ static inline void packmsg_write_hdrdata_(packmsg_output_t *buf, uint8_t hdr, co
 	}
 }
 
+/** \brief Internal function, do not use. */
+static inline void packmsg_write_payload_(packmsg_output_t *buf, const void *data, uint32_t dlen)
+{
+	// Keep one entry free for the final part of the output buffer.
+	if (unlikely(buf->iov != NULL) && dlen >= buf->threshold && buf->iovcnt + 3 <= buf->iovmax && likely(buf->len >= 0)) {
+		size_t used = buf->ptr - buf->start;
+
+		if (used > buf->iovmark) {
+			buf->iov[buf->iovcnt].iov_base = NULL;
+			buf->iov[buf->iovcnt].iov_len = used - buf->iovmark;
+			buf->iovcnt++;
+			buf->iovmark = used;
+		}
+
+		buf->iov[buf->iovcnt].iov_base = (void *)data;
+		buf->iov[buf->iovcnt].iov_len = dlen;
+		buf->iovcnt++;
+	} else {
+		packmsg_write_data_(buf, data, dlen);
+	}
+}
+
 /** \brief Add a NIL to the output.
  *  \memberof packmsg_output
  *
@@ -460,7 +1110,7 @@ static inline void packmsg_add_str(packmsg_output_t *buf, const char *str)
 		packmsg_output_invalidate(buf);
 		return;
 	}
-	packmsg_write_data_(buf, str, slen);
+	packmsg_write_payload_(buf, str, slen);
 }
 
 /** \brief Add binary data to the output.
@@ -482,19 +1132,11 @@ static inline void packmsg_add_bin(packmsg_output_t *buf, const void *data, uint
 		packmsg_output_invalidate(buf);
 		return;
 	}
-	packmsg_write_data_(buf, data, dlen);
+	packmsg_write_payload_(buf, data, dlen);
 }
 
-/** \brief Add extension data to the output.
- *  \memberof packmsg_output
- *
- * \param buf   A pointer to an output buffer iterator.
- * \param type  The extension type. Values between 0 and 127 are application specific,
- *              values between -1 and -128 are reserved for future extensions.
- * \param data  A pointer to the data to add.
- * \param dlen  The length of the data in bytes.
- */
-static inline void packmsg_add_ext(packmsg_output_t *buf, int8_t type, const void *data, uint32_t dlen)
+/** \brief Internal function, do not use. */
+static inline bool packmsg_write_ext_hdr_(packmsg_output_t *buf, int8_t type, uint32_t dlen)
 {
 	if (dlen <= 0xff) {
 		if (dlen == 16) {
@@ -519,9 +1161,25 @@ static inline void packmsg_add_ext(packmsg_output_t *buf, int8_t type, const voi
 		packmsg_write_data_(buf, &type, 1);
 	} else {
 		packmsg_output_invalidate(buf);
-		return;
+		return false;
 	}
-	packmsg_write_data_(buf, data, dlen);
+
+	return true;
+}
+
+/** \brief Add extension data to the output.
+ *  \memberof packmsg_output
+ *
+ * \param buf   A pointer to an output buffer iterator.
+ * \param type  The extension type. Values between 0 and 127 are application specific,
+ *              values between -1 and -128 are reserved for future extensions.
+ * \param data  A pointer to the data to add.
+ * \param dlen  The length of the data in bytes.
+ */
+static inline void packmsg_add_ext(packmsg_output_t *buf, int8_t type, const void *data, uint32_t dlen)
+{
+	if (packmsg_write_ext_hdr_(buf, type, dlen))
+		packmsg_write_payload_(buf, data, dlen);
 }
 
 /** \brief Add a map header to the output.
@@ -568,336 +1226,995 @@ static inline void packmsg_add_array(packmsg_output_t *buf, uint32_t count)
 	}
 }
 
-/* Decoding functions
- * ==================
+/* Bulk encoding functions
+ * =======================
+ *
+ * The packmsg_add_*_array() functions add an array header followed by all values,
+ * encoded exactly like adding each value with the corresponding packmsg_add_*() function,
+ * but with a single bounds check for the whole array.
  */
 
-/** \brief Internal function, do not use. */
-static inline uint8_t packmsg_read_hdr_(packmsg_input_t *buf)
+/** \brief Internal function, do not use.
+ *
+ * Makes sure at least dlen bytes can be written without further bounds checks.
+ */
+static inline bool packmsg_reserve_(packmsg_output_t *buf, uint64_t dlen)
 {
-	assert(buf);
-	assert(buf->ptr);
+	return likely(buf->len >= 0 && (uint64_t)buf->len >= dlen) || (dlen <= PTRDIFF_MAX && packmsg_output_grow_(buf, dlen));
+}
 
-	if (likely(buf->len > 0)) {
-		uint8_t hdr = *buf->ptr;
-		buf->ptr++;
-		buf->len--;
-		return hdr;
-	} else {
-		packmsg_input_invalidate(buf);
-		return 0xc1;
+/** \brief Internal function, do not use. */
+static inline int64_t packmsg_load_sint_(const void *data, size_t i, size_t size)
+{
+	switch (size) {
+	case 1: return ((const int8_t *)data)[i];
+	case 2: return ((const int16_t *)data)[i];
+	case 4: return ((const int32_t *)data)[i];
+	default: return ((const int64_t *)data)[i];
 	}
 }
 
 /** \brief Internal function, do not use. */
-static inline void packmsg_read_data_(packmsg_input_t *buf, void *data, uint32_t dlen)
+static inline uint64_t packmsg_load_uint_(const void *data, size_t i, size_t size)
 {
-	assert(buf);
-	assert(buf->ptr);
-	assert(data);
-
-	if (likely(buf->len >= dlen)) {
-		memcpy(data, buf->ptr, dlen);
-		buf->ptr += dlen;
-		buf->len -= dlen;
-	} else {
-		packmsg_input_invalidate(buf);
+	switch (size) {
+	case 1: return ((const uint8_t *)data)[i];
+	case 2: return ((const uint16_t *)data)[i];
+	case 4: return ((const uint32_t *)data)[i];
+	default: return ((const uint64_t *)data)[i];
 	}
 }
 
-/** \brief Internal function, do not use. */
-static inline uint8_t packmsg_peek_hdr_(const packmsg_input_t *buf)
+/** \brief Internal function, do not use.
+ *
+ * Encodes count signed integers of the given size, with the same encoding as packmsg_add_int64().
+ * Runs of 16 fixints are checked and narrowed without branches, so the compiler can vectorize them.
+ * Other values are encoded by always storing the header and size bytes of value,
+ * and advancing only by the amount needed. The caller must have reserved count * (size + 1) bytes.
+ */
+static inline __attribute__((always_inline)) uint8_t *packmsg_encode_sint_array_(uint8_t *__restrict ptr, const void *__restrict data, uint32_t count, size_t size)
 {
-	assert(buf);
-	assert(buf->ptr);
+	uint32_t i = 0;
 
-	if (likely(buf->len > 0)) {
-		return *buf->ptr;
-	} else {
-		return 0xc1;
+	while (i < count) {
+		if (count - i >= 16) {
+			uint64_t other = 0;
+
+			for (uint32_t j = 0; j < 16; j++)
+				other |= (uint64_t)packmsg_load_sint_(data, i + j, size) + 32 >= 160;
+
+			if (!other) {
+				for (uint32_t j = 0; j < 16; j++)
+					ptr[j] = (uint8_t)packmsg_load_sint_(data, i + j, size);
+
+				ptr += 16;
+				i += 16;
+				continue;
+			}
+		}
+
+		uint32_t end = count - i >= 16 ? i + 16 : count;
+
+		for (; i < end; i++) {
+			int64_t val = packmsg_load_sint_(data, i, size);
+			int bits = 64 - __builtin_clrsbll(val);
+			int width = (bits > 8) + (bits > 16) + (bits > 32);
+			bool fixint = (uint64_t)val + 32 < 160;
+
+			*ptr = fixint ? (uint8_t)val : 0xd0 + width;
+			memcpy(ptr + 1, &val, size);
+			ptr += fixint ? 1 : 1 + (1 << width);
+		}
 	}
+
+	return ptr;
 }
 
-/** \brief Get a NIL from the input.
- *  \memberof packmsg_input
- *
- * This function does not return anything, but will invalidate the input interator
- * if no NIL was succesfully consumed from the input.
+/** \brief Internal function, do not use.
  *
- * \param buf  A pointer to an input buffer iterator.
+ * Encodes count unsigned integers of the given size, with the same encoding as packmsg_add_uint64().
+ * See packmsg_encode_sint_array_() for details.
  */
-static inline void packmsg_get_nil(packmsg_input_t *buf)
+static inline __attribute__((always_inline)) uint8_t *packmsg_encode_uint_array_(uint8_t *__restrict ptr, const void *__restrict data, uint32_t count, size_t size)
 {
-	if (packmsg_read_hdr_(buf) != 0xc0)
-		packmsg_input_invalidate(buf);
-}
+	uint32_t i = 0;
 
+	while (i < count) {
+		if (count - i >= 16) {
+			uint64_t other = 0;
 
-/** \brief Get a boolean value from the input.
- *  \memberof packmsg_input
+			for (uint32_t j = 0; j < 16; j++)
+				other |= packmsg_load_uint_(data, i + j, size) >= 0x80;
+
+			if (!other) {
+				for (uint32_t j = 0; j < 16; j++)
+					ptr[j] = (uint8_t)packmsg_load_uint_(data, i + j, size);
+
+				ptr += 16;
+				i += 16;
+				continue;
+			}
+		}
+
+		uint32_t end = count - i >= 16 ? i + 16 : count;
+
+		for (; i < end; i++) {
+			uint64_t val = packmsg_load_uint_(data, i, size);
+			int width = (val > 0xff) + (val > 0xffff) + (val > 0xffffffff);
+			bool fixint = val < 0x80;
+
+			*ptr = fixint ? (uint8_t)val : 0xcc + width;
+			memcpy(ptr + 1, &val, size);
+			ptr += fixint ? 1 : 1 + (1 << width);
+		}
+	}
+
+	return ptr;
+}
+
+/** \brief Add an array of int8 values to the output, as if by packmsg_add_int8() for each value.
+ *  \memberof packmsg_output
  *
- * \param buf  A pointer to an input buffer iterator.
- * \return     The boolean value that was read from the input,
- *             or false in case of an error.
+ * \param buf    A pointer to an output buffer iterator.
+ * \param data   A pointer to the values to add.
+ * \param count  The number of values to add.
  */
-static inline bool packmsg_get_bool(packmsg_input_t *buf)
+static inline void packmsg_add_int8_array(packmsg_output_t *buf, const int8_t *data, uint32_t count)
 {
-	uint8_t hdr = packmsg_read_hdr_(buf);
+	assert(data || !count);
 
-	if (hdr == 0xc2) {
-		return false;
-	} else if (hdr == 0xc3) {
-		return true;
+	packmsg_add_array(buf, count);
+
+	if (likely(packmsg_reserve_(buf, (uint64_t)count * 2))) {
+		uint8_t *end = packmsg_encode_sint_array_(buf->ptr, data, count, 1);
+		buf->len -= end - buf->ptr;
+		buf->ptr = end;
 	} else {
-		packmsg_input_invalidate(buf);
-		return false;
+		for (uint32_t i = 0; i < count && packmsg_output_ok(buf); i++)
+			packmsg_add_int8(buf, data[i]);
 	}
 }
 
-/** \brief Get an int8 value from the input.
- *  \memberof packmsg_input
+/** \brief Add an array of int16 values to the output, as if by packmsg_add_int16() for each value.
+ *  \memberof packmsg_output
  *
- * \param buf  A pointer to an input buffer iterator.
- * \return     The int8 value that was read from the input,
- *             or 0 in case of an error.
+ * \param buf    A pointer to an output buffer iterator.
+ * \param data   A pointer to the values to add.
+ * \param count  The number of values to add.
  */
-static inline int8_t packmsg_get_int8(packmsg_input_t *buf)
+static inline void packmsg_add_int16_array(packmsg_output_t *buf, const int16_t *data, uint32_t count)
 {
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	if (hdr < 0x80 || hdr >= 0xe0) {
-		return (int8_t)hdr;
-	} else if (hdr == 0xd0) {
-		return packmsg_read_hdr_(buf);
+	assert(data || !count);
+
+	packmsg_add_array(buf, count);
+
+	if (likely(packmsg_reserve_(buf, (uint64_t)count * 3))) {
+		uint8_t *end = packmsg_encode_sint_array_(buf->ptr, data, count, 2);
+		buf->len -= end - buf->ptr;
+		buf->ptr = end;
 	} else {
-		packmsg_input_invalidate(buf);
-		return 0;
+		for (uint32_t i = 0; i < count && packmsg_output_ok(buf); i++)
+			packmsg_add_int16(buf, data[i]);
 	}
 }
 
-/** \brief Get an int16 value from the input.
- *  \memberof packmsg_input
+/** \brief Add an array of int32 values to the output, as if by packmsg_add_int32() for each value.
+ *  \memberof packmsg_output
  *
- * \param buf  A pointer to an input buffer iterator.
- * \return     The int16 value that was read from the input,
- *             or 0 in case of an error.
+ * \param buf    A pointer to an output buffer iterator.
+ * \param data   A pointer to the values to add.
+ * \param count  The number of values to add.
  */
-static inline int16_t packmsg_get_int16(packmsg_input_t *buf)
+static inline void packmsg_add_int32_array(packmsg_output_t *buf, const int32_t *data, uint32_t count)
 {
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	if (hdr < 0x80 || hdr >= 0xe0) {
-		return (int8_t)hdr;
-	} else if (hdr == 0xd0) {
-		return (int8_t) packmsg_read_hdr_(buf);
-	} else if (hdr == 0xd1) {
-		int16_t val = 0;
-		packmsg_read_data_(buf, &val, 2);
-		return val;
+	assert(data || !count);
+
+	packmsg_add_array(buf, count);
+
+	if (likely(packmsg_reserve_(buf, (uint64_t)count * 5))) {
+		uint8_t *end = packmsg_encode_sint_array_(buf->ptr, data, count, 4);
+		buf->len -= end - buf->ptr;
+		buf->ptr = end;
 	} else {
-		packmsg_input_invalidate(buf);
-		return 0;
+		for (uint32_t i = 0; i < count && packmsg_output_ok(buf); i++)
+			packmsg_add_int32(buf, data[i]);
 	}
 }
 
-/** \brief Get an int32 value from the input.
- *  \memberof packmsg_input
+/** \brief Add an array of int64 values to the output, as if by packmsg_add_int64() for each value.
+ *  \memberof packmsg_output
  *
- * \param buf  A pointer to an input buffer iterator.
- * \return     The int32 value that was read from the input,
- *             or 0 in case of an error.
+ * \param buf    A pointer to an output buffer iterator.
+ * \param data   A pointer to the values to add.
+ * \param count  The number of values to add.
  */
-static inline int32_t packmsg_get_int32(packmsg_input_t *buf)
+static inline void packmsg_add_int64_array(packmsg_output_t *buf, const int64_t *data, uint32_t count)
 {
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	if (hdr < 0x80 || hdr >= 0xe0) {
-		return (int8_t)hdr;
-	} else if (hdr == 0xd0) {
-		return (int8_t) packmsg_read_hdr_(buf);
-	} else if (hdr == 0xd1) {
-		int16_t val = 0;
-		packmsg_read_data_(buf, &val, 2);
-		return val;
-	} else if (hdr == 0xd2) {
-		int32_t val = 0;
-		packmsg_read_data_(buf, &val, 4);
-		return val;
+	assert(data || !count);
+
+	packmsg_add_array(buf, count);
+
+	if (likely(packmsg_reserve_(buf, (uint64_t)count * 9))) {
+		uint8_t *end = packmsg_encode_sint_array_(buf->ptr, data, count, 8);
+		buf->len -= end - buf->ptr;
+		buf->ptr = end;
 	} else {
-		packmsg_input_invalidate(buf);
-		return 0;
+		for (uint32_t i = 0; i < count && packmsg_output_ok(buf); i++)
+			packmsg_add_int64(buf, data[i]);
 	}
 }
 
-/** \brief Get an int64 value from the input.
- *  \memberof packmsg_input
+/** \brief Add an array of uint8 values to the output, as if by packmsg_add_uint8() for each value.
+ *  \memberof packmsg_output
  *
- * \param buf  A pointer to an input buffer iterator.
- * \return     The int64 value that was read from the input,
- *             or 0 in case of an error.
+ * \param buf    A pointer to an output buffer iterator.
+ * \param data   A pointer to the values to add.
+ * \param count  The number of values to add.
  */
-static inline int64_t packmsg_get_int64(packmsg_input_t *buf)
+static inline void packmsg_add_uint8_array(packmsg_output_t *buf, const uint8_t *data, uint32_t count)
 {
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	if (hdr < 0x80 || hdr >= 0xe0) {
-		return (int8_t)hdr;
-	} else if (hdr == 0xd0) {
-		return (int8_t) packmsg_read_hdr_(buf);
-	} else if (hdr == 0xd1) {
-		int16_t val = 0;
-		packmsg_read_data_(buf, &val, 2);
-		return val;
-	} else if (hdr == 0xd2) {
-		int32_t val = 0;
-		packmsg_read_data_(buf, &val, 4);
-		return val;
-	} else if (hdr == 0xd3) {
-		int64_t val = 0;
-		packmsg_read_data_(buf, &val, 8);
-		return val;
+	assert(data || !count);
+
+	packmsg_add_array(buf, count);
+
+	if (likely(packmsg_reserve_(buf, (uint64_t)count * 2))) {
+		uint8_t *end = packmsg_encode_uint_array_(buf->ptr, data, count, 1);
+		buf->len -= end - buf->ptr;
+		buf->ptr = end;
 	} else {
-		packmsg_input_invalidate(buf);
-		return 0;
+		for (uint32_t i = 0; i < count && packmsg_output_ok(buf); i++)
+			packmsg_add_uint8(buf, data[i]);
 	}
 }
 
-/** \brief Get an uint8 value from the input.
- *  \memberof packmsg_input
+/** \brief Add an array of uint16 values to the output, as if by packmsg_add_uint16() for each value.
+ *  \memberof packmsg_output
  *
- * \param buf  A pointer to an input buffer iterator.
- * \return     The uint8 value that was read from the input,
- *             or 0 in case of an error.
+ * \param buf    A pointer to an output buffer iterator.
+ * \param data   A pointer to the values to add.
+ * \param count  The number of values to add.
  */
-static inline uint8_t packmsg_get_uint8(packmsg_input_t *buf)
+static inline void packmsg_add_uint16_array(packmsg_output_t *buf, const uint16_t *data, uint32_t count)
 {
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	if (hdr < 0x80) {
-		return hdr;
-	} else if (hdr == 0xcc) {
-		return packmsg_read_hdr_(buf);
+	assert(data || !count);
+
+	packmsg_add_array(buf, count);
+
+	if (likely(packmsg_reserve_(buf, (uint64_t)count * 3))) {
+		uint8_t *end = packmsg_encode_uint_array_(buf->ptr, data, count, 2);
+		buf->len -= end - buf->ptr;
+		buf->ptr = end;
 	} else {
-		packmsg_input_invalidate(buf);
-		return 0;
+		for (uint32_t i = 0; i < count && packmsg_output_ok(buf); i++)
+			packmsg_add_uint16(buf, data[i]);
 	}
 }
 
-/** \brief Get an uint16 value from the input.
- *  \memberof packmsg_input
+/** \brief Add an array of uint32 values to the output, as if by packmsg_add_uint32() for each value.
+ *  \memberof packmsg_output
  *
- * \param buf  A pointer to an input buffer iterator.
- * \return     The uint16 value that was read from the input,
- *             or 0 in case of an error.
+ * \param buf    A pointer to an output buffer iterator.
+ * \param data   A pointer to the values to add.
+ * \param count  The number of values to add.
  */
-static inline uint16_t packmsg_get_uint16(packmsg_input_t *buf)
+static inline void packmsg_add_uint32_array(packmsg_output_t *buf, const uint32_t *data, uint32_t count)
 {
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	if (hdr < 0x80) {
-		return hdr;
-	} else if (hdr == 0xcc) {
-		return packmsg_read_hdr_(buf);
-	} else if (hdr == 0xcd) {
-		uint16_t val = 0;
-		packmsg_read_data_(buf, &val, 2);
-		return val;
+	assert(data || !count);
+
+	packmsg_add_array(buf, count);
+
+	if (likely(packmsg_reserve_(buf, (uint64_t)count * 5))) {
+		uint8_t *end = packmsg_encode_uint_array_(buf->ptr, data, count, 4);
+		buf->len -= end - buf->ptr;
+		buf->ptr = end;
 	} else {
-		packmsg_input_invalidate(buf);
-		return 0;
+		for (uint32_t i = 0; i < count && packmsg_output_ok(buf); i++)
+			packmsg_add_uint32(buf, data[i]);
 	}
 }
 
-/** \brief Get an uint32 value from the input.
- *  \memberof packmsg_input
+/** \brief Add an array of uint64 values to the output, as if by packmsg_add_uint64() for each value.
+ *  \memberof packmsg_output
  *
- * \param buf  A pointer to an input buffer iterator.
- * \return     The uint32 value that was read from the input,
- *             or 0 in case of an error.
+ * \param buf    A pointer to an output buffer iterator.
+ * \param data   A pointer to the values to add.
+ * \param count  The number of values to add.
  */
-static inline uint32_t packmsg_get_uint32(packmsg_input_t *buf)
+static inline void packmsg_add_uint64_array(packmsg_output_t *buf, const uint64_t *data, uint32_t count)
 {
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	if (hdr < 0x80) {
-		return hdr;
-	} else if (hdr == 0xcc) {
-		return packmsg_read_hdr_(buf);
-	} else if (hdr == 0xcd) {
-		uint16_t val = 0;
-		packmsg_read_data_(buf, &val, 2);
-		return val;
-	} else if (hdr == 0xce) {
-		uint32_t val = 0;
-		packmsg_read_data_(buf, &val, 4);
-		return val;
+	assert(data || !count);
+
+	packmsg_add_array(buf, count);
+
+	if (likely(packmsg_reserve_(buf, (uint64_t)count * 9))) {
+		uint8_t *end = packmsg_encode_uint_array_(buf->ptr, data, count, 8);
+		buf->len -= end - buf->ptr;
+		buf->ptr = end;
 	} else {
-		packmsg_input_invalidate(buf);
-		return 0;
+		for (uint32_t i = 0; i < count && packmsg_output_ok(buf); i++)
+			packmsg_add_uint64(buf, data[i]);
 	}
 }
 
-/** \brief Get an uint64 value from the input.
- *  \memberof packmsg_input
+/** \brief Add an array of float values to the output, as if by packmsg_add_float() for each value.
+ *  \memberof packmsg_output
  *
- * \param buf  A pointer to an input buffer iterator.
- * \return     The uint64 value that was read from the input,
- *             or 0 in case of an error.
+ * \param buf    A pointer to an output buffer iterator.
+ * \param data   A pointer to the values to add.
+ * \param count  The number of values to add.
  */
-static inline uint64_t packmsg_get_uint64(packmsg_input_t *buf)
+static inline void packmsg_add_float_array(packmsg_output_t *buf, const float *data, uint32_t count)
 {
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	if (hdr < 0x80) {
-		return hdr;
-	} else if (hdr == 0xcc) {
-		return packmsg_read_hdr_(buf);
-	} else if (hdr == 0xcd) {
-		uint16_t val = 0;
-		packmsg_read_data_(buf, &val, 2);
-		return val;
-	} else if (hdr == 0xce) {
-		uint32_t val = 0;
-		packmsg_read_data_(buf, &val, 4);
-		return val;
-	} else if (hdr == 0xcf) {
-		uint64_t val = 0;
-		packmsg_read_data_(buf, &val, 8);
-		return val;
+	assert(data || !count);
+
+	packmsg_add_array(buf, count);
+
+	if (likely(packmsg_reserve_(buf, (uint64_t)count * 5))) {
+		for (uint32_t i = 0; i < count; i++) {
+			buf->ptr[i * 5] = 0xca;
+			memcpy(buf->ptr + i * 5 + 1, data + i, 4);
+		}
+
+		buf->ptr += (size_t)count * 5;
+		buf->len -= (size_t)count * 5;
 	} else {
-		packmsg_input_invalidate(buf);
-		return 0;
+		packmsg_output_invalidate(buf);
 	}
 }
 
-/** \brief Get a float value from the input.
- *  \memberof packmsg_input
+/** \brief Add an array of double values to the output, as if by packmsg_add_double() for each value.
+ *  \memberof packmsg_output
  *
- * \param buf  A pointer to an input buffer iterator.
- * \return     The float value that was read from the input,
- *             or 0 in case of an error.
+ * \param buf    A pointer to an output buffer iterator.
+ * \param data   A pointer to the values to add.
+ * \param count  The number of values to add.
  */
-static inline float packmsg_get_float(packmsg_input_t *buf)
+static inline void packmsg_add_double_array(packmsg_output_t *buf, const double *data, uint32_t count)
 {
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	if (hdr == 0xca) {
-		float val;
-		packmsg_read_data_(buf, &val, 4);
-		return val;
+	assert(data || !count);
+
+	packmsg_add_array(buf, count);
+
+	if (likely(packmsg_reserve_(buf, (uint64_t)count * 9))) {
+		for (uint32_t i = 0; i < count; i++) {
+			buf->ptr[i * 9] = 0xcb;
+			memcpy(buf->ptr + i * 9 + 1, data + i, 8);
+		}
+
+		buf->ptr += (size_t)count * 9;
+		buf->len -= (size_t)count * 9;
 	} else {
-		packmsg_input_invalidate(buf);
-		return 0;
+		packmsg_output_invalidate(buf);
 	}
 }
 
-/** \brief Get a double value from the input.
- *  \memberof packmsg_input
+/** \brief The width of the count field of a deferred map or array header.
  *
- * \param buf  A pointer to an input buffer iterator.
- * \return     The float value that was read from the input,
- *             or 0 in case of an error.
+ * This enum determines how a map or array header is reserved by packmsg_add_map_deferred()
+ * and packmsg_add_array_deferred(), and how it is written by packmsg_finish_deferred().
  */
-static inline double packmsg_get_double(packmsg_input_t *buf)
+enum packmsg_deferred_width {
+	PACKMSG_DEFERRED_16,     /**< Reserve a header with a 16 bit count, limiting the container to 65535 elements. */
+	PACKMSG_DEFERRED_32,     /**< Reserve a header with a 32 bit count. */
+	PACKMSG_DEFERRED_SHRINK, /**< Reserve a header with a 32 bit count, and move the contents back afterwards if a smaller header suffices. */
+};
+
+/** \brief A map or array header whose count is written afterwards.
+ *
+ * This structure is filled in by packmsg_add_map_deferred() or packmsg_add_array_deferred(),
+ * and must be passed to packmsg_finish_deferred() once all elements of the container have been added.
+ */
+typedef struct packmsg_deferred {
+	uint8_t *ptr;                      /**< A pointer to the reserved header, for output iterators without a known buffer start. */
+	size_t offset;                     /**< The offset of the reserved header from the start of the buffer. */
+	uint8_t hdr;                       /**< The header byte of the reserved header. */
+	enum packmsg_deferred_width width; /**< The width of the reserved header. */
+} packmsg_deferred_t;
+
+/** \brief Internal function, do not use. */
+static inline void packmsg_add_deferred_(packmsg_output_t *buf, packmsg_deferred_t *hdr, uint8_t type, enum packmsg_deferred_width width)
 {
-	uint8_t hdr = packmsg_read_hdr_(buf);
+	assert(hdr);
+
+	const uint32_t zero = 0;
+
+	hdr->ptr = buf->ptr;
+	hdr->offset = buf->start ? (size_t)(buf->ptr - buf->start) : 0;
+	hdr->hdr = width == PACKMSG_DEFERRED_16 ? type : type + 1;
+	hdr->width = width;
+
+	packmsg_write_hdrdata_(buf, hdr->hdr, &zero, width == PACKMSG_DEFERRED_16 ? 2 : 4);
+}
+
+/** \brief Add a map header to the output, with the count to be filled in later.
+ *  \memberof packmsg_output
+ *
+ * This function reserves space for a map header, without having to know the number of elements in advance.
+ * The key-value pairs can then be added using regular packmsg_add_*() calls,
+ * after which packmsg_finish_deferred() must be called with the actual number of key-value pairs.
+ * Deferred headers can be nested, but must be finished in the reverse order in which they were added.
+ *
+ * \param buf    A pointer to an output buffer iterator.
+ * \param hdr    A pointer to a deferred header that will be filled in.
+ * \param width  The width of the header to reserve.
+ */
+static inline void packmsg_add_map_deferred(packmsg_output_t *buf, packmsg_deferred_t *hdr, enum packmsg_deferred_width width)
+{
+	packmsg_add_deferred_(buf, hdr, 0xde, width);
+}
+
+/** \brief Add an array header to the output, with the count to be filled in later.
+ *  \memberof packmsg_output
+ *
+ * This function reserves space for an array header, without having to know the number of elements in advance.
+ * The elements can then be added using regular packmsg_add_*() calls,
+ * after which packmsg_finish_deferred() must be called with the actual number of elements.
+ * Deferred headers can be nested, but must be finished in the reverse order in which they were added.
+ *
+ * \param buf    A pointer to an output buffer iterator.
+ * \param hdr    A pointer to a deferred header that will be filled in.
+ * \param width  The width of the header to reserve.
+ */
+static inline void packmsg_add_array_deferred(packmsg_output_t *buf, packmsg_deferred_t *hdr, enum packmsg_deferred_width width)
+{
+	packmsg_add_deferred_(buf, hdr, 0xdc, width);
+}
+
+/** \brief Write the count of a deferred map or array header.
+ *  \memberof packmsg_output
+ *
+ * This function writes the final number of elements into a header reserved by
+ * packmsg_add_map_deferred() or packmsg_add_array_deferred().
+ * If the header was reserved with PACKMSG_DEFERRED_SHRINK, the smallest possible header is written,
+ * and the contents of the container are moved back to directly follow it,
+ * unless the output is in scatter-gather mode and data has already been referenced since the header was reserved.
+ * If the count does not fit in the reserved header, the output iterator is invalidated.
+ *
+ * \param buf    A pointer to an output buffer iterator.
+ * \param hdr    A pointer to the deferred header.
+ * \param count  The number of elements in the map or array.
+ */
+static inline void packmsg_finish_deferred(packmsg_output_t *buf, packmsg_deferred_t *hdr, uint32_t count)
+{
+	assert(buf);
+	assert(hdr);
+
+	if (unlikely(!packmsg_output_ok(buf)))
+		return;
+
+	uint8_t *ptr = buf->start ? buf->start + hdr->offset : hdr->ptr;
+
+	if (hdr->width == PACKMSG_DEFERRED_16) {
+		if (unlikely(count > 0xffff)) {
+			packmsg_output_invalidate(buf);
+			return;
+		}
+
+		memcpy(ptr + 1, &count, 2);
+		return;
+	}
+
+	// Data already recorded in the scatter-gather list cannot be moved.
+	bool pinned = buf->iov && buf->iovmark > hdr->offset;
+
+	if (hdr->width == PACKMSG_DEFERRED_32 || count > 0xffff || pinned) {
+		memcpy(ptr + 1, &count, 4);
+		return;
+	}
+
+	uint8_t *body = ptr + 5;
+	ptrdiff_t shrink;
+
+	if (count <= 0xf) {
+		*ptr = (hdr->hdr == 0xdd ? 0x90 : 0x80) | (uint8_t) count;
+		shrink = 4;
+	} else {
+		*ptr = hdr->hdr - 1;
+		memcpy(ptr + 1, &count, 2);
+		shrink = 2;
+	}
+
+	memmove(body - shrink, body, buf->ptr - body);
+	buf->ptr -= shrink;
+	buf->len += shrink;
+}
+
+/* UTF-8 validation
+ * ================
+ */
+
+/** \brief Check whether a buffer contains valid UTF-8.
+ *
+ * This function checks that the buffer consists of complete UTF-8 sequences,
+ * without overlong encodings, surrogates or code points above U+10FFFF.
+ * Runs of 16 ASCII characters are checked without branches, so the compiler can vectorize them.
+ *
+ * \param data  A pointer to the start of the buffer.
+ * \param len   The size of the buffer in bytes.
+ *
+ * \return      True if the buffer is valid UTF-8, false otherwise.
+ */
+static inline bool packmsg_utf8_valid(const void *data, size_t len)
+{
+	assert(data || !len);
+
+	const uint8_t *ptr = (const uint8_t *)data;
+	const uint8_t *end = ptr + len;
+
+	while (ptr < end) {
+		if (end - ptr >= 16) {
+			uint8_t bits = 0;
+
+			for (int j = 0; j < 16; j++)
+				bits |= ptr[j];
+
+			if (!(bits & 0x80)) {
+				ptr += 16;
+				continue;
+			}
+		}
+
+		uint8_t c = *ptr;
+
+		if (c < 0x80) {
+			ptr++;
+			continue;
+		}
+
+		// The number of continuation bytes, and the allowed range of the first one.
+		size_t n;
+		uint8_t lo = 0x80;
+		uint8_t hi = 0xbf;
+
+		if (c >= 0xc2 && c <= 0xdf) {
+			n = 1;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			n = 2;
+			lo = c == 0xe0 ? 0xa0 : 0x80;
+			hi = c == 0xed ? 0x9f : 0xbf;
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			n = 3;
+			lo = c == 0xf0 ? 0x90 : 0x80;
+			hi = c == 0xf4 ? 0x8f : 0xbf;
+		} else {
+			return false;
+		}
+
+		if ((size_t)(end - ptr) <= n || ptr[1] < lo || ptr[1] > hi)
+			return false;
+
+		for (size_t i = 2; i <= n; i++)
+			if ((ptr[i] & 0xc0) != 0x80)
+				return false;
+
+		ptr += n + 1;
+	}
+
+	return true;
+}
+
+/* Decoding functions
+ * ==================
+ */
+
+/** \brief An enum describing the type of an element in a PackMessage message.
+ *
+ * This enum describes the type of an element in a PackMessage message.
+ * In case of integers and floating point values, the type normally represents
+ * the smallest type that can succesfully hold the value of the element;
+ * i.e. an element of type PACKMSG_INT32 can only succesfully be read by
+ * packmsg_get_int32() or packmsg_get_int64(). However, the converse it not true;
+ * for an element of type PACKMSG_INT32, there is no guarantee
+ * that the value is larger than would fit into an int16_t.
+ *
+ * PackMessage makes a clear distinction between signed and unsigned integers,
+ * except in the case of positive fixints (values between 0 and 127 inclusive),
+ * which can be read as both signed and unsigned.
+ */
+enum packmsg_type {
+	PACKMSG_ERROR,            /**< An invalid element was found or the input buffer is in an invalid state. */
+	PACKMSG_NIL,              /**< The next element is a NIL. */
+	PACKMSG_BOOL,             /**< The next element is a boolean. */
+	PACKMSG_POSITIVE_FIXINT,  /**< The next element is an integer between 0 and 127 inclusive. */
+	PACKMSG_INT8,             /**< The next element is a signed integer that fits in an int8_t. */
+	PACKMSG_INT16,            /**< The next element is a signed integer that fits in an int16_t. */
+	PACKMSG_INT32,            /**< The next element is a signed integer that fits in an int32_t. */
+	PACKMSG_INT64,            /**< The next element is a signed integer that fits in an int64_t. */
+	PACKMSG_UINT8,            /**< The next element is an unsigned integer that fits in an uint8_t. */
+	PACKMSG_UINT16,           /**< The next element is an unsigned integer that fits in an uint16_t. */
+	PACKMSG_UINT32,           /**< The next element is an unsigned integer that fits in an uint32_t. */
+	PACKMSG_UINT64,           /**< The next element is an unsigned integer that fits in an uint64_t. */
+	PACKMSG_FLOAT,            /**< The next element is a single precision floating point value. */
+	PACKMSG_DOUBLE,           /**< The next element is a double precision floating point value. */
+	PACKMSG_STR,              /**< The next element is a string. */
+	PACKMSG_BIN,              /**< The next element is binary data. */
+	PACKMSG_EXT,              /**< The next element is extension data. */
+	PACKMSG_MAP,              /**< The next element is a map header. */
+	PACKMSG_ARRAY,            /**< The next element is an array header. */
+	PACKMSG_DONE,             /**< There are no more elements in the input buffer. */
+};
+
+/** \brief Internal type, do not use.
+ *
+ * Describes how an element starting with a given header byte is encoded.
+ */
+typedef struct packmsg_hdr_info_ {
+	uint8_t type;   /**< The enum packmsg_type of the element. */
+	uint8_t width;  /**< The size of the length or count field following the header. */
+	uint8_t size;   /**< The number of bytes following the length field that do not depend on it. */
+	int8_t value;   /**< The value of a fixint, or the length or count stored in the header itself. */
+} packmsg_hdr_info_t;
+
+#define PACKMSG_HDR16_(M, n) \
+	M(n + 0x0), M(n + 0x1), M(n + 0x2), M(n + 0x3), M(n + 0x4), M(n + 0x5), M(n + 0x6), M(n + 0x7), \
+	M(n + 0x8), M(n + 0x9), M(n + 0xa), M(n + 0xb), M(n + 0xc), M(n + 0xd), M(n + 0xe), M(n + 0xf)
+#define PACKMSG_FIXINT_(n) {PACKMSG_POSITIVE_FIXINT, 0, 0, n}
+#define PACKMSG_FIXMAP_(n) {PACKMSG_MAP, 0, 0, n}
+#define PACKMSG_FIXARRAY_(n) {PACKMSG_ARRAY, 0, 0, n}
+#define PACKMSG_FIXSTR_(n) {PACKMSG_STR, 0, n, n}
+#define PACKMSG_NEGATIVE_FIXINT_(n) {PACKMSG_INT8, 0, 0, n - 32}
+
+/** \brief Internal variable, do not use.
+ *
+ * Maps every header byte to a description of the element it starts,
+ * so type checks, getters and skipping only need a single table lookup.
+ */
+static const packmsg_hdr_info_t packmsg_hdr_info_[256] = {
+	PACKMSG_HDR16_(PACKMSG_FIXINT_, 0x00),
+	PACKMSG_HDR16_(PACKMSG_FIXINT_, 0x10),
+	PACKMSG_HDR16_(PACKMSG_FIXINT_, 0x20),
+	PACKMSG_HDR16_(PACKMSG_FIXINT_, 0x30),
+	PACKMSG_HDR16_(PACKMSG_FIXINT_, 0x40),
+	PACKMSG_HDR16_(PACKMSG_FIXINT_, 0x50),
+	PACKMSG_HDR16_(PACKMSG_FIXINT_, 0x60),
+	PACKMSG_HDR16_(PACKMSG_FIXINT_, 0x70),
+	PACKMSG_HDR16_(PACKMSG_FIXMAP_, 0x00),
+	PACKMSG_HDR16_(PACKMSG_FIXARRAY_, 0x00),
+	PACKMSG_HDR16_(PACKMSG_FIXSTR_, 0x00),
+	PACKMSG_HDR16_(PACKMSG_FIXSTR_, 0x10),
+	{PACKMSG_NIL, 0, 0, 0},       // 0xc0
+	{PACKMSG_ERROR, 0, 0, 0},     // 0xc1
+	{PACKMSG_BOOL, 0, 0, 0},      // 0xc2
+	{PACKMSG_BOOL, 0, 0, 1},      // 0xc3
+	{PACKMSG_BIN, 1, 0, 0},       // 0xc4
+	{PACKMSG_BIN, 2, 0, 0},       // 0xc5
+	{PACKMSG_BIN, 4, 0, 0},       // 0xc6
+	{PACKMSG_EXT, 1, 1, 0},       // 0xc7
+	{PACKMSG_EXT, 2, 1, 0},       // 0xc8
+	{PACKMSG_EXT, 4, 1, 0},       // 0xc9
+	{PACKMSG_FLOAT, 0, 4, 0},     // 0xca
+	{PACKMSG_DOUBLE, 0, 8, 0},    // 0xcb
+	{PACKMSG_UINT8, 0, 1, 0},     // 0xcc
+	{PACKMSG_UINT16, 0, 2, 0},    // 0xcd
+	{PACKMSG_UINT32, 0, 4, 0},    // 0xce
+	{PACKMSG_UINT64, 0, 8, 0},    // 0xcf
+	{PACKMSG_INT8, 0, 1, 0},      // 0xd0
+	{PACKMSG_INT16, 0, 2, 0},     // 0xd1
+	{PACKMSG_INT32, 0, 4, 0},     // 0xd2
+	{PACKMSG_INT64, 0, 8, 0},     // 0xd3
+	{PACKMSG_EXT, 0, 2, 1},       // 0xd4
+	{PACKMSG_EXT, 0, 3, 2},       // 0xd5
+	{PACKMSG_EXT, 0, 5, 4},       // 0xd6
+	{PACKMSG_EXT, 0, 9, 8},       // 0xd7
+	{PACKMSG_EXT, 0, 17, 16},     // 0xd8
+	{PACKMSG_STR, 1, 0, 0},       // 0xd9
+	{PACKMSG_STR, 2, 0, 0},       // 0xda
+	{PACKMSG_STR, 4, 0, 0},       // 0xdb
+	{PACKMSG_ARRAY, 2, 0, 0},     // 0xdc
+	{PACKMSG_ARRAY, 4, 0, 0},     // 0xdd
+	{PACKMSG_MAP, 2, 0, 0},       // 0xde
+	{PACKMSG_MAP, 4, 0, 0},       // 0xdf
+	PACKMSG_HDR16_(PACKMSG_NEGATIVE_FIXINT_, 0x00),
+	PACKMSG_HDR16_(PACKMSG_NEGATIVE_FIXINT_, 0x10),
+};
+
+#undef PACKMSG_HDR16_
+#undef PACKMSG_FIXINT_
+#undef PACKMSG_FIXMAP_
+#undef PACKMSG_FIXARRAY_
+#undef PACKMSG_FIXSTR_
+#undef PACKMSG_NEGATIVE_FIXINT_
+
+/** \brief Internal function, do not use.
+ *
+ * Returns true if at least dlen bytes are available in the input without refilling it.
+ * If PACKMSG_TRUSTED is defined, this only checks that the input iterator is still valid,
+ * so getters still fail after a type mismatch.
+ */
+static inline bool packmsg_input_has_(const packmsg_input_t *buf, uint64_t dlen)
+{
+#ifdef PACKMSG_TRUSTED
+	(void)dlen;
+	return likely(buf->len >= 0);
+#else
+	return likely(buf->len >= 0 && (uint64_t)buf->len >= dlen);
+#endif
+}
+
+/** \brief Internal function, do not use. */
+static inline uint8_t packmsg_read_hdr_(packmsg_input_t *buf)
+{
+	assert(buf);
+	assert(buf->ptr);
+
+	if (packmsg_input_has_(buf, 1) || packmsg_input_refill_(buf, 1)) {
+		uint8_t hdr = *buf->ptr;
+		buf->ptr++;
+		buf->len--;
+		return hdr;
+	} else {
+		packmsg_input_invalidate(buf);
+		return 0xc1;
+	}
+}
+
+/** \brief Internal function, do not use. */
+static inline void packmsg_read_data_(packmsg_input_t *buf, void *data, uint32_t dlen)
+{
+	assert(buf);
+	assert(buf->ptr);
+	assert(data);
+
+	if (packmsg_input_has_(buf, dlen) || packmsg_input_refill_(buf, dlen)) {
+		memcpy(data, buf->ptr, dlen);
+		buf->ptr += dlen;
+		buf->len -= dlen;
+	} else {
+		packmsg_input_invalidate(buf);
+	}
+}
+
+/** \brief Internal function, do not use.
+ *
+ * Returns a pointer to at least dlen bytes at the position of the input iterator, without consuming them,
+ * or NULL if they are not available. An input source may be refilled, but the iterator itself is not modified.
+ */
+static inline const uint8_t *packmsg_peek_(const packmsg_input_t *buf, uint64_t dlen)
+{
+	if (likely(buf->len >= 0 && (uint64_t)buf->len >= dlen))
+		return buf->ptr;
+	else if (buf->src && dlen <= buf->src->size)
+		return packmsg_source_fill_(buf, dlen);
+	else
+		return NULL;
+}
+
+/** \brief Internal function, do not use. */
+static inline uint8_t packmsg_peek_hdr_(const packmsg_input_t *buf)
+{
+	assert(buf);
+	assert(buf->ptr);
+
+	const uint8_t *ptr = packmsg_peek_(buf, 1);
+	return ptr ? *ptr : 0xc1;
+}
+
+/** \brief Internal function, do not use.
+ *
+ * Returns a mask with a bit set for each type that can be read by the signed integer getter for type max.
+ */
+static inline uint32_t packmsg_sint_types_(enum packmsg_type max)
+{
+	return (2u << max) - (1u << PACKMSG_POSITIVE_FIXINT);
+}
+
+/** \brief Internal function, do not use.
+ *
+ * Returns a mask with a bit set for each type that can be read by the unsigned integer getter for type max.
+ */
+static inline uint32_t packmsg_uint_types_(enum packmsg_type max)
+{
+	return (1u << PACKMSG_POSITIVE_FIXINT) | ((2u << max) - (1u << PACKMSG_UINT8));
+}
+
+/** \brief Internal function, do not use.
+ *
+ * Reads an integer of one of the types in mask, sign-extending it if sign is true.
+ */
+static inline uint64_t packmsg_read_int_(packmsg_input_t *buf, uint32_t mask, bool sign)
+{
+	const packmsg_hdr_info_t *info = &packmsg_hdr_info_[packmsg_read_hdr_(buf)];
+
+	if (unlikely(!((mask >> info->type) & 1))) {
+		packmsg_input_invalidate(buf);
+		return 0;
+	}
+
+	if (!info->size)
+		return (uint64_t)(int64_t)info->value;
+
+	uint64_t val = 0;
+	packmsg_read_data_(buf, &val, info->size);
+
+	if (sign) {
+		unsigned int shift = 64 - 8 * info->size;
+		val = (uint64_t)((int64_t)(val << shift) >> shift);
+	}
+
+	return val;
+}
+
+/** \brief Internal function, do not use.
+ *
+ * Reads the header of a string, binary data, extension data, map or array of the given type,
+ * and returns its length or count.
+ */
+static inline uint32_t packmsg_read_len_(packmsg_input_t *buf, enum packmsg_type type)
+{
+	const packmsg_hdr_info_t *info = &packmsg_hdr_info_[packmsg_read_hdr_(buf)];
+
+	if (unlikely(info->type != type)) {
+		packmsg_input_invalidate(buf);
+		return 0;
+	}
+
+	uint32_t dlen = 0;
+
+	if (info->width)
+		packmsg_read_data_(buf, &dlen, info->width);
+
+	return dlen + (uint8_t)info->value;
+}
+
+/** \brief Get a NIL from the input.
+ *  \memberof packmsg_input
+ *
+ * This function does not return anything, but will invalidate the input interator
+ * if no NIL was succesfully consumed from the input.
+ *
+ * \param buf  A pointer to an input buffer iterator.
+ */
+static inline void packmsg_get_nil(packmsg_input_t *buf)
+{
+	if (packmsg_read_hdr_(buf) != 0xc0)
+		packmsg_input_invalidate(buf);
+}
+
+
+/** \brief Get a boolean value from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf  A pointer to an input buffer iterator.
+ * \return     The boolean value that was read from the input,
+ *             or false in case of an error.
+ */
+static inline bool packmsg_get_bool(packmsg_input_t *buf)
+{
+	return packmsg_read_int_(buf, 1u << PACKMSG_BOOL, false);
+}
+
+/** \brief Get an int8 value from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf  A pointer to an input buffer iterator.
+ * \return     The int8 value that was read from the input,
+ *             or 0 in case of an error.
+ */
+static inline int8_t packmsg_get_int8(packmsg_input_t *buf)
+{
+	return packmsg_read_int_(buf, packmsg_sint_types_(PACKMSG_INT8), true);
+}
+
+/** \brief Get an int16 value from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf  A pointer to an input buffer iterator.
+ * \return     The int16 value that was read from the input,
+ *             or 0 in case of an error.
+ */
+static inline int16_t packmsg_get_int16(packmsg_input_t *buf)
+{
+	return packmsg_read_int_(buf, packmsg_sint_types_(PACKMSG_INT16), true);
+}
+
+/** \brief Get an int32 value from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf  A pointer to an input buffer iterator.
+ * \return     The int32 value that was read from the input,
+ *             or 0 in case of an error.
+ */
+static inline int32_t packmsg_get_int32(packmsg_input_t *buf)
+{
+	return packmsg_read_int_(buf, packmsg_sint_types_(PACKMSG_INT32), true);
+}
+
+/** \brief Get an int64 value from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf  A pointer to an input buffer iterator.
+ * \return     The int64 value that was read from the input,
+ *             or 0 in case of an error.
+ */
+static inline int64_t packmsg_get_int64(packmsg_input_t *buf)
+{
+	return packmsg_read_int_(buf, packmsg_sint_types_(PACKMSG_INT64), true);
+}
+
+/** \brief Get an uint8 value from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf  A pointer to an input buffer iterator.
+ * \return     The uint8 value that was read from the input,
+ *             or 0 in case of an error.
+ */
+static inline uint8_t packmsg_get_uint8(packmsg_input_t *buf)
+{
+	return packmsg_read_int_(buf, packmsg_uint_types_(PACKMSG_UINT8), false);
+}
+
+/** \brief Get an uint16 value from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf  A pointer to an input buffer iterator.
+ * \return     The uint16 value that was read from the input,
+ *             or 0 in case of an error.
+ */
+static inline uint16_t packmsg_get_uint16(packmsg_input_t *buf)
+{
+	return packmsg_read_int_(buf, packmsg_uint_types_(PACKMSG_UINT16), false);
+}
+
+/** \brief Get an uint32 value from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf  A pointer to an input buffer iterator.
+ * \return     The uint32 value that was read from the input,
+ *             or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_uint32(packmsg_input_t *buf)
+{
+	return packmsg_read_int_(buf, packmsg_uint_types_(PACKMSG_UINT32), false);
+}
+
+/** \brief Get an uint64 value from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf  A pointer to an input buffer iterator.
+ * \return     The uint64 value that was read from the input,
+ *             or 0 in case of an error.
+ */
+static inline uint64_t packmsg_get_uint64(packmsg_input_t *buf)
+{
+	return packmsg_read_int_(buf, packmsg_uint_types_(PACKMSG_UINT64), false);
+}
+
+/** \brief Get a float value from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf  A pointer to an input buffer iterator.
+ * \return     The float value that was read from the input,
+ *             or 0 in case of an error.
+ */
+static inline float packmsg_get_float(packmsg_input_t *buf)
+{
+	uint8_t hdr = packmsg_read_hdr_(buf);
+	if (hdr == 0xca) {
+		float val = 0;
+		packmsg_read_data_(buf, &val, 4);
+		return val;
+	} else {
+		packmsg_input_invalidate(buf);
+		return 0;
+	}
+}
+
+/** \brief Get a double value from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf  A pointer to an input buffer iterator.
+ * \return     The float value that was read from the input,
+ *             or 0 in case of an error.
+ */
+static inline double packmsg_get_double(packmsg_input_t *buf)
+{
+	uint8_t hdr = packmsg_read_hdr_(buf);
 	if (hdr == 0xcb) {
-		double val;
+		double val = 0;
 		packmsg_read_data_(buf, &val, 8);
 		return val;
 	} else if (hdr == 0xca) {
-		float val;
+		float val = 0;
 		packmsg_read_data_(buf, &val, 4);
 		return val;
 	} else {
@@ -906,889 +2223,3372 @@ static inline double packmsg_get_double(packmsg_input_t *buf)
 	}
 }
 
-/** \brief Get a raw pointer to a string from the input.
+/** \brief Get a raw pointer to a string from the input.
+ *  \memberof packmsg_input
+ *
+ * This function returns the size of a string and a pointer into the input buffer itself,
+ * to a string that is *not NUL-terminated!* This function avoids making a copy of the string,
+ * but the application must take care to not read more than the returned number of bytes.
+ * If packmsg_input_set_utf8() was used to enable it, the string must be valid UTF-8.
+ *
+ * \param buf       A pointer to an input buffer iterator.
+ * \param[out] str  A pointer to a const char pointer that will be set to the start of the string,
+ *                  or will be set to NULL in case of an error.
+ * \return          The size of the string in bytes,
+ *                  or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_str_raw(packmsg_input_t *buf, const char **str)
+{
+	assert(str);
+
+	uint32_t slen = packmsg_read_len_(buf, PACKMSG_STR);
+
+	if ((packmsg_input_has_(buf, slen) || packmsg_input_refill_(buf, slen)) && (likely(!buf->utf8) || packmsg_utf8_valid(buf->ptr, slen))) {
+		*str = (const char *)buf->ptr;
+		buf->ptr += slen;
+		buf->len -= slen;
+		return slen;
+	} else {
+		packmsg_input_invalidate(buf);
+		*str = NULL;
+		return 0;
+	}
+}
+
+/** \brief Copy a string from the input into a newly allocated buffer.
+ *  \memberof packmsg_input
+ *
+ * This function copies a string from the input into a buffer allocated by the library
+ * using malloc(). The copy will be NUL-terminated.
+ * The application is responsible for freeing the memory of the buffer using free().
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ *
+ * \return      A pointer to the newly allocated buffer containing a NUL-terminated string,
+ *              or NULL in case of an error.
+ */
+static inline char *packmsg_get_str_dup(packmsg_input_t *buf)
+{
+	const char *str;
+	uint32_t slen = packmsg_get_str_raw(buf, &str);
+	if (likely(packmsg_input_ok(buf))) {
+		char *dup = (char *)malloc((size_t) slen + 1);
+		if (likely(dup)) {
+			memcpy(dup, str, slen);
+			dup[slen] = 0;
+			return dup;
+		} else {
+			packmsg_input_invalidate(buf);
+			return NULL;
+		}
+	} else {
+		return NULL;
+	}
+}
+
+/** \brief Copy a string from the input into another buffer.
+ *  \memberof packmsg_input
+ *
+ * This function copies a string from the input another buffer provided by the application.
+ * The buffer must be long enough to hold the complete string plus a terminating NUL-byte.
+ * If the buffer is not long enough, or another error occured,
+ * a single NUL-byte will be written to the start of the buffer (if its size is at least one byte).
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ * \param data  A pointer to a buffer allocated by the application.
+ * \param dlen  The size of the buffer pointed to by data.
+ *
+ * \return      The size of the string in bytes,
+ *              or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_str_copy(packmsg_input_t *buf, void *data, uint32_t dlen)
+{
+	assert(data);
+
+	const char *str;
+	uint32_t slen = packmsg_get_str_raw(buf, &str);
+	if (likely(packmsg_input_ok(buf))) {
+		if (likely(slen < dlen)) {
+			memcpy(data, str, slen);
+			((char *)data)[slen] = 0;
+			return slen;
+		} else {
+			if (dlen)
+				*(char *)data = 0;
+			packmsg_input_invalidate(buf);
+			return 0;
+		}
+	} else {
+		if (dlen)
+			*(char *)data = 0;
+		return 0;
+	}
+}
+
+/** \brief Get a raw pointer to binary data from the input.
+ *  \memberof packmsg_input
+ *
+ * This function returns the size of the binary data and a pointer into the input buffer itself.
+ * This function avoids making a copy of the binary data,
+ * but the application must take care to not read more than the returned number of bytes.
+ *
+ * \param buf        A pointer to an input buffer iterator.
+ * \param[out] data  A pointer to a const void pointer that will be set to the start of the data,
+ *                   or will be set to NULL in case of an error.
+ * \return           The size of the data in bytes,
+ *                   or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_bin_raw(packmsg_input_t *buf, const void **data)
+{
+	assert(data);
+
+	uint32_t dlen = packmsg_read_len_(buf, PACKMSG_BIN);
+
+	if (packmsg_input_has_(buf, dlen) || packmsg_input_refill_(buf, dlen)) {
+		*data = buf->ptr;
+		buf->ptr += dlen;
+		buf->len -= dlen;
+		return dlen;
+	} else {
+		packmsg_input_invalidate(buf);
+		*data = NULL;
+		return 0;
+	}
+}
+
+/** \brief Copy binary data from the input into a newly allocated buffer.
+ *  \memberof packmsg_input
+ *
+ * This function copies binary data from the input into a buffer allocated by the library
+ * using malloc().
+ * The application is responsible for freeing the memory of the buffer using free().
+ *
+ * \param buf        A pointer to an input buffer iterator.
+ * \param[out] dlen  A pointer to an uint32_t that will be set to the size of the binary data.
+ *
+ * \return           A pointer to the newly allocated buffer containing the binary data,
+ *                   or NULL in case of an error.
+ */
+static inline void *packmsg_get_bin_dup(packmsg_input_t *buf, uint32_t *dlen)
+{
+	const void *data;
+	*dlen = packmsg_get_bin_raw(buf, &data);
+	if (likely(packmsg_input_ok(buf))) {
+		char *dup = (char *)malloc(*dlen);
+		if (likely(dup)) {
+			memcpy(dup, data, *dlen);
+			return dup;
+		} else {
+			*dlen = 0;
+			packmsg_input_invalidate(buf);
+			return NULL;
+		}
+	} else {
+		return NULL;
+	}
+}
+
+/** \brief Copy binary data from the input into another buffer.
+ *  \memberof packmsg_input
+ *
+ * This function copies binary data from the input another buffer provided by the application.
+ * The buffer must be long enough to hold all the binary data.
+ *
+ * \param buf     A pointer to an input buffer iterator.
+ * \param rawbuf  A pointer to a buffer allocated by the application.
+ * \param rlen    The size of the buffer pointed to by data.
+ *
+ * \return      The size of the binary data in bytes,
+ *              or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_bin_copy(packmsg_input_t *buf, void *rawbuf, uint32_t rlen)
+{
+	assert(rawbuf);
+
+	const void *data;
+	uint32_t dlen = packmsg_get_bin_raw(buf, &data);
+	if (likely(packmsg_input_ok(buf))) {
+		if (likely(dlen <= rlen)) {
+			memcpy(rawbuf, data, dlen);
+			return dlen;
+		} else {
+			packmsg_input_invalidate(buf);
+			return 0;
+		}
+	} else {
+		return 0;
+	}
+}
+
+/** \brief Get a raw pointer to extension data from the input.
+ *  \memberof packmsg_input
+ *
+ * This function returns the type of the extension, the size of the data
+ * and a pointer into the input buffer itself.
+ * This function avoids making a copy of the binary data,
+ * but the application must take care to not read more than the returned number of bytes.
+ *
+ * \param buf        A pointer to an input buffer iterator.
+ * \param[out] type  A pointer to an int8_t that will be set to the type of the extension.
+ *                   or will be set to 0 in case of an error.
+ * \param[out] data  A pointer to a const void pointer that will be set to the start of the data,
+ *                   or will be set to NULL in case of an error.
+ *
+ * \return           The size of the data in bytes,
+ *                   or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_ext_raw(packmsg_input_t *buf, int8_t *type, const void **data)
+{
+	assert(type);
+	assert(data);
+
+	uint32_t dlen = packmsg_read_len_(buf, PACKMSG_EXT);
+
+	*type = packmsg_read_hdr_(buf);
+
+	if (packmsg_input_has_(buf, dlen) || packmsg_input_refill_(buf, dlen)) {
+		*data = buf->ptr;
+		buf->ptr += dlen;
+		buf->len -= dlen;
+		return dlen;
+	} else {
+		packmsg_input_invalidate(buf);
+		*type = 0;
+		*data = NULL;
+		return 0;
+	}
+}
+
+/** \brief Copy extension data from the input into a newly allocated buffer.
+ *  \memberof packmsg_input
+ *
+ * This function copies extension data from the input into a buffer allocated by the library
+ * using malloc().
+ * The application is responsible for freeing the memory of the buffer using free().
+ *
+ * \param buf        A pointer to an input buffer iterator.
+ * \param[out] type  A pointer to an int8_t that will be set to the type of the extension.
+ *                   or will be set to 0 in case of an error.
+ * \param[out] dlen  A pointer to an uint32_t that will be set to the size of the extension data,
+ *                   or will be set to 0 in case of an error.
+ *
+ * \return           A pointer to the newly allocated buffer containing the extension data,
+ *                   or NULL in case of an error.
+ */
+static inline void *packmsg_get_ext_dup(packmsg_input_t *buf, int8_t *type, uint32_t *dlen)
+{
+	assert(type);
+
+	const void *data;
+	*dlen = packmsg_get_ext_raw(buf, type, &data);
+	if (likely(packmsg_input_ok(buf))) {
+		char *dup = (char *)malloc(*dlen);
+		if (likely(dup)) {
+			memcpy(dup, data, *dlen);
+			return dup;
+		} else {
+			*type = 0;
+			*dlen = 0;
+			packmsg_input_invalidate(buf);
+			return NULL;
+		}
+	} else {
+		*type = 0;
+		*dlen = 0;
+		return NULL;
+	}
+}
+
+/** \brief Copy extension data from the input into another buffer.
+ *  \memberof packmsg_input
+ *
+ * This function copies extension data from the input another buffer provided by the application.
+ * The buffer must be long enough to hold all the extension data.
+ *
+ * \param buf        A pointer to an input buffer iterator.
+ * \param[out] type  A pointer to an int8_t that will be set to the type of the extension.
+ *                   or will be set to 0 in case of an error.
+ * \param rawbuf     A pointer to a buffer allocated by the application.
+ * \param rlen       The size of the buffer pointed to by data.
+ *
+ * \return           The size of the extension data in bytes,
+ *                   or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_ext_copy(packmsg_input_t *buf, int8_t *type, void *rawbuf, uint32_t rlen)
+{
+	assert(type);
+	assert(rawbuf);
+
+	const void *data;
+	uint32_t dlen = packmsg_get_ext_raw(buf, type, &data);
+	if (likely(packmsg_input_ok(buf))) {
+		if (likely(dlen <= rlen)) {
+			memcpy(rawbuf, data, dlen);
+			return dlen;
+		} else {
+			*type = 0;
+			packmsg_input_invalidate(buf);
+			return 0;
+		}
+	} else {
+		*type = 0;
+		return 0;
+	}
+}
+
+/** \brief Get a map header from the output.
+ *  \memberof packmsg_input
+ *
+ * This function only reads a map header, and returns the number of key-value
+ * pairs in the map.
+ * These key-value pairs have to be read by the application using regular
+ * packmsg_get_*() calls.
+ *
+ * \param buf    A pointer to an input buffer iterator.
+ *
+ * \return       The number of key-value pairs in the map.
+ */
+static inline uint32_t packmsg_get_map(packmsg_input_t *buf)
+{
+	return packmsg_read_len_(buf, PACKMSG_MAP);
+}
+
+/** \brief Get an array header from the output.
+ *  \memberof packmsg_input
+ *
+ * This function only reads an array header, and returns the number of elements
+ * in the array.
+ * These elements have to be read by the application using regular
+ * packmsg_get_*() calls.
+ *
+ * \param buf    A pointer to an input buffer iterator.
+ *
+ * \return       The number of elements in the array.
+ */
+static inline uint32_t packmsg_get_array(packmsg_input_t *buf)
+{
+	return packmsg_read_len_(buf, PACKMSG_ARRAY);
+}
+
+/* Arena allocation
+ * ================
+ */
+
+/** \brief A region of memory that strings, binary and extension data can be copied into.
+ *
+ * An arena is a buffer allocated by the application, from which memory is handed out
+ * by simply advancing an offset. Individual allocations are never freed;
+ * instead, all memory is released at once with packmsg_arena_reset().
+ * This avoids a malloc() and free() per element when using packmsg_get_*_arena()
+ * instead of packmsg_get_*_dup().
+ */
+typedef struct packmsg_arena {
+	uint8_t *start; /**< A pointer to the start of the region. */
+	size_t size;    /**< The total size of the region. */
+	size_t used;    /**< The number of bytes handed out since the last reset. */
+} packmsg_arena_t;
+
+/** \brief Initialize an arena.
+ *  \memberof packmsg_arena
+ *
+ * \param arena  A pointer to an arena.
+ * \param data   A pointer to the start of a region of memory allocated by the application.
+ * \param size   The size of the region in bytes.
+ */
+static inline void packmsg_arena_init(packmsg_arena_t *arena, void *data, size_t size)
+{
+	assert(arena);
+	assert(data || !size);
+
+	arena->start = (uint8_t *)data;
+	arena->size = size;
+	arena->used = 0;
+}
+
+/** \brief Release all memory allocated from an arena.
+ *  \memberof packmsg_arena
+ *
+ * All pointers previously returned by functions using this arena become invalid.
+ *
+ * \param arena  A pointer to an arena.
+ */
+static inline void packmsg_arena_reset(packmsg_arena_t *arena)
+{
+	assert(arena);
+
+	arena->used = 0;
+}
+
+/** \brief Allocate memory from an arena.
+ *  \memberof packmsg_arena
+ *
+ * \param arena  A pointer to an arena.
+ * \param size   The number of bytes to allocate.
+ * \param align  The required alignment of the allocation, which must be a power of two.
+ *
+ * \return       A pointer to the allocated memory,
+ *               or NULL if there is not enough room left in the arena.
+ *               A zero-size allocation always succeeds if the arena is not full.
+ *               If the arena has no memory, it returns a pointer to a shared empty sentinel,
+ *               which points to no storage and must not be dereferenced.
+ */
+static inline void *packmsg_arena_alloc(packmsg_arena_t *arena, size_t size, size_t align)
+{
+	assert(arena);
+	assert(align && !(align & (align - 1)));
+
+	uintptr_t next = (uintptr_t)arena->start + arena->used;
+	size_t offset = arena->used + ((0 - next) & (align - 1));
+
+	if (unlikely(offset > arena->size || size > arena->size - offset))
+		return NULL;
+
+	arena->used = offset + size;
+
+	// An arena without memory still has to return a valid pointer for empty allocations.
+	if (unlikely(!arena->start)) {
+		static const uint8_t empty = 0;
+		return (void *)&empty;
+	}
+
+	return arena->start + offset;
+}
+
+/** \brief Copy a string from the input into an arena.
+ *  \memberof packmsg_input
+ *
+ * This function copies a string from the input into memory allocated from an arena.
+ * The copy will be NUL-terminated. If the arena does not have enough room left,
+ * the input iterator is invalidated.
+ *
+ * \param buf    A pointer to an input buffer iterator.
+ * \param arena  A pointer to an arena.
+ *
+ * \return       A pointer into the arena containing a NUL-terminated string,
+ *               or NULL in case of an error.
+ */
+static inline char *packmsg_get_str_arena(packmsg_input_t *buf, packmsg_arena_t *arena)
+{
+	const char *str;
+	uint32_t slen = packmsg_get_str_raw(buf, &str);
+	if (likely(packmsg_input_ok(buf))) {
+		char *copy = (char *)packmsg_arena_alloc(arena, (size_t) slen + 1, 1);
+		if (likely(copy)) {
+			memcpy(copy, str, slen);
+			copy[slen] = 0;
+			return copy;
+		} else {
+			packmsg_input_invalidate(buf);
+			return NULL;
+		}
+	} else {
+		return NULL;
+	}
+}
+
+/** \brief Copy binary data from the input into an arena.
+ *  \memberof packmsg_input
+ *
+ * This function copies binary data from the input into memory allocated from an arena,
+ * aligned to 8 bytes. If the arena does not have enough room left,
+ * the input iterator is invalidated.
+ *
+ * \param buf        A pointer to an input buffer iterator.
+ * \param arena      A pointer to an arena.
+ * \param[out] dlen  A pointer to an uint32_t that will be set to the size of the binary data.
+ *
+ * \return           A pointer into the arena containing the binary data,
+ *                   or NULL in case of an error.
+ */
+static inline void *packmsg_get_bin_arena(packmsg_input_t *buf, packmsg_arena_t *arena, uint32_t *dlen)
+{
+	const void *data;
+	*dlen = packmsg_get_bin_raw(buf, &data);
+	if (likely(packmsg_input_ok(buf))) {
+		void *copy = packmsg_arena_alloc(arena, *dlen, 8);
+		if (likely(copy)) {
+			memcpy(copy, data, *dlen);
+			return copy;
+		} else {
+			*dlen = 0;
+			packmsg_input_invalidate(buf);
+			return NULL;
+		}
+	} else {
+		return NULL;
+	}
+}
+
+/** \brief Copy extension data from the input into an arena.
+ *  \memberof packmsg_input
+ *
+ * This function copies extension data from the input into memory allocated from an arena,
+ * aligned to 8 bytes. If the arena does not have enough room left,
+ * the input iterator is invalidated.
+ *
+ * \param buf        A pointer to an input buffer iterator.
+ * \param arena      A pointer to an arena.
+ * \param[out] type  A pointer to an int8_t that will be set to the type of the extension.
+ *                   or will be set to 0 in case of an error.
+ * \param[out] dlen  A pointer to an uint32_t that will be set to the size of the extension data,
+ *                   or will be set to 0 in case of an error.
+ *
+ * \return           A pointer into the arena containing the extension data,
+ *                   or NULL in case of an error.
+ */
+static inline void *packmsg_get_ext_arena(packmsg_input_t *buf, packmsg_arena_t *arena, int8_t *type, uint32_t *dlen)
+{
+	assert(type);
+
+	const void *data;
+	*dlen = packmsg_get_ext_raw(buf, type, &data);
+	if (likely(packmsg_input_ok(buf))) {
+		void *copy = packmsg_arena_alloc(arena, *dlen, 8);
+		if (likely(copy)) {
+			memcpy(copy, data, *dlen);
+			return copy;
+		} else {
+			*type = 0;
+			*dlen = 0;
+			packmsg_input_invalidate(buf);
+			return NULL;
+		}
+	} else {
+		*type = 0;
+		*dlen = 0;
+		return NULL;
+	}
+}
+
+/* Bulk decoding functions
+ * =======================
+ *
+ * The packmsg_get_*_array() functions read an array header followed by all its elements,
+ * which must each be readable by the corresponding packmsg_get_*() function, into an array provided by the application.
+ * If the array in the input has more than max elements, the input iterator is invalidated.
+ * In case of an error, the elements of data that were read are set to 0.
+ */
+
+/** \brief Internal function, do not use. */
+static inline void packmsg_store_int_(void *data, size_t i, size_t size, uint64_t val)
+{
+	switch (size) {
+	case 1: ((uint8_t *)data)[i] = (uint8_t)val; break;
+	case 2: ((uint16_t *)data)[i] = (uint16_t)val; break;
+	case 4: ((uint32_t *)data)[i] = (uint32_t)val; break;
+	default: ((uint64_t *)data)[i] = val; break;
+	}
+}
+
+/** \brief Internal function, do not use. */
+static inline uint64_t packmsg_get_int_(packmsg_input_t *buf, size_t size, bool sign)
+{
+	switch (size) {
+	case 1: return sign ? (uint64_t)packmsg_get_int8(buf) : packmsg_get_uint8(buf);
+	case 2: return sign ? (uint64_t)packmsg_get_int16(buf) : packmsg_get_uint16(buf);
+	case 4: return sign ? (uint64_t)packmsg_get_int32(buf) : packmsg_get_uint32(buf);
+	default: return sign ? (uint64_t)packmsg_get_int64(buf) : packmsg_get_uint64(buf);
+	}
+}
+
+/** \brief Internal function, do not use.
+ *
+ * Decodes an array of integers of the given size and signedness.
+ * Runs of 16 fixints, and runs of 16 integers that all use the full-width header for this size,
+ * are checked and converted without branches, so the compiler can vectorize them.
+ * Everything else is decoded by the regular packmsg_get_*() functions.
+ */
+static inline __attribute__((always_inline)) uint32_t packmsg_get_int_array_(packmsg_input_t *buf, void *__restrict data, uint32_t max, size_t size, bool sign)
+{
+	assert(data || !max);
+
+	uint32_t count = packmsg_get_array(buf);
+
+	if (unlikely(count > max)) {
+		packmsg_input_invalidate(buf);
+		return 0;
+	}
+
+	// The header of integers using all size bytes, for example 0xd2 for int32_t.
+	const uint8_t full = (sign ? 0xd0 : 0xcc) + (size == 1 ? 0 : size == 2 ? 1 : size == 4 ? 2 : 3);
+	const ptrdiff_t stride = size + 1;
+	uint32_t i = 0;
+
+	while (i < count && likely(packmsg_input_ok(buf))) {
+		const uint8_t *__restrict ptr = buf->ptr;
+
+		if (count - i >= 16 && buf->len >= 16) {
+			uint32_t other = 0;
+
+			for (uint32_t j = 0; j < 16; j++)
+				other |= sign ? (uint8_t)(ptr[j] + 32) >= 160 : ptr[j] >= 0x80;
+
+			if (!other) {
+				for (uint32_t j = 0; j < 16; j++)
+					packmsg_store_int_(data, i + j, size, sign ? (uint64_t)(int8_t)ptr[j] : ptr[j]);
+
+				buf->ptr += 16;
+				buf->len -= 16;
+				i += 16;
+				continue;
+			}
+		}
+
+		if (count - i >= 16 && buf->len >= 16 * stride && *ptr == full) {
+			uint32_t other = 0;
+
+			for (uint32_t j = 0; j < 16; j++)
+				other |= ptr[j * stride] != full;
+
+			if (!other) {
+				for (uint32_t j = 0; j < 16; j++)
+					memcpy((uint8_t *)data + (i + j) * size, ptr + j * stride + 1, size);
+
+				buf->ptr += 16 * stride;
+				buf->len -= 16 * stride;
+				i += 16;
+				continue;
+			}
+		}
+
+		uint32_t end = count - i >= 16 ? i + 16 : count;
+
+		for (; i < end; i++)
+			packmsg_store_int_(data, i, size, packmsg_get_int_(buf, size, sign));
+	}
+
+	if (unlikely(!packmsg_input_ok(buf))) {
+		if (count)
+			memset(data, 0, (size_t)count * size);
+
+		return 0;
+	}
+
+	return count;
+}
+
+/** \brief Get an array of int8 values from the input, each as if by packmsg_get_int8().
+ *  \memberof packmsg_input
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ * \param data  A pointer to an array allocated by the application.
+ * \param max   The number of elements the array pointed to by data can hold.
+ *
+ * \return      The number of elements read, or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_int8_array(packmsg_input_t *buf, int8_t *data, uint32_t max)
+{
+	return packmsg_get_int_array_(buf, data, max, 1, true);
+}
+
+/** \brief Get an array of int16 values from the input, each as if by packmsg_get_int16().
+ *  \memberof packmsg_input
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ * \param data  A pointer to an array allocated by the application.
+ * \param max   The number of elements the array pointed to by data can hold.
+ *
+ * \return      The number of elements read, or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_int16_array(packmsg_input_t *buf, int16_t *data, uint32_t max)
+{
+	return packmsg_get_int_array_(buf, data, max, 2, true);
+}
+
+/** \brief Get an array of int32 values from the input, each as if by packmsg_get_int32().
+ *  \memberof packmsg_input
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ * \param data  A pointer to an array allocated by the application.
+ * \param max   The number of elements the array pointed to by data can hold.
+ *
+ * \return      The number of elements read, or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_int32_array(packmsg_input_t *buf, int32_t *data, uint32_t max)
+{
+	return packmsg_get_int_array_(buf, data, max, 4, true);
+}
+
+/** \brief Get an array of int64 values from the input, each as if by packmsg_get_int64().
+ *  \memberof packmsg_input
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ * \param data  A pointer to an array allocated by the application.
+ * \param max   The number of elements the array pointed to by data can hold.
+ *
+ * \return      The number of elements read, or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_int64_array(packmsg_input_t *buf, int64_t *data, uint32_t max)
+{
+	return packmsg_get_int_array_(buf, data, max, 8, true);
+}
+
+/** \brief Get an array of uint8 values from the input, each as if by packmsg_get_uint8().
+ *  \memberof packmsg_input
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ * \param data  A pointer to an array allocated by the application.
+ * \param max   The number of elements the array pointed to by data can hold.
+ *
+ * \return      The number of elements read, or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_uint8_array(packmsg_input_t *buf, uint8_t *data, uint32_t max)
+{
+	return packmsg_get_int_array_(buf, data, max, 1, false);
+}
+
+/** \brief Get an array of uint16 values from the input, each as if by packmsg_get_uint16().
+ *  \memberof packmsg_input
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ * \param data  A pointer to an array allocated by the application.
+ * \param max   The number of elements the array pointed to by data can hold.
+ *
+ * \return      The number of elements read, or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_uint16_array(packmsg_input_t *buf, uint16_t *data, uint32_t max)
+{
+	return packmsg_get_int_array_(buf, data, max, 2, false);
+}
+
+/** \brief Get an array of uint32 values from the input, each as if by packmsg_get_uint32().
+ *  \memberof packmsg_input
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ * \param data  A pointer to an array allocated by the application.
+ * \param max   The number of elements the array pointed to by data can hold.
+ *
+ * \return      The number of elements read, or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_uint32_array(packmsg_input_t *buf, uint32_t *data, uint32_t max)
+{
+	return packmsg_get_int_array_(buf, data, max, 4, false);
+}
+
+/** \brief Get an array of uint64 values from the input, each as if by packmsg_get_uint64().
+ *  \memberof packmsg_input
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ * \param data  A pointer to an array allocated by the application.
+ * \param max   The number of elements the array pointed to by data can hold.
+ *
+ * \return      The number of elements read, or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_uint64_array(packmsg_input_t *buf, uint64_t *data, uint32_t max)
+{
+	return packmsg_get_int_array_(buf, data, max, 8, false);
+}
+
+/** \brief Get an array of float values from the input, each as if by packmsg_get_float().
+ *  \memberof packmsg_input
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ * \param data  A pointer to an array allocated by the application.
+ * \param max   The number of elements the array pointed to by data can hold.
+ *
+ * \return      The number of elements read, or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_float_array(packmsg_input_t *buf, float *__restrict data, uint32_t max)
+{
+	assert(data || !max);
+
+	uint32_t count = packmsg_get_array(buf);
+
+	if (unlikely(count > max)) {
+		packmsg_input_invalidate(buf);
+		return 0;
+	}
+
+	uint32_t i = 0;
+
+	while (i < count && likely(packmsg_input_ok(buf))) {
+		const uint8_t *__restrict ptr = buf->ptr;
+
+		if (count - i >= 16 && buf->len >= 16 * 5 && *ptr == 0xca) {
+			uint32_t other = 0;
+
+			for (uint32_t j = 0; j < 16; j++)
+				other |= ptr[j * 5] != 0xca;
+
+			if (!other) {
+				for (uint32_t j = 0; j < 16; j++)
+					memcpy(data + i + j, ptr + j * 5 + 1, 4);
+
+				buf->ptr += 16 * 5;
+				buf->len -= 16 * 5;
+				i += 16;
+				continue;
+			}
+		}
+
+		uint32_t end = count - i >= 16 ? i + 16 : count;
+
+		for (; i < end; i++)
+			data[i] = packmsg_get_float(buf);
+	}
+
+	if (unlikely(!packmsg_input_ok(buf))) {
+		if (count)
+			memset(data, 0, (size_t)count * sizeof(*data));
+
+		return 0;
+	}
+
+	return count;
+}
+
+/** \brief Get an array of double values from the input, each as if by packmsg_get_double().
+ *  \memberof packmsg_input
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ * \param data  A pointer to an array allocated by the application.
+ * \param max   The number of elements the array pointed to by data can hold.
+ *
+ * \return      The number of elements read, or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_double_array(packmsg_input_t *buf, double *__restrict data, uint32_t max)
+{
+	assert(data || !max);
+
+	uint32_t count = packmsg_get_array(buf);
+
+	if (unlikely(count > max)) {
+		packmsg_input_invalidate(buf);
+		return 0;
+	}
+
+	uint32_t i = 0;
+
+	while (i < count && likely(packmsg_input_ok(buf))) {
+		const uint8_t *__restrict ptr = buf->ptr;
+
+		if (count - i >= 16 && buf->len >= 16 * 9 && *ptr == 0xcb) {
+			uint32_t other = 0;
+
+			for (uint32_t j = 0; j < 16; j++)
+				other |= ptr[j * 9] != 0xcb;
+
+			if (!other) {
+				for (uint32_t j = 0; j < 16; j++)
+					memcpy(data + i + j, ptr + j * 9 + 1, 8);
+
+				buf->ptr += 16 * 9;
+				buf->len -= 16 * 9;
+				i += 16;
+				continue;
+			}
+		}
+
+		uint32_t end = count - i >= 16 ? i + 16 : count;
+
+		for (; i < end; i++)
+			data[i] = packmsg_get_double(buf);
+	}
+
+	if (unlikely(!packmsg_input_ok(buf))) {
+		if (count)
+			memset(data, 0, (size_t)count * sizeof(*data));
+
+		return 0;
+	}
+
+	return count;
+}
+
+/* Typed arrays
+ * ============
+ *
+ * The packmsg_get_*_typed_array() functions return a pointer to the elements of a typed array in the input buffer itself.
+ * If the array has elements of another type, or if the elements are not correctly aligned in memory,
+ * the input iterator is invalidated. Use packmsg_get_typed_array_copy() if the alignment is not guaranteed.
+ */
+
+/** \brief Extension types defined by PackMessage.
+ *
+ * These extension types are used by PackMessage itself,
+ * and are taken from the range reserved for future extensions.
+ */
+enum packmsg_ext_type {
+	PACKMSG_EXT_TYPED_ARRAY = -2, /**< A typed array, see packmsg_add_typed_array(). */
+};
+
+/** \brief The type of the elements of a typed array. */
+enum packmsg_dtype {
+	PACKMSG_DTYPE_INT8,   /**< The elements are of type int8_t. */
+	PACKMSG_DTYPE_INT16,  /**< The elements are of type int16_t. */
+	PACKMSG_DTYPE_INT32,  /**< The elements are of type int32_t. */
+	PACKMSG_DTYPE_INT64,  /**< The elements are of type int64_t. */
+	PACKMSG_DTYPE_UINT8,  /**< The elements are of type uint8_t. */
+	PACKMSG_DTYPE_UINT16, /**< The elements are of type uint16_t. */
+	PACKMSG_DTYPE_UINT32, /**< The elements are of type uint32_t. */
+	PACKMSG_DTYPE_UINT64, /**< The elements are of type uint64_t. */
+	PACKMSG_DTYPE_FLOAT,  /**< The elements are of type float. */
+	PACKMSG_DTYPE_DOUBLE, /**< The elements are of type double. */
+};
+
+/** \brief Get the size of an element of a typed array.
+ *
+ * \param dtype  The type of the elements.
+ *
+ * \return       The size of an element in bytes, or 0 if dtype is not valid.
+ */
+static inline size_t packmsg_dtype_size(enum packmsg_dtype dtype)
+{
+	static const uint8_t sizes[] = {1, 2, 4, 8, 1, 2, 4, 8, 4, 8};
+
+	if ((unsigned)dtype < sizeof sizes)
+		return sizes[dtype];
+	else
+		return 0;
+}
+
+/** \brief Add a typed array to the output.
+ *  \memberof packmsg_output
+ *
+ * This function adds an extension of type PACKMSG_EXT_TYPED_ARRAY, which holds
+ * the type of the elements followed by the raw contents of the array.
+ * This is much more compact and faster to encode and decode than a regular array,
+ * and allows the receiver to access the elements in the input buffer without copying them.
+ *
+ * The contents of the array can be aligned, relative to the start of the message.
+ * In scatter-gather mode, this includes the data referenced by the scatter-gather list.
+ * If the receiver also aligns the start of its input buffer, it can then safely access the elements in place.
+ * To do this, the extension always uses a 32 bit length, and padding is inserted before the elements.
+ *
+ * \param buf    A pointer to an output buffer iterator.
+ * \param dtype  The type of the elements.
+ * \param data   A pointer to the elements to add.
+ * \param count  The number of elements to add.
+ * \param align  The alignment of the elements in bytes, which must be a power of two up to 128,
+ *               or 0 if no alignment is necessary.
+ */
+static inline void packmsg_add_typed_array(packmsg_output_t *buf, enum packmsg_dtype dtype, const void *data, uint32_t count, uint8_t align)
+{
+	assert(data || !count);
+	assert(!(align & (align - 1)) && align <= 128);
+
+	size_t size = packmsg_dtype_size(dtype);
+	uint64_t dlen = (uint64_t)count * size;
+	uint8_t prefix[2] = {(uint8_t)dtype, 0};
+
+	if (unlikely(!size || dlen > 0xffffffff - 2 - 128)) {
+		packmsg_output_invalidate(buf);
+		return;
+	}
+
+	if (align > 1) {
+		// The elements follow a 6 byte ext32 header and the prefix.
+		uintptr_t pos = buf->start ? (uintptr_t)(buf->ptr - buf->start) : (uintptr_t)buf->ptr;
+
+		// In scatter-gather mode, referenced data is part of the message but not of the output buffer.
+		for (size_t i = 0; buf->iov && i < buf->iovcnt; i++) {
+			if (buf->iov[i].iov_base)
+				pos += buf->iov[i].iov_len;
+		}
+
+		prefix[1] = -(pos + 6 + sizeof prefix) & (align - 1);
+		uint32_t extlen = sizeof prefix + prefix[1] + (uint32_t)dlen;
+
+		packmsg_write_hdrdata_(buf, 0xc9, &extlen, 4);
+		packmsg_write_hdr_(buf, (uint8_t)PACKMSG_EXT_TYPED_ARRAY);
+	} else if (!packmsg_write_ext_hdr_(buf, PACKMSG_EXT_TYPED_ARRAY, sizeof prefix + (uint32_t)dlen)) {
+		return;
+	}
+
+	packmsg_write_data_(buf, prefix, sizeof prefix);
+
+	for (uint8_t i = 0; i < prefix[1]; i++)
+		packmsg_write_hdr_(buf, 0);
+
+	if (dlen)
+		packmsg_write_payload_(buf, data, dlen);
+}
+
+/** \brief Get a raw pointer to a typed array from the input.
+ *  \memberof packmsg_input
+ *
+ * This function returns the type and number of elements of a typed array,
+ * and a pointer to the elements in the input buffer itself.
+ * The pointer is not necessarily aligned; use memcpy() to access the elements if that is a concern.
+ *
+ * \param buf         A pointer to an input buffer iterator.
+ * \param[out] dtype  A pointer to an enum packmsg_dtype that will be set to the type of the elements.
+ * \param[out] data   A pointer to a const void pointer that will be set to the start of the elements,
+ *                    or will be set to NULL in case of an error.
+ *
+ * \return            The number of elements in the array,
+ *                    or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_typed_array_raw(packmsg_input_t *buf, enum packmsg_dtype *dtype, const void **data)
+{
+	assert(dtype);
+	assert(data);
+
+	int8_t type;
+	const uint8_t *ext;
+	uint32_t dlen = packmsg_get_ext_raw(buf, &type, (const void **)&ext);
+	size_t size = dlen >= 2 ? packmsg_dtype_size((enum packmsg_dtype)ext[0]) : 0;
+
+	if (likely(type == PACKMSG_EXT_TYPED_ARRAY && size && ext[1] <= dlen - 2 && (dlen - 2 - ext[1]) % size == 0)) {
+		*dtype = (enum packmsg_dtype)ext[0];
+		*data = ext + 2 + ext[1];
+		return (dlen - 2 - ext[1]) / size;
+	} else {
+		packmsg_input_invalidate(buf);
+		*dtype = PACKMSG_DTYPE_INT8;
+		*data = NULL;
+		return 0;
+	}
+}
+
+/** \brief Copy a typed array from the input into another buffer.
+ *  \memberof packmsg_input
+ *
+ * This function copies the elements of a typed array of the given type into a buffer provided by the application.
+ * If the array has elements of another type, or if there are more than max elements, the input iterator is invalidated.
+ *
+ * \param buf    A pointer to an input buffer iterator.
+ * \param dtype  The expected type of the elements.
+ * \param data   A pointer to a buffer allocated by the application.
+ * \param max    The number of elements the buffer pointed to by data can hold.
+ *
+ * \return       The number of elements copied,
+ *               or 0 in case of an error.
+ */
+static inline uint32_t packmsg_get_typed_array_copy(packmsg_input_t *buf, enum packmsg_dtype dtype, void *data, uint32_t max)
+{
+	assert(data || !max);
+
+	enum packmsg_dtype type;
+	const void *elements;
+	uint32_t count = packmsg_get_typed_array_raw(buf, &type, &elements);
+
+	if (likely(packmsg_input_ok(buf) && type == dtype && count <= max)) {
+		memcpy(data, elements, (size_t)count * packmsg_dtype_size(dtype));
+		return count;
+	} else {
+		packmsg_input_invalidate(buf);
+		return 0;
+	}
+}
+
+/** \brief Internal function, do not use. */
+static inline const void *packmsg_get_typed_array_(packmsg_input_t *buf, enum packmsg_dtype dtype, uint32_t *count)
+{
+	assert(count);
+
+	enum packmsg_dtype type;
+	const void *elements;
+	*count = packmsg_get_typed_array_raw(buf, &type, &elements);
+	size_t size = packmsg_dtype_size(dtype);
+
+	if (likely(packmsg_input_ok(buf) && type == dtype && (!*count || !((uintptr_t)elements & (size - 1))))) {
+		return elements;
+	} else {
+		packmsg_input_invalidate(buf);
+		*count = 0;
+		return NULL;
+	}
+}
+
+/** \brief Get a pointer to a typed array of int8_t elements from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf         A pointer to an input buffer iterator.
+ * \param[out] count  A pointer to an uint32_t that will be set to the number of elements,
+ *                    or will be set to 0 in case of an error.
+ *
+ * \return            A pointer to the elements, or NULL in case of an error.
+ */
+static inline const int8_t *packmsg_get_int8_typed_array(packmsg_input_t *buf, uint32_t *count)
+{
+	return (const int8_t *)packmsg_get_typed_array_(buf, PACKMSG_DTYPE_INT8, count);
+}
+
+/** \brief Get a pointer to a typed array of int16_t elements from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf         A pointer to an input buffer iterator.
+ * \param[out] count  A pointer to an uint32_t that will be set to the number of elements,
+ *                    or will be set to 0 in case of an error.
+ *
+ * \return            A pointer to the elements, or NULL in case of an error.
+ */
+static inline const int16_t *packmsg_get_int16_typed_array(packmsg_input_t *buf, uint32_t *count)
+{
+	return (const int16_t *)packmsg_get_typed_array_(buf, PACKMSG_DTYPE_INT16, count);
+}
+
+/** \brief Get a pointer to a typed array of int32_t elements from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf         A pointer to an input buffer iterator.
+ * \param[out] count  A pointer to an uint32_t that will be set to the number of elements,
+ *                    or will be set to 0 in case of an error.
+ *
+ * \return            A pointer to the elements, or NULL in case of an error.
+ */
+static inline const int32_t *packmsg_get_int32_typed_array(packmsg_input_t *buf, uint32_t *count)
+{
+	return (const int32_t *)packmsg_get_typed_array_(buf, PACKMSG_DTYPE_INT32, count);
+}
+
+/** \brief Get a pointer to a typed array of int64_t elements from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf         A pointer to an input buffer iterator.
+ * \param[out] count  A pointer to an uint32_t that will be set to the number of elements,
+ *                    or will be set to 0 in case of an error.
+ *
+ * \return            A pointer to the elements, or NULL in case of an error.
+ */
+static inline const int64_t *packmsg_get_int64_typed_array(packmsg_input_t *buf, uint32_t *count)
+{
+	return (const int64_t *)packmsg_get_typed_array_(buf, PACKMSG_DTYPE_INT64, count);
+}
+
+/** \brief Get a pointer to a typed array of uint8_t elements from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf         A pointer to an input buffer iterator.
+ * \param[out] count  A pointer to an uint32_t that will be set to the number of elements,
+ *                    or will be set to 0 in case of an error.
+ *
+ * \return            A pointer to the elements, or NULL in case of an error.
+ */
+static inline const uint8_t *packmsg_get_uint8_typed_array(packmsg_input_t *buf, uint32_t *count)
+{
+	return (const uint8_t *)packmsg_get_typed_array_(buf, PACKMSG_DTYPE_UINT8, count);
+}
+
+/** \brief Get a pointer to a typed array of uint16_t elements from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf         A pointer to an input buffer iterator.
+ * \param[out] count  A pointer to an uint32_t that will be set to the number of elements,
+ *                    or will be set to 0 in case of an error.
+ *
+ * \return            A pointer to the elements, or NULL in case of an error.
+ */
+static inline const uint16_t *packmsg_get_uint16_typed_array(packmsg_input_t *buf, uint32_t *count)
+{
+	return (const uint16_t *)packmsg_get_typed_array_(buf, PACKMSG_DTYPE_UINT16, count);
+}
+
+/** \brief Get a pointer to a typed array of uint32_t elements from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf         A pointer to an input buffer iterator.
+ * \param[out] count  A pointer to an uint32_t that will be set to the number of elements,
+ *                    or will be set to 0 in case of an error.
+ *
+ * \return            A pointer to the elements, or NULL in case of an error.
+ */
+static inline const uint32_t *packmsg_get_uint32_typed_array(packmsg_input_t *buf, uint32_t *count)
+{
+	return (const uint32_t *)packmsg_get_typed_array_(buf, PACKMSG_DTYPE_UINT32, count);
+}
+
+/** \brief Get a pointer to a typed array of uint64_t elements from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf         A pointer to an input buffer iterator.
+ * \param[out] count  A pointer to an uint32_t that will be set to the number of elements,
+ *                    or will be set to 0 in case of an error.
+ *
+ * \return            A pointer to the elements, or NULL in case of an error.
+ */
+static inline const uint64_t *packmsg_get_uint64_typed_array(packmsg_input_t *buf, uint32_t *count)
+{
+	return (const uint64_t *)packmsg_get_typed_array_(buf, PACKMSG_DTYPE_UINT64, count);
+}
+
+/** \brief Get a pointer to a typed array of float elements from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf         A pointer to an input buffer iterator.
+ * \param[out] count  A pointer to an uint32_t that will be set to the number of elements,
+ *                    or will be set to 0 in case of an error.
+ *
+ * \return            A pointer to the elements, or NULL in case of an error.
+ */
+static inline const float *packmsg_get_float_typed_array(packmsg_input_t *buf, uint32_t *count)
+{
+	return (const float *)packmsg_get_typed_array_(buf, PACKMSG_DTYPE_FLOAT, count);
+}
+
+/** \brief Get a pointer to a typed array of double elements from the input.
+ *  \memberof packmsg_input
+ *
+ * \param buf         A pointer to an input buffer iterator.
+ * \param[out] count  A pointer to an uint32_t that will be set to the number of elements,
+ *                    or will be set to 0 in case of an error.
+ *
+ * \return            A pointer to the elements, or NULL in case of an error.
+ */
+static inline const double *packmsg_get_double_typed_array(packmsg_input_t *buf, uint32_t *count)
+{
+	return (const double *)packmsg_get_typed_array_(buf, PACKMSG_DTYPE_DOUBLE, count);
+}
+
+/** \brief Checks if the next element is a typed array.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_typed_array_raw(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_typed_array(const packmsg_input_t *buf)
+{
+	// Peek at the header, without reading from a copy that could refill an input source.
+	const uint8_t *ptr = packmsg_peek_(buf, 1);
+
+	if (!ptr || packmsg_hdr_info_[*ptr].type != PACKMSG_EXT)
+		return false;
+
+	const packmsg_hdr_info_t *info = &packmsg_hdr_info_[*ptr];
+	size_t hlen = 2 + info->width;
+
+	if (!(ptr = packmsg_peek_(buf, hlen + 2)))
+		return false;
+
+	uint32_t dlen = info->value;
+
+	if (info->width) {
+		dlen = 0;
+		memcpy(&dlen, ptr + 1, info->width);
+	}
+
+	const uint8_t *prefix = ptr + hlen;
+	size_t size = dlen >= 2 ? packmsg_dtype_size((enum packmsg_dtype)prefix[0]) : 0;
+
+	return (int8_t)ptr[hlen - 1] == PACKMSG_EXT_TYPED_ARRAY && size && prefix[1] <= dlen - 2 && (dlen - 2 - prefix[1]) % size == 0
+	       && packmsg_peek_(buf, hlen + dlen);
+}
+
+/* Type checking
+ * =============
+ */
+
+/** \brief Internal function, do not use.
+ *
+ * Returns true if the type of the next element is one of the types in mask.
+ */
+static inline bool packmsg_is_type_(const packmsg_input_t *buf, uint32_t mask)
+{
+	return (mask >> packmsg_hdr_info_[packmsg_peek_hdr_(buf)].type) & 1;
+}
+
+/** \brief Checks if the next element is a NIL.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_nil(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_nil(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, 1u << PACKMSG_NIL);
+}
+
+/** \brief Checks if the next element is a bool.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_nil(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_bool(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, 1u << PACKMSG_BOOL);
+}
+
+/** \brief Checks if the next element is a signed integer that fits in an int8_t.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_int8(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_int8(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, packmsg_sint_types_(PACKMSG_INT8));
+}
+
+/** \brief Checks if the next element is a signed integer that fits in an int16_t.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_int16(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_int16(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, packmsg_sint_types_(PACKMSG_INT16));
+}
+
+/** \brief Checks if the next element is a signed integer that fits in an int32_t.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_int32(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_int32(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, packmsg_sint_types_(PACKMSG_INT32));
+}
+
+/** \brief Checks if the next element is a signed integer that fits in an int64_t.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_int64(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_int64(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, packmsg_sint_types_(PACKMSG_INT64));
+}
+
+/** \brief Checks if the next element is an unsigned integer that fits in an uint8_t.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_uint8(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_uint8(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, packmsg_uint_types_(PACKMSG_UINT8));
+}
+
+/** \brief Checks if the next element is an unsigned integer that fits in an uint16_t.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_uint16(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_uint16(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, packmsg_uint_types_(PACKMSG_UINT16));
+}
+
+/** \brief Checks if the next element is an unsigned integer that fits in an uint32_t.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_uint32(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_uint32(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, packmsg_uint_types_(PACKMSG_UINT32));
+}
+
+/** \brief Checks if the next element is an unsigned integer that fits in an uint64_t.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_uint64(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_uint64(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, packmsg_uint_types_(PACKMSG_UINT64));
+}
+
+/** \brief Checks if the next element is a single precision floating point value.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_float(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_float(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, 1u << PACKMSG_FLOAT);
+}
+
+/** \brief Checks if the next element is a single or double precision floating point value.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_double(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_double(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, 1u << PACKMSG_FLOAT | 1u << PACKMSG_DOUBLE);
+}
+
+/** \brief Checks if the next element is a string.
  *  \memberof packmsg_input
  *
- * This function returns the size of a string and a pointer into the input buffer itself,
- * to a string that is *not NUL-terminated!* This function avoids making a copy of the string,
- * but the application must take care to not read more than the returned number of bytes.
+ * \param buf A pointer to an input buffer iterator.
  *
- * \param buf       A pointer to an input buffer iterator.
- * \param[out] str  A pointer to a const char pointer that will be set to the start of the string,
- *                  or will be set to NULL in case of an error.
- * \return          The size of the string in bytes,
- *                  or 0 in case of an error.
+ * \return True if the next element can be read by packmsg_get_str_*(),
+ *         false if not or if any other error occurred.
  */
-static inline uint32_t packmsg_get_str_raw(packmsg_input_t *buf, const char **str)
+static inline bool packmsg_is_str(const packmsg_input_t *buf)
 {
-	assert(str);
+	return packmsg_is_type_(buf, 1u << PACKMSG_STR);
+}
 
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	uint32_t slen = 0;
-
-	if ((hdr & 0xe0) == 0xa0) {
-		slen = hdr & 0x1f;
-	} else if (hdr == 0xd9) {
-		packmsg_read_data_(buf, &slen, 1);
-	} else if (hdr == 0xda) {
-		packmsg_read_data_(buf, &slen, 2);
-	} else if (hdr == 0xdb) {
-		packmsg_read_data_(buf, &slen, 4);
+/** \brief Checks if the next element is binary data.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_bin_*(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_bin(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, 1u << PACKMSG_BIN);
+}
+
+/** \brief Checks if the next element is extension data.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_ext_*(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_ext(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, 1u << PACKMSG_EXT);
+}
+
+/** \brief Checks if the next element is a map header.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_map(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_map(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, 1u << PACKMSG_MAP);
+}
+
+/** \brief Checks if the next element is an array header.
+ *  \memberof packmsg_input
+ *
+ * \param buf A pointer to an input buffer iterator.
+ *
+ * \return True if the next element can be read by packmsg_get_array(),
+ *         false if not or if any other error occurred.
+ */
+static inline bool packmsg_is_array(const packmsg_input_t *buf)
+{
+	return packmsg_is_type_(buf, 1u << PACKMSG_ARRAY);
+}
+
+/** \brief Checks the type of the next element.
+ *  \memberof packmsg_input
+ *
+ * This function checks the next element and returns an enum packmsg_type
+ * that describes the type of the element. If the input buffer was fully consumed
+ * and there are no more elements left, this function will return PACKMSG_DONE.
+ *
+ * \param buf A pointer to an output buffer iterator.
+ *
+ * \return    The type of the next element, or PACKMSG_DONE if no more elements
+ *            are present in the input buffer, or PACKMSG_ERROR if the next element
+ *            is invalid, or if any other error occurred.
+ */
+static inline enum packmsg_type packmsg_get_type(const packmsg_input_t *buf) {
+	if (unlikely(packmsg_done(buf)))
+		return PACKMSG_DONE;
+
+	return (enum packmsg_type)packmsg_hdr_info_[packmsg_peek_hdr_(buf)].type;
+}
+
+/** \brief Internal function, do not use. */
+static inline void packmsg_input_advance_(packmsg_input_t *buf, uint64_t dlen) {
+	if(packmsg_input_has_(buf, dlen)) {
+		buf->ptr += dlen;
+		buf->len -= dlen;
+	} else if(buf->src) {
+		packmsg_input_skip_(buf, dlen);
 	} else {
 		packmsg_input_invalidate(buf);
-		*str = NULL;
-		return 0;
 	}
+}
 
-	if (likely(buf->len >= slen)) {
-		*str = (const char *)buf->ptr;
-		buf->ptr += slen;
-		buf->len -= slen;
-		return slen;
-	} else {
+/** \brief Internal function, do not use.
+ *
+ * Skips the rest of the element with the given header, and returns the number of elements
+ * contained in it if it is a map or array header.
+ */
+static inline uint64_t packmsg_skip_hdr_(packmsg_input_t *buf, uint8_t hdr) {
+	const packmsg_hdr_info_t *info = &packmsg_hdr_info_[hdr];
+
+	if (unlikely(info->type == PACKMSG_ERROR)) {
 		packmsg_input_invalidate(buf);
-		*str = NULL;
 		return 0;
 	}
+
+	uint32_t dlen = 0;
+
+	if (info->width)
+		packmsg_read_data_(buf, &dlen, info->width);
+
+	if (info->type == PACKMSG_MAP)
+		return 2 * ((uint64_t)dlen + info->value);
+
+	if (info->type == PACKMSG_ARRAY)
+		return (uint64_t)dlen + info->value;
+
+	packmsg_input_advance_(buf, (uint64_t)dlen + info->size);
+	return 0;
 }
 
-/** \brief Copy a string from the input into a newly allocated buffer.
+/** \brief Skip one element in the input
  *  \memberof packmsg_input
  *
- * This function copies a string from the input into a buffer allocated by the library
- * using malloc(). The copy will be NUL-terminated.
- * The application is responsible for freeing the memory of the buffer using free().
+ *  This function skips the next element in the input.
+ *  If the element is a map or an array, only the map or array header is skipped,
+ *  but not the contents of the map or array.
  *
- * \param buf   A pointer to an input buffer iterator.
+ * \param buf A pointer to an output buffer iterator.
+ */
+static inline void packmsg_skip_element(packmsg_input_t *buf) {
+	packmsg_skip_hdr_(buf, packmsg_read_hdr_(buf));
+}
+
+/** \brief Skip one object in the input
+ *  \memberof packmsg_input
  *
- * \return      A pointer to the newly allocated buffer containing a NUL-terminated string,
- *              or NULL in case of an error.
+ *  This function checks the type of the next element.
+ *  In case it is a scalar value (for example, an int or a string),
+ *  it skips just that scalar. If the next element is a map or an array,
+ *  it will skip all the objects in that map or array, including nested maps and arrays.
+ *  This does not use recursion, and every header is read only once.
+ *  If maps and arrays are nested deeper than PACKMSG_MAX_DEPTH,
+ *  the input iterator will be invalidated.
+ *
+ * \param buf A pointer to an output buffer iterator.
  */
-static inline char *packmsg_get_str_dup(packmsg_input_t *buf)
+static inline void packmsg_skip_object(packmsg_input_t *buf) {
+	uint64_t remaining[PACKMSG_MAX_DEPTH];
+	uint32_t depth = 0;
+
+	do {
+		uint64_t count = packmsg_skip_hdr_(buf, packmsg_read_hdr_(buf));
+
+		if(count) {
+			if(unlikely(depth >= PACKMSG_MAX_DEPTH)) {
+				packmsg_input_invalidate(buf);
+				return;
+			}
+
+			remaining[depth++] = count;
+			continue;
+		}
+
+		while(depth && !--remaining[depth - 1]) {
+			depth--;
+		}
+	} while(depth && likely(buf->len >= 0));
+}
+
+/* Validation
+ * ==========
+ */
+
+/** \brief Check that a buffer contains a given number of well-formed objects.
+ *
+ * This function checks in a single pass that the buffer contains exactly count objects,
+ * that every header is valid, that all elements fit inside the buffer,
+ * and that maps and arrays are nested no deeper than max_depth.
+ * The contents of strings, binary data and extension data are not checked.
+ *
+ * Buffers that passed validation can be decoded with bounds checks removed,
+ * by defining PACKMSG_TRUSTED before including packmsg.h.
+ * The application must then only read elements with getters matching their type,
+ * which can be checked using packmsg_get_type() or packmsg_is_*().
+ *
+ * \param data       A pointer to the start of the buffer.
+ * \param len        The size of the buffer in bytes.
+ * \param count      The number of top-level objects the buffer must contain.
+ * \param max_depth  The maximum nesting depth of maps and arrays,
+ *                   which is limited to PACKMSG_MAX_DEPTH.
+ *
+ * \return           True if the buffer is valid, false otherwise.
+ */
+static inline bool packmsg_validate(const void *data, size_t len, uint32_t count, uint32_t max_depth)
 {
-	const char *str;
-	uint32_t slen = packmsg_get_str_raw(buf, &str);
-	if (likely(packmsg_input_ok(buf))) {
-		char *dup = (char *)malloc((size_t) slen + 1);
-		if (likely(dup)) {
-			memcpy(dup, str, slen);
-			dup[slen] = 0;
-			return dup;
+	assert(data || !len);
+
+	const uint8_t *ptr = (const uint8_t *)data;
+	const uint8_t *end = ptr + len;
+	uint64_t remaining[PACKMSG_MAX_DEPTH + 1];
+	uint32_t depth = 0;
+
+	if (max_depth > PACKMSG_MAX_DEPTH)
+		max_depth = PACKMSG_MAX_DEPTH;
+
+	remaining[0] = count;
+
+	while (remaining[depth] || depth) {
+		if (!remaining[depth]) {
+			depth--;
+			continue;
+		}
+
+		remaining[depth]--;
+
+		if (unlikely(ptr == end))
+			return false;
+
+		const packmsg_hdr_info_t *info = &packmsg_hdr_info_[*ptr++];
+
+		if (unlikely(info->type == PACKMSG_ERROR || (size_t)(end - ptr) < info->width))
+			return false;
+
+		uint32_t dlen = 0;
+		memcpy(&dlen, ptr, info->width);
+		ptr += info->width;
+
+		if (info->type == PACKMSG_MAP || info->type == PACKMSG_ARRAY) {
+			uint64_t children = (uint64_t)dlen + info->value;
+
+			if (info->type == PACKMSG_MAP)
+				children *= 2;
+
+			if (children) {
+				// Every element takes at least one byte.
+				if (unlikely(depth >= max_depth || children > (size_t)(end - ptr)))
+					return false;
+
+				remaining[++depth] = children;
+			}
 		} else {
-			packmsg_input_invalidate(buf);
+			uint64_t skip = (uint64_t)dlen + info->size;
+
+			if (unlikely(skip > (size_t)(end - ptr)))
+				return false;
+
+			ptr += skip;
+		}
+	}
+
+	return ptr == end;
+}
+
+/* Record boundaries
+ * =================
+ */
+
+/** \brief Internal function, do not use.
+ *
+ * Returns a pointer just past the object starting at ptr,
+ * or NULL if it is invalid, truncated or nested deeper than PACKMSG_MAX_DEPTH.
+ * Inside maps and arrays, runs of up to 16 fixints are found without branches and skipped at once.
+ */
+static inline const uint8_t *packmsg_scan_object_(const uint8_t *ptr, const uint8_t *end)
+{
+	uint64_t remaining[PACKMSG_MAX_DEPTH];
+	uint32_t depth = 0;
+
+	do {
+		if (unlikely(ptr == end))
 			return NULL;
+
+		uint32_t other = 1;
+
+		if (depth && end - ptr >= 16) {
+			other = 0x10000;
+
+			for (uint32_t j = 0; j < 16; j++) {
+				other |= (uint32_t)((uint8_t)(ptr[j] + 32) >= 160) << j;
+			}
 		}
-	} else {
-		return NULL;
+
+		uint64_t run = __builtin_ctz(other);
+
+		if (run) {
+			if (run > remaining[depth - 1])
+				run = remaining[depth - 1];
+
+			ptr += run;
+			remaining[depth - 1] -= run - 1;
+		} else {
+			const packmsg_hdr_info_t *info = &packmsg_hdr_info_[*ptr++];
+
+			if (unlikely(info->type == PACKMSG_ERROR || (size_t)(end - ptr) < info->width))
+				return NULL;
+
+			uint32_t dlen = 0;
+
+			if (info->width) {
+				memcpy(&dlen, ptr, info->width);
+				ptr += info->width;
+			}
+
+			if (info->type == PACKMSG_MAP || info->type == PACKMSG_ARRAY) {
+				uint64_t count = (uint64_t)dlen + info->value;
+
+				if (info->type == PACKMSG_MAP)
+					count *= 2;
+
+				if (count) {
+					if (unlikely(depth >= PACKMSG_MAX_DEPTH))
+						return NULL;
+
+					remaining[depth++] = count;
+					continue;
+				}
+			} else {
+				uint64_t skip = (uint64_t)dlen + info->size;
+
+				if (unlikely(skip > (size_t)(end - ptr)))
+					return NULL;
+
+				ptr += skip;
+			}
+		}
+
+		while (depth && !--remaining[depth - 1]) {
+			depth--;
+		}
+	} while (depth);
+
+	return ptr;
+}
+
+/** \brief Find the start of every top-level object in a buffer.
+ *
+ * This function scans a buffer of concatenated messages, and stores the offset of each top-level object
+ * from the start of the buffer. It uses the same checks as packmsg_skip_object(),
+ * but works directly on the buffer and skips runs of fixints inside maps and arrays at once,
+ * which makes it considerably faster than calling packmsg_skip_object() in a loop.
+ * Scanning stops at the end of the buffer, at the first invalid or truncated object,
+ * or when max offsets have been stored.
+ *
+ * \param data        A pointer to the start of the buffer.
+ * \param len         The size of the buffer in bytes.
+ * \param[out] offsets  A pointer to an array that will be filled with the offsets of the objects, or NULL.
+ * \param max         The number of elements in the offsets array.
+ * \param[out] used   A pointer to a size_t that will be set to the number of bytes
+ *                    taken up by the objects that were found, or NULL.
+ *                    If this is less than len, the buffer ends with an invalid or truncated object,
+ *                    or there were more than max objects.
+ *
+ * \return            The number of objects found.
+ */
+static inline size_t packmsg_find_boundaries(const void *data, size_t len, size_t *offsets, size_t max, size_t *used)
+{
+	assert(data || !len);
+	assert(offsets || !max);
+
+	const uint8_t *start = (const uint8_t *)data;
+	const uint8_t *ptr = start;
+	const uint8_t *end = start + len;
+	size_t count = 0;
+
+	while (ptr != end && count < max) {
+		const uint8_t *next = packmsg_scan_object_(ptr, end);
+
+		if (unlikely(!next))
+			break;
+
+		offsets[count++] = ptr - start;
+		ptr = next;
+	}
+
+	if (used)
+		*used = ptr - start;
+
+	return count;
+}
+
+/** \brief Count the top-level objects in a buffer.
+ *
+ * This function scans a buffer of concatenated messages like packmsg_find_boundaries(),
+ * without storing the offsets of the objects.
+ *
+ * \param data       A pointer to the start of the buffer.
+ * \param len        The size of the buffer in bytes.
+ * \param[out] used  A pointer to a size_t that will be set to the number of bytes
+ *                   taken up by the objects that were found, or NULL.
+ *                   If this is less than len, the buffer ends with an invalid or truncated object.
+ *
+ * \return           The number of objects found.
+ */
+static inline size_t packmsg_count_records(const void *data, size_t len, size_t *used)
+{
+	assert(data || !len);
+
+	const uint8_t *start = (const uint8_t *)data;
+	const uint8_t *ptr = start;
+	const uint8_t *end = start + len;
+	size_t count = 0;
+
+	while (ptr != end) {
+		const uint8_t *next = packmsg_scan_object_(ptr, end);
+
+		if (unlikely(!next))
+			break;
+
+		count++;
+		ptr = next;
+	}
+
+	if (used)
+		*used = ptr - start;
+
+	return count;
+}
+
+#if defined(PACKMSG_FILE) && !defined(_WIN32)
+/* Memory-mapped files
+ * ===================
+ */
+
+/** \brief A file of concatenated messages, mapped into memory.
+ *
+ * This allows iterating over the top-level objects of files larger than the available memory,
+ * without copying them. The file is mapped read-only with a hint to the kernel that it will be read
+ * sequentially, and transparent huge pages are requested where available.
+ * Each record returned by packmsg_file_next() is an input iterator covering exactly one object,
+ * pointing directly into the mapping. Records stay valid until packmsg_file_close() is called.
+ * UTF-8 validation of strings in all records can be enabled by calling packmsg_input_set_utf8() on the in member.
+ */
+typedef struct packmsg_file {
+	const uint8_t *data; /**< A pointer to the start of the mapping. */
+	size_t size;         /**< The size of the mapping. */
+	packmsg_input_t in;  /**< An input iterator positioned at the next record. */
+} packmsg_file_t;
+
+/** \brief Map a file descriptor into memory.
+ *  \memberof packmsg_file
+ *
+ * The file descriptor is not needed after this function returns, and can be closed by the application.
+ *
+ * \param file  A pointer to a file.
+ * \param fd    A file descriptor of a regular file opened for reading.
+ *
+ * \return      True if the file was mapped, false otherwise, in which case errno is set.
+ */
+static inline bool packmsg_file_open_fd(packmsg_file_t *file, int fd)
+{
+	assert(file);
+
+	struct stat st;
+
+	file->data = (const uint8_t *)"";
+	file->size = 0;
+	packmsg_input_init(&file->in, file->data, 0);
+
+	if (fstat(fd, &st)) {
+		packmsg_input_invalidate(&file->in);
+		return false;
+	}
+
+	if ((uint64_t)st.st_size > PTRDIFF_MAX) {
+		packmsg_input_invalidate(&file->in);
+		errno = EFBIG;
+		return false;
+	}
+
+	if (!st.st_size)
+		return true;
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (data == MAP_FAILED) {
+		packmsg_input_invalidate(&file->in);
+		return false;
 	}
+
+	// These are only hints, failures are harmless.
+	// In strict ISO C mode they are only available if _DEFAULT_SOURCE is defined.
+#ifdef POSIX_MADV_SEQUENTIAL
+	posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_HUGEPAGE
+	madvise(data, st.st_size, MADV_HUGEPAGE);
+#endif
+
+	file->data = (const uint8_t *)data;
+	file->size = st.st_size;
+	packmsg_input_init(&file->in, file->data, file->size);
+	return true;
 }
 
-/** \brief Copy a string from the input into another buffer.
- *  \memberof packmsg_input
- *
- * This function copies a string from the input another buffer provided by the application.
- * The buffer must be long enough to hold the complete string plus a terminating NUL-byte.
- * If the buffer is not long enough, or another error occured,
- * a single NUL-byte will be written to the start of the buffer (if its size is at least one byte).
+/** \brief Map a file into memory.
+ *  \memberof packmsg_file
  *
- * \param buf   A pointer to an input buffer iterator.
- * \param data  A pointer to a buffer allocated by the application.
- * \param dlen  The size of the buffer pointed to by data.
+ * \param file  A pointer to a file.
+ * \param path  The path of a regular file.
  *
- * \return      The size of the string in bytes,
- *              or 0 in case of an error.
+ * \return      True if the file was mapped, false otherwise, in which case errno is set.
  */
-static inline uint32_t packmsg_get_str_copy(packmsg_input_t *buf, void *data, uint32_t dlen)
+static inline bool packmsg_file_open(packmsg_file_t *file, const char *path)
 {
-	assert(data);
+	assert(file);
+	assert(path);
 
-	const char *str;
-	uint32_t slen = packmsg_get_str_raw(buf, &str);
-	if (likely(packmsg_input_ok(buf))) {
-		if (likely(slen < dlen)) {
-			memcpy(data, str, slen);
-			((char *)data)[slen] = 0;
-			return slen;
-		} else {
-			if (dlen)
-				*(char *)data = 0;
-			packmsg_input_invalidate(buf);
-			return 0;
-		}
-	} else {
-		if (dlen)
-			*(char *)data = 0;
-		return 0;
+#ifdef O_CLOEXEC
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+#else
+	int fd = open(path, O_RDONLY);
+#endif
+
+	if (fd == -1) {
+		file->data = (const uint8_t *)"";
+		file->size = 0;
+		packmsg_input_init(&file->in, file->data, 0);
+		packmsg_input_invalidate(&file->in);
+		return false;
 	}
+
+	bool result = packmsg_file_open_fd(file, fd);
+	int saved = errno;
+	close(fd);
+	errno = saved;
+	return result;
 }
 
-/** \brief Get a raw pointer to binary data from the input.
- *  \memberof packmsg_input
+/** \brief Get the next record from a file.
+ *  \memberof packmsg_file
  *
- * This function returns the size of the binary data and a pointer into the input buffer itself.
- * This function avoids making a copy of the binary data,
- * but the application must take care to not read more than the returned number of bytes.
+ * This function skips over the next top-level object in the file, like packmsg_skip_object(),
+ * and initializes an input iterator covering exactly that object.
+ * When it returns false, packmsg_done() can be called on the in member of the file
+ * to distinguish the end of the file from an invalid record.
  *
- * \param buf        A pointer to an input buffer iterator.
- * \param[out] data  A pointer to a const void pointer that will be set to the start of the data,
- *                   or will be set to NULL in case of an error.
- * \return           The size of the data in bytes,
- *                   or 0 in case of an error.
+ * \param file    A pointer to a file.
+ * \param record  A pointer to an input buffer iterator that will be initialized.
+ *
+ * \return        True if a record was found, false at the end of the file or in case of an error.
  */
-static inline uint32_t packmsg_get_bin_raw(packmsg_input_t *buf, const void **data)
+static inline bool packmsg_file_next(packmsg_file_t *file, packmsg_input_t *record)
 {
-	assert(data);
+	assert(file);
+	assert(record);
 
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	uint32_t dlen = 0;
+	const uint8_t *start = file->in.ptr;
 
-	if (hdr == 0xc4) {
-		packmsg_read_data_(buf, &dlen, 1);
-	} else if (hdr == 0xc5) {
-		packmsg_read_data_(buf, &dlen, 2);
-	} else if (hdr == 0xc6) {
-		packmsg_read_data_(buf, &dlen, 4);
-	} else {
-		packmsg_input_invalidate(buf);
-		*data = NULL;
-		return 0;
+	if (packmsg_done(&file->in) || !packmsg_input_ok(&file->in)) {
+		packmsg_input_init(record, start, 0);
+		packmsg_input_invalidate(record);
+		return false;
 	}
 
-	if (likely(buf->len >= dlen)) {
-		*data = buf->ptr;
-		buf->ptr += dlen;
-		buf->len -= dlen;
-		return dlen;
-	} else {
-		packmsg_input_invalidate(buf);
-		*data = NULL;
-		return 0;
+	const uint8_t *end = packmsg_scan_object_(start, start + file->in.len);
+
+	if (unlikely(!end)) {
+		packmsg_input_invalidate(&file->in);
+		packmsg_input_init(record, start, 0);
+		packmsg_input_invalidate(record);
+		return false;
 	}
+
+	file->in.ptr = end;
+	file->in.len -= end - start;
+	packmsg_input_init(record, start, end - start);
+	record->utf8 = file->in.utf8;
+	return true;
 }
 
-/** \brief Copy binary data from the input into a newly allocated buffer.
- *  \memberof packmsg_input
+/** \brief Unmap a file.
+ *  \memberof packmsg_file
  *
- * This function copies binary data from the input into a buffer allocated by the library
- * using malloc().
- * The application is responsible for freeing the memory of the buffer using free().
- *
- * \param buf        A pointer to an input buffer iterator.
- * \param[out] dlen  A pointer to an uint32_t that will be set to the size of the binary data.
+ * All records returned by packmsg_file_next() become invalid.
  *
- * \return           A pointer to the newly allocated buffer containing the binary data,
- *                   or NULL in case of an error.
+ * \param file  A pointer to a file.
  */
-static inline void *packmsg_get_bin_dup(packmsg_input_t *buf, uint32_t *dlen)
+static inline void packmsg_file_close(packmsg_file_t *file)
 {
-	const void *data;
-	*dlen = packmsg_get_bin_raw(buf, &data);
-	if (likely(packmsg_input_ok(buf))) {
-		char *dup = (char *)malloc(*dlen);
-		if (likely(dup)) {
-			memcpy(dup, data, *dlen);
-			return dup;
-		} else {
-			*dlen = 0;
-			packmsg_input_invalidate(buf);
-			return NULL;
-		}
-	} else {
-		return NULL;
-	}
+	assert(file);
+
+	if (file->size)
+		munmap((void *)file->data, file->size);
+
+	file->data = (const uint8_t *)"";
+	file->size = 0;
+	packmsg_input_init(&file->in, file->data, 0);
+	packmsg_input_invalidate(&file->in);
 }
+#endif
 
-/** \brief Copy binary data from the input into another buffer.
- *  \memberof packmsg_input
+#ifdef PACKMSG_PARALLEL
+/* Parallel decoding
+ * =================
+ */
+
+/** \brief Callback that decodes one record.
  *
- * This function copies binary data from the input another buffer provided by the application.
- * The buffer must be long enough to hold all the binary data.
+ * This function is called concurrently from multiple threads, each time with an input iterator
+ * covering exactly one top-level object.
  *
- * \param buf     A pointer to an input buffer iterator.
- * \param rawbuf  A pointer to a buffer allocated by the application.
- * \param rlen    The size of the buffer pointed to by data.
+ * \param ctx     The context pointer from the packmsg_parallel_t.
+ * \param record  A pointer to an input iterator covering the record.
+ * \param index   The position of the record in the buffer, starting at 0.
+ * \param thread  The number of the calling thread, from 0 up to the number of threads,
+ *                which can be used to index per-thread state.
  *
- * \return      The size of the binary data in bytes,
- *              or 0 in case of an error.
+ * \return        True to continue, false to stop decoding.
  */
-static inline uint32_t packmsg_get_bin_copy(packmsg_input_t *buf, void *rawbuf, uint32_t rlen)
-{
-	assert(rawbuf);
-
-	const void *data;
-	uint32_t dlen = packmsg_get_bin_raw(buf, &data);
-	if (likely(packmsg_input_ok(buf))) {
-		if (likely(dlen <= rlen)) {
-			memcpy(rawbuf, data, dlen);
-			return dlen;
-		} else {
-			packmsg_input_invalidate(buf);
-			return 0;
-		}
-	} else {
-		return 0;
-	}
-}
+typedef bool (*packmsg_record_cb_t)(void *ctx, packmsg_input_t *record, uint64_t index, unsigned thread);
 
-/** \brief Get a raw pointer to extension data from the input.
- *  \memberof packmsg_input
+/** \brief Callback that is called in order after a range of records has been decoded.
  *
- * This function returns the type of the extension, the size of the data
- * and a pointer into the input buffer itself.
- * This function avoids making a copy of the binary data,
- * but the application must take care to not read more than the returned number of bytes.
+ * Calls to this function are serialized, and are made in the order of the records in the buffer.
+ * They are made without holding any internal locks, so other threads keep decoding in the meantime.
  *
- * \param buf        A pointer to an input buffer iterator.
- * \param[out] type  A pointer to an int8_t that will be set to the type of the extension.
- *                   or will be set to 0 in case of an error.
- * \param[out] data  A pointer to a const void pointer that will be set to the start of the data,
- *                   or will be set to NULL in case of an error.
+ * \param ctx    The context pointer from the packmsg_parallel_t.
+ * \param first  The index of the first record in the range.
+ * \param count  The number of records in the range.
+ */
+typedef void (*packmsg_ordered_cb_t)(void *ctx, uint64_t first, uint64_t count);
+
+/** \brief Parameters for packmsg_parallel_decode(). */
+typedef struct packmsg_parallel {
+	packmsg_record_cb_t decode;   /**< The callback that decodes each record. */
+	packmsg_ordered_cb_t ordered; /**< The callback that is called in order after each range of records, or NULL. */
+	void *ctx;                    /**< A context pointer that is passed to the callbacks. */
+	unsigned threads;             /**< The number of threads to use, or 0 to use one per online processor. */
+	size_t chunk_size;            /**< The approximate number of bytes in each range of records handed to a thread, or 0 for 1 MiB. */
+} packmsg_parallel_t;
+
+/** \brief Internal type, do not use. */
+typedef struct packmsg_chunk_ {
+	size_t offset;  /**< The offset of the first record from the start of the buffer. */
+	size_t len;     /**< The size of all records in the chunk. */
+	uint64_t first; /**< The index of the first record. */
+	uint64_t count; /**< The number of records. */
+	bool done;      /**< Whether all records have been decoded. */
+} packmsg_chunk_t_;
+
+/** \brief Internal type, do not use. */
+typedef struct packmsg_parallel_state_ {
+	const packmsg_parallel_t *par; /**< The parameters. */
+	const uint8_t *data;           /**< A pointer to the start of the buffer. */
+	packmsg_chunk_t_ *chunks;      /**< The chunks found so far. */
+	size_t ready;                  /**< The number of chunks found by the scanner. */
+	size_t next;                   /**< The next chunk to be decoded. */
+	size_t next_ordered;           /**< The next chunk to pass to the ordered callback. */
+	bool emitting;                 /**< Whether a thread is calling the ordered callback. */
+	bool scanned;                  /**< Whether the scanner has finished. */
+	bool failed;                   /**< Whether a callback asked to stop. */
+	unsigned thread;               /**< The number of the next thread to start. */
+	pthread_mutex_t lock;          /**< Protects all other members. */
+	pthread_cond_t cond;           /**< Signalled when chunks are found or decoding stops. */
+} packmsg_parallel_state_t_;
+
+/** \brief Internal function, do not use.
  *
- * \return           The size of the data in bytes,
- *                   or 0 in case of an error.
+ * Decodes chunks until there are none left.
  */
-static inline uint32_t packmsg_get_ext_raw(packmsg_input_t *buf, int8_t *type, const void **data)
+static inline void *packmsg_parallel_worker_(void *arg)
 {
-	assert(type);
-	assert(data);
+	packmsg_parallel_state_t_ *state = (packmsg_parallel_state_t_ *)arg;
+	const packmsg_parallel_t *par = state->par;
 
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	uint32_t dlen = 0;
+	pthread_mutex_lock(&state->lock);
+	unsigned thread = state->thread++;
 
-	if (hdr == 0xc7) {
-		packmsg_read_data_(buf, &dlen, 1);
-	} else if (hdr == 0xc8) {
-		packmsg_read_data_(buf, &dlen, 2);
-	} else if (hdr == 0xc9) {
-		packmsg_read_data_(buf, &dlen, 4);
-	} else if (hdr >= 0xd4 && hdr <= 0xd8) {
-		dlen = 1 << (hdr - 0xd4);
-	} else {
-		packmsg_input_invalidate(buf);
-		*type = 0;
-		*data = NULL;
-		return 0;
-	}
+	while (true) {
+		while (state->next == state->ready && !state->scanned && !state->failed) {
+			pthread_cond_wait(&state->cond, &state->lock);
+		}
 
-	*type = packmsg_read_hdr_(buf);
+		if (state->next == state->ready || state->failed)
+			break;
 
-	if (likely(buf->len >= dlen)) {
-		*data = buf->ptr;
-		buf->ptr += dlen;
-		buf->len -= dlen;
-		return dlen;
-	} else {
-		packmsg_input_invalidate(buf);
-		*type = 0;
-		*data = NULL;
-		return 0;
+		packmsg_chunk_t_ *chunk = &state->chunks[state->next++];
+		pthread_mutex_unlock(&state->lock);
+
+		packmsg_input_t in;
+		packmsg_input_init(&in, state->data + chunk->offset, chunk->len);
+		bool ok = true;
+
+		for (uint64_t i = 0; i < chunk->count && ok; i++) {
+			const uint8_t *start = in.ptr;
+			packmsg_skip_object(&in);
+
+			packmsg_input_t record;
+			packmsg_input_init(&record, start, in.ptr - start);
+			ok = par->decode(par->ctx, &record, chunk->first + i, thread);
+		}
+
+		pthread_mutex_lock(&state->lock);
+		chunk->done = true;
+
+		if (!ok) {
+			state->failed = true;
+			pthread_cond_broadcast(&state->cond);
+		}
+
+		// Only one thread at a time passes finished chunks to the ordered callback, without holding the lock.
+		// Chunks finished by other threads in the meantime are picked up before it stops emitting.
+		if (par->ordered && !state->emitting) {
+			state->emitting = true;
+
+			while (!state->failed && state->next_ordered < state->ready && state->chunks[state->next_ordered].done) {
+				size_t first = state->next_ordered;
+				size_t last = first;
+
+				while (last < state->ready && state->chunks[last].done) {
+					last++;
+				}
+
+				pthread_mutex_unlock(&state->lock);
+
+				for (size_t i = first; i < last; i++) {
+					par->ordered(par->ctx, state->chunks[i].first, state->chunks[i].count);
+				}
+
+				pthread_mutex_lock(&state->lock);
+				state->next_ordered = last;
+			}
+
+			state->emitting = false;
+		}
 	}
+
+	pthread_mutex_unlock(&state->lock);
+	return NULL;
 }
 
-/** \brief Copy extension data from the input into a newly allocated buffer.
- *  \memberof packmsg_input
+/** \brief Decode a buffer of concatenated messages using multiple threads.
+ *  \memberof packmsg_parallel
  *
- * This function copies extension data from the input into a buffer allocated by the library
- * using malloc().
- * The application is responsible for freeing the memory of the buffer using free().
+ * The buffer is split into ranges of whole records of about chunk_size bytes,
+ * by finding the record boundaries in the same way as packmsg_find_boundaries().
+ * While the buffer is being split, the other threads already start decoding the ranges found so far.
+ * Each thread takes the next range that has not been decoded yet, and calls the decode callback
+ * for every record in it. The calling thread also takes part in decoding once the buffer has been split.
  *
- * \param buf        A pointer to an input buffer iterator.
- * \param[out] type  A pointer to an int8_t that will be set to the type of the extension.
- *                   or will be set to 0 in case of an error.
- * \param[out] dlen  A pointer to an uint32_t that will be set to the size of the extension data,
- *                   or will be set to 0 in case of an error.
+ * Records can thus be decoded in any order. If the ordered callback is set, it is called
+ * once for each range of records after all of them have been decoded, in the order of the buffer,
+ * so results can be collected or written out in order.
  *
- * \return           A pointer to the newly allocated buffer containing the extension data,
- *                   or NULL in case of an error.
+ * Decoding stops early if a callback returns false, or if an invalid record is found.
+ * In the latter case, all records before the invalid one are still decoded.
+ *
+ * \param par   A pointer to the parameters.
+ * \param data  A pointer to the start of the buffer.
+ * \param len   The size of the buffer in bytes.
+ *
+ * \return      True if all records were decoded, false otherwise.
  */
-static inline void *packmsg_get_ext_dup(packmsg_input_t *buf, int8_t *type, uint32_t *dlen)
+static inline bool packmsg_parallel_decode(const packmsg_parallel_t *par, const void *data, size_t len)
 {
-	assert(type);
+	assert(par);
+	assert(par->decode);
+	assert(data || !len);
 
-	const void *data;
-	*dlen = packmsg_get_ext_raw(buf, type, &data);
-	if (likely(packmsg_input_ok(buf))) {
-		char *dup = (char *)malloc(*dlen);
-		if (likely(dup)) {
-			memcpy(dup, data, *dlen);
-			return dup;
-		} else {
-			*type = 0;
-			*dlen = 0;
-			packmsg_input_invalidate(buf);
-			return NULL;
+	packmsg_parallel_state_t_ state;
+	size_t chunk_size = par->chunk_size ? par->chunk_size : 1 << 20;
+	unsigned threads = par->threads;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	if (!threads) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = online > 0 ? online : 1;
+	}
+#endif
+
+	if (!threads)
+		threads = 1;
+
+	// Every chunk except the last one is at least chunk_size bytes long.
+	size_t max = len / chunk_size + 1;
+
+	state.par = par;
+	state.data = (const uint8_t *)data;
+	state.chunks = (packmsg_chunk_t_ *)malloc(max * sizeof(*state.chunks));
+	state.ready = 0;
+	state.next = 0;
+	state.next_ordered = 0;
+	state.emitting = false;
+	state.scanned = false;
+	state.failed = false;
+	state.thread = 0;
+
+	if (!state.chunks)
+		return false;
+
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.cond, NULL);
+
+	pthread_t *workers = (pthread_t *)malloc(threads * sizeof(*workers));
+	unsigned started = 0;
+
+	while (workers && started < threads - 1 && !pthread_create(&workers[started], NULL, packmsg_parallel_worker_, &state)) {
+		started++;
+	}
+
+	const uint8_t *ptr = state.data;
+	const uint8_t *end = state.data + len;
+	uint64_t index = 0;
+	bool valid = true;
+
+	while (valid && ptr != end) {
+		packmsg_chunk_t_ chunk;
+		chunk.offset = ptr - state.data;
+		chunk.len = 0;
+		chunk.first = index;
+		chunk.done = false;
+
+		do {
+			ptr = packmsg_scan_object_(ptr, end);
+
+			if (unlikely(!ptr)) {
+				valid = false;
+				break;
+			}
+
+			chunk.len = ptr - state.data - chunk.offset;
+			index++;
+		} while (ptr != end && chunk.len < chunk_size);
+
+		chunk.count = index - chunk.first;
+
+		if (!chunk.count)
+			break;
+
+		pthread_mutex_lock(&state.lock);
+
+		if (state.failed) {
+			pthread_mutex_unlock(&state.lock);
+			break;
 		}
-	} else {
-		*type = 0;
-		*dlen = 0;
-		return NULL;
+
+		state.chunks[state.ready++] = chunk;
+		pthread_cond_signal(&state.cond);
+		pthread_mutex_unlock(&state.lock);
+	}
+
+	pthread_mutex_lock(&state.lock);
+	state.scanned = true;
+	pthread_cond_broadcast(&state.cond);
+	pthread_mutex_unlock(&state.lock);
+
+	packmsg_parallel_worker_(&state);
+
+	for (unsigned i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
 	}
+
+	free(workers);
+	free(state.chunks);
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.lock);
+
+	return valid && !state.failed;
 }
+#endif
 
-/** \brief Copy extension data from the input into another buffer.
+/* Map lookup
+ * ==========
+ */
+
+/** \brief Find a key in a map.
  *  \memberof packmsg_input
  *
- * This function copies extension data from the input another buffer provided by the application.
- * The buffer must be long enough to hold all the extension data.
+ * This function reads a map header, and then compares the keys of the map with the given string,
+ * skipping non-matching keys and their values without decoding them.
+ * If the key is found, the input iterator is positioned at the corresponding value,
+ * and the remaining pairs of the map follow after the value.
+ * If the key is not found, the whole map has been consumed.
+ * Keys that are not strings never match.
+ * To look up several keys in the same map, the input iterator can be copied before calling this function,
+ * or a hashed view can be built with packmsg_map_view_build().
  *
- * \param buf        A pointer to an input buffer iterator.
- * \param[out] type  A pointer to an int8_t that will be set to the type of the extension.
- *                   or will be set to 0 in case of an error.
- * \param rawbuf     A pointer to a buffer allocated by the application.
- * \param rlen       The size of the buffer pointed to by data.
+ * \param buf     A pointer to an input buffer iterator.
+ * \param key     A pointer to the key to find.
+ * \param keylen  The length of the key in bytes.
  *
- * \return           The size of the extension data in bytes,
- *                   or 0 in case of an error.
+ * \return        True if the key was found, false if it was not found or if an error occurred.
  */
-static inline uint32_t packmsg_get_ext_copy(packmsg_input_t *buf, int8_t *type, void *rawbuf, uint32_t rlen)
+static inline bool packmsg_map_find(packmsg_input_t *buf, const char *key, uint32_t keylen)
 {
-	assert(type);
-	assert(rawbuf);
+	assert(buf);
+	assert(key || !keylen);
 
-	const void *data;
-	uint32_t dlen = packmsg_get_ext_raw(buf, type, &data);
-	if (likely(packmsg_input_ok(buf))) {
-		if (likely(dlen <= rlen)) {
-			memcpy(rawbuf, data, dlen);
-			return dlen;
+	uint32_t count = packmsg_get_map(buf);
+
+	while (count-- && likely(buf->len >= 0)) {
+		if (packmsg_is_str(buf)) {
+			const char *str;
+			uint32_t slen = packmsg_get_str_raw(buf, &str);
+
+			if (slen == keylen && likely(buf->len >= 0) && (!keylen || !memcmp(str, key, keylen))) {
+				return true;
+			}
 		} else {
-			*type = 0;
-			packmsg_input_invalidate(buf);
-			return 0;
+			packmsg_skip_object(buf);
 		}
-	} else {
-		*type = 0;
-		return 0;
+
+		packmsg_skip_object(buf);
 	}
+
+	return false;
 }
 
-/** \brief Get a map header from the output.
- *  \memberof packmsg_input
+/** \brief A slot in a hashed map view. */
+typedef struct packmsg_map_slot {
+	const char *key;      /**< A pointer to the key, or NULL if the slot is empty. */
+	const uint8_t *value; /**< A pointer to the encoded value. */
+	uint32_t keylen;      /**< The length of the key in bytes. */
+	uint32_t valuelen;    /**< The length of the encoded value in bytes. */
+	uint32_t hash;        /**< The hash of the key. */
+} packmsg_map_slot_t;
+
+/** \brief Hashed view of the keys of a map.
  *
- * This function only reads a map header, and returns the number of key-value
- * pairs in the map.
- * These key-value pairs have to be read by the application using regular
- * packmsg_get_*() calls.
+ * This is an open-addressing hash table of the string keys of a map, pointing into the input buffer,
+ * built in one pass with packmsg_map_view_build(). Afterwards, packmsg_map_view_find()
+ * looks up keys in constant time on average.
+ * It has to be initialized with packmsg_map_view_init() with an array of slots allocated by the application.
+ */
+typedef struct packmsg_map_view {
+	packmsg_map_slot_t *slots; /**< The array of slots. */
+	uint32_t size;             /**< The number of slots, a power of two. */
+	uint32_t count;            /**< The number of keys in the view. */
+	bool utf8;                 /**< Whether strings in values must be valid UTF-8, taken from the input iterator the view was built from. */
+} packmsg_map_view_t;
+
+/** \brief Internal function, do not use. */
+static inline uint32_t packmsg_hash_(const char *key, uint32_t keylen)
+{
+	uint32_t hash = 2166136261u;
+
+	for (uint32_t i = 0; i < keylen; i++) {
+		hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+/** \brief Initialize a hashed map view.
+ *  \memberof packmsg_map_view
  *
- * \param buf    A pointer to an input buffer iterator.
+ * \param view   A pointer to a hashed map view.
+ * \param slots  A pointer to an array of slots.
+ * \param size   The number of slots in the array, which must be a power of two.
+ *               At most half of the slots can be used.
+ */
+static inline void packmsg_map_view_init(packmsg_map_view_t *view, packmsg_map_slot_t *slots, uint32_t size)
+{
+	assert(view);
+	assert(slots || !size);
+	assert(!(size & (size - 1)));
+
+	view->slots = slots;
+	view->size = size;
+	view->count = 0;
+	view->utf8 = false;
+}
+
+/** \brief Build a hashed view of the next map in the input.
+ *  \memberof packmsg_map_view
  *
- * \return       The number of key-value pairs in the map.
+ * This function consumes the whole map, and records the position of every value with a string key.
+ * If a key occurs more than once, the first one is used, like packmsg_map_find() does.
+ * The view points into the input buffer, which must stay valid as long as the view is used.
+ * If the map has more keys than half the number of slots, if it is invalid,
+ * or if the input iterator is reading from a packmsg_source_t, the input iterator will be invalidated.
+ *
+ * \param buf   A pointer to an input buffer iterator.
+ * \param view  A pointer to a hashed map view.
+ *
+ * \return      True if the view was built successfully, false otherwise.
  */
-static inline uint32_t packmsg_get_map(packmsg_input_t *buf)
+static inline bool packmsg_map_view_build(packmsg_input_t *buf, packmsg_map_view_t *view)
 {
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	if ((hdr & 0xf0) == 0x80) {
-		return hdr & 0xf;
-	} else if (hdr == 0xde) {
-		uint32_t dlen = 0;
-		packmsg_read_data_(buf, &dlen, 2);
-		return dlen;
-	} else if (hdr == 0xdf) {
-		uint32_t dlen = 0;
-		packmsg_read_data_(buf, &dlen, 4);
-		return dlen;
-	} else {
+	assert(buf);
+	assert(view);
+
+	view->count = 0;
+	view->utf8 = buf->utf8;
+
+	for (uint32_t i = 0; i < view->size; i++) {
+		view->slots[i].key = NULL;
+	}
+
+	if (unlikely(buf->src != NULL)) {
 		packmsg_input_invalidate(buf);
-		return 0;
+		return false;
+	}
+
+	uint32_t count = packmsg_get_map(buf);
+
+	if (unlikely(count > view->size / 2)) {
+		packmsg_input_invalidate(buf);
+		return false;
+	}
+
+	while (count-- && likely(buf->len >= 0)) {
+		if (!packmsg_is_str(buf)) {
+			packmsg_skip_object(buf);
+			packmsg_skip_object(buf);
+			continue;
+		}
+
+		const char *key;
+		uint32_t keylen = packmsg_get_str_raw(buf, &key);
+		const uint8_t *value = buf->ptr;
+		packmsg_skip_object(buf);
+
+		if (unlikely(buf->len < 0)) {
+			break;
+		}
+
+		uint32_t hash = packmsg_hash_(key, keylen);
+		uint32_t i = hash & (view->size - 1);
+
+		for (; view->slots[i].key; i = (i + 1) & (view->size - 1)) {
+			if (view->slots[i].hash == hash && view->slots[i].keylen == keylen && (!keylen || !memcmp(view->slots[i].key, key, keylen))) {
+				break;
+			}
+		}
+
+		if (view->slots[i].key) {
+			continue;
+		}
+
+		view->slots[i].key = key ? key : "";
+		view->slots[i].value = value;
+		view->slots[i].keylen = keylen;
+		view->slots[i].valuelen = buf->ptr - value;
+		view->slots[i].hash = hash;
+		view->count++;
 	}
+
+	return likely(buf->len >= 0);
 }
 
-/** \brief Get an array header from the output.
- *  \memberof packmsg_input
+/** \brief Find a key in a hashed map view.
+ *  \memberof packmsg_map_view
  *
- * This function only reads an array header, and returns the number of elements
- * in the array.
- * These elements have to be read by the application using regular
- * packmsg_get_*() calls.
+ * If the key is found, the input iterator is initialized to cover exactly the corresponding value,
+ * so it can be decoded with the regular packmsg_get_*() functions.
+ * If the key is not found, the input iterator will be invalid.
  *
- * \param buf    A pointer to an input buffer iterator.
+ * \param view    A pointer to a hashed map view.
+ * \param key     A pointer to the key to find.
+ * \param keylen  The length of the key in bytes.
+ * \param buf     A pointer to an input buffer iterator that will be initialized.
  *
- * \return       The number of elements in the array.
+ * \return        True if the key was found, false otherwise.
  */
-static inline uint32_t packmsg_get_array(packmsg_input_t *buf)
+static inline bool packmsg_map_view_find(const packmsg_map_view_t *view, const char *key, uint32_t keylen, packmsg_input_t *buf)
 {
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	if ((hdr & 0xf0) == 0x90) {
-		return hdr & 0xf;
-	} else if (hdr == 0xdc) {
-		uint32_t dlen = 0;
-		packmsg_read_data_(buf, &dlen, 2);
-		return dlen;
-	} else if (hdr == 0xdd) {
-		uint32_t dlen = 0;
-		packmsg_read_data_(buf, &dlen, 4);
-		return dlen;
-	} else {
-		packmsg_input_invalidate(buf);
-		return 0;
+	assert(view);
+	assert(key || !keylen);
+	assert(buf);
+
+	if (likely(view->count)) {
+		uint32_t hash = packmsg_hash_(key, keylen);
+
+		for (uint32_t i = hash & (view->size - 1); view->slots[i].key; i = (i + 1) & (view->size - 1)) {
+			const packmsg_map_slot_t *slot = &view->slots[i];
+
+			if (slot->hash == hash && slot->keylen == keylen && (!keylen || !memcmp(slot->key, key, keylen))) {
+				packmsg_input_init(buf, slot->value, slot->valuelen);
+				buf->utf8 = view->utf8;
+				return true;
+			}
+		}
 	}
+
+	packmsg_input_init(buf, "", 0);
+	packmsg_input_invalidate(buf);
+	return false;
 }
 
-/* Type checking
- * =============
+/* Incremental decoding
+ * ====================
  */
 
-/** \brief An enum describing the type of an element in a PackMessage message.
- *
- * This enum describes the type of an element in a PackMessage message.
- * In case of integers and floating point values, the type normally represents
- * the smallest type that can succesfully hold the value of the element;
- * i.e. an element of type PACKMSG_INT32 can only succesfully be read by
- * packmsg_get_int32() or packmsg_get_int64(). However, the converse it not true;
- * for an element of type PACKMSG_INT32, there is no guarantee
- * that the value is larger than would fit into an int16_t.
- *
- * PackMessage makes a clear distinction between signed and unsigned integers,
- * except in the case of positive fixints (values between 0 and 127 inclusive),
- * which can be read as both signed and unsigned.
- */
-enum packmsg_type {
-	PACKMSG_ERROR,            /**< An invalid element was found or the input buffer is in an invalid state. */
-	PACKMSG_NIL,              /**< The next element is a NIL. */
-	PACKMSG_BOOL,             /**< The next element is a boolean. */
-	PACKMSG_POSITIVE_FIXINT,  /**< The next element is an integer between 0 and 127 inclusive. */
-	PACKMSG_INT8,             /**< The next element is a signed integer that fits in an int8_t. */
-	PACKMSG_INT16,            /**< The next element is a signed integer that fits in an int16_t. */
-	PACKMSG_INT32,            /**< The next element is a signed integer that fits in an int32_t. */
-	PACKMSG_INT64,            /**< The next element is a signed integer that fits in an int64_t. */
-	PACKMSG_UINT8,            /**< The next element is an unsigned integer that fits in an uint8_t. */
-	PACKMSG_UINT16,           /**< The next element is an unsigned integer that fits in an uint16_t. */
-	PACKMSG_UINT32,           /**< The next element is an unsigned integer that fits in an uint32_t. */
-	PACKMSG_UINT64,           /**< The next element is an unsigned integer that fits in an uint64_t. */
-	PACKMSG_FLOAT,            /**< The next element is a single precision floating point value. */
-	PACKMSG_DOUBLE,           /**< The next element is a double precision floating point value. */
-	PACKMSG_STR,              /**< The next element is a string. */
-	PACKMSG_BIN,              /**< The next element is binary data. */
-	PACKMSG_EXT,              /**< The next element is extension data. */
-	PACKMSG_MAP,              /**< The next element is a map header. */
-	PACKMSG_ARRAY,            /**< The next element is an array header. */
-	PACKMSG_DONE,             /**< There are no more elements in the input buffer. */
+/** \brief The result of feeding data to an incremental decoder. */
+enum packmsg_stream_status {
+	PACKMSG_STREAM_ERROR,    /**< The input is invalid, or nested too deeply. */
+	PACKMSG_STREAM_MORE,     /**< All data was consumed, but the current message is not complete yet. */
+	PACKMSG_STREAM_COMPLETE, /**< A complete message was consumed. */
 };
 
-/** \brief Checks if the next element is a NIL.
- *  \memberof packmsg_input
+/** \brief State of an incremental decoder.
  *
- * \param buf A pointer to an input buffer iterator.
+ * This keeps track of the structure of a message that is received in arbitrary chunks,
+ * for example from a network socket, so the application knows when a complete message
+ * has been received, without having to rescan the message from the start on every read.
+ * It has to be initialized with packmsg_stream_init(), and data is passed to it with packmsg_stream_feed().
+ */
+typedef struct packmsg_stream {
+	uint64_t remaining[PACKMSG_MAX_DEPTH + 1]; /**< The number of objects left at each nesting level. */
+	uint32_t depth;                            /**< The current nesting level. */
+	uint8_t hdr[5];                            /**< A header that has only been partially received. */
+	uint8_t hdrlen;                            /**< The number of bytes of the header received so far. */
+	uint8_t hdrneed;                           /**< The total size of the header. */
+	uint64_t skip;                             /**< The number of bytes of data of the current element still to be received. */
+	size_t size;                               /**< The number of bytes of the current message received so far. */
+	bool error;                                /**< Whether an error occurred. */
+} packmsg_stream_t;
+
+/** \brief Initialize an incremental decoder.
+ *  \memberof packmsg_stream
  *
- * \return True if the next element can be read by packmsg_get_nil(),
- *         false if not or if any other error occurred.
+ * \param stream  A pointer to an incremental decoder.
  */
-static inline bool packmsg_is_nil(const packmsg_input_t *buf)
+static inline void packmsg_stream_init(packmsg_stream_t *stream)
 {
-	return packmsg_peek_hdr_(buf) == 0xc0;
+	assert(stream);
+
+	stream->remaining[0] = 1;
+	stream->depth = 0;
+	stream->hdrlen = 0;
+	stream->hdrneed = 0;
+	stream->skip = 0;
+	stream->size = 0;
+	stream->error = false;
 }
 
-/** \brief Checks if the next element is a bool.
- *  \memberof packmsg_input
- *
- * \param buf A pointer to an input buffer iterator.
+/** \brief Internal function, do not use.
  *
- * \return True if the next element can be read by packmsg_get_nil(),
- *         false if not or if any other error occurred.
+ * Returns the number of bytes following the header byte that are needed to know the size of an element.
  */
-static inline bool packmsg_is_bool(const packmsg_input_t *buf)
+static inline uint8_t packmsg_stream_hdrlen_(uint8_t hdr)
 {
-	return (packmsg_peek_hdr_(buf) & 0xfe) == 0xc2;
+	return packmsg_hdr_info_[hdr].width;
 }
 
-/** \brief Checks if the next element is a signed integer that fits in an int8_t.
- *  \memberof packmsg_input
- *
- * \param buf A pointer to an input buffer iterator.
+/** \brief Internal function, do not use.
  *
- * \return True if the next element can be read by packmsg_get_int8(),
- *         false if not or if any other error occurred.
+ * Processes a complete header. Returns false if the header is invalid or nesting is too deep.
  */
-static inline bool packmsg_is_int8(const packmsg_input_t *buf)
+static inline bool packmsg_stream_hdr_(packmsg_stream_t *stream)
 {
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-	return hdr < 0x80 || hdr == 0xd0;
+	uint8_t hdr = stream->hdr[0];
+	uint32_t len = 0;
+	memcpy(&len, stream->hdr + 1, stream->hdrneed - 1);
+
+	const packmsg_hdr_info_t *info = &packmsg_hdr_info_[hdr];
+	uint64_t count = 0;
+	uint64_t skip = 0;
+
+	if (info->type == PACKMSG_ERROR)
+		return false;
+	else if (info->type == PACKMSG_MAP)
+		count = 2 * ((uint64_t)len + info->value);
+	else if (info->type == PACKMSG_ARRAY)
+		count = (uint64_t)len + info->value;
+	else
+		skip = (uint64_t)len + info->size;
+
+	stream->remaining[stream->depth]--;
+
+	if (count) {
+		if (stream->depth >= PACKMSG_MAX_DEPTH)
+			return false;
+
+		stream->remaining[++stream->depth] = count;
+	}
+
+	stream->skip = skip;
+	return true;
 }
 
-/** \brief Checks if the next element is a signed integer that fits in an int16_t.
- *  \memberof packmsg_input
+/** \brief Feed data to an incremental decoder.
+ *  \memberof packmsg_stream
+ *
+ * This function consumes data until either all data has been consumed, or a complete message
+ * (one top-level object) has been received. The state of the decoder is kept between calls,
+ * so each byte is only examined once.
+ * When a message is complete, the decoder is ready to receive the next message, and the size of the message
+ * that was just completed can be retrieved with packmsg_stream_size(); any remaining data
+ * should be passed in a new call to this function.
+ *
+ * \param stream         A pointer to an incremental decoder.
+ * \param data           A pointer to the received data.
+ * \param len            The number of bytes of data.
+ * \param[out] consumed  A pointer to a size_t that will be set to the number of bytes consumed.
+ *
+ * \return               PACKMSG_STREAM_COMPLETE if a complete message was received,
+ *                       PACKMSG_STREAM_MORE if more data is needed,
+ *                       or PACKMSG_STREAM_ERROR if the data is invalid. Once an error occurred,
+ *                       the decoder must be reinitialized with packmsg_stream_init().
+ */
+static inline enum packmsg_stream_status packmsg_stream_feed(packmsg_stream_t *stream, const void *data, size_t len, size_t *consumed)
+{
+	assert(stream);
+	assert(data || !len);
+	assert(consumed);
+
+	const uint8_t *ptr = (const uint8_t *)data;
+	size_t pos = 0;
+
+	*consumed = 0;
+
+	if (unlikely(stream->error))
+		return PACKMSG_STREAM_ERROR;
+
+	// A previously completed message is reported once, the next call starts a new one.
+	if (!stream->depth && !stream->remaining[0] && !stream->skip && !stream->hdrlen) {
+		stream->remaining[0] = 1;
+		stream->size = 0;
+	}
+
+	while (pos < len) {
+		if (stream->skip) {
+			size_t n = len - pos < stream->skip ? len - pos : (size_t)stream->skip;
+			pos += n;
+			stream->skip -= n;
+
+			if (stream->skip)
+				break;
+		} else {
+			if (!stream->hdrlen) {
+				stream->hdr[0] = ptr[pos++];
+				stream->hdrlen = 1;
+				stream->hdrneed = 1 + packmsg_stream_hdrlen_(stream->hdr[0]);
+			}
+
+			while (stream->hdrlen < stream->hdrneed && pos < len)
+				stream->hdr[stream->hdrlen++] = ptr[pos++];
+
+			if (stream->hdrlen < stream->hdrneed)
+				break;
+
+			stream->hdrlen = 0;
+
+			if (unlikely(!packmsg_stream_hdr_(stream))) {
+				stream->error = true;
+				stream->size += pos;
+				*consumed = pos;
+				return PACKMSG_STREAM_ERROR;
+			}
+
+			if (stream->skip)
+				continue;
+		}
+
+		while (stream->depth && !stream->remaining[stream->depth])
+			stream->depth--;
+
+		if (!stream->depth && !stream->remaining[0]) {
+			stream->size += pos;
+			*consumed = pos;
+			return PACKMSG_STREAM_COMPLETE;
+		}
+	}
+
+	stream->size += pos;
+	*consumed = pos;
+	return PACKMSG_STREAM_MORE;
+}
+
+/** \brief Get the size of the current message of an incremental decoder.
+ *  \memberof packmsg_stream
  *
- * \param buf A pointer to an input buffer iterator.
+ * \param stream  A pointer to an incremental decoder.
  *
- * \return True if the next element can be read by packmsg_get_int16(),
- *         false if not or if any other error occurred.
+ * \return        The size in bytes of the message that was just completed,
+ *                or the number of bytes received so far of an incomplete message.
  */
-static inline bool packmsg_is_int16(const packmsg_input_t *buf)
+static inline size_t packmsg_stream_size(const packmsg_stream_t *stream)
 {
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-	return hdr < 0x80 || hdr == 0xd0 || hdr == 0xd1;
+	assert(stream);
+
+	return stream->size;
 }
 
-/** \brief Checks if the next element is a signed integer that fits in an int32_t.
- *  \memberof packmsg_input
+/* Structural index
+ * ================
+ */
+
+/** \brief An entry in a structural index.
  *
- * \param buf A pointer to an input buffer iterator.
+ * Every element of a message, including the keys and values of maps
+ * and the elements of arrays, gets one entry, in the order in which they appear in the message.
  *
- * \return True if the next element can be read by packmsg_get_int32(),
- *         false if not or if any other error occurred.
+ * The child members of all entries together form a table of the children of all maps and arrays,
+ * with the children of each map or array in consecutive slots, starting at the slot given by its children member.
+ * A slot of the table is not related to the entry it is stored in.
  */
-static inline bool packmsg_is_int32(const packmsg_input_t *buf)
+typedef struct packmsg_index_entry {
+	uint32_t offset;        /**< The offset of the element from the start of the message. */
+	uint32_t length;        /**< The size of the element in bytes, including its header and, for maps and arrays, all their contents. */
+	uint32_t end;           /**< The index of the first entry after this element and all its contents. */
+	uint32_t children;      /**< The slot in the child table of the first child of a map or array. */
+	uint32_t child;         /**< A slot of the child table, holding the index of the entry of a child. */
+	enum packmsg_type type; /**< The type of the element. */
+} packmsg_index_entry_t;
+
+/** \brief Structural index of a message.
+ *
+ * This is a tape of entries describing every element of a message, built in one pass with packmsg_index().
+ * Afterwards, skipping over a map or array, or finding any element,
+ * is possible without decoding the message again.
+ * It has to be initialized with packmsg_index_init() with an array of entries allocated by the application.
+ */
+typedef struct packmsg_index {
+	packmsg_index_entry_t *entries; /**< The array of entries. */
+	uint32_t max;                   /**< The number of entries in the array. */
+	uint32_t count;                 /**< The number of entries in use. */
+	const uint8_t *ptr;             /**< A pointer to the start of the indexed message. */
+	bool utf8;                      /**< Whether strings must be valid UTF-8, taken from the input iterator the index was built from. */
+} packmsg_index_t;
+
+/** \brief Initialize a structural index.
+ *  \memberof packmsg_index
+ *
+ * \param index    A pointer to a structural index.
+ * \param entries  A pointer to an array of entries.
+ * \param max      The number of entries in the array.
+ */
+static inline void packmsg_index_init(packmsg_index_t *index, packmsg_index_entry_t *entries, uint32_t max)
 {
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-	return hdr < 0x80 || hdr == 0xd0 || hdr == 0xd1 || hdr == 0xd2;
+	assert(index);
+	assert(entries || !max);
+
+	index->entries = entries;
+	index->max = max;
+	index->count = 0;
+	index->ptr = NULL;
+	index->utf8 = false;
 }
 
-/** \brief Checks if the next element is a signed integer that fits in an int64_t.
- *  \memberof packmsg_input
+/** \brief Build a structural index of the next object in the input.
+ *  \memberof packmsg_index
  *
- * \param buf A pointer to an input buffer iterator.
+ * This function walks over the next object in the input, like packmsg_skip_object(),
+ * and records an entry for every element it contains.
+ * The index points into the input buffer, which must stay valid as long as the index is used.
+ * If the object has more elements than there are entries, if it is nested deeper than PACKMSG_MAX_DEPTH,
+ * if it is invalid, or if the input iterator is reading from a packmsg_source_t,
+ * the input iterator will be invalidated.
  *
- * \return True if the next element can be read by packmsg_get_int64(),
- *         false if not or if any other error occurred.
+ * \param buf    A pointer to an input buffer iterator.
+ * \param index  A pointer to a structural index.
+ *
+ * \return       The number of entries used, or 0 in case of an error.
  */
-static inline bool packmsg_is_int64(const packmsg_input_t *buf)
+static inline uint32_t packmsg_index(packmsg_input_t *buf, packmsg_index_t *index)
 {
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-	return hdr < 0x80 || hdr == 0xd0 || hdr == 0xd1 || hdr == 0xd2 || hdr == 0xd3;
+	assert(buf);
+	assert(index);
+
+	uint32_t stack[PACKMSG_MAX_DEPTH];
+	uint32_t remaining[PACKMSG_MAX_DEPTH];
+	uint32_t slot[PACKMSG_MAX_DEPTH];
+	uint32_t depth = 0;
+	uint32_t slots = 0;
+	uint32_t n = 0;
+
+	index->count = 0;
+	index->ptr = buf->ptr;
+	index->utf8 = buf->utf8;
+
+	if (unlikely(buf->src != NULL) || unlikely((uint64_t)buf->len > UINT32_MAX)) {
+		packmsg_input_invalidate(buf);
+	}
+
+	while (likely(buf->len >= 0)) {
+		if (unlikely(n >= index->max)) {
+			packmsg_input_invalidate(buf);
+			break;
+		}
+
+		packmsg_index_entry_t *entry = &index->entries[n];
+		entry->offset = buf->ptr - index->ptr;
+		entry->type = packmsg_get_type(buf);
+		entry->children = slots;
+		entry->end = ++n;
+
+		if (depth) {
+			index->entries[slot[depth - 1]++].child = n - 1;
+		}
+
+		uint32_t count = 0;
+
+		if (entry->type == PACKMSG_MAP) {
+			count = packmsg_get_map(buf);
+
+			if (unlikely(count > UINT32_MAX / 2)) {
+				packmsg_input_invalidate(buf);
+				break;
+			}
+
+			count *= 2;
+		} else if (entry->type == PACKMSG_ARRAY) {
+			count = packmsg_get_array(buf);
+		} else if (likely(entry->type != PACKMSG_ERROR && entry->type != PACKMSG_DONE)) {
+			packmsg_skip_element(buf);
+		} else {
+			packmsg_input_invalidate(buf);
+			break;
+		}
+
+		entry->length = buf->ptr - index->ptr - entry->offset;
+
+		if (count) {
+			// Every child needs an entry of its own, so its slot in the child table always fits.
+			if (unlikely(depth >= PACKMSG_MAX_DEPTH) || unlikely(count > index->max - slots)) {
+				packmsg_input_invalidate(buf);
+				break;
+			}
+
+			stack[depth] = n - 1;
+			remaining[depth] = count;
+			slot[depth] = slots;
+			slots += count;
+			depth++;
+			continue;
+		}
+
+		// Close all maps and arrays whose last element this was.
+		while (depth && !--remaining[depth - 1]) {
+			entry = &index->entries[stack[--depth]];
+			entry->end = n;
+			entry->length = buf->ptr - index->ptr - entry->offset;
+		}
+
+		if (!depth) {
+			break;
+		}
+	}
+
+	if (unlikely(buf->len < 0)) {
+		return 0;
+	}
+
+	index->count = n;
+	return n;
 }
 
-/** \brief Checks if the next element is an unsigned integer that fits in an uint8_t.
- *  \memberof packmsg_input
+/** \brief Get an input iterator for an indexed element.
+ *  \memberof packmsg_index
  *
- * \param buf A pointer to an input buffer iterator.
+ * The input iterator covers exactly the given element, including all its contents,
+ * so it can be decoded with the regular packmsg_get_*() functions.
+ * If the entry does not exist, the input iterator will be invalid.
  *
- * \return True if the next element can be read by packmsg_get_uint8(),
- *         false if not or if any other error occurred.
+ * \param index  A pointer to a structural index.
+ * \param entry  The index of the entry.
+ * \param buf    A pointer to an input buffer iterator that will be initialized.
  */
-static inline bool packmsg_is_uint8(const packmsg_input_t *buf)
+static inline void packmsg_index_input(const packmsg_index_t *index, uint32_t entry, packmsg_input_t *buf)
 {
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-	return hdr < 0x80 || hdr == 0xcc;
+	assert(index);
+	assert(buf);
+
+	if (likely(entry < index->count)) {
+		packmsg_input_init(buf, index->ptr + index->entries[entry].offset, index->entries[entry].length);
+		buf->utf8 = index->utf8;
+	} else {
+		packmsg_input_init(buf, "", 0);
+		packmsg_input_invalidate(buf);
+	}
 }
 
-/** \brief Checks if the next element is an unsigned integer that fits in an uint16_t.
- *  \memberof packmsg_input
+/** \brief Get the number of children of an indexed map or array.
+ *  \memberof packmsg_index
  *
- * \param buf A pointer to an input buffer iterator.
+ * \param index  A pointer to a structural index.
+ * \param entry  The index of the entry.
  *
- * \return True if the next element can be read by packmsg_get_uint16(),
- *         false if not or if any other error occurred.
+ * \return       The number of elements of an array, twice the number of key/value pairs of a map,
+ *               or 0 if the entry is not a map or array.
  */
-static inline bool packmsg_is_uint16(const packmsg_input_t *buf)
+static inline uint32_t packmsg_index_children(const packmsg_index_t *index, uint32_t entry)
 {
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-	return hdr < 0x80 || hdr == 0xcc || hdr == 0xcd;
+	assert(index);
+
+	if (unlikely(entry >= index->count)) {
+		return 0;
+	}
+
+	packmsg_input_t in;
+	packmsg_input_init(&in, index->ptr + index->entries[entry].offset, index->entries[entry].length);
+
+	if (index->entries[entry].type == PACKMSG_MAP) {
+		return packmsg_get_map(&in) * 2;
+	} else if (index->entries[entry].type == PACKMSG_ARRAY) {
+		return packmsg_get_array(&in);
+	} else {
+		return 0;
+	}
 }
 
-/** \brief Checks if the next element is an unsigned integer that fits in an uint32_t.
- *  \memberof packmsg_input
+/** \brief Find a child of an indexed map or array.
+ *  \memberof packmsg_index
  *
- * \param buf A pointer to an input buffer iterator.
+ * For arrays, child n is the nth element. For maps, child 2n is the key of the nth pair,
+ * and child 2n + 1 its value. This takes constant time, regardless of the types of the children.
  *
- * \return True if the next element can be read by packmsg_get_uint32(),
- *         false if not or if any other error occurred.
+ * \param index  A pointer to a structural index.
+ * \param entry  The index of the entry of the map or array.
+ * \param n      The number of the child.
+ *
+ * \return       The index of the entry of the child, or 0 if it does not exist.
  */
-static inline bool packmsg_is_uint32(const packmsg_input_t *buf)
+static inline uint32_t packmsg_index_child(const packmsg_index_t *index, uint32_t entry, uint32_t n)
 {
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-	return hdr < 0x80 || hdr == 0xcc || hdr == 0xcd || hdr == 0xce;
+	assert(index);
+
+	uint32_t count = packmsg_index_children(index, entry);
+
+	if (unlikely(n >= count)) {
+		return 0;
+	}
+
+	return index->entries[index->entries[entry].children + n].child;
 }
 
-/** \brief Checks if the next element is an unsigned integer that fits in an uint64_t.
- *  \memberof packmsg_input
- *
- * \param buf A pointer to an input buffer iterator.
- *
- * \return True if the next element can be read by packmsg_get_uint64(),
- *         false if not or if any other error occurred.
+/* Object views
+ * ============
  */
-static inline bool packmsg_is_uint64(const packmsg_input_t *buf)
-{
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-	return hdr < 0x80 || hdr == 0xcc || hdr == 0xcd || hdr == 0xce || hdr == 0xcf;
-}
 
-/** \brief Checks if the next element is a single precision floating point value.
- *  \memberof packmsg_input
- *
- * \param buf A pointer to an input buffer iterator.
+/** \brief A node of an object view.
+ *
+ * An object view gives random access to a message in any order, similar to a document object model.
+ * Nodes are allocated from a packmsg_arena_t and point into the input buffer,
+ * which must stay valid as long as the view is used.
+ * Only the root node is created by packmsg_node_parse(); the children of a map or array
+ * are created the first time one of them is accessed with packmsg_node_child() or packmsg_node_find().
+ * The value of a node is read by getting an input iterator for it with packmsg_node_input(),
+ * and using the regular packmsg_get_*() functions. Strings, binary and extension data
+ * can thus be accessed without copying them using the packmsg_get_*_raw() functions.
+ */
+typedef struct packmsg_node {
+	const uint8_t *ptr;            /**< A pointer to the start of the element in the input buffer. */
+	uint32_t length;               /**< The size of the element in bytes, including its header and, for maps and arrays, all their contents. */
+	enum packmsg_type type;        /**< The type of the element. */
+	struct packmsg_node *children; /**< The children of a map or array, or NULL if they have not been created yet. */
+	bool utf8;                     /**< Whether strings must be valid UTF-8, taken from the input iterator the view was parsed from. */
+} packmsg_node_t;
+
+/** \brief Internal function, do not use.
  *
- * \return True if the next element can be read by packmsg_get_float(),
- *         false if not or if any other error occurred.
+ * Fills in a node for the next object in the input, and skips over it.
  */
-static inline bool packmsg_is_float(const packmsg_input_t *buf)
+static inline void packmsg_node_init_(packmsg_node_t *node, packmsg_input_t *buf)
 {
-	return packmsg_peek_hdr_(buf) == 0xca;
+	node->ptr = buf->ptr;
+	node->type = packmsg_get_type(buf);
+	node->children = NULL;
+	node->utf8 = buf->utf8;
+	packmsg_skip_object(buf);
+	node->length = buf->ptr - node->ptr;
 }
 
-/** \brief Checks if the next element is a single or double precision floating point value.
- *  \memberof packmsg_input
+/** \brief Parse the next object in the input into an object view.
+ *  \memberof packmsg_node
  *
- * \param buf A pointer to an input buffer iterator.
+ * This function checks the next object in the input and skips over it,
+ * like packmsg_skip_object(), and allocates its root node from the arena.
+ * If the object is invalid, if it is larger than 4 GiB, if the arena does not have enough room left,
+ * or if the input iterator is reading from a packmsg_source_t, the input iterator will be invalidated.
  *
- * \return True if the next element can be read by packmsg_get_double(),
- *         false if not or if any other error occurred.
+ * \param buf    A pointer to an input buffer iterator.
+ * \param arena  A pointer to the arena to allocate nodes from.
+ *
+ * \return       A pointer to the root node, or NULL in case of an error.
  */
-static inline bool packmsg_is_double(const packmsg_input_t *buf)
+static inline packmsg_node_t *packmsg_node_parse(packmsg_input_t *buf, packmsg_arena_t *arena)
 {
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-	return hdr == 0xcb || hdr == 0xca;
+	assert(buf);
+	assert(arena);
+
+	if (unlikely(buf->src != NULL) || unlikely((uint64_t)buf->len > UINT32_MAX)) {
+		packmsg_input_invalidate(buf);
+		return NULL;
+	}
+
+	packmsg_node_t *node = (packmsg_node_t *)packmsg_arena_alloc(arena, sizeof(*node), sizeof(void *));
+
+	if (unlikely(!node)) {
+		packmsg_input_invalidate(buf);
+		return NULL;
+	}
+
+	packmsg_node_init_(node, buf);
+
+	if (unlikely(!packmsg_input_ok(buf))) {
+		return NULL;
+	}
+
+	return node;
 }
 
-/** \brief Checks if the next element is a string.
- *  \memberof packmsg_input
+/** \brief Get an input iterator for a node.
+ *  \memberof packmsg_node
  *
- * \param buf A pointer to an input buffer iterator.
+ * The input iterator covers exactly the element of the node, including all its contents,
+ * so it can be decoded with the regular packmsg_get_*() functions.
  *
- * \return True if the next element can be read by packmsg_get_str_*(),
- *         false if not or if any other error occurred.
+ * \param node  A pointer to a node.
+ * \param buf   A pointer to an input buffer iterator that will be initialized.
  */
-static inline bool packmsg_is_str(const packmsg_input_t *buf)
+static inline void packmsg_node_input(const packmsg_node_t *node, packmsg_input_t *buf)
 {
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-	return (hdr & 0xe0) == 0xa0 || hdr == 0xd9 || hdr == 0xda || hdr == 0xdb;
+	assert(node);
+	assert(buf);
+
+	packmsg_input_init(buf, node->ptr, node->length);
+	buf->utf8 = node->utf8;
 }
 
-/** \brief Checks if the next element is binary data.
- *  \memberof packmsg_input
+/** \brief Get the number of children of a node.
+ *  \memberof packmsg_node
  *
- * \param buf A pointer to an input buffer iterator.
+ * \param node  A pointer to a node.
  *
- * \return True if the next element can be read by packmsg_get_bin_*(),
- *         false if not or if any other error occurred.
+ * \return      The number of elements of an array, twice the number of key/value pairs of a map,
+ *              or 0 if the node is not a map or array.
  */
-static inline bool packmsg_is_bin(const packmsg_input_t *buf)
+static inline uint32_t packmsg_node_children(const packmsg_node_t *node)
 {
-	return (packmsg_peek_hdr_(buf) & 0xfc) == 0xc4;
+	assert(node);
+
+	packmsg_input_t in;
+	packmsg_node_input(node, &in);
+
+	if (node->type == PACKMSG_MAP) {
+		return packmsg_get_map(&in) * 2;
+	} else if (node->type == PACKMSG_ARRAY) {
+		return packmsg_get_array(&in);
+	} else {
+		return 0;
+	}
 }
 
-/** \brief Checks if the next element is extension data.
- *  \memberof packmsg_input
+/** \brief Get a child of a map or array node.
+ *  \memberof packmsg_node
  *
- * \param buf A pointer to an input buffer iterator.
+ * For arrays, child n is the nth element. For maps, child 2n is the key of the nth pair,
+ * and child 2n + 1 its value. The first time a child of a node is requested,
+ * nodes for all its children are allocated from the arena. After that, any child is found in constant time.
  *
- * \return True if the next element can be read by packmsg_get_ext_*(),
- *         false if not or if any other error occurred.
+ * \param node   A pointer to the node of a map or array.
+ * \param n      The number of the child.
+ * \param arena  A pointer to the arena to allocate nodes from.
+ *
+ * \return       A pointer to the node of the child,
+ *               or NULL if it does not exist or if the arena does not have enough room left.
  */
-static inline bool packmsg_is_ext(const packmsg_input_t *buf)
+static inline packmsg_node_t *packmsg_node_child(packmsg_node_t *node, uint32_t n, packmsg_arena_t *arena)
 {
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-	return (hdr >= 0xc7 && hdr <= 0xc9) || (hdr >= 0xd4 && hdr <= 0xd8);
+	assert(node);
+	assert(arena);
+
+	if (unlikely(!node->children)) {
+		packmsg_input_t in;
+		packmsg_node_input(node, &in);
+
+		uint32_t count = packmsg_node_children(node);
+
+		if (!count) {
+			return NULL;
+		}
+
+		packmsg_node_t *children = (packmsg_node_t *)packmsg_arena_alloc(arena, (size_t)count * sizeof(*children), sizeof(void *));
+
+		if (unlikely(!children)) {
+			return NULL;
+		}
+
+		packmsg_skip_element(&in);
+
+		for (uint32_t i = 0; i < count; i++) {
+			packmsg_node_init_(&children[i], &in);
+		}
+
+		node->children = children;
+	}
+
+	if (unlikely(n >= packmsg_node_children(node))) {
+		return NULL;
+	}
+
+	return &node->children[n];
 }
 
-/** \brief Checks if the next element is a map header.
- *  \memberof packmsg_input
+/** \brief Find the value of a key in a map node.
+ *  \memberof packmsg_node
  *
- * \param buf A pointer to an input buffer iterator.
+ * This function compares the keys of the map with the given string,
+ * creating the nodes of the children of the map if necessary.
  *
- * \return True if the next element can be read by packmsg_get_map(),
- *         false if not or if any other error occurred.
+ * \param node    A pointer to the node of a map.
+ * \param key     A pointer to the key to look for, which does not have to be NUL-terminated.
+ * \param keylen  The length of the key in bytes.
+ * \param arena   A pointer to the arena to allocate nodes from.
+ *
+ * \return        A pointer to the node of the value, or NULL if the key was not found,
+ *                if the node is not a map, or if the arena does not have enough room left.
  */
-static inline bool packmsg_is_map(const packmsg_input_t *buf)
+static inline packmsg_node_t *packmsg_node_find(packmsg_node_t *node, const char *key, uint32_t keylen, packmsg_arena_t *arena)
 {
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-	return (hdr & 0xf0) == 0x80 || hdr == 0xde || hdr == 0xdf;
+	assert(node);
+	assert(key || !keylen);
+
+	if (node->type != PACKMSG_MAP || !packmsg_node_child(node, 0, arena)) {
+		return NULL;
+	}
+
+	uint32_t count = packmsg_node_children(node);
+
+	for (uint32_t i = 0; i < count; i += 2) {
+		if (node->children[i].type != PACKMSG_STR) {
+			continue;
+		}
+
+		packmsg_input_t in;
+		packmsg_node_input(&node->children[i], &in);
+
+		const char *str;
+		uint32_t slen = packmsg_get_str_raw(&in, &str);
+
+		if (slen == keylen && (!keylen || !memcmp(str, key, keylen))) {
+			return &node->children[i + 1];
+		}
+	}
+
+	return NULL;
 }
 
-/** \brief Checks if the next element is an array header.
- *  \memberof packmsg_input
- *
- * \param buf A pointer to an input buffer iterator.
+/* Path queries
+ * ============
+ */
+
+/** \brief The kind of a step in a compiled path. */
+enum packmsg_path_kind {
+	PACKMSG_PATH_KEY,       /**< Descend into the value of a map with the given string key, written as .key. */
+	PACKMSG_PATH_INDEX,     /**< Descend into the element of an array with the given index, written as [index]. */
+	PACKMSG_PATH_ANY_KEY,   /**< Descend into all values of a map, written as .*. */
+	PACKMSG_PATH_ANY_INDEX, /**< Descend into all elements of an array, written as [*]. */
+};
+
+/** \brief A step in a compiled path. */
+typedef struct packmsg_path_step {
+	enum packmsg_path_kind kind; /**< The kind of step. */
+	uint32_t index;              /**< The array index for PACKMSG_PATH_INDEX. */
+	const char *key;             /**< A pointer to the key for PACKMSG_PATH_KEY. */
+	uint32_t keylen;             /**< The length of the key in bytes. */
+} packmsg_path_step_t;
+
+/** \brief A compiled path query.
  *
- * \return True if the next element can be read by packmsg_get_array(),
- *         false if not or if any other error occurred.
+ * A path is a sequence of steps that select elements in nested maps and arrays,
+ * for example `.users[3].address.city` or `.users[*].name`.
+ * Keys consist of all characters up to the next `.` or `[`. The empty path selects the whole object.
+ * It is compiled once with packmsg_path_compile(), after which it can be used with packmsg_path_match()
+ * on any number of messages.
  */
-static inline bool packmsg_is_array(const packmsg_input_t *buf)
-{
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-	return (hdr & 0xf0) == 0x90 || hdr == 0xdc || hdr == 0xdd;
-}
+typedef struct packmsg_path {
+	packmsg_path_step_t steps[PACKMSG_MAX_DEPTH]; /**< The steps of the path. */
+	uint32_t count;                               /**< The number of steps. */
+} packmsg_path_t;
 
-/** \brief Checks the type of the next element.
- *  \memberof packmsg_input
+/** \brief Compile a path query.
+ *  \memberof packmsg_path
  *
- * This function checks the next element and returns an enum packmsg_type
- * that describes the type of the element. If the input buffer was fully consumed
- * and there are no more elements left, this function will return PACKMSG_DONE.
+ * The keys in the compiled path point into the expression, which must stay valid as long as the path is used.
  *
- * \param buf A pointer to an output buffer iterator.
+ * \param path  A pointer to a path.
+ * \param expr  A NUL-terminated path expression.
  *
- * \return    The type of the next element, or PACKMSG_DONE if no more elements
- *            are present in the input buffer, or PACKMSG_ERROR if the next element
- *            is invalid, or if any other error occurred.
+ * \return      True if the expression was compiled successfully,
+ *              false if it is invalid or has more than PACKMSG_MAX_DEPTH steps.
  */
-static inline enum packmsg_type packmsg_get_type(const packmsg_input_t *buf) {
-	if (unlikely(packmsg_done(buf)))
-		return PACKMSG_DONE;
+static inline bool packmsg_path_compile(packmsg_path_t *path, const char *expr)
+{
+	assert(path);
+	assert(expr);
 
-	uint8_t hdr = packmsg_peek_hdr_(buf);
-
-	switch (hdr >> 4) {
-	case 0x0:
-	case 0x1:
-	case 0x2:
-	case 0x3:
-	case 0x4:
-	case 0x5:
-	case 0x6:
-	case 0x7: return PACKMSG_POSITIVE_FIXINT;
-	case 0x8: return PACKMSG_MAP;
-	case 0x9: return PACKMSG_ARRAY;
-	case 0xa:
-	case 0xb: return PACKMSG_STR;
-	case 0xc: switch (hdr & 0xf) {
-		case 0x0: return PACKMSG_NIL;
-		case 0x1: return PACKMSG_ERROR;
-		case 0x2:
-		case 0x3: return PACKMSG_BOOL;
-		case 0x4:
-		case 0x5:
-		case 0x6: return PACKMSG_BIN;
-		case 0x7:
-		case 0x8:
-		case 0x9: return PACKMSG_EXT;
-		case 0xa: return PACKMSG_FLOAT;
-		case 0xb: return PACKMSG_DOUBLE;
-		case 0xc: return PACKMSG_UINT8;
-		case 0xd: return PACKMSG_UINT16;
-		case 0xe: return PACKMSG_UINT32;
-		case 0xf: return PACKMSG_UINT64;
-		default: return PACKMSG_ERROR;
-		}
-	case 0xd: switch (hdr & 0xf) {
-		case 0x0: return PACKMSG_INT8;
-		case 0x1: return PACKMSG_INT16;
-		case 0x2: return PACKMSG_INT32;
-		case 0x3: return PACKMSG_INT64;
-		case 0x4:
-		case 0x5:
-		case 0x6:
-		case 0x7:
-		case 0x8: return PACKMSG_EXT;
-		case 0x9:
-		case 0xa:
-		case 0xb: return PACKMSG_STR;
-		case 0xc:
-		case 0xd: return PACKMSG_ARRAY;
-		case 0xe:
-		case 0xf: return PACKMSG_MAP;
-		default: return PACKMSG_ERROR;
-		}
-	case 0xe:
-	case 0xf: return PACKMSG_INT8;
-	default: return PACKMSG_ERROR;
-	}
-}
+	path->count = 0;
 
-/** \brief Skip one element in the input
- *  \memberof packmsg_input
- *
- *  This function skips the next element in the input.
- *  If the element is a map or an array, only the map or array header is skipped,
- *  but not the contents of the map or array.
- *
- * \param buf A pointer to an output buffer iterator.
- */
-static inline void packmsg_skip_element(packmsg_input_t *buf) {
-	uint8_t hdr = packmsg_read_hdr_(buf);
-	int32_t skip = 0;
-
-	switch(hdr >> 4) {
-	case 0x0:
-	case 0x1:
-	case 0x2:
-	case 0x3:
-	case 0x4:
-	case 0x5:
-	case 0x6:
-	case 0x7:
-	case 0x8:
-	case 0x9: return;
-	case 0xa:
-	case 0xb: skip = hdr & 0x1f; break;
-	case 0xc: switch(hdr & 0xf) {
-		case 0x0:
-		case 0x1:
-		case 0x2:
-		case 0x3: return;
-		case 0x4: skip = -1; break;
-		case 0x5: skip = -2; break;
-		case 0x6: skip = -4; break;
-		case 0x7: skip = -1; break;
-		case 0x8: skip = -2; break;
-		case 0x9: skip = -4; break;
-		case 0xa: skip = 4; break;
-		case 0xb: skip = 8; break;
-		case 0xc: skip = 1; break;
-		case 0xd: skip = 2; break;
-		case 0xe: skip = 4; break;
-		case 0xf: skip = 8; break;
-		}
-		break;
-	case 0xd: switch(hdr & 0xf) {
-		case 0x0: skip = 1; break;
-		case 0x1: skip = 2; break;
-		case 0x2: skip = 4; break;
-		case 0x3: skip = 8; break;
-		case 0x4: skip = 2; break;
-		case 0x5: skip = 3; break;
-		case 0x6: skip = 5; break;
-		case 0x7: skip = 9; break;
-		case 0x8: skip = 17; break;
-		case 0x9: skip = -1; break;
-		case 0xa: skip = -2; break;
-		case 0xb: skip = -4; break;
-		case 0xc: skip = 2; break;
-		case 0xd: skip = 4; break;
-		case 0xe: skip = 2; break;
-		case 0xf: skip = 4; break;
-		}
-		break;
-	case 0xe:
-	case 0xf: return;
-	}
+	while (*expr) {
+		if (path->count >= PACKMSG_MAX_DEPTH) {
+			return false;
+		}
 
-	uint32_t dlen = 0;
+		packmsg_path_step_t *step = &path->steps[path->count++];
+		step->index = 0;
+		step->key = NULL;
+		step->keylen = 0;
 
-	if(skip < 0) {
-		packmsg_read_data_(buf, &dlen, -skip);
+		if (*expr == '.') {
+			const char *key = ++expr;
 
-		if(hdr >= 0xc7 && hdr <= 0xc9)
-			dlen++;
-	} else {
-		dlen = skip;
-	}
+			while (*expr && *expr != '.' && *expr != '[') {
+				expr++;
+			}
 
-	if(likely(buf->len >= dlen)) {
-		buf->ptr += dlen;
-		buf->len -= dlen;
-	} else {
-		packmsg_input_invalidate(buf);
+			if (expr - key == 1 && *key == '*') {
+				step->kind = PACKMSG_PATH_ANY_KEY;
+			} else {
+				step->kind = PACKMSG_PATH_KEY;
+				step->key = key;
+				step->keylen = expr - key;
+			}
+		} else if (*expr == '[') {
+			expr++;
+
+			if (expr[0] == '*' && expr[1] == ']') {
+				step->kind = PACKMSG_PATH_ANY_INDEX;
+				expr += 2;
+				continue;
+			}
+
+			step->kind = PACKMSG_PATH_INDEX;
+
+			if (*expr < '0' || *expr > '9') {
+				return false;
+			}
+
+			uint64_t index = 0;
+
+			while (*expr >= '0' && *expr <= '9') {
+				index = index * 10 + (*expr++ - '0');
+
+				if (index > UINT32_MAX) {
+					return false;
+				}
+			}
+
+			if (*expr++ != ']') {
+				return false;
+			}
+
+			step->index = index;
+		} else {
+			return false;
+		}
 	}
+
+	return true;
 }
 
-/** \brief Skip one object in the input
- *  \memberof packmsg_input
- *
- *  This function checks the type of the next element.
- *  In case it is a scalar value (for example, an int or a string),
- *  it skips just that scalar. If the next element is a map or an array,
- *  it will recursively skip as many objects as there are in that map or array.
- *
- * \param buf A pointer to an output buffer iterator.
- */
-static inline void packmsg_skip_object(packmsg_input_t *buf) {
-	if(packmsg_is_array(buf)) {
-		uint32_t count = packmsg_get_array(buf);
+/** \brief Internal function, do not use. */
+static inline void packmsg_path_match_(packmsg_input_t *buf, const packmsg_path_t *path, uint32_t depth, packmsg_input_t *matches, uint32_t max, uint32_t *found)
+{
+	if (depth == path->count) {
+		const uint8_t *start = buf->ptr;
+		packmsg_skip_object(buf);
+
+		if (likely(buf->len >= 0) && *found < max) {
+			packmsg_input_init(&matches[*found], start, buf->ptr - start);
+			matches[*found].utf8 = buf->utf8;
+		}
+
+		++*found;
+		return;
+	}
 
-		while(count-- && buf->len >= 0) {
+	const packmsg_path_step_t *step = &path->steps[depth];
+
+	if (step->kind == PACKMSG_PATH_KEY || step->kind == PACKMSG_PATH_ANY_KEY) {
+		if (!packmsg_is_map(buf)) {
 			packmsg_skip_object(buf);
+			return;
 		}
-	} else if(packmsg_is_map(buf)) {
+
 		uint32_t count = packmsg_get_map(buf);
 
-		while(count-- && buf->len >= 0) {
-			packmsg_skip_object(buf);
-			packmsg_skip_object(buf);
+		while (count-- && likely(buf->len >= 0)) {
+			bool match = step->kind == PACKMSG_PATH_ANY_KEY;
+
+			if (match || !packmsg_is_str(buf)) {
+				packmsg_skip_object(buf);
+			} else {
+				const char *key;
+				uint32_t keylen = packmsg_get_str_raw(buf, &key);
+				match = keylen == step->keylen && (!keylen || !memcmp(key, step->key, keylen));
+			}
+
+			if (match) {
+				packmsg_path_match_(buf, path, depth + 1, matches, max, found);
+			} else {
+				packmsg_skip_object(buf);
+			}
 		}
 	} else {
-		packmsg_skip_element(buf);
+		if (!packmsg_is_array(buf)) {
+			packmsg_skip_object(buf);
+			return;
+		}
+
+		uint32_t count = packmsg_get_array(buf);
+
+		for (uint32_t i = 0; i < count && likely(buf->len >= 0); i++) {
+			if (step->kind == PACKMSG_PATH_ANY_INDEX || i == step->index) {
+				packmsg_path_match_(buf, path, depth + 1, matches, max, found);
+			} else {
+				packmsg_skip_object(buf);
+			}
+		}
+	}
+}
+
+/** \brief Find all elements matching a path in the next object in the input.
+ *  \memberof packmsg_path
+ *
+ * This function consumes the next object in the input. Everything that is not on the path
+ * is skipped without being decoded. For every matching element, an input iterator is stored
+ * that covers exactly that element, pointing into the input buffer,
+ * so it can be decoded with the regular packmsg_get_*() functions.
+ * Elements that have the wrong type for a step, for example an array where a map is expected, do not match.
+ * If there are more matches than fit in the array, or if the input iterator is reading from a packmsg_source_t,
+ * the input iterator will be invalidated.
+ *
+ * \param buf      A pointer to an input buffer iterator.
+ * \param path     A pointer to a compiled path.
+ * \param matches  A pointer to an array of input buffer iterators that will be initialized.
+ * \param max      The number of elements in the array.
+ *
+ * \return         The number of matches, or 0 in case of an error.
+ */
+static inline uint32_t packmsg_path_match(packmsg_input_t *buf, const packmsg_path_t *path, packmsg_input_t *matches, uint32_t max)
+{
+	assert(buf);
+	assert(path);
+	assert(matches || !max);
+
+	uint32_t found = 0;
+
+	if (unlikely(buf->src != NULL)) {
+		packmsg_input_invalidate(buf);
+		return 0;
 	}
+
+	packmsg_path_match_(buf, path, 0, matches, max, &found);
+
+	if (unlikely(found > max)) {
+		packmsg_input_invalidate(buf);
+	}
+
+	if (unlikely(buf->len < 0)) {
+		return 0;
+	}
+
+	return found;
 }
 
 #undef likely
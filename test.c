@@ -1,14 +1,19 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <check.h>
 #include <limits.h>
 #include <math.h>
 
+#define PACKMSG_FILE
+#define PACKMSG_PARALLEL
 #include "packmsg.h"
 
 #define TEST_OUTPUT(statement, expected, size) {\
 	uint8_t buf[size + 64];\
 	memcpy(buf + size, "Canary!", 8);\
-	packmsg_output_t out = {buf, size};\
+	packmsg_output_t out;\
+	packmsg_output_init(&out, buf, size);\
 	statement;\
 	char filename[100];\
 	snprintf(filename, sizeof filename, "fuzz-in/testcase-%d", __LINE__);\
@@ -381,17 +386,30 @@ START_TEST(add_ext)
 }
 END_TEST
 
-#define TEST_INPUT(statement, buf, size) {\
-	packmsg_input_t in = {(uint8_t *)buf, size};\
+// Trusted decoding is only allowed on input that passed validation,
+// so test cases with truncated or malformed input only run with bounds checks.
+#ifdef PACKMSG_TRUSTED
+#define TEST_BOUNDS_CHECKED false
+#define TEST_DECODABLE(buf, size) packmsg_validate(buf, size, 1, PACKMSG_MAX_DEPTH)
+#else
+#define TEST_BOUNDS_CHECKED true
+#define TEST_DECODABLE(buf, size) true
+#endif
+
+#define TEST_INPUT(statement, buf, size) if (TEST_DECODABLE(buf, size)) {\
+	packmsg_input_t in;\
+	packmsg_input_init(&in, buf, size);\
 	statement;\
 	ck_assert(packmsg_done(&in));\
-	packmsg_input_t in2 = {(uint8_t *)buf, size};\
+	packmsg_input_t in2;\
+	packmsg_input_init(&in2, buf, size);\
 	packmsg_skip_element(&in2);\
 	assert(packmsg_done(&in2));\
 }
 
-#define TEST_INPUT_FAILURE(statement, buf, size) {\
-	packmsg_input_t in = {(uint8_t *)buf, size};\
+#define TEST_INPUT_FAILURE(statement, buf, size) if (TEST_DECODABLE(buf, size)) {\
+	packmsg_input_t in;\
+	packmsg_input_init(&in, buf, size);\
 	statement;\
 	ck_assert(!packmsg_done(&in));\
 }
@@ -733,6 +751,9 @@ START_TEST(get_float)
 	TEST_INPUT_FAILURE(ck_assert_float_eq(packmsg_get_float(&in), 0), "\xd2\x00\x00\x00\x00", 5);
 	TEST_INPUT_FAILURE(ck_assert_float_eq(packmsg_get_float(&in), 0), "\xd3\x00\x00\x00\x00\x00\x00\x00\x00", 9);
 	TEST_INPUT_FAILURE(ck_assert_float_eq(packmsg_get_float(&in), 0), "\xcb\x00\x00\x00\x00\x00\x00\x00\x00", 9);
+
+	/* Fail on truncated input */
+	TEST_INPUT_FAILURE(ck_assert_float_eq(packmsg_get_float(&in), 0), "\xca\x00\x00\x80", 4);
 }
 END_TEST
 
@@ -774,20 +795,26 @@ START_TEST(get_double)
 	TEST_INPUT_FAILURE(ck_assert_double_eq(packmsg_get_double(&in), 0), "\xd1\x00\x00", 3);
 	TEST_INPUT_FAILURE(ck_assert_double_eq(packmsg_get_double(&in), 0), "\xd2\x00\x00\x00\x00", 5);
 	TEST_INPUT_FAILURE(ck_assert_double_eq(packmsg_get_double(&in), 0), "\xd3\x00\x00\x00\x00\x00\x00\x00\x00", 9);
+
+	/* Fail on truncated input */
+	TEST_INPUT_FAILURE(ck_assert_double_eq(packmsg_get_double(&in), 0), "\xca\x00\x00\x80", 4);
+	TEST_INPUT_FAILURE(ck_assert_double_eq(packmsg_get_double(&in), 0), "\xcb\x00\x00\x00\x00\x00\x00\xf0", 8);
 }
 END_TEST
 
 #define TEST_INPUT_STRING(hdrsize, size, str) {\
 	const char *inbuf = (const char *)str;\
 \
-	packmsg_input_t in1 = {(uint8_t *)inbuf, hdrsize + size};\
+	packmsg_input_t in1;\
+	packmsg_input_init(&in1, inbuf, hdrsize + size);\
 	const char *rawptr = NULL;\
 	ck_assert_int_eq(packmsg_get_str_raw(&in1, &rawptr), size);\
 	ck_assert(packmsg_done(&in1));\
 	ck_assert_ptr_nonnull(rawptr);\
 	ck_assert_mem_eq(rawptr, inbuf + hdrsize, size);\
 \
-	packmsg_input_t in2 = {(uint8_t *)inbuf, hdrsize + size};\
+	packmsg_input_t in2;\
+	packmsg_input_init(&in2, inbuf, hdrsize + size);\
 	char *dupptr = packmsg_get_str_dup(&in2);\
 	ck_assert_ptr_nonnull(dupptr);\
 	ck_assert(packmsg_done(&in2));\
@@ -795,7 +822,8 @@ END_TEST
 	ck_assert(dupptr[size] == 0);\
 	free(dupptr);\
 \
-	packmsg_input_t in3 = {(uint8_t *)inbuf, hdrsize + size};\
+	packmsg_input_t in3;\
+	packmsg_input_init(&in3, inbuf, hdrsize + size);\
 	char outbuf[size + 1 + 64];\
 	memcpy(outbuf + size + 1, "Canary!", 8);\
 	ck_assert_int_eq(packmsg_get_str_copy(&in3, &outbuf, size + 1), size);\
@@ -804,24 +832,30 @@ END_TEST
 	ck_assert(outbuf[size] == 0);\
 	ck_assert_mem_eq(outbuf + size + 1, "Canary!", 8);\
 \
-	packmsg_input_t in4 = {(uint8_t *)inbuf, hdrsize + size - 1};\
-	ck_assert_int_eq(packmsg_get_str_raw(&in4, &rawptr), 0);\
-	ck_assert_ptr_null(rawptr);\
-	ck_assert(!packmsg_done(&in4));\
+	if (TEST_BOUNDS_CHECKED) {\
+		packmsg_input_t in4;\
+		packmsg_input_init(&in4, inbuf, hdrsize + size - 1);\
+		ck_assert_int_eq(packmsg_get_str_raw(&in4, &rawptr), 0);\
+		ck_assert_ptr_null(rawptr);\
+		ck_assert(!packmsg_done(&in4));\
 \
-	packmsg_input_t in5 = {(uint8_t *)inbuf, hdrsize + size - 1};\
-	dupptr = packmsg_get_str_dup(&in5);\
-	ck_assert_ptr_null(dupptr);\
-	ck_assert(!packmsg_done(&in5));\
+		packmsg_input_t in5;\
+		packmsg_input_init(&in5, inbuf, hdrsize + size - 1);\
+		dupptr = packmsg_get_str_dup(&in5);\
+		ck_assert_ptr_null(dupptr);\
+		ck_assert(!packmsg_done(&in5));\
 \
-	packmsg_input_t in6 = {(uint8_t *)inbuf, hdrsize + size - 1};\
-	memcpy(outbuf, "Canary!", 8);\
-	ck_assert_int_eq(packmsg_get_str_copy(&in6, &outbuf, size), 0);\
-	ck_assert(!packmsg_done(&in6));\
-	ck_assert_mem_eq(outbuf, size ? "\0anary!" : "Canary!", 8);\
+		packmsg_input_t in6;\
+		packmsg_input_init(&in6, inbuf, hdrsize + size - 1);\
+		memcpy(outbuf, "Canary!", 8);\
+		ck_assert_int_eq(packmsg_get_str_copy(&in6, &outbuf, size), 0);\
+		ck_assert(!packmsg_done(&in6));\
+		ck_assert_mem_eq(outbuf, size ? "\0anary!" : "Canary!", 8);\
+	}\
 \
 	if (size) {\
-		packmsg_input_t in7 = {(uint8_t *)inbuf, hdrsize + size};\
+		packmsg_input_t in7;\
+		packmsg_input_init(&in7, inbuf, hdrsize + size);\
 		memcpy(outbuf, "Canary!", 8);\
 		ck_assert_int_eq(packmsg_get_str_copy(&in7, &outbuf, size - 1), 0);\
 		ck_assert(!packmsg_done(&in7));\
@@ -876,14 +910,16 @@ END_TEST
 #define TEST_INPUT_BIN(hdrsize, size, bin) {\
 	const char *inbuf = (const char *)bin;\
 \
-	packmsg_input_t in1 = {(uint8_t *)inbuf, hdrsize + size};\
+	packmsg_input_t in1;\
+	packmsg_input_init(&in1, inbuf, hdrsize + size);\
 	const void *rawptr = NULL;\
 	ck_assert_int_eq(packmsg_get_bin_raw(&in1, &rawptr), size);\
 	ck_assert(packmsg_done(&in1));\
 	ck_assert_ptr_nonnull(rawptr);\
 	ck_assert_mem_eq(rawptr, inbuf + hdrsize, size);\
 \
-	packmsg_input_t in2 = {(uint8_t *)inbuf, hdrsize + size};\
+	packmsg_input_t in2;\
+	packmsg_input_init(&in2, inbuf, hdrsize + size);\
 	uint32_t len;\
 	void *dupptr = packmsg_get_bin_dup(&in2, &len);\
 	ck_assert_ptr_nonnull(dupptr);\
@@ -892,7 +928,8 @@ END_TEST
 	ck_assert_mem_eq(dupptr, inbuf + hdrsize, size);\
 	free(dupptr);\
 \
-	packmsg_input_t in3 = {(uint8_t *)inbuf, hdrsize + size};\
+	packmsg_input_t in3;\
+	packmsg_input_init(&in3, inbuf, hdrsize + size);\
 	char outbuf[size + 64];\
 	memcpy(outbuf + size, "Canary!", 8);\
 	ck_assert_int_eq(packmsg_get_bin_copy(&in3, &outbuf, size + 1), size);\
@@ -900,25 +937,31 @@ END_TEST
 	ck_assert_mem_eq(outbuf, inbuf + hdrsize, size);\
 	ck_assert_mem_eq(outbuf + size, "Canary!", 8);\
 \
-	packmsg_input_t in4 = {(uint8_t *)inbuf, hdrsize + size - 1};\
-	ck_assert_int_eq(packmsg_get_bin_raw(&in4, &rawptr), 0);\
-	ck_assert_ptr_null(rawptr);\
-	ck_assert(!packmsg_done(&in4));\
+	if (TEST_BOUNDS_CHECKED) {\
+		packmsg_input_t in4;\
+		packmsg_input_init(&in4, inbuf, hdrsize + size - 1);\
+		ck_assert_int_eq(packmsg_get_bin_raw(&in4, &rawptr), 0);\
+		ck_assert_ptr_null(rawptr);\
+		ck_assert(!packmsg_done(&in4));\
 \
-	packmsg_input_t in5 = {(uint8_t *)inbuf, hdrsize + size - 1};\
-	dupptr = packmsg_get_bin_dup(&in5, &len);\
-	ck_assert_ptr_null(dupptr);\
-	ck_assert_int_eq(len, 0);\
-	ck_assert(!packmsg_done(&in5));\
+		packmsg_input_t in5;\
+		packmsg_input_init(&in5, inbuf, hdrsize + size - 1);\
+		dupptr = packmsg_get_bin_dup(&in5, &len);\
+		ck_assert_ptr_null(dupptr);\
+		ck_assert_int_eq(len, 0);\
+		ck_assert(!packmsg_done(&in5));\
 \
-	packmsg_input_t in6 = {(uint8_t *)inbuf, hdrsize + size - 1};\
-	memcpy(outbuf, "Canary!", 8);\
-	ck_assert_int_eq(packmsg_get_bin_copy(&in6, &outbuf, size), 0);\
-	ck_assert(!packmsg_done(&in6));\
-	ck_assert_mem_eq(outbuf, "Canary!", 8);\
+		packmsg_input_t in6;\
+		packmsg_input_init(&in6, inbuf, hdrsize + size - 1);\
+		memcpy(outbuf, "Canary!", 8);\
+		ck_assert_int_eq(packmsg_get_bin_copy(&in6, &outbuf, size), 0);\
+		ck_assert(!packmsg_done(&in6));\
+		ck_assert_mem_eq(outbuf, "Canary!", 8);\
+	}\
 \
 	if (size) {\
-		packmsg_input_t in7 = {(uint8_t *)inbuf, hdrsize + size};\
+		packmsg_input_t in7;\
+		packmsg_input_init(&in7, inbuf, hdrsize + size);\
 		memcpy(outbuf, "Canary!", 8);\
 		ck_assert_int_eq(packmsg_get_bin_copy(&in7, &outbuf, size - 1), 0);\
 		ck_assert(!packmsg_done(&in7));\
@@ -926,6 +969,92 @@ END_TEST
 	}\
 }
 
+START_TEST(utf8)
+{
+	ck_assert(packmsg_utf8_valid("", 0));
+	ck_assert(packmsg_utf8_valid("0123456789abcdef0123456789abcdef!", 33));
+	ck_assert(packmsg_utf8_valid("\xc2\x80\xdf\xbf", 4));
+	ck_assert(packmsg_utf8_valid("\xe0\xa0\x80\xed\x9f\xbf\xef\xbf\xbf", 9));
+	ck_assert(packmsg_utf8_valid("\xf0\x90\x80\x80\xf4\x8f\xbf\xbf", 8));
+	ck_assert(packmsg_utf8_valid("0123456789abcdef\xe2\x82\xac" "0123456789abcdef", 35));
+
+	// Stray continuation bytes, overlong encodings, surrogates, too large code points and truncated sequences.
+	ck_assert(!packmsg_utf8_valid("\x80", 1));
+	ck_assert(!packmsg_utf8_valid("\xc0\x80", 2));
+	ck_assert(!packmsg_utf8_valid("\xc1\xbf", 2));
+	ck_assert(!packmsg_utf8_valid("\xe0\x9f\xbf", 3));
+	ck_assert(!packmsg_utf8_valid("\xed\xa0\x80", 3));
+	ck_assert(!packmsg_utf8_valid("\xf0\x8f\xbf\xbf", 4));
+	ck_assert(!packmsg_utf8_valid("\xf4\x90\x80\x80", 4));
+	ck_assert(!packmsg_utf8_valid("\xf5\x80\x80\x80", 4));
+	ck_assert(!packmsg_utf8_valid("\xe2\x82", 2));
+	ck_assert(!packmsg_utf8_valid("\xe2\x82\x41", 3));
+	ck_assert(!packmsg_utf8_valid("0123456789abcdef0123456789abcde\xff", 32));
+
+	// Checking strings is opt-in per input iterator.
+	const char *str;
+	packmsg_input_t in;
+	packmsg_input_init(&in, "\xa2\xc3\xa9\xa1\xff", 5);
+	packmsg_input_set_utf8(&in, true);
+	ck_assert_int_eq(packmsg_get_str_raw(&in, &str), 2);
+	ck_assert_int_eq(packmsg_get_str_raw(&in, &str), 0);
+	ck_assert_ptr_null(str);
+	ck_assert(!packmsg_input_ok(&in));
+
+	packmsg_input_init(&in, "\xa1\xff", 2);
+	ck_assert_int_eq(packmsg_get_str_raw(&in, &str), 1);
+	ck_assert(packmsg_done(&in));
+
+	// Iterators derived from one that checks strings check them as well.
+	const char msg[] = "\x82\xa1" "a\xa1\xff\xa1" "b\xa1" "b";
+	packmsg_input_t value;
+
+	packmsg_map_slot_t slots[4];
+	packmsg_map_view_t view;
+	packmsg_map_view_init(&view, slots, 4);
+	packmsg_input_init(&in, msg, sizeof msg - 1);
+	packmsg_input_set_utf8(&in, true);
+	ck_assert(packmsg_map_view_build(&in, &view));
+	ck_assert(packmsg_map_view_find(&view, "a", 1, &value));
+	ck_assert_int_eq(packmsg_get_str_raw(&value, &str), 0);
+	ck_assert(!packmsg_input_ok(&value));
+	ck_assert(packmsg_map_view_find(&view, "b", 1, &value));
+	ck_assert_int_eq(packmsg_get_str_raw(&value, &str), 1);
+	ck_assert(packmsg_done(&value));
+
+	packmsg_index_entry_t entries[5];
+	packmsg_index_t index;
+	packmsg_index_init(&index, entries, 5);
+	packmsg_input_init(&in, msg, sizeof msg - 1);
+	packmsg_input_set_utf8(&in, true);
+	ck_assert_int_eq(packmsg_index(&in, &index), 5);
+	packmsg_index_input(&index, packmsg_index_child(&index, 0, 1), &value);
+	ck_assert_int_eq(packmsg_get_str_raw(&value, &str), 0);
+	ck_assert(!packmsg_input_ok(&value));
+
+	uint8_t region[256];
+	packmsg_arena_t arena;
+	packmsg_arena_init(&arena, region, sizeof region);
+	packmsg_input_init(&in, msg, sizeof msg - 1);
+	packmsg_input_set_utf8(&in, true);
+	packmsg_node_t *root = packmsg_node_parse(&in, &arena);
+	ck_assert_ptr_nonnull(root);
+	packmsg_node_t *node = packmsg_node_find(root, "a", 1, &arena);
+	ck_assert_ptr_nonnull(node);
+	packmsg_node_input(node, &value);
+	ck_assert_int_eq(packmsg_get_str_raw(&value, &str), 0);
+	ck_assert(!packmsg_input_ok(&value));
+
+	packmsg_path_t path;
+	ck_assert(packmsg_path_compile(&path, ".a"));
+	packmsg_input_init(&in, msg, sizeof msg - 1);
+	packmsg_input_set_utf8(&in, true);
+	ck_assert_int_eq(packmsg_path_match(&in, &path, &value, 1), 1);
+	ck_assert_int_eq(packmsg_get_str_raw(&value, &str), 0);
+	ck_assert(!packmsg_input_ok(&value));
+}
+END_TEST
+
 START_TEST(get_bin)
 {
 	uint8_t *bin = (uint8_t *)calloc(1, 0x10000 + 1 + 4);
@@ -968,7 +1097,8 @@ END_TEST
 	const char *inbuf = (const char *)bin;\
 	int8_t type;\
 \
-	packmsg_input_t in1 = {(uint8_t *)inbuf, hdrsize + size};\
+	packmsg_input_t in1;\
+	packmsg_input_init(&in1, inbuf, hdrsize + size);\
 	const void *rawptr = NULL;\
 	ck_assert_int_eq(packmsg_get_ext_raw(&in1, &type, &rawptr), size);\
 	ck_assert(packmsg_done(&in1));\
@@ -976,7 +1106,8 @@ END_TEST
 	ck_assert_ptr_nonnull(rawptr);\
 	ck_assert_mem_eq(rawptr, inbuf + hdrsize, size);\
 \
-	packmsg_input_t in2 = {(uint8_t *)inbuf, hdrsize + size};\
+	packmsg_input_t in2;\
+	packmsg_input_init(&in2, inbuf, hdrsize + size);\
 	uint32_t len;\
 	void *dupptr = packmsg_get_ext_dup(&in2, &type, &len);\
 	ck_assert(packmsg_done(&in2));\
@@ -986,7 +1117,8 @@ END_TEST
 	ck_assert_mem_eq(dupptr, inbuf + hdrsize, size);\
 	free(dupptr);\
 \
-	packmsg_input_t in3 = {(uint8_t *)inbuf, hdrsize + size};\
+	packmsg_input_t in3;\
+	packmsg_input_init(&in3, inbuf, hdrsize + size);\
 	char outbuf[size + 64];\
 	memcpy(outbuf + size, "Canary!", 8);\
 	ck_assert_int_eq(packmsg_get_ext_copy(&in3, &type, &outbuf, size + 1), size);\
@@ -995,27 +1127,33 @@ END_TEST
 	ck_assert_mem_eq(outbuf, inbuf + hdrsize, size);\
 	ck_assert_mem_eq(outbuf + size, "Canary!", 8);\
 \
-	packmsg_input_t in4 = {(uint8_t *)inbuf, hdrsize + size - 1};\
-	ck_assert_int_eq(packmsg_get_ext_raw(&in4, &type, &rawptr), 0);\
-	ck_assert_ptr_null(rawptr);\
-	ck_assert_int_eq(type, 0);\
-	ck_assert(!packmsg_done(&in4));\
+	if (TEST_BOUNDS_CHECKED) {\
+		packmsg_input_t in4;\
+		packmsg_input_init(&in4, inbuf, hdrsize + size - 1);\
+		ck_assert_int_eq(packmsg_get_ext_raw(&in4, &type, &rawptr), 0);\
+		ck_assert_ptr_null(rawptr);\
+		ck_assert_int_eq(type, 0);\
+		ck_assert(!packmsg_done(&in4));\
 \
-	packmsg_input_t in5 = {(uint8_t *)inbuf, hdrsize + size - 1};\
-	dupptr = packmsg_get_ext_dup(&in5, &type, &len);\
-	ck_assert_ptr_null(dupptr);\
-	ck_assert_int_eq(len, 0);\
-	ck_assert(!packmsg_done(&in5));\
+		packmsg_input_t in5;\
+		packmsg_input_init(&in5, inbuf, hdrsize + size - 1);\
+		dupptr = packmsg_get_ext_dup(&in5, &type, &len);\
+		ck_assert_ptr_null(dupptr);\
+		ck_assert_int_eq(len, 0);\
+		ck_assert(!packmsg_done(&in5));\
 \
-	packmsg_input_t in6 = {(uint8_t *)inbuf, hdrsize + size - 1};\
-	memcpy(outbuf, "Canary!", 8);\
-	ck_assert_int_eq(packmsg_get_ext_copy(&in6, &type, &outbuf, size), 0);\
-	ck_assert_int_eq(type, 0);\
-	ck_assert(!packmsg_done(&in6));\
-	ck_assert_mem_eq(outbuf, "Canary!", 8);\
+		packmsg_input_t in6;\
+		packmsg_input_init(&in6, inbuf, hdrsize + size - 1);\
+		memcpy(outbuf, "Canary!", 8);\
+		ck_assert_int_eq(packmsg_get_ext_copy(&in6, &type, &outbuf, size), 0);\
+		ck_assert_int_eq(type, 0);\
+		ck_assert(!packmsg_done(&in6));\
+		ck_assert_mem_eq(outbuf, "Canary!", 8);\
+	}\
 \
 	if (size) {\
-		packmsg_input_t in7 = {(uint8_t *)inbuf, hdrsize + size};\
+		packmsg_input_t in7;\
+		packmsg_input_init(&in7, inbuf, hdrsize + size);\
 		memcpy(outbuf, "Canary!", 8);\
 		ck_assert_int_eq(packmsg_get_ext_copy(&in7, &type, &outbuf, size - 1), 0);\
 		ck_assert_int_eq(type, 0);\
@@ -1070,18 +1208,22 @@ END_TEST
 
 #define TEST_INPUT_FIXEXT(size, ext, data) {\
 	const char *buf = data;\
-	packmsg_input_t in1 = {(uint8_t *)buf, size + 2};\
+	packmsg_input_t in1;\
+	packmsg_input_init(&in1, buf, size + 2);\
 	const void *rawptr;\
 	int8_t type;\
 	ck_assert_int_eq(packmsg_get_ext_raw(&in1, &type, &rawptr), size);\
 	ck_assert(packmsg_done(&in1));\
 	ck_assert_ptr_nonnull(rawptr);\
 	ck_assert_mem_eq(rawptr, buf + 2, size);\
-	packmsg_input_t in2 = {(uint8_t *)buf, size + 1};\
-	ck_assert_int_eq(packmsg_get_ext_raw(&in2, &type, &rawptr), 0);\
-	ck_assert_int_eq(type, 0);\
-	ck_assert_ptr_null(rawptr);\
-	ck_assert(!packmsg_done(&in2));\
+	if (TEST_BOUNDS_CHECKED) {\
+		packmsg_input_t in2;\
+		packmsg_input_init(&in2, buf, size + 1);\
+		ck_assert_int_eq(packmsg_get_ext_raw(&in2, &type, &rawptr), 0);\
+		ck_assert_int_eq(type, 0);\
+		ck_assert_ptr_null(rawptr);\
+		ck_assert(!packmsg_done(&in2));\
+	}\
 }
 
 START_TEST(get_fixext)
@@ -1094,6 +1236,67 @@ START_TEST(get_fixext)
 }
 END_TEST
 
+START_TEST(get_arena)
+{
+	uint8_t region[64];
+	packmsg_arena_t arena;
+	packmsg_arena_init(&arena, region, sizeof region);
+
+	uint32_t dlen;
+	int8_t type;
+	char *str = NULL;
+	void *data = NULL;
+
+	TEST_INPUT(str = packmsg_get_str_arena(&in, &arena), "\xa3" "foo", 4);
+	ck_assert_str_eq(str, "foo");
+	ck_assert_ptr_eq(str, region);
+
+	TEST_INPUT(data = packmsg_get_bin_arena(&in, &arena, &dlen), "\xc4\x02\x01\x02", 4);
+	ck_assert_int_eq(dlen, 2);
+	ck_assert_mem_eq(data, "\x01\x02", 2);
+	ck_assert(!((uintptr_t)data & 7));
+
+	TEST_INPUT(data = packmsg_get_ext_arena(&in, &arena, &type, &dlen), "\xd5\x07\x01\x02", 4);
+	ck_assert_int_eq(type, 7);
+	ck_assert_int_eq(dlen, 2);
+	ck_assert_mem_eq(data, "\x01\x02", 2);
+	ck_assert(!((uintptr_t)data & 7));
+
+	// Earlier allocations are not overwritten.
+	ck_assert_str_eq(str, "foo");
+
+	// Running out of room invalidates the input.
+	TEST_INPUT_FAILURE(ck_assert_ptr_null(packmsg_get_str_arena(&in, &arena)), "\xd9\x40" "0123456789012345678901234567890123456789012345678901234567890123", 66);
+	ck_assert(arena.used <= sizeof region);
+
+	// A reset makes all room available again.
+	packmsg_arena_reset(&arena);
+	TEST_INPUT(str = packmsg_get_str_arena(&in, &arena), "\xd9\x3f" "012345678901234567890123456789012345678901234567890123456789012", 65);
+	ck_assert_int_eq(strlen(str), 63);
+	ck_assert_int_eq(arena.used, sizeof region);
+
+	TEST_INPUT_FAILURE(ck_assert_ptr_null(packmsg_get_bin_arena(&in, &arena, &dlen)), "\xc4\x01\x01", 3);
+	ck_assert_int_eq(dlen, 0);
+	TEST_INPUT_FAILURE(ck_assert_ptr_null(packmsg_get_ext_arena(&in, &arena, &type, &dlen)), "\xd4\x07\x01", 3);
+	ck_assert_int_eq(type, 0);
+	ck_assert_int_eq(dlen, 0);
+
+	// Empty values do not need any room, not even in an arena without memory.
+	packmsg_arena_t empty;
+	packmsg_arena_init(&empty, NULL, 0);
+
+	TEST_INPUT(data = packmsg_get_bin_arena(&in, &empty, &dlen), "\xc4\x00", 2);
+	ck_assert_ptr_nonnull(data);
+	ck_assert_ptr_ne(data, &empty);
+	ck_assert_int_eq(dlen, 0);
+	TEST_INPUT(ck_assert_ptr_nonnull(packmsg_get_ext_arena(&in, &empty, &type, &dlen)), "\xc7\x00\x07", 3);
+	ck_assert_int_eq(type, 7);
+	ck_assert_int_eq(dlen, 0);
+	TEST_INPUT_FAILURE(ck_assert_ptr_null(packmsg_get_bin_arena(&in, &empty, &dlen)), "\xc4\x01\x01", 3);
+	ck_assert_int_eq(empty.used, 0);
+}
+END_TEST
+
 START_TEST(get_map)
 {
 	TEST_INPUT(ck_assert_int_eq(packmsg_get_map(&in),          0), "\x80", 1)
@@ -1132,10 +1335,96 @@ START_TEST(get_array)
 }
 END_TEST
 
+START_TEST(type_mismatch)
+{
+	// Type checks are also performed in trusted mode, and report errors the same way.
+	const char *str = "";
+	const void *data = "";
+	TEST_INPUT_FAILURE(ck_assert_int_eq(packmsg_get_str_raw(&in, &str), 0), "\xc0", 1);
+	ck_assert_ptr_null(str);
+	TEST_INPUT_FAILURE(ck_assert_int_eq(packmsg_get_bin_raw(&in, &data), 0), "\xc0", 1);
+	ck_assert_ptr_null(data);
+	TEST_INPUT_FAILURE(ck_assert_int_eq(packmsg_get_int8(&in), 0), "\xa1:", 2);
+	TEST_INPUT_FAILURE(ck_assert_int_eq(packmsg_get_map(&in), 0), "\x91\x01", 2);
+
+	// Nothing is read after the input iterator has been invalidated.
+	packmsg_input_t in;
+	packmsg_input_init(&in, "\xc0\x01", 2);
+	ck_assert(!packmsg_get_bool(&in));
+	ck_assert(!packmsg_input_ok(&in));
+	ck_assert_int_eq(packmsg_get_int8(&in), 0);
+	ck_assert_int_eq(packmsg_get_str_raw(&in, &str), 0);
+	ck_assert_ptr_null(str);
+	ck_assert(!packmsg_input_ok(&in));
+}
+END_TEST
+
+START_TEST(get_types)
+{
+	for (int hdr = 0; hdr < 256; hdr++) {
+		uint8_t buf[32] = {(uint8_t)hdr};
+		packmsg_input_t in;
+		packmsg_input_init(&in, buf, sizeof(buf));
+
+		enum packmsg_type type = packmsg_get_type(&in);
+		ck_assert(type != PACKMSG_DONE);
+		ck_assert(packmsg_is_nil(&in) == (type == PACKMSG_NIL));
+		ck_assert(packmsg_is_bool(&in) == (type == PACKMSG_BOOL));
+		ck_assert(packmsg_is_int8(&in) == (type == PACKMSG_POSITIVE_FIXINT || type == PACKMSG_INT8));
+		ck_assert(packmsg_is_int64(&in) == (type >= PACKMSG_POSITIVE_FIXINT && type <= PACKMSG_INT64));
+		ck_assert(packmsg_is_uint8(&in) == (type == PACKMSG_POSITIVE_FIXINT || type == PACKMSG_UINT8));
+		ck_assert(packmsg_is_uint64(&in) == (type == PACKMSG_POSITIVE_FIXINT || (type >= PACKMSG_UINT8 && type <= PACKMSG_UINT64)));
+		ck_assert(packmsg_is_double(&in) == (type == PACKMSG_FLOAT || type == PACKMSG_DOUBLE));
+		ck_assert(packmsg_is_str(&in) == (type == PACKMSG_STR));
+		ck_assert(packmsg_is_bin(&in) == (type == PACKMSG_BIN));
+		ck_assert(packmsg_is_ext(&in) == (type == PACKMSG_EXT));
+		ck_assert(packmsg_is_map(&in) == (type == PACKMSG_MAP));
+		ck_assert(packmsg_is_array(&in) == (type == PACKMSG_ARRAY));
+
+		// With all length fields zero, skipping a scalar consumes exactly the header, length field and fixed size data.
+		packmsg_skip_element(&in);
+
+		if (type == PACKMSG_ERROR) {
+			ck_assert(!packmsg_input_ok(&in));
+		} else if (hdr >= 0xa0 && hdr < 0xc0) {
+			ck_assert_int_eq(in.ptr - buf, 1 + (hdr & 0x1f));
+		} else if (hdr >= 0xc4 && hdr <= 0xc6) {
+			ck_assert_int_eq(in.ptr - buf, 1 + (1 << (hdr - 0xc4)));
+		} else if (hdr >= 0xc7 && hdr <= 0xc9) {
+			ck_assert_int_eq(in.ptr - buf, 2 + (1 << (hdr - 0xc7)));
+		} else if (hdr >= 0xd4 && hdr <= 0xd8) {
+			ck_assert_int_eq(in.ptr - buf, 2 + (1 << (hdr - 0xd4)));
+		} else if (hdr == 0xca || hdr == 0xce || hdr == 0xd2) {
+			ck_assert_int_eq(in.ptr - buf, 5);
+		} else if (hdr == 0xcb || hdr == 0xcf || hdr == 0xd3) {
+			ck_assert_int_eq(in.ptr - buf, 9);
+		} else if (hdr == 0xd9 || hdr == 0xda || hdr == 0xdb) {
+			ck_assert_int_eq(in.ptr - buf, 1 + (1 << (hdr - 0xd9)));
+		}
+
+		if (type != PACKMSG_ERROR)
+			ck_assert(packmsg_input_ok(&in));
+	}
+
+	packmsg_input_t in;
+
+	// Negative fixints are readable as all signed integer types, but not as unsigned integers.
+	packmsg_input_init(&in, "\xe0", 1);
+	ck_assert(packmsg_is_int8(&in));
+	ck_assert(!packmsg_is_uint64(&in));
+
+	// Extension data is not binary data.
+	packmsg_input_init(&in, "\xc7\x00\x01", 3);
+	ck_assert(!packmsg_is_bin(&in));
+	ck_assert(packmsg_is_ext(&in));
+}
+END_TEST
+
 START_TEST(simple_object)
 {
 	uint8_t buf[1024];
-	packmsg_output_t out = {buf, sizeof(buf)};
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof(buf));
 
 	packmsg_add_map(&out, 2);
 	packmsg_add_str(&out, "compact");
@@ -1147,7 +1436,8 @@ START_TEST(simple_object)
 	ck_assert_int_eq(packmsg_output_size(&out, buf), 18);
 	ck_assert_mem_eq(buf, "\x82\xa7" "compact" "\xc3\xa6" "schema", 18);
 
-	packmsg_input_t in = {buf, packmsg_output_size(&out, buf)};
+	packmsg_input_t in;
+	packmsg_input_init(&in, buf, packmsg_output_size(&out, buf));
 
 	ck_assert(packmsg_is_map(&in));
 	ck_assert(packmsg_get_type(&in) == PACKMSG_MAP);
@@ -1177,19 +1467,1569 @@ START_TEST(simple_object)
 
 	ck_assert(packmsg_done(&in));
 
-	packmsg_input_t in2 = {buf, packmsg_output_size(&out, buf)};
+	packmsg_input_t in2;
+	packmsg_input_init(&in2, buf, packmsg_output_size(&out, buf));
 	for (int i = 0; i < 5; i++) {
 		packmsg_skip_element(&in2);
 		assert(packmsg_input_ok(&in2));
 	}
 	assert(packmsg_done(&in2));
 
-	packmsg_input_t in3 = {buf, packmsg_output_size(&out, buf)};
+	packmsg_input_t in3;
+	packmsg_input_init(&in3, buf, packmsg_output_size(&out, buf));
 	packmsg_skip_object(&in3);
 	ck_assert(packmsg_done(&in3));
 }
 END_TEST
 
+START_TEST(skip_nested)
+{
+	uint8_t buf[1024];
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof buf);
+
+	// Every kind of element, nested in maps and arrays of all header sizes.
+	packmsg_add_map(&out, 20);
+	packmsg_add_str(&out, "a");
+	packmsg_add_array(&out, 0);
+	packmsg_add_int8(&out, -1);
+	packmsg_add_map(&out, 0);
+	packmsg_add_nil(&out);
+	packmsg_add_array(&out, 3);
+	packmsg_add_bool(&out, false);
+	packmsg_add_uint64(&out, UINT64_MAX);
+	packmsg_add_double(&out, 0.5);
+	packmsg_add_bin(&out, "\x01\x02\x03", 3);
+	packmsg_add_ext(&out, 1, "\x01\x02\x03\x04", 4);
+	packmsg_add_ext(&out, 2, "\x01\x02\x03", 3);
+	for (int i = 0; i < 30; i++)
+		packmsg_add_int32(&out, i * 1000000);
+	packmsg_add_str(&out, "0123456789012345678901234567890123456789");
+	ck_assert(packmsg_output_ok(&out));
+	size_t size = packmsg_output_size(&out, buf);
+
+	packmsg_input_t in;
+	packmsg_input_init(&in, buf, size);
+	packmsg_skip_object(&in);
+	ck_assert(packmsg_done(&in));
+
+	packmsg_input_init(&in, buf, size - 1);
+	packmsg_skip_object(&in);
+	ck_assert(!packmsg_input_ok(&in));
+
+	// Nesting up to the depth limit is fine, deeper nesting is an error.
+	memset(buf, 0x91, PACKMSG_MAX_DEPTH);
+	buf[PACKMSG_MAX_DEPTH] = 0xc0;
+	buf[PACKMSG_MAX_DEPTH + 1] = 0x2a;
+	packmsg_input_init(&in, buf, PACKMSG_MAX_DEPTH + 2);
+	packmsg_skip_object(&in);
+	ck_assert_int_eq(packmsg_get_uint8(&in), 42);
+	ck_assert(packmsg_done(&in));
+
+	buf[PACKMSG_MAX_DEPTH] = 0x91;
+	buf[PACKMSG_MAX_DEPTH + 1] = 0xc0;
+	packmsg_input_init(&in, buf, PACKMSG_MAX_DEPTH + 2);
+	packmsg_skip_object(&in);
+	ck_assert(!packmsg_input_ok(&in));
+
+	// Hostile inputs cannot exhaust the stack.
+	memset(buf, 0xdd, sizeof buf);
+	packmsg_input_init(&in, buf, sizeof buf);
+	packmsg_skip_object(&in);
+	ck_assert(!packmsg_input_ok(&in));
+
+	// Invalid headers are errors.
+	packmsg_input_init(&in, "\x92\x01\xc1", 3);
+	packmsg_skip_object(&in);
+	ck_assert(!packmsg_input_ok(&in));
+}
+END_TEST
+
+static int alloc_calls;
+
+static void *counting_alloc(void *ctx, void *ptr, size_t size)
+{
+	alloc_calls++;
+
+	if (ctx && size > *(size_t *)ctx)
+		return NULL;
+
+	if (!size) {
+		free(ptr);
+		return NULL;
+	}
+
+	return realloc(ptr, size);
+}
+
+START_TEST(growable_output)
+{
+	packmsg_output_t out;
+	alloc_calls = 0;
+	packmsg_output_init_growable(&out, counting_alloc, NULL, 0);
+
+	ck_assert(packmsg_output_ok(&out));
+	ck_assert_int_eq(packmsg_output_size(&out, packmsg_output_data(&out)), 0);
+
+	packmsg_add_array(&out, 1000);
+	for (int i = 0; i < 1000; i++)
+		packmsg_add_int32(&out, i * 1000);
+
+	ck_assert(packmsg_output_ok(&out));
+	ck_assert_int_le(alloc_calls, 8);
+
+	packmsg_input_t in;
+	packmsg_input_init(&in, packmsg_output_data(&out), packmsg_output_size(&out, packmsg_output_data(&out)));
+	ck_assert_int_eq(packmsg_get_array(&in), 1000);
+	for (int i = 0; i < 1000; i++)
+		ck_assert_int_eq(packmsg_get_int32(&in), i * 1000);
+	ck_assert(packmsg_done(&in));
+
+	// Resetting reuses the existing allocation.
+	int calls = alloc_calls;
+	packmsg_output_reset(&out);
+	ck_assert_int_eq(packmsg_output_size(&out, packmsg_output_data(&out)), 0);
+	packmsg_add_str(&out, "compact");
+	ck_assert(packmsg_output_ok(&out));
+	ck_assert_int_eq(packmsg_output_size(&out, packmsg_output_data(&out)), 8);
+	ck_assert_mem_eq(packmsg_output_data(&out), "\xa7" "compact", 8);
+	ck_assert_int_eq(alloc_calls, calls);
+
+	packmsg_output_free(&out);
+	ck_assert_int_eq(alloc_calls, calls + 1);
+	ck_assert(!packmsg_output_ok(&out));
+
+	// Allocation failures invalidate the iterator.
+	size_t limit = 100;
+	packmsg_output_init_growable(&out, counting_alloc, &limit, 16);
+	packmsg_add_bin(&out, "0123456789abcdef0123456789abcdef", 32);
+	ck_assert(packmsg_output_ok(&out));
+	packmsg_add_bin(&out, "0123456789abcdef0123456789abcdef", 32);
+	packmsg_add_bin(&out, "0123456789abcdef0123456789abcdef", 32);
+	ck_assert(!packmsg_output_ok(&out));
+	ck_assert_int_eq(packmsg_output_size(&out, packmsg_output_data(&out)), 0);
+	packmsg_output_reset(&out);
+	ck_assert(packmsg_output_ok(&out));
+	packmsg_output_free(&out);
+
+	// Fixed size buffers never grow, but can be reset.
+	uint8_t buf[2];
+	packmsg_output_init(&out, buf, sizeof buf);
+	packmsg_add_uint16(&out, 0x100);
+	ck_assert(!packmsg_output_ok(&out));
+	packmsg_output_reset(&out);
+	packmsg_add_uint8(&out, 0x80);
+	ck_assert(packmsg_output_ok(&out));
+	ck_assert_int_eq(packmsg_output_size(&out, buf), 2);
+}
+END_TEST
+
+START_TEST(deferred_headers)
+{
+	uint8_t buf[64];
+	packmsg_output_t out;
+	packmsg_deferred_t map;
+	packmsg_deferred_t array;
+
+	packmsg_output_init(&out, buf, sizeof buf);
+	packmsg_add_array_deferred(&out, &array, PACKMSG_DEFERRED_16);
+	packmsg_add_nil(&out);
+	packmsg_finish_deferred(&out, &array, 1);
+	ck_assert(packmsg_output_ok(&out));
+	ck_assert_int_eq(packmsg_output_size(&out, buf), 4);
+	ck_assert_mem_eq(buf, "\xdc\x01\x00\xc0", 4);
+
+	packmsg_output_init(&out, buf, sizeof buf);
+	packmsg_add_map_deferred(&out, &map, PACKMSG_DEFERRED_32);
+	packmsg_add_nil(&out);
+	packmsg_add_nil(&out);
+	packmsg_finish_deferred(&out, &map, 1);
+	ck_assert(packmsg_output_ok(&out));
+	ck_assert_int_eq(packmsg_output_size(&out, buf), 7);
+	ck_assert_mem_eq(buf, "\xdf\x01\x00\x00\x00\xc0\xc0", 7);
+
+	packmsg_output_init(&out, buf, sizeof buf);
+	packmsg_add_array_deferred(&out, &array, PACKMSG_DEFERRED_16);
+	packmsg_finish_deferred(&out, &array, 0x10000);
+	ck_assert(!packmsg_output_ok(&out));
+
+	// Nested shrinking headers produce the same output as regular headers.
+	packmsg_output_init(&out, buf, sizeof buf);
+	packmsg_add_map_deferred(&out, &map, PACKMSG_DEFERRED_SHRINK);
+	packmsg_add_str(&out, "compact");
+	packmsg_add_array_deferred(&out, &array, PACKMSG_DEFERRED_SHRINK);
+	for (int i = 0; i < 16; i++)
+		packmsg_add_int8(&out, i);
+	packmsg_finish_deferred(&out, &array, 16);
+	packmsg_add_str(&out, "schema");
+	packmsg_add_int32(&out, 0);
+	packmsg_finish_deferred(&out, &map, 2);
+	ck_assert(packmsg_output_ok(&out));
+	ck_assert_int_eq(packmsg_output_size(&out, buf), 36);
+	ck_assert_mem_eq(buf, "\x82\xa7" "compact" "\xdc\x10\x00" "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f" "\xa6" "schema" "\x00", 36);
+	ck_assert_int_eq(out.len, sizeof buf - 36);
+
+	// Deferred headers survive a growable buffer moving.
+	packmsg_output_init_growable(&out, NULL, NULL, 1);
+	packmsg_add_array_deferred(&out, &array, PACKMSG_DEFERRED_SHRINK);
+	for (int i = 0; i < 100; i++)
+		packmsg_add_str(&out, "0123456789");
+	packmsg_finish_deferred(&out, &array, 100);
+	ck_assert(packmsg_output_ok(&out));
+
+	packmsg_input_t in;
+	packmsg_input_init(&in, packmsg_output_data(&out), packmsg_output_size(&out, packmsg_output_data(&out)));
+	ck_assert_int_eq(in.len, 3 + 100 * 11);
+	ck_assert_int_eq(packmsg_get_array(&in), 100);
+	for (int i = 0; i < 100; i++)
+		packmsg_skip_object(&in);
+	ck_assert(packmsg_done(&in));
+	packmsg_output_free(&out);
+}
+END_TEST
+
+static void add_iov_message(packmsg_output_t *out, const char *str, const uint8_t *blob)
+{
+	packmsg_add_map(out, 4);
+	packmsg_add_str(out, "str");
+	packmsg_add_str(out, str);
+	packmsg_add_str(out, "bin");
+	packmsg_add_bin(out, blob, 1000);
+	packmsg_add_str(out, "ext");
+	packmsg_add_ext(out, 42, blob, 300);
+	packmsg_add_str(out, "fixext");
+	packmsg_add_ext(out, 43, blob, 16);
+}
+
+static size_t gather(uint8_t *dst, const struct iovec *iov, size_t iovcnt)
+{
+	size_t total = 0;
+	for (size_t i = 0; i < iovcnt; i++) {
+		memcpy(dst + total, iov[i].iov_base, iov[i].iov_len);
+		total += iov[i].iov_len;
+	}
+	return total;
+}
+
+START_TEST(iov_output)
+{
+	static uint8_t blob[1000];
+	for (size_t i = 0; i < sizeof blob; i++)
+		blob[i] = i * 7;
+	const char *str = "0123456789012345678901234567890123456789";
+
+	uint8_t expected[2048];
+	packmsg_output_t out;
+	packmsg_output_init(&out, expected, sizeof expected);
+	add_iov_message(&out, str, blob);
+	ck_assert(packmsg_output_ok(&out));
+	size_t expected_len = packmsg_output_size(&out, expected);
+
+	// Large payloads are referenced, small ones copied.
+	uint8_t buf[64];
+	struct iovec iov[8];
+	size_t iovcnt;
+	packmsg_output_init(&out, buf, sizeof buf);
+	packmsg_output_set_iov(&out, iov, 8, 32);
+	add_iov_message(&out, str, blob);
+	ck_assert(packmsg_output_ok(&out));
+	ck_assert_ptr_nonnull(packmsg_output_iov(&out, &iovcnt));
+	ck_assert_int_eq(iovcnt, 7);
+	ck_assert_ptr_eq(iov[1].iov_base, str);
+	ck_assert_ptr_eq(iov[3].iov_base, blob);
+	ck_assert_ptr_eq(iov[5].iov_base, blob);
+
+	uint8_t gathered[2048];
+	ck_assert_int_eq(gather(gathered, iov, iovcnt), expected_len);
+	ck_assert_mem_eq(gathered, expected, expected_len);
+
+	// Running out of entries falls back to copying.
+	uint8_t big[2048];
+	packmsg_output_init(&out, big, sizeof big);
+	packmsg_output_set_iov(&out, iov, 4, 32);
+	add_iov_message(&out, str, blob);
+	ck_assert_ptr_nonnull(packmsg_output_iov(&out, &iovcnt));
+	ck_assert_int_eq(iovcnt, 3);
+	ck_assert_int_eq(gather(gathered, iov, iovcnt), expected_len);
+	ck_assert_mem_eq(gathered, expected, expected_len);
+
+	// Resetting clears the list, and growable buffers can move.
+	packmsg_output_init_growable(&out, NULL, NULL, 1);
+	packmsg_output_set_iov(&out, iov, 8, 500);
+	packmsg_add_nil(&out);
+	packmsg_output_reset(&out);
+	add_iov_message(&out, str, blob);
+	ck_assert_ptr_nonnull(packmsg_output_iov(&out, &iovcnt));
+	ck_assert_int_eq(iovcnt, 3);
+	ck_assert_ptr_eq(iov[0].iov_base, packmsg_output_data(&out));
+	ck_assert_ptr_eq(iov[1].iov_base, blob);
+	ck_assert_int_eq(gather(gathered, iov, iovcnt), expected_len);
+	ck_assert_mem_eq(gathered, expected, expected_len);
+	packmsg_output_free(&out);
+
+	// Deferred headers are not shrunk once their contents have been referenced.
+	packmsg_deferred_t array;
+	packmsg_output_init(&out, buf, sizeof buf);
+	packmsg_output_set_iov(&out, iov, 8, 32);
+	packmsg_add_array_deferred(&out, &array, PACKMSG_DEFERRED_SHRINK);
+	packmsg_add_str(&out, str);
+	packmsg_finish_deferred(&out, &array, 1);
+	ck_assert_ptr_nonnull(packmsg_output_iov(&out, &iovcnt));
+	ck_assert_int_eq(iovcnt, 2);
+	ck_assert_int_eq(gather(gathered, iov, iovcnt), 47);
+	ck_assert_mem_eq(gathered, "\xdd\x01\x00\x00\x00\xd9\x28", 7);
+
+	// Errors are reported.
+	packmsg_output_init(&out, buf, 4);
+	packmsg_output_set_iov(&out, iov, 8, 32);
+	add_iov_message(&out, str, blob);
+	ck_assert_ptr_null(packmsg_output_iov(&out, &iovcnt));
+	ck_assert_int_eq(iovcnt, 0);
+}
+END_TEST
+
+START_TEST(add_int_arrays)
+{
+	int64_t sval[100];
+	uint64_t uval[100];
+	int64_t ranges[] = {0, 1, -1, 31, -32, 127, -33, 128, INT8_MIN, INT8_MAX, INT16_MIN, INT16_MAX, 1 + INT16_MAX, INT32_MIN, INT32_MAX, 1LL + INT32_MAX, INT64_MIN, INT64_MAX};
+
+	// Leading fixints exercise the bulk path, the rest the mixed path.
+	for (int i = 0; i < 100; i++) {
+		sval[i] = i < 40 ? i - 32 : ranges[i % 18] ^ (i & 1);
+		uval[i] = i < 40 ? (uint64_t)i : (uint64_t)ranges[i % 18] ^ (i & 1);
+	}
+
+	uint8_t expected[1024];
+	uint8_t buf[1024];
+	packmsg_output_t exp;
+	packmsg_output_t out;
+
+#define CHECK_ARRAY(name, type, values) {\
+		type data[100];\
+		for (int i = 0; i < 100; i++)\
+			data[i] = (type)values[i];\
+		packmsg_output_init(&exp, expected, sizeof expected);\
+		packmsg_add_array(&exp, 100);\
+		for (int i = 0; i < 100; i++)\
+			packmsg_add_##name(&exp, data[i]);\
+		ck_assert(packmsg_output_ok(&exp));\
+		size_t len = packmsg_output_size(&exp, expected);\
+		packmsg_output_init(&out, buf, sizeof buf);\
+		packmsg_add_##name##_array(&out, data, 100);\
+		ck_assert(packmsg_output_ok(&out));\
+		ck_assert_int_eq(packmsg_output_size(&out, buf), len);\
+		ck_assert_mem_eq(buf, expected, len);\
+		packmsg_output_init(&out, buf, len);\
+		packmsg_add_##name##_array(&out, data, 100);\
+		ck_assert(packmsg_output_ok(&out));\
+		ck_assert_mem_eq(buf, expected, len);\
+		packmsg_output_init(&out, buf, len - 1);\
+		packmsg_add_##name##_array(&out, data, 100);\
+		ck_assert(!packmsg_output_ok(&out));\
+	}
+
+	CHECK_ARRAY(int8, int8_t, sval)
+	CHECK_ARRAY(int16, int16_t, sval)
+	CHECK_ARRAY(int32, int32_t, sval)
+	CHECK_ARRAY(int64, int64_t, sval)
+	CHECK_ARRAY(uint8, uint8_t, uval)
+	CHECK_ARRAY(uint16, uint16_t, uval)
+	CHECK_ARRAY(uint32, uint32_t, uval)
+	CHECK_ARRAY(uint64, uint64_t, uval)
+	CHECK_ARRAY(float, float, sval)
+	CHECK_ARRAY(double, double, sval)
+
+#undef CHECK_ARRAY
+
+	packmsg_output_init_growable(&out, NULL, NULL, 0);
+	packmsg_add_int64_array(&out, sval, 100);
+	ck_assert(packmsg_output_ok(&out));
+	packmsg_input_t in;
+	packmsg_input_init(&in, packmsg_output_data(&out), packmsg_output_size(&out, packmsg_output_data(&out)));
+	ck_assert_int_eq(packmsg_get_array(&in), 100);
+	for (int i = 0; i < 100; i++)
+		ck_assert_int_eq(packmsg_get_int64(&in), sval[i]);
+	ck_assert(packmsg_done(&in));
+	packmsg_output_free(&out);
+}
+END_TEST
+
+START_TEST(get_int_arrays)
+{
+	int64_t sval[100];
+	uint64_t uval[100];
+	int64_t ranges[] = {0, 1, -1, 31, -32, 127, -33, 128, INT8_MIN, INT8_MAX, INT16_MIN, INT16_MAX, 1 + INT16_MAX, INT32_MIN, INT32_MAX, 1LL + INT32_MAX, INT64_MIN, INT64_MAX};
+
+	// Fixints, then full-width values, then a mix of everything.
+	for (int i = 0; i < 100; i++) {
+		sval[i] = i < 32 ? i - 32 : i < 64 ? INT64_MIN + i : ranges[i % 18] ^ (i & 1);
+		uval[i] = i < 32 ? (uint64_t)i : i < 64 ? UINT64_MAX - i : (uint64_t)ranges[i % 18] ^ (i & 1);
+	}
+
+	uint8_t buf[1024];
+	packmsg_output_t out;
+
+#define CHECK_ARRAY(name, type, values) {\
+		type data[100];\
+		type result[100];\
+		for (int i = 0; i < 100; i++)\
+			data[i] = (type)values[i];\
+		packmsg_output_init(&out, buf, sizeof buf);\
+		packmsg_add_array(&out, 100);\
+		for (int i = 0; i < 100; i++)\
+			packmsg_add_##name(&out, data[i]);\
+		ck_assert(packmsg_output_ok(&out));\
+		size_t len = packmsg_output_size(&out, buf);\
+		packmsg_input_t in;\
+		packmsg_input_init(&in, buf, len);\
+		ck_assert_int_eq(packmsg_get_##name##_array(&in, result, 100), 100);\
+		ck_assert(packmsg_done(&in));\
+		ck_assert_mem_eq(result, data, sizeof data);\
+		in.ptr = buf;\
+		in.len = len;\
+		ck_assert_int_eq(packmsg_get_##name##_array(&in, result, 99), 0);\
+		ck_assert(!packmsg_input_ok(&in));\
+		if (TEST_BOUNDS_CHECKED) {\
+			in.ptr = buf;\
+			in.len = len - 1;\
+			ck_assert_int_eq(packmsg_get_##name##_array(&in, result, 100), 0);\
+			ck_assert(!packmsg_input_ok(&in));\
+			for (int i = 0; i < 100; i++)\
+				ck_assert(result[i] == 0);\
+		}\
+	}
+
+	CHECK_ARRAY(int8, int8_t, sval)
+	CHECK_ARRAY(int16, int16_t, sval)
+	CHECK_ARRAY(int32, int32_t, sval)
+	CHECK_ARRAY(int64, int64_t, sval)
+	CHECK_ARRAY(uint8, uint8_t, uval)
+	CHECK_ARRAY(uint16, uint16_t, uval)
+	CHECK_ARRAY(uint32, uint32_t, uval)
+	CHECK_ARRAY(uint64, uint64_t, uval)
+	CHECK_ARRAY(float, float, sval)
+	CHECK_ARRAY(double, double, sval)
+
+#undef CHECK_ARRAY
+
+	// Elements of the wrong type are rejected.
+	int32_t i32[4];
+	uint32_t u32[4];
+	packmsg_input_t in;
+	packmsg_input_init(&in, "\x93\x01\xcc\x80\x02", 5);
+	ck_assert_int_eq(packmsg_get_uint32_array(&in, u32, 4), 3);
+	ck_assert(packmsg_done(&in));
+	ck_assert_int_eq(u32[1], 0x80);
+	in.ptr = (const uint8_t *)"\x93\x01\xcc\x80\x02";
+	in.len = 5;
+	ck_assert_int_eq(packmsg_get_int32_array(&in, i32, 4), 0);
+	ck_assert(!packmsg_input_ok(&in));
+
+	// Empty arrays can be read without a buffer, and errors leave it untouched.
+	packmsg_input_init(&in, "\x90\x90", 2);
+	ck_assert_int_eq(packmsg_get_uint32_array(&in, NULL, 0), 0);
+	ck_assert_int_eq(packmsg_get_float_array(&in, NULL, 0), 0);
+	ck_assert(packmsg_done(&in));
+
+	if (TEST_BOUNDS_CHECKED) {
+		ck_assert_int_eq(packmsg_get_int8_array(&in, NULL, 0), 0);
+		ck_assert_int_eq(packmsg_get_double_array(&in, NULL, 0), 0);
+		ck_assert_int_eq(packmsg_get_float_array(&in, NULL, 0), 0);
+		ck_assert(!packmsg_input_ok(&in));
+	}
+
+	// Doubles can be read from a mix of floats and doubles.
+	double dbl[20];
+	packmsg_output_init(&out, buf, sizeof buf);
+	packmsg_add_array(&out, 20);
+	for (int i = 0; i < 20; i++) {
+		if (i == 17)
+			packmsg_add_float(&out, 0.5);
+		else
+			packmsg_add_double(&out, i);
+	}
+	in.ptr = buf;
+	in.len = packmsg_output_size(&out, buf);
+	ck_assert_int_eq(packmsg_get_double_array(&in, dbl, 20), 20);
+	ck_assert(packmsg_done(&in));
+	ck_assert_double_eq(dbl[16], 16);
+	ck_assert_double_eq(dbl[17], 0.5);
+	ck_assert_double_eq(dbl[19], 19);
+}
+END_TEST
+
+START_TEST(validate)
+{
+	uint8_t buf[1024];
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof buf);
+
+	packmsg_add_map(&out, 2);
+	packmsg_add_str(&out, "a");
+	packmsg_add_array(&out, 2);
+	packmsg_add_ext(&out, 1, "\x01\x02\x03", 3);
+	packmsg_add_map(&out, 0);
+	packmsg_add_str(&out, "0123456789012345678901234567890123456789");
+	packmsg_add_bin(&out, "\x01\x02\x03", 3);
+	packmsg_add_uint64(&out, UINT64_MAX);
+	ck_assert(packmsg_output_ok(&out));
+	size_t size = packmsg_output_size(&out, buf);
+
+	ck_assert(packmsg_validate(buf, size, 2, 2));
+	ck_assert(!packmsg_validate(buf, size, 1, 2));
+	ck_assert(!packmsg_validate(buf, size, 3, 2));
+	ck_assert(!packmsg_validate(buf, size, 2, 1));
+	ck_assert(packmsg_validate(buf, 0, 0, 0));
+
+	// Truncating the buffer anywhere must be detected.
+	for (size_t i = 0; i < size; i++)
+		ck_assert(!packmsg_validate(buf, i, 2, 2));
+
+	// Invalid headers and impossible counts.
+	ck_assert(!packmsg_validate("\xc1", 1, 1, 1));
+	ck_assert(!packmsg_validate("\x92\xc0", 2, 1, 1));
+	ck_assert(!packmsg_validate("\xdd\xff\xff\xff\xff\xc0", 6, 1, 1));
+	ck_assert(!packmsg_validate("\xdb\x00\x00\x00\x80", 5, 1, 1));
+
+	// The depth is limited to PACKMSG_MAX_DEPTH.
+	memset(buf, 0x91, PACKMSG_MAX_DEPTH + 1);
+	buf[PACKMSG_MAX_DEPTH + 1] = 0xc0;
+	ck_assert(packmsg_validate(buf + 1, PACKMSG_MAX_DEPTH + 1, 1, UINT32_MAX));
+	ck_assert(!packmsg_validate(buf, PACKMSG_MAX_DEPTH + 2, 1, UINT32_MAX));
+}
+END_TEST
+
+START_TEST(find_boundaries)
+{
+	uint8_t buf[1024];
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof buf);
+
+	packmsg_add_int32(&out, 1);
+	packmsg_add_int32(&out, -1);
+	packmsg_add_array(&out, 40);
+	for (int i = 0; i < 40; i++)
+		packmsg_add_int32(&out, i - 20);
+	packmsg_add_map(&out, 2);
+	packmsg_add_str(&out, "a");
+	packmsg_add_array(&out, 17);
+	for (int i = 0; i < 16; i++)
+		packmsg_add_int32(&out, i);
+	packmsg_add_map(&out, 0);
+	packmsg_add_str(&out, "b");
+	packmsg_add_bin(&out, "\x01\x02\x03", 3);
+	packmsg_add_str(&out, "0123456789012345678901234567890123456789");
+	packmsg_add_array(&out, 1);
+	packmsg_add_uint64(&out, UINT64_MAX);
+	ck_assert(packmsg_output_ok(&out));
+	size_t size = packmsg_output_size(&out, buf);
+
+	// Compare with packmsg_skip_object().
+	size_t expected[16];
+	size_t nexpected = 0;
+	packmsg_input_t in;
+	packmsg_input_init(&in, buf, size);
+
+	while (!packmsg_done(&in)) {
+		expected[nexpected++] = in.ptr - buf;
+		packmsg_skip_object(&in);
+		ck_assert(packmsg_input_ok(&in));
+	}
+
+	ck_assert_int_eq(nexpected, 6);
+
+	size_t offsets[16];
+	size_t used;
+	ck_assert_int_eq(packmsg_find_boundaries(buf, size, offsets, 16, &used), 6);
+	ck_assert_int_eq(used, size);
+	ck_assert_mem_eq(offsets, expected, sizeof(size_t) * 6);
+	ck_assert_int_eq(packmsg_count_records(buf, size, &used), 6);
+	ck_assert_int_eq(used, size);
+
+	ck_assert_int_eq(packmsg_find_boundaries(buf, size, offsets, 3, &used), 3);
+	ck_assert_int_eq(used, expected[3]);
+	ck_assert_int_eq(packmsg_count_records(buf, 0, NULL), 0);
+
+	// Truncation stops at the last complete object.
+	for (size_t i = 0; i < size; i++) {
+		size_t n = 0;
+		while (n < nexpected && (n + 1 == nexpected ? size : expected[n + 1]) <= i)
+			n++;
+		ck_assert_int_eq(packmsg_count_records(buf, i, &used), n);
+		ck_assert_int_eq(used, n ? (n == nexpected ? size : expected[n]) : 0);
+	}
+
+	// Invalid headers and the depth limit.
+	ck_assert_int_eq(packmsg_count_records("\x01\xc1\x02", 3, &used), 1);
+	ck_assert_int_eq(used, 1);
+	memset(buf, 0x91, PACKMSG_MAX_DEPTH + 1);
+	buf[PACKMSG_MAX_DEPTH + 1] = 0xc0;
+	ck_assert_int_eq(packmsg_count_records(buf + 1, PACKMSG_MAX_DEPTH + 1, NULL), 1);
+	ck_assert_int_eq(packmsg_count_records(buf, PACKMSG_MAX_DEPTH + 2, NULL), 0);
+}
+END_TEST
+
+START_TEST(typed_arrays)
+{
+	_Alignas(16) uint8_t buf[256];
+	packmsg_output_t out;
+	int32_t values[10];
+	for (int i = 0; i < 10; i++)
+		values[i] = i * 100000 - 500000;
+
+	packmsg_output_init(&out, buf, sizeof buf);
+	packmsg_add_typed_array(&out, PACKMSG_DTYPE_UINT8, "\x01\x02", 2, 0);
+	packmsg_add_nil(&out);
+	packmsg_add_typed_array(&out, PACKMSG_DTYPE_INT32, values, 10, 16);
+	packmsg_add_typed_array(&out, PACKMSG_DTYPE_DOUBLE, NULL, 0, 0);
+	ck_assert(packmsg_output_ok(&out));
+	ck_assert_mem_eq(buf, "\xd6\xfe\x04\x00\x01\x02\xc0", 7);
+	ck_assert_mem_eq(buf + 7, "\xc9\x2b\x00\x00\x00\xfe\x02\x01\x00", 9);
+
+	packmsg_input_t in;
+	packmsg_input_init(&in, buf, packmsg_output_size(&out, buf));
+	enum packmsg_dtype dtype;
+	const void *data;
+	uint32_t count;
+
+	ck_assert(packmsg_get_type(&in) == PACKMSG_EXT);
+	ck_assert(packmsg_is_typed_array(&in));
+	ck_assert_int_eq(packmsg_get_typed_array_raw(&in, &dtype, &data), 2);
+	ck_assert(dtype == PACKMSG_DTYPE_UINT8);
+	ck_assert_mem_eq(data, "\x01\x02", 2);
+	ck_assert(!packmsg_is_typed_array(&in));
+	packmsg_get_nil(&in);
+
+	const int32_t *elements = packmsg_get_int32_typed_array(&in, &count);
+	ck_assert_ptr_nonnull(elements);
+	ck_assert_int_eq(count, 10);
+	ck_assert_int_eq((uintptr_t)elements % 16, 0);
+	ck_assert_mem_eq(elements, values, sizeof values);
+
+	ck_assert_ptr_nonnull(packmsg_get_double_typed_array(&in, &count));
+	ck_assert_int_eq(count, 0);
+	ck_assert(packmsg_done(&in));
+
+	// Wrong types and misaligned elements are rejected, copies are always possible.
+	int32_t copy[10];
+	in.ptr = buf + 7;
+	in.len = packmsg_output_size(&out, buf) - 7;
+	ck_assert_ptr_null(packmsg_get_int64_typed_array(&in, &count));
+	ck_assert_int_eq(count, 0);
+	ck_assert(!packmsg_input_ok(&in));
+
+	memmove(buf + 1, buf, sizeof buf - 1);
+	in.ptr = buf + 8;
+	in.len = packmsg_output_size(&out, buf) - 7;
+	ck_assert_int_eq(packmsg_get_typed_array_copy(&in, PACKMSG_DTYPE_INT32, copy, 10), 10);
+	ck_assert_mem_eq(copy, values, sizeof values);
+	in.ptr = buf + 8;
+	in.len = packmsg_output_size(&out, buf) - 7;
+	ck_assert_ptr_null(packmsg_get_int32_typed_array(&in, &count));
+	in.ptr = buf + 8;
+	in.len = packmsg_output_size(&out, buf) - 7;
+	ck_assert_int_eq(packmsg_get_typed_array_copy(&in, PACKMSG_DTYPE_INT32, copy, 9), 0);
+	ck_assert(!packmsg_input_ok(&in));
+
+	// Malformed typed arrays.
+	in.ptr = (const uint8_t *)"\xd5\xfe\x0a\x00";
+	in.len = 4;
+	ck_assert(!packmsg_is_typed_array(&in));
+	in.len = 3;
+	ck_assert(!packmsg_is_typed_array(&in));
+	in.len = 4;
+	ck_assert_int_eq(packmsg_get_typed_array_raw(&in, &dtype, &data), 0);
+	ck_assert_ptr_null(data);
+	ck_assert(!packmsg_input_ok(&in));
+	in.ptr = (const uint8_t *)"\xd6\xfe\x01\x00\x01\x02";
+	in.len = 5;
+	ck_assert(!packmsg_is_typed_array(&in));
+	in.len = 6;
+	ck_assert(packmsg_is_typed_array(&in));
+	ck_assert_int_eq(packmsg_get_typed_array_raw(&in, &dtype, &data), 1);
+	in.ptr = (const uint8_t *)"\xd6\xfe\x02\x00\x01\x02";
+	ck_assert(!packmsg_is_typed_array(&in));
+	ck_assert_int_eq(packmsg_get_typed_array_raw(&in, &dtype, &data), 0);
+	in.ptr = (const uint8_t *)"\xd6\xfe\x01\x03\x01\x02";
+	in.len = 6;
+	ck_assert_int_eq(packmsg_get_typed_array_raw(&in, &dtype, &data), 0);
+
+	// Large typed arrays can be referenced in scatter-gather mode.
+	struct iovec iov[4];
+	size_t iovcnt;
+	packmsg_output_init(&out, buf, sizeof buf);
+	packmsg_output_set_iov(&out, iov, 4, 32);
+	packmsg_add_typed_array(&out, PACKMSG_DTYPE_INT32, values, 10, 0);
+	ck_assert_ptr_nonnull(packmsg_output_iov(&out, &iovcnt));
+	ck_assert_int_eq(iovcnt, 2);
+	ck_assert_ptr_eq(iov[1].iov_base, values);
+
+	// Referenced data counts towards the alignment of later typed arrays.
+	static const char blob[33];
+	_Alignas(16) uint8_t gathered[256];
+	size_t total = 0;
+	packmsg_output_init(&out, buf, sizeof buf);
+	packmsg_output_set_iov(&out, iov, 4, 32);
+	packmsg_add_bin(&out, blob, sizeof blob);
+	packmsg_add_typed_array(&out, PACKMSG_DTYPE_INT32, values, 4, 16);
+	ck_assert_ptr_nonnull(packmsg_output_iov(&out, &iovcnt));
+	ck_assert_int_eq(iovcnt, 3);
+	ck_assert_ptr_eq(iov[1].iov_base, blob);
+	for (size_t i = 0; i < iovcnt; i++) {
+		memcpy(gathered + total, iov[i].iov_base, iov[i].iov_len);
+		total += iov[i].iov_len;
+	}
+
+	packmsg_input_init(&in, gathered, total);
+	ck_assert_int_eq(packmsg_get_bin_raw(&in, &data), sizeof blob);
+	elements = packmsg_get_int32_typed_array(&in, &count);
+	ck_assert_ptr_nonnull(elements);
+	ck_assert_int_eq(count, 4);
+	ck_assert_mem_eq(elements, values, 4 * sizeof *values);
+	ck_assert(packmsg_done(&in));
+}
+END_TEST
+
+START_TEST(stream_decoder)
+{
+	uint8_t buf[1024];
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof buf);
+
+	// A nested message, followed by a scalar message and an empty array.
+	packmsg_add_map(&out, 3);
+	packmsg_add_str(&out, "compact");
+	packmsg_add_bool(&out, true);
+	packmsg_add_str(&out, "array");
+	packmsg_add_array(&out, 20);
+	for (int i = 0; i < 20; i++)
+		packmsg_add_uint32(&out, i * 10000);
+	packmsg_add_str(&out, "nested");
+	packmsg_add_map(&out, 1);
+	packmsg_add_ext(&out, 1, "0123456789", 10);
+	packmsg_add_array(&out, 1);
+	packmsg_add_bin(&out, "\x01", 1);
+	size_t sizes[3];
+	sizes[0] = packmsg_output_size(&out, buf);
+	packmsg_add_str(&out, "0123456789012345678901234567890123456789");
+	sizes[1] = packmsg_output_size(&out, buf) - sizes[0];
+	packmsg_add_array(&out, 0);
+	sizes[2] = 1;
+	ck_assert(packmsg_output_ok(&out));
+	size_t total = packmsg_output_size(&out, buf);
+
+	// Feed the data in chunks of every size, messages must be found at the right offsets.
+	for (size_t chunk = 1; chunk <= total; chunk++) {
+		packmsg_stream_t stream;
+		packmsg_stream_init(&stream);
+		size_t pos = 0;
+		size_t start = 0;
+		int found = 0;
+
+		while (pos < total) {
+			size_t len = total - pos < chunk ? total - pos : chunk;
+			size_t consumed;
+			enum packmsg_stream_status status = packmsg_stream_feed(&stream, buf + pos, len, &consumed);
+			pos += consumed;
+
+			if (status == PACKMSG_STREAM_COMPLETE) {
+				ck_assert_int_lt(found, 3);
+				ck_assert_int_eq(packmsg_stream_size(&stream), sizes[found]);
+				ck_assert_int_eq(pos - start, sizes[found]);
+
+				packmsg_input_t in;
+				packmsg_input_init(&in, buf + start, pos - start);
+				packmsg_skip_object(&in);
+				ck_assert(packmsg_done(&in));
+
+				start = pos;
+				found++;
+			} else {
+				ck_assert(status == PACKMSG_STREAM_MORE);
+				ck_assert_int_eq(consumed, len);
+			}
+		}
+
+		ck_assert_int_eq(found, 3);
+	}
+
+	// Invalid headers and too deep nesting are errors.
+	packmsg_stream_t stream;
+	size_t consumed;
+	packmsg_stream_init(&stream);
+	ck_assert(packmsg_stream_feed(&stream, "\x92\x01\xc1", 3, &consumed) == PACKMSG_STREAM_ERROR);
+	ck_assert(packmsg_stream_feed(&stream, "\x01", 1, &consumed) == PACKMSG_STREAM_ERROR);
+
+	memset(buf, 0x91, PACKMSG_MAX_DEPTH);
+	buf[PACKMSG_MAX_DEPTH] = 0x01;
+	packmsg_stream_init(&stream);
+	ck_assert(packmsg_stream_feed(&stream, buf, PACKMSG_MAX_DEPTH + 1, &consumed) == PACKMSG_STREAM_COMPLETE);
+	ck_assert_int_eq(consumed, PACKMSG_MAX_DEPTH + 1);
+	buf[PACKMSG_MAX_DEPTH] = 0x91;
+	packmsg_stream_init(&stream);
+	ck_assert(packmsg_stream_feed(&stream, buf, PACKMSG_MAX_DEPTH + 1, &consumed) == PACKMSG_STREAM_ERROR);
+}
+END_TEST
+
+START_TEST(structural_index)
+{
+	uint8_t buf[1024];
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof buf);
+
+	packmsg_add_map(&out, 3);
+	packmsg_add_str(&out, "users");
+	packmsg_add_array(&out, 4);
+	for (int i = 0; i < 4; i++) {
+		packmsg_add_map(&out, 2);
+		packmsg_add_str(&out, "id");
+		packmsg_add_uint32(&out, i * 1000);
+		packmsg_add_str(&out, "tags");
+		packmsg_add_array(&out, i);
+		for (int j = 0; j < i; j++)
+			packmsg_add_int8(&out, -j);
+	}
+	packmsg_add_str(&out, "values");
+	packmsg_add_array(&out, 3);
+	packmsg_add_double(&out, 1.5);
+	packmsg_add_nil(&out);
+	packmsg_add_bin(&out, "\x01\x02", 2);
+	packmsg_add_str(&out, "empty");
+	packmsg_add_map(&out, 0);
+	packmsg_add_int32(&out, 42);
+	ck_assert(packmsg_output_ok(&out));
+	size_t size = packmsg_output_size(&out, buf);
+
+	packmsg_input_t in;
+	packmsg_input_init(&in, buf, size);
+	packmsg_index_entry_t entries[PACKMSG_MAX_DEPTH + 2];
+	packmsg_index_t index;
+	packmsg_index_init(&index, entries, PACKMSG_MAX_DEPTH + 2);
+	uint32_t count = packmsg_index(&in, &index);
+	ck_assert_int_eq(count, 36);
+	ck_assert_int_eq(in.len, 1);
+	ck_assert_int_eq(packmsg_get_int32(&in), 42);
+	ck_assert(packmsg_done(&in));
+
+	ck_assert(entries[0].type == PACKMSG_MAP);
+	ck_assert_int_eq(entries[0].offset, 0);
+	ck_assert_int_eq(entries[0].length, size - 1);
+	ck_assert_int_eq(entries[0].end, count);
+	ck_assert_int_eq(packmsg_index_children(&index, 0), 6);
+
+	// Random access to nested elements.
+	uint32_t users = packmsg_index_child(&index, 0, 1);
+	ck_assert(entries[users].type == PACKMSG_ARRAY);
+	ck_assert_int_eq(packmsg_index_children(&index, users), 4);
+	uint32_t user = packmsg_index_child(&index, users, 3);
+	ck_assert(entries[user].type == PACKMSG_MAP);
+	uint32_t id = packmsg_index_child(&index, user, 1);
+	packmsg_index_input(&index, id, &in);
+	ck_assert_int_eq(packmsg_get_uint32(&in), 3000);
+	ck_assert(packmsg_done(&in));
+	uint32_t tags = packmsg_index_child(&index, user, 3);
+	ck_assert_int_eq(packmsg_index_children(&index, tags), 3);
+	packmsg_index_input(&index, packmsg_index_child(&index, tags, 2), &in);
+	ck_assert_int_eq(packmsg_get_int8(&in), -2);
+	ck_assert(packmsg_done(&in));
+
+	// A whole subtree can be decoded on its own.
+	packmsg_index_input(&index, packmsg_index_child(&index, users, 2), &in);
+	packmsg_skip_object(&in);
+	ck_assert(packmsg_done(&in));
+
+	uint32_t values = packmsg_index_child(&index, 0, 3);
+	ck_assert_int_eq(entries[values].end, values + 4);
+	ck_assert(entries[packmsg_index_child(&index, values, 1)].type == PACKMSG_NIL);
+	packmsg_index_input(&index, packmsg_index_child(&index, values, 2), &in);
+	const void *data;
+	ck_assert_int_eq(packmsg_get_bin_raw(&in, &data), 2);
+	ck_assert_mem_eq(data, "\x01\x02", 2);
+
+	uint32_t empty = packmsg_index_child(&index, 0, 5);
+	ck_assert(entries[empty].type == PACKMSG_MAP);
+	ck_assert_int_eq(entries[empty].end, count);
+	ck_assert_int_eq(packmsg_index_children(&index, empty), 0);
+	ck_assert_int_eq(packmsg_index_child(&index, empty, 0), 0);
+	ck_assert_int_eq(packmsg_index_child(&index, values, 3), 0);
+	packmsg_index_input(&index, count, &in);
+	ck_assert(!packmsg_input_ok(&in));
+
+	// Children can be found directly, and agree with walking the siblings.
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t child = i + 1;
+
+		for (uint32_t j = 0; j < packmsg_index_children(&index, i); j++) {
+			ck_assert_int_eq(packmsg_index_child(&index, i, j), child);
+			child = entries[child].end;
+		}
+
+		if (packmsg_index_children(&index, i))
+			ck_assert_int_eq(child, entries[i].end);
+	}
+
+	// Too few entries, truncated input and too deep nesting are errors.
+	packmsg_input_init(&in, buf, size);
+	packmsg_index_init(&index, entries, 35);
+	ck_assert_int_eq(packmsg_index(&in, &index), 0);
+	ck_assert(!packmsg_input_ok(&in));
+
+	packmsg_input_init(&in, buf, size - 2);
+	packmsg_index_init(&index, entries, PACKMSG_MAX_DEPTH + 2);
+	ck_assert_int_eq(packmsg_index(&in, &index), 0);
+	ck_assert(!packmsg_input_ok(&in));
+
+	memset(buf, 0x91, PACKMSG_MAX_DEPTH + 1);
+	buf[PACKMSG_MAX_DEPTH] = 0x01;
+	packmsg_input_init(&in, buf, PACKMSG_MAX_DEPTH + 1);
+	packmsg_index_init(&index, entries, PACKMSG_MAX_DEPTH + 2);
+	ck_assert_int_eq(packmsg_index(&in, &index), PACKMSG_MAX_DEPTH + 1);
+	buf[PACKMSG_MAX_DEPTH] = 0x91;
+	buf[PACKMSG_MAX_DEPTH + 1] = 0x01;
+	packmsg_input_init(&in, buf, PACKMSG_MAX_DEPTH + 2);
+	packmsg_index_init(&index, entries, PACKMSG_MAX_DEPTH + 2);
+	ck_assert_int_eq(packmsg_index(&in, &index), 0);
+	ck_assert(!packmsg_input_ok(&in));
+}
+END_TEST
+
+START_TEST(object_view)
+{
+	uint8_t buf[1024];
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof buf);
+
+	// {"name": "packmsg", "list": [1, [2, 3], "four"], "empty": {}}
+	packmsg_add_map(&out, 3);
+	packmsg_add_str(&out, "name");
+	packmsg_add_str(&out, "packmsg");
+	packmsg_add_str(&out, "list");
+	packmsg_add_array(&out, 3);
+	packmsg_add_int32(&out, 1);
+	packmsg_add_array(&out, 2);
+	packmsg_add_int32(&out, 2);
+	packmsg_add_int32(&out, 3);
+	packmsg_add_str(&out, "four");
+	packmsg_add_str(&out, "empty");
+	packmsg_add_map(&out, 0);
+	packmsg_add_nil(&out);
+	ck_assert(packmsg_output_ok(&out));
+	size_t size = packmsg_output_size(&out, buf);
+
+	uint8_t region[1024];
+	packmsg_arena_t arena;
+	packmsg_arena_init(&arena, region, sizeof region);
+
+	packmsg_input_t in;
+	packmsg_input_init(&in, buf, size);
+	packmsg_node_t *root = packmsg_node_parse(&in, &arena);
+	ck_assert_ptr_nonnull(root);
+	ck_assert(root->type == PACKMSG_MAP);
+	ck_assert_ptr_null(root->children);
+	ck_assert_int_eq(packmsg_node_children(root), 6);
+	ck_assert(packmsg_is_nil(&in));
+
+	// Children are only created when accessed, in any order.
+	packmsg_node_t *list = packmsg_node_find(root, "list", 4, &arena);
+	ck_assert_ptr_nonnull(list);
+	ck_assert_ptr_null(list->children);
+
+	packmsg_node_t *four = packmsg_node_child(list, 2, &arena);
+	ck_assert_ptr_nonnull(four);
+	packmsg_input_t value;
+	packmsg_node_input(four, &value);
+	const char *str;
+	ck_assert_int_eq(packmsg_get_str_raw(&value, &str), 4);
+	ck_assert(str >= (const char *)buf && str < (const char *)buf + size);
+	ck_assert(!memcmp(str, "four", 4));
+
+	packmsg_node_t *inner = packmsg_node_child(list, 1, &arena);
+	ck_assert_ptr_nonnull(inner);
+	packmsg_node_input(packmsg_node_child(inner, 1, &arena), &value);
+	ck_assert_int_eq(packmsg_get_int32(&value), 3);
+	packmsg_node_input(packmsg_node_child(list, 0, &arena), &value);
+	ck_assert_int_eq(packmsg_get_int32(&value), 1);
+	ck_assert_ptr_null(packmsg_node_child(list, 3, &arena));
+
+	packmsg_node_t *name = packmsg_node_find(root, "name", 4, &arena);
+	ck_assert_ptr_nonnull(name);
+	packmsg_node_input(name, &value);
+	char copy[16];
+	packmsg_get_str_copy(&value, copy, sizeof copy);
+	ck_assert_str_eq(copy, "packmsg");
+
+	packmsg_node_t *empty = packmsg_node_find(root, "empty", 5, &arena);
+	ck_assert_ptr_nonnull(empty);
+	ck_assert_int_eq(packmsg_node_children(empty), 0);
+	ck_assert_ptr_null(packmsg_node_child(empty, 0, &arena));
+	ck_assert_ptr_null(packmsg_node_find(root, "missing", 7, &arena));
+	ck_assert_ptr_null(packmsg_node_find(list, "list", 4, &arena));
+	ck_assert_ptr_null(packmsg_node_child(name, 0, &arena));
+
+	// Running out of room in the arena.
+	packmsg_arena_init(&arena, region, sizeof(packmsg_node_t) + 2 * sizeof(void *));
+	packmsg_input_init(&in, buf, size);
+	root = packmsg_node_parse(&in, &arena);
+	ck_assert_ptr_nonnull(root);
+	ck_assert_ptr_null(packmsg_node_child(root, 0, &arena));
+	ck_assert_ptr_null(root->children);
+
+	packmsg_arena_init(&arena, region, 0);
+	packmsg_input_init(&in, buf, size);
+	ck_assert_ptr_null(packmsg_node_parse(&in, &arena));
+	ck_assert(!packmsg_input_ok(&in));
+
+	// Invalid input.
+	packmsg_arena_init(&arena, region, sizeof region);
+	packmsg_input_init(&in, buf, size - 2);
+	ck_assert_ptr_null(packmsg_node_parse(&in, &arena));
+	ck_assert(!packmsg_input_ok(&in));
+}
+END_TEST
+
+START_TEST(map_lookup)
+{
+	uint8_t buf[4096];
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof buf);
+
+	packmsg_add_map(&out, 103);
+	packmsg_add_str(&out, "nested");
+	packmsg_add_map(&out, 1);
+	packmsg_add_str(&out, "name");
+	packmsg_add_array(&out, 2);
+	packmsg_add_nil(&out);
+	packmsg_add_nil(&out);
+	packmsg_add_int8(&out, 1);
+	packmsg_add_str(&out, "not a string key");
+	for (int i = 0; i < 100; i++) {
+		char key[16];
+		snprintf(key, sizeof key, "key%d", i);
+		packmsg_add_str(&out, key);
+		packmsg_add_int32(&out, i * 1000);
+	}
+	packmsg_add_str(&out, "key0");
+	packmsg_add_bool(&out, true);
+	ck_assert(packmsg_output_ok(&out));
+	size_t size = packmsg_output_size(&out, buf);
+
+	packmsg_input_t in;
+	packmsg_input_init(&in, buf, size);
+	ck_assert(packmsg_map_find(&in, "key42", 5));
+	ck_assert_int_eq(packmsg_get_int32(&in), 42000);
+	ck_assert(packmsg_input_ok(&in));
+
+	packmsg_input_init(&in, buf, size);
+	ck_assert(packmsg_map_find(&in, "key0", 4));
+	ck_assert_int_eq(packmsg_get_int32(&in), 0);
+
+	packmsg_input_init(&in, buf, size);
+	ck_assert(packmsg_map_find(&in, "name", 4) == false);
+	ck_assert(packmsg_done(&in));
+
+	packmsg_input_init(&in, buf, size);
+	ck_assert(packmsg_map_find(&in, "nested", 6));
+	ck_assert(packmsg_map_find(&in, "name", 4));
+	ck_assert_int_eq(packmsg_get_array(&in), 2);
+
+	packmsg_input_init(&in, buf, size - 1);
+	ck_assert(packmsg_map_find(&in, "missing", 7) == false);
+	ck_assert(!packmsg_input_ok(&in));
+
+	// Hashed view.
+	packmsg_map_slot_t slots[256];
+	packmsg_map_view_t view;
+	packmsg_map_view_init(&view, slots, 256);
+	packmsg_input_init(&in, buf, size);
+	ck_assert(packmsg_map_view_build(&in, &view));
+	ck_assert(packmsg_done(&in));
+	ck_assert_int_eq(view.count, 101);
+
+	for (int i = 99; i >= 0; i--) {
+		char key[16];
+		int keylen = snprintf(key, sizeof key, "key%d", i);
+		packmsg_input_t value;
+		ck_assert(packmsg_map_view_find(&view, key, keylen, &value));
+		ck_assert_int_eq(packmsg_get_int32(&value), i * 1000);
+		ck_assert(packmsg_done(&value));
+	}
+
+	packmsg_input_t value;
+	ck_assert(packmsg_map_view_find(&view, "nested", 6, &value));
+	ck_assert(packmsg_map_find(&value, "name", 4));
+	ck_assert(!packmsg_map_view_find(&view, "key100", 6, &value));
+	ck_assert(!packmsg_input_ok(&value));
+	ck_assert(!packmsg_map_view_find(&view, "", 0, &value));
+
+	// Too few slots.
+	packmsg_map_view_init(&view, slots, 128);
+	packmsg_input_init(&in, buf, size);
+	ck_assert(!packmsg_map_view_build(&in, &view));
+	ck_assert(!packmsg_input_ok(&in));
+}
+END_TEST
+
+START_TEST(path_queries)
+{
+	uint8_t buf[1024];
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof buf);
+
+	packmsg_add_map(&out, 2);
+	packmsg_add_str(&out, "version");
+	packmsg_add_int32(&out, 3);
+	packmsg_add_str(&out, "users");
+	packmsg_add_array(&out, 4);
+	for (int i = 0; i < 4; i++) {
+		char city[16];
+		snprintf(city, sizeof city, "city%d", i);
+		packmsg_add_map(&out, 2);
+		packmsg_add_str(&out, "address");
+		if (i == 2) {
+			packmsg_add_array(&out, 1);
+			packmsg_add_str(&out, city);
+		} else {
+			packmsg_add_map(&out, 2);
+			packmsg_add_str(&out, "street");
+			packmsg_add_nil(&out);
+			packmsg_add_str(&out, "city");
+			packmsg_add_str(&out, city);
+		}
+		packmsg_add_str(&out, "id");
+		packmsg_add_int32(&out, i);
+	}
+	packmsg_add_int32(&out, 42);
+	ck_assert(packmsg_output_ok(&out));
+	size_t size = packmsg_output_size(&out, buf);
+
+	packmsg_path_t path;
+	packmsg_input_t in;
+	packmsg_input_t matches[8];
+	char str[16];
+
+	ck_assert(packmsg_path_compile(&path, ".users[3].address.city"));
+	ck_assert_int_eq(path.count, 4);
+	packmsg_input_init(&in, buf, size);
+	ck_assert_int_eq(packmsg_path_match(&in, &path, matches, 8), 1);
+	ck_assert_int_eq(packmsg_get_int32(&in), 42);
+	ck_assert(packmsg_done(&in));
+	ck_assert_int_eq(packmsg_get_str_copy(&matches[0], str, sizeof str), 5);
+	ck_assert_str_eq(str, "city3");
+	ck_assert(packmsg_done(&matches[0]));
+
+	// Wildcards, skipping elements of the wrong type.
+	ck_assert(packmsg_path_compile(&path, ".users[*].address.city"));
+	packmsg_input_init(&in, buf, size);
+	ck_assert_int_eq(packmsg_path_match(&in, &path, matches, 8), 3);
+	ck_assert_int_eq(packmsg_get_str_copy(&matches[0], str, sizeof str), 5);
+	ck_assert_str_eq(str, "city0");
+	ck_assert_int_eq(packmsg_get_str_copy(&matches[2], str, sizeof str), 5);
+	ck_assert_str_eq(str, "city3");
+
+	ck_assert(packmsg_path_compile(&path, ".*"));
+	packmsg_input_init(&in, buf, size);
+	ck_assert_int_eq(packmsg_path_match(&in, &path, matches, 8), 2);
+	ck_assert_int_eq(packmsg_get_int32(&matches[0]), 3);
+	ck_assert_int_eq(packmsg_get_array(&matches[1]), 4);
+
+	ck_assert(packmsg_path_compile(&path, ".users[2].*[0]"));
+	packmsg_input_init(&in, buf, size);
+	ck_assert_int_eq(packmsg_path_match(&in, &path, matches, 8), 1);
+	ck_assert_int_eq(packmsg_get_str_copy(&matches[0], str, sizeof str), 5);
+	ck_assert_str_eq(str, "city2");
+
+	ck_assert(packmsg_path_compile(&path, ""));
+	packmsg_input_init(&in, buf, size);
+	ck_assert_int_eq(packmsg_path_match(&in, &path, matches, 8), 1);
+	ck_assert_int_eq(matches[0].len, size - 1);
+
+	ck_assert(packmsg_path_compile(&path, ".users[4].id"));
+	packmsg_input_init(&in, buf, size);
+	ck_assert_int_eq(packmsg_path_match(&in, &path, matches, 8), 0);
+	ck_assert(packmsg_input_ok(&in));
+
+	// Too many matches and invalid input.
+	ck_assert(packmsg_path_compile(&path, ".users[*].id"));
+	packmsg_input_init(&in, buf, size);
+	ck_assert_int_eq(packmsg_path_match(&in, &path, matches, 3), 0);
+	ck_assert(!packmsg_input_ok(&in));
+	packmsg_input_init(&in, buf, size - 2);
+	ck_assert_int_eq(packmsg_path_match(&in, &path, matches, 8), 0);
+	ck_assert(!packmsg_input_ok(&in));
+
+	// Invalid expressions.
+	ck_assert(!packmsg_path_compile(&path, "users"));
+	ck_assert(!packmsg_path_compile(&path, ".users["));
+	ck_assert(!packmsg_path_compile(&path, ".users[1"));
+	ck_assert(!packmsg_path_compile(&path, ".users[x]"));
+	ck_assert(!packmsg_path_compile(&path, ".users[4294967296]"));
+}
+END_TEST
+
+struct chunked_reader {
+	const uint8_t *data;
+	size_t len;
+	size_t chunk;
+};
+
+static ptrdiff_t chunked_read(void *ctx, void *data, size_t len)
+{
+	struct chunked_reader *reader = ctx;
+
+	if (len > reader->chunk)
+		len = reader->chunk;
+	if (len > reader->len)
+		len = reader->len;
+
+	memcpy(data, reader->data, len);
+	reader->data += len;
+	reader->len -= len;
+	return len;
+}
+
+static void read_refill_message(packmsg_input_t *in, bool full)
+{
+	char str[64];
+	uint32_t values[20];
+
+	ck_assert_int_eq(packmsg_get_map(in), 3);
+	ck_assert_int_eq(packmsg_get_str_copy(in, str, sizeof str), 5);
+	ck_assert_str_eq(str, "array");
+	ck_assert_int_eq(packmsg_get_uint32_array(in, values, 20), 20);
+	for (int i = 0; i < 20; i++)
+		ck_assert_uint_eq(values[i], i * 10000);
+
+	// If reads fill the whole window, a raw string stays valid while the next one is read.
+	const char *key;
+	const char *value;
+	ck_assert_int_eq(packmsg_get_str_raw(in, &key), 3);
+	ck_assert_mem_eq(key, "key", 3);
+	ck_assert_int_eq(packmsg_get_str_raw(in, &value), 40);
+	if (full)
+		ck_assert_mem_eq(key, "key", 3);
+	ck_assert_mem_eq(value, "0123456789012345678901234567890123456789", 40);
+
+	// Binary data larger than the window can be skipped.
+	ck_assert_int_eq(packmsg_get_str_copy(in, str, sizeof str), 5);
+	ck_assert_str_eq(str, "large");
+	packmsg_skip_element(in);
+}
+
+START_TEST(refill_source)
+{
+	static uint8_t large[1000];
+	uint8_t buf[2048];
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof buf);
+
+	packmsg_add_map(&out, 3);
+	packmsg_add_str(&out, "array");
+	packmsg_add_array(&out, 20);
+	for (int i = 0; i < 20; i++)
+		packmsg_add_uint32(&out, i * 10000);
+	packmsg_add_str(&out, "key");
+	packmsg_add_str(&out, "0123456789012345678901234567890123456789");
+	packmsg_add_str(&out, "large");
+	packmsg_add_bin(&out, large, sizeof large);
+	ck_assert(packmsg_output_ok(&out));
+	size_t total = packmsg_output_size(&out, buf);
+
+	// Read the message with every chunk size from the callback.
+	for (size_t chunk = 1; chunk <= 128; chunk++) {
+		struct chunked_reader reader = {buf, total, chunk};
+		packmsg_source_t src;
+		packmsg_input_t in;
+		packmsg_source_init(&src, &in, chunked_read, &reader, 64);
+		read_refill_message(&in, chunk >= 64);
+		ck_assert(packmsg_done(&in));
+		packmsg_source_free(&src);
+	}
+
+	// Elements larger than the window cannot be read.
+	struct chunked_reader reader = {buf, total, 16};
+	packmsg_source_t src;
+	packmsg_input_t in;
+	packmsg_source_init(&src, &in, chunked_read, &reader, 32);
+	ck_assert_int_eq(packmsg_get_map(&in), 3);
+	packmsg_skip_element(&in);
+	packmsg_skip_object(&in);
+	packmsg_skip_element(&in);
+	ck_assert(packmsg_input_ok(&in));
+	const char *value;
+	ck_assert_int_eq(packmsg_get_str_raw(&in, &value), 0);
+	ck_assert(!packmsg_input_ok(&in));
+	packmsg_source_free(&src);
+
+	// Truncated input invalidates the iterator.
+	reader = (struct chunked_reader) {buf, total - 1, 7};
+	packmsg_source_init(&src, &in, chunked_read, &reader, 64);
+	read_refill_message(&in, false);
+	ck_assert(!packmsg_input_ok(&in));
+	ck_assert(!packmsg_done(&in));
+	packmsg_source_free(&src);
+
+	// Read from a pipe.
+	int fds[2];
+	ck_assert_int_eq(pipe(fds), 0);
+	ck_assert_int_eq(write(fds[1], buf, total), total);
+	close(fds[1]);
+	packmsg_source_init_fd(&src, &in, fds[0], 64);
+	read_refill_message(&in, true);
+	ck_assert(packmsg_done(&in));
+	packmsg_source_free(&src);
+	close(fds[0]);
+}
+END_TEST
+
+START_TEST(source_copies)
+{
+	uint8_t buf[1024];
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof buf);
+
+	for (int i = 0; i < 40; i++) {
+		packmsg_add_uint32(&out, i * 1000);
+		packmsg_add_str(&out, "value");
+	}
+
+	ck_assert(packmsg_output_ok(&out));
+	size_t total = packmsg_output_size(&out, buf);
+
+	// A copy reads ahead and refills the window, after which the original reads the same elements.
+	// Either the original still finds its bytes, or it is invalidated, but it never reads anything else.
+	for (size_t chunk = 1; chunk <= 128; chunk++) {
+		struct chunked_reader reader = {buf, total, chunk};
+		packmsg_source_t src;
+		packmsg_input_t in;
+		packmsg_source_init(&src, &in, chunked_read, &reader, 64);
+		int i;
+
+		for (i = 0; i < 40 && packmsg_input_ok(&in); i++) {
+			packmsg_input_t copy = in;
+			char str[8];
+			ck_assert_uint_eq(packmsg_get_uint32(&copy), i * 1000);
+			ck_assert_int_eq(packmsg_get_str_copy(&copy, str, sizeof str), 5);
+			ck_assert(packmsg_input_ok(&copy));
+
+			uint32_t value = packmsg_get_uint32(&in);
+			uint32_t len = packmsg_get_str_copy(&in, str, sizeof str);
+
+			if (packmsg_input_ok(&in)) {
+				ck_assert_uint_eq(value, i * 1000);
+				ck_assert_int_eq(len, 5);
+				ck_assert_str_eq(str, "value");
+			}
+		}
+
+		// Reads of up to half the window always leave the original enough room to catch up.
+		if (chunk <= 32) {
+			ck_assert_int_eq(i, 40);
+			ck_assert(packmsg_done(&in));
+		}
+
+		packmsg_source_free(&src);
+	}
+
+	// Peeking through a const iterator refills the source, but the iterator only moves when it is read from.
+	struct chunked_reader reader = {buf, total, 64};
+	packmsg_source_t src;
+	packmsg_input_t in;
+	packmsg_source_init(&src, &in, chunked_read, &reader, 64);
+	ck_assert(!packmsg_done(&in));
+	ck_assert_int_eq(packmsg_get_type(&in), PACKMSG_POSITIVE_FIXINT);
+	ck_assert_int_eq(in.len, 0);
+	ck_assert_uint_eq(packmsg_get_uint32(&in), 0);
+	ck_assert(packmsg_input_ok(&in));
+	packmsg_source_free(&src);
+}
+END_TEST
+
+START_TEST(typed_array_source)
+{
+	uint32_t values[4] = {1, 2, 3, 4};
+	uint8_t buf[64];
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof buf);
+	packmsg_add_typed_array(&out, PACKMSG_DTYPE_UINT32, values, 4, 0);
+	packmsg_add_int32(&out, 77);
+	ck_assert(packmsg_output_ok(&out));
+	size_t total = packmsg_output_size(&out, buf);
+
+	// Checking for a typed array does not disturb the iterator, whatever the window holds at that point.
+	for (size_t chunk = 1; chunk <= 32; chunk++) {
+		struct chunked_reader reader = {buf, total, chunk};
+		packmsg_source_t src;
+		packmsg_input_t in;
+		packmsg_source_init(&src, &in, chunked_read, &reader, 32);
+		enum packmsg_dtype dtype;
+		const void *data;
+
+		ck_assert(packmsg_is_typed_array(&in));
+		ck_assert_int_eq(packmsg_get_typed_array_raw(&in, &dtype, &data), 4);
+		ck_assert(dtype == PACKMSG_DTYPE_UINT32);
+		ck_assert_mem_eq(data, values, sizeof values);
+		ck_assert(!packmsg_is_typed_array(&in));
+		ck_assert_int_eq(packmsg_get_int32(&in), 77);
+		ck_assert(packmsg_done(&in));
+		packmsg_source_free(&src);
+	}
+}
+END_TEST
+
+START_TEST(mapped_file)
+{
+	FILE *f = tmpfile();
+	ck_assert_ptr_nonnull(f);
+
+	packmsg_file_t file;
+	packmsg_input_t record;
+
+	// An empty file has no records.
+	ck_assert(packmsg_file_open_fd(&file, fileno(f)));
+	ck_assert(!packmsg_file_next(&file, &record));
+	ck_assert(packmsg_done(&file.in));
+	packmsg_file_close(&file);
+
+	// Concatenated messages are returned one record at a time.
+	fwrite("\x82\xa1" "a\x01\xa1" "b\x92\xc3\xc0" "\x2a" "\xa3" "foo", 14, 1, f);
+	fflush(f);
+	ck_assert(packmsg_file_open_fd(&file, fileno(f)));
+	ck_assert_int_eq(file.size, 14);
+
+	ck_assert(packmsg_file_next(&file, &record));
+	ck_assert_ptr_eq(record.ptr, file.data);
+	ck_assert_int_eq(record.len, 9);
+	ck_assert_int_eq(packmsg_get_map(&record), 2);
+
+	ck_assert(packmsg_file_next(&file, &record));
+	ck_assert_int_eq(packmsg_get_uint8(&record), 42);
+	ck_assert(packmsg_done(&record));
+
+	ck_assert(packmsg_file_next(&file, &record));
+	char str[4];
+	ck_assert_int_eq(packmsg_get_str_copy(&record, str, sizeof str), 3);
+	ck_assert_str_eq(str, "foo");
+	ck_assert(packmsg_done(&record));
+
+	ck_assert(!packmsg_file_next(&file, &record));
+	ck_assert(!packmsg_input_ok(&record));
+	ck_assert(packmsg_done(&file.in));
+	packmsg_file_close(&file);
+
+	// A truncated record is an error.
+	fwrite("\x92\x01", 2, 1, f);
+	fflush(f);
+	ck_assert(packmsg_file_open_fd(&file, fileno(f)));
+	for (int i = 0; i < 3; i++)
+		ck_assert(packmsg_file_next(&file, &record));
+	ck_assert(!packmsg_file_next(&file, &record));
+	ck_assert(!packmsg_done(&file.in));
+	packmsg_file_close(&file);
+
+	// Records check strings if the file does.
+	ck_assert(packmsg_file_open_fd(&file, fileno(f)));
+	packmsg_input_set_utf8(&file.in, true);
+	for (int i = 0; i < 3; i++)
+		ck_assert(packmsg_file_next(&file, &record));
+	ck_assert(record.utf8);
+	packmsg_file_close(&file);
+
+	fclose(f);
+
+	ck_assert(!packmsg_file_open(&file, "/nonexistent/file"));
+	ck_assert(!packmsg_file_next(&file, &record));
+}
+END_TEST
+
+struct parallel_result {
+	uint32_t values[1000];
+	uint64_t ordered;
+	uint64_t stop;
+	bool in_order;
+	volatile bool emitting;
+};
+
+static bool parallel_decode(void *ctx, packmsg_input_t *record, uint64_t index, unsigned thread)
+{
+	struct parallel_result *result = (struct parallel_result *)ctx;
+
+	// Values are checked by parallel_ordered(), so a wrong count or thread number shows up there.
+	if (thread < 4 && packmsg_get_array(record) == 2) {
+		uint32_t a = packmsg_get_uint32(record);
+		uint32_t b = packmsg_get_uint32(record);
+		result->values[index] = packmsg_done(record) ? a + b : 0;
+	}
+
+	return index != result->stop;
+}
+
+static void parallel_ordered(void *ctx, uint64_t first, uint64_t count)
+{
+	struct parallel_result *result = (struct parallel_result *)ctx;
+
+	// Calls must not overlap, even though they are made without holding the lock.
+	if (result->emitting)
+		result->in_order = false;
+
+	result->emitting = true;
+
+	if (first != result->ordered)
+		result->in_order = false;
+
+	for (uint64_t i = first; i < first + count; i++)
+		if (result->values[i] != 3 * i)
+			result->in_order = false;
+
+	result->ordered = first + count;
+	result->emitting = false;
+}
+
+START_TEST(parallel_decode_records)
+{
+	static uint8_t buf[16384];
+	packmsg_output_t out;
+	packmsg_output_init(&out, buf, sizeof buf);
+
+	for (uint32_t i = 0; i < 1000; i++) {
+		packmsg_add_array(&out, 2);
+		packmsg_add_uint32(&out, i);
+		packmsg_add_uint32(&out, 2 * i);
+	}
+
+	ck_assert(packmsg_output_ok(&out));
+	size_t size = packmsg_output_size(&out, buf);
+
+	static struct parallel_result result;
+	memset(&result, 0, sizeof result);
+	result.stop = UINT64_MAX;
+	result.in_order = true;
+
+	packmsg_parallel_t par = {parallel_decode, parallel_ordered, &result, 4, 64};
+	ck_assert(packmsg_parallel_decode(&par, buf, size));
+	ck_assert(result.in_order);
+	ck_assert_int_eq(result.ordered, 1000);
+
+	// Records before an invalid one are still decoded.
+	memset(&result, 0, sizeof result);
+	result.stop = UINT64_MAX;
+	result.in_order = true;
+	buf[size] = 0xc1;
+	ck_assert(!packmsg_parallel_decode(&par, buf, size + 1));
+	ck_assert(result.in_order);
+	ck_assert_int_eq(result.ordered, 1000);
+
+	// A callback can stop decoding early.
+	memset(&result, 0, sizeof result);
+	result.stop = 500;
+	result.in_order = true;
+	ck_assert(!packmsg_parallel_decode(&par, buf, size));
+	ck_assert(result.ordered <= 500);
+
+	ck_assert(packmsg_parallel_decode(&par, buf, 0));
+}
+END_TEST
+
 int main(void)
 {
 	Suite *s = suite_create("packmsg");
@@ -1218,6 +3058,7 @@ int main(void)
 		tcase_add_test(tc_add, add_fixext);
 		tcase_add_test(tc_add, add_map);
 		tcase_add_test(tc_add, add_array);
+		tcase_add_test(tc_add, add_int_arrays);
 	}
 	suite_add_tcase(s, tc_add);
 
@@ -1239,20 +3080,57 @@ int main(void)
 		tcase_add_test(tc_get, get_float);
 		tcase_add_test(tc_get, get_double);
 		tcase_add_test(tc_get, get_str);
+		tcase_add_test(tc_get, utf8);
 		tcase_add_test(tc_get, get_bin);
 		tcase_add_test(tc_get, get_ext);
 		tcase_add_test(tc_get, get_fixext);
+		tcase_add_test(tc_get, get_arena);
 		tcase_add_test(tc_get, get_map);
 		tcase_add_test(tc_get, get_array);
+		tcase_add_test(tc_get, get_types);
+		tcase_add_test(tc_get, type_mismatch);
+		tcase_add_test(tc_get, get_int_arrays);
 	}
 	suite_add_tcase(s, tc_get);
 
 	TCase *tc_objects = tcase_create("objects");
 	{
 		tcase_add_test(tc_objects, simple_object);
+		tcase_add_test(tc_objects, skip_nested);
+		tcase_add_test(tc_objects, validate);
+		tcase_add_test(tc_objects, find_boundaries);
+		tcase_add_test(tc_objects, typed_arrays);
+		tcase_add_test(tc_objects, structural_index);
+		tcase_add_test(tc_objects, object_view);
+		tcase_add_test(tc_objects, map_lookup);
+		tcase_add_test(tc_objects, path_queries);
 	}
 	suite_add_tcase(s, tc_objects);
 
+	TCase *tc_stream = tcase_create("stream");
+	{
+		tcase_add_test(tc_stream, stream_decoder);
+
+		// Trusted decoding cannot be used with input sources.
+		if (TEST_BOUNDS_CHECKED) {
+			tcase_add_test(tc_stream, refill_source);
+			tcase_add_test(tc_stream, source_copies);
+			tcase_add_test(tc_stream, typed_array_source);
+		}
+
+		tcase_add_test(tc_stream, mapped_file);
+		tcase_add_test(tc_stream, parallel_decode_records);
+	}
+	suite_add_tcase(s, tc_stream);
+
+	TCase *tc_output = tcase_create("output");
+	{
+		tcase_add_test(tc_output, growable_output);
+		tcase_add_test(tc_output, deferred_headers);
+		tcase_add_test(tc_output, iov_output);
+	}
+	suite_add_tcase(s, tc_output);
+
 	srunner_run_all(sr, CK_NORMAL);
 	int failed = srunner_ntests_failed(sr);
 	srunner_free(sr);